@@ -417,6 +417,7 @@ BlockDriverState *bdrv_new(void)
         QLIST_INIT(&bs->op_blockers[i]);
     }
     qemu_co_mutex_init(&bs->reqs_lock);
+    treap_init(&bs->tracked_request_tree, &bdrv_tracked_request_tree_ops);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
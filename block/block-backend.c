@@ -2618,6 +2618,48 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/* To be called between exactly one pair of blk_inc/dec_in_flight() */
+static int coroutine_fn
+blk_co_do_splice_read(BlockBackend *blk, int64_t offset, int64_t bytes,
+                      int pipe_fd)
+{
+    BlockDriverState *bs;
+    int ret;
+    IO_CODE();
+
+    blk_wait_while_drained(blk);
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The caller falls back to blk_co_pread(), which is throttled */
+    if (blk->public.throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    ret = bdrv_co_splice_read(blk->root, offset, bytes, pipe_fd);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+int coroutine_fn blk_co_splice_read(BlockBackend *blk, int64_t offset,
+                                    int64_t bytes, int pipe_fd)
+{
+    int ret;
+    IO_OR_GS_CODE();
+
+    blk_inc_in_flight(blk);
+    ret = blk_co_do_splice_read(blk, offset, bytes, pipe_fd);
+    blk_dec_in_flight(blk);
+
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     GLOBAL_STATE_CODE();
@@ -58,9 +58,12 @@ int coroutine_fn bdrv_co_readv_vmstate(BlockDriverState *bs,
 int coroutine_fn bdrv_co_writev_vmstate(BlockDriverState *bs,
                                         QEMUIOVector *qiov, int64_t pos);
 
+/* One of the connections of an NBD client node, see block/nbd.c */
+typedef struct NBDConnState NBDConnState;
+
 int coroutine_fn
-nbd_co_do_establish_connection(BlockDriverState *bs, bool blocking,
-                               Error **errp);
+nbd_co_do_establish_connection(BlockDriverState *bs, NBDConnState *cs,
+                               bool blocking, Error **errp);
 
 
 /*
@@ -83,6 +86,7 @@ bdrv_common_block_status_above(BlockDriverState *bs,
                                BlockDriverState **file,
                                int *depth);
 int generated_co_wrapper
-nbd_do_establish_connection(BlockDriverState *bs, bool blocking, Error **errp);
+nbd_do_establish_connection(BlockDriverState *bs, NBDConnState *cs,
+                            bool blocking, Error **errp);
 
 #endif /* BLOCK_COROUTINES_H */
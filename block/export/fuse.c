@@ -19,8 +19,10 @@
 #define FUSE_USE_VERSION 31
 
 #include "qemu/osdep.h"
+#include "qemu/lockable.h"
 #include "qemu/memalign.h"
 #include "block/aio.h"
+#include "block/aio-wait.h"
 #include "block/block.h"
 #include "block/export.h"
 #include "block/fuse.h"
@@ -28,9 +30,12 @@
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "trace.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
+#include <sys/ioctl.h>
 
 #if defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
@@ -40,17 +45,54 @@
 #include <linux/fs.h>
 #endif
 
+/* From <linux/fuse.h>, which cannot be included along with libfuse */
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
 
-typedef struct FuseExport {
+typedef struct FuseExport FuseExport;
+
+/*
+ * A clone of the session's /dev/fuse file descriptor, read from in its own
+ * IOThread.  Replies must be written to the file descriptor the request
+ * was read from.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    IOThread *iothread;
+    AioContext *ctx;
+    int fd;
+
+    /* Taken while receiving, so that receiving can be paused */
+    QemuMutex lock;
+    bool paused;
+
+    /* Receive buffer of a completed request, for the next one */
+    void *spare_buf;
+} FuseQueue;
+
+typedef struct FuseRequest {
+    FuseQueue *q;
+    struct fuse_buf buf;
+} FuseRequest;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
     struct fuse_buf fuse_buf;
     bool mounted, fd_handler_set_up;
 
+    /* With queue-iothreads, the session's file descriptor is not read */
+    FuseQueue *queues;
+    unsigned int num_queues;
+    /* Requests received on queues and not yet replied to */
+    unsigned int in_flight;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -60,7 +102,7 @@ typedef struct FuseExport {
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -73,6 +115,9 @@ static void init_exports_table(void);
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
 static void read_from_fuse_export(void *opaque);
+static int fuse_export_get_queues(FuseExport *exp, strList *ids,
+                                  Error **errp);
+static int fuse_export_setup_queues(FuseExport *exp, Error **errp);
 
 static bool is_regular_file(const char *path, Error **errp);
 
@@ -128,6 +173,13 @@ static int fuse_export_create(BlockExport *blk_exp,
         goto fail;
     }
 
+    if (args->has_queue_iothreads) {
+        ret = fuse_export_get_queues(exp, args->queue_iothreads, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
@@ -159,6 +211,14 @@ static int fuse_export_create(BlockExport *blk_exp,
         goto fail;
     }
 
+    if (exp->num_queues) {
+        ret = fuse_export_setup_queues(exp, errp);
+        if (ret < 0) {
+            fuse_export_shutdown(blk_exp);
+            goto fail;
+        }
+    }
+
     return 0;
 
 fail:
@@ -222,10 +282,12 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session), true,
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    if (!exp->num_queues) {
+        aio_set_fd_handler(exp->common.ctx,
+                           fuse_session_fd(exp->fuse_session), true,
+                           read_from_fuse_export, NULL, NULL, NULL, exp);
+        exp->fd_handler_set_up = true;
+    }
 
     return 0;
 
@@ -258,6 +320,271 @@ out:
     blk_exp_unref(&exp->common);
 }
 
+/**
+ * Process a request received on a queue.  Callbacks that use the block
+ * layer move to the export's AioContext for that and come back to reply
+ * (see fuse_enter_export_ctx()), so that many requests can be in flight
+ * per queue.
+ */
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequest *req = opaque;
+    FuseQueue *q = req->q;
+    FuseExport *exp = q->exp;
+
+    fuse_session_process_buf(exp->fuse_session, &req->buf);
+    assert(qemu_get_current_aio_context() == q->ctx);
+
+    if (!q->spare_buf) {
+        q->spare_buf = req->buf.mem;
+    } else {
+        free(req->buf.mem);
+    }
+    g_free(req);
+
+    /* exp may be freed as soon as this drops to zero */
+    qatomic_dec(&exp->in_flight);
+    aio_wait_kick();
+}
+
+/**
+ * Callback to be invoked when a queue's FD can be read from.  Several
+ * queues may be woken up for the same request, so the FD is non-blocking
+ * and all but one get -EAGAIN.
+ */
+static void fuse_queue_read(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    FuseRequest *req;
+    Coroutine *co;
+    int ret;
+
+    req = g_new0(FuseRequest, 1);
+    req->q = q;
+
+    qemu_mutex_lock(&q->lock);
+    if (q->paused) {
+        qemu_mutex_unlock(&q->lock);
+        g_free(req);
+        return;
+    }
+
+    req->buf.mem = q->spare_buf;
+    q->spare_buf = NULL;
+    do {
+        ret = fuse_session_receive_buf(exp->fuse_session, &req->buf);
+    } while (ret == -EINTR);
+    trace_fuse_queue_read(exp, q->fd, ret);
+    if (ret <= 0) {
+        q->spare_buf = req->buf.mem;
+        qemu_mutex_unlock(&q->lock);
+        g_free(req);
+        return;
+    }
+
+    /* Counted before unlocking, so that drained_poll sees it */
+    qatomic_inc(&exp->in_flight);
+    qemu_mutex_unlock(&q->lock);
+
+    co = qemu_coroutine_create(fuse_co_process_request, req);
+    qemu_coroutine_enter(co);
+}
+
+#ifdef CONFIG_FUSE_CUSTOM_IO
+/**
+ * With queues, libfuse reads and writes through these.  Each queue is the
+ * only one in its AioContext, and requests are received and replied to
+ * there, so the current AioContext determines the FD to use.
+ */
+static int fuse_queue_fd(FuseExport *exp, int fd)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned int i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        if (exp->queues[i].ctx == ctx) {
+            return exp->queues[i].fd;
+        }
+    }
+
+    return fd;
+}
+
+static ssize_t fuse_io_read(int fd, void *buf, size_t buf_len, void *userdata)
+{
+    return read(fuse_queue_fd(userdata, fd), buf, buf_len);
+}
+
+static ssize_t fuse_io_writev(int fd, struct iovec *iov, int count,
+                              void *userdata)
+{
+    return writev(fuse_queue_fd(userdata, fd), iov, count);
+}
+
+static const struct fuse_custom_io fuse_queue_io = {
+    .read   = fuse_io_read,
+    .writev = fuse_io_writev,
+};
+#endif
+
+/**
+ * Pause or resume receiving requests on all queues.  Requests that have
+ * already been received are counted in exp->in_flight.
+ */
+static void fuse_export_set_queues_paused(FuseExport *exp, bool paused)
+{
+    unsigned int i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        if (q->fd < 0) {
+            continue;
+        }
+
+        QEMU_LOCK_GUARD(&q->lock);
+        q->paused = paused || !exp->fd_handler_set_up;
+        aio_set_fd_handler(q->ctx, q->fd, true,
+                           q->paused ? NULL : fuse_queue_read,
+                           NULL, NULL, NULL, q);
+    }
+}
+
+/*
+ * Queues in other IOThreads are not stopped by draining the export's
+ * AioContext, so pause them explicitly.
+ */
+static void fuse_export_drained_begin(void *opaque)
+{
+    fuse_export_set_queues_paused(opaque, true);
+}
+
+static void fuse_export_drained_end(void *opaque)
+{
+    fuse_export_set_queues_paused(opaque, false);
+}
+
+static bool fuse_export_drained_poll(void *opaque)
+{
+    FuseExport *exp = opaque;
+
+    return qatomic_read(&exp->in_flight) > 0;
+}
+
+static const BlockDevOps fuse_export_dev_ops = {
+    .drained_begin = fuse_export_drained_begin,
+    .drained_end   = fuse_export_drained_end,
+    .drained_poll  = fuse_export_drained_poll,
+};
+
+/**
+ * Look up the IOThreads given in queue-iothreads and allocate exp->queues.
+ */
+static int fuse_export_get_queues(FuseExport *exp, strList *ids, Error **errp)
+{
+    strList *id;
+    unsigned int i, n = 0;
+
+#ifndef CONFIG_FUSE_CUSTOM_IO
+    error_setg(errp, "queue-iothreads requires libfuse 3.14 or newer");
+    return -ENOTSUP;
+#endif
+
+    if (!ids) {
+        error_setg(errp, "queue-iothreads must not be empty");
+        return -EINVAL;
+    }
+
+    for (id = ids; id; id = id->next) {
+        n++;
+    }
+    exp->queues = g_new0(FuseQueue, n);
+
+    for (id = ids; id; id = id->next) {
+        IOThread *iothread = iothread_by_id(id->value);
+        FuseQueue *q;
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", id->value);
+            return -EINVAL;
+        }
+
+        /* fuse_queue_fd() needs the queue of an AioContext to be unique */
+        for (i = 0; i < exp->num_queues; i++) {
+            if (exp->queues[i].iothread == iothread) {
+                error_setg(errp, "iothread \"%s\" is given more than once",
+                           id->value);
+                return -EINVAL;
+            }
+        }
+
+        q = &exp->queues[exp->num_queues++];
+        *q = (FuseQueue) {
+            .exp        = exp,
+            .iothread   = iothread,
+            .ctx        = iothread_get_aio_context(iothread),
+            .fd         = -1,
+        };
+        qemu_mutex_init(&q->lock);
+        object_ref(OBJECT(iothread));
+    }
+
+    return 0;
+}
+
+/**
+ * Clone the session's FD for every queue and start reading from the
+ * clones in their IOThreads.
+ */
+static int fuse_export_setup_queues(FuseExport *exp, Error **errp)
+{
+    uint32_t session_fd = fuse_session_fd(exp->fuse_session);
+    unsigned int i;
+    int ret;
+
+#ifdef CONFIG_FUSE_CUSTOM_IO
+    ret = fuse_session_custom_io(exp->fuse_session, &fuse_queue_io,
+                                 session_fd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to set up FUSE queues");
+        return ret;
+    }
+#else
+    /* Rejected by fuse_export_get_queues() */
+    g_assert_not_reached();
+#endif
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        q->fd = qemu_open("/dev/fuse", O_RDWR, errp);
+        if (q->fd < 0) {
+            return -errno;
+        }
+
+        if (ioctl(q->fd, FUSE_DEV_IOC_CLONE, &session_fd) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Failed to clone FUSE session FD");
+            return ret;
+        }
+
+        g_unix_set_fd_nonblocking(q->fd, true, NULL);
+    }
+
+    /*
+     * Requests from the queues must be able to complete in a drained
+     * section, which is what blk_root_drained_poll() waits for.
+     */
+    blk_set_disable_request_queuing(exp->common.blk, true);
+    blk_set_dev_ops(exp->common.blk, &fuse_export_dev_ops, exp);
+
+    exp->fd_handler_set_up = true;
+    fuse_export_set_queues_paused(exp, false);
+
+    return 0;
+}
+
 static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
@@ -265,7 +592,10 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
 
-        if (exp->fd_handler_set_up) {
+        if (exp->fd_handler_set_up && exp->num_queues) {
+            exp->fd_handler_set_up = false;
+            fuse_export_set_queues_paused(exp, true);
+        } else if (exp->fd_handler_set_up) {
             aio_set_fd_handler(exp->common.ctx,
                                fuse_session_fd(exp->fuse_session), true,
                                NULL, NULL, NULL, NULL, NULL);
@@ -285,6 +615,25 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    unsigned int i;
+
+    if (exp->num_queues) {
+        /* Requests on the queues do not hold a reference to the export */
+        AIO_WAIT_WHILE(exp->common.ctx, qatomic_read(&exp->in_flight) > 0);
+        blk_set_dev_ops(exp->common.blk, NULL, NULL);
+    }
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        if (q->fd >= 0) {
+            close(q->fd);
+        }
+        free(q->spare_buf);
+        qemu_mutex_destroy(&q->lock);
+        object_unref(OBJECT(q->iothread));
+    }
+    g_free(exp->queues);
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -338,6 +687,31 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
 }
 
+/**
+ * Requests received on a queue are processed in a coroutine in the queue's
+ * IOThread, but the block layer may only be used from the export's
+ * AioContext.  Callbacks move there with fuse_enter_export_ctx() before
+ * using the block layer, and must return with fuse_leave_export_ctx()
+ * before replying.  Both do nothing for requests
+ * read from the session's FD.
+ */
+static AioContext *fuse_enter_export_ctx(FuseExport *exp)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    if (qemu_in_coroutine() && ctx != exp->common.ctx) {
+        aio_co_reschedule_self(exp->common.ctx);
+    }
+    return ctx;
+}
+
+static void fuse_leave_export_ctx(AioContext *ctx)
+{
+    if (qemu_get_current_aio_context() != ctx) {
+        aio_co_reschedule_self(ctx);
+    }
+}
+
 /**
  * Let clients look up files.  Always return ENOENT because we only
  * care about the mountpoint itself.
@@ -348,20 +722,17 @@ static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 }
 
 /**
- * Let clients get file attributes (i.e., stat() the file).
+ * Fill in the file attributes of the export.
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static int fuse_do_getattr(FuseExport *exp, fuse_ino_t inode,
+                           struct stat *statbuf)
 {
-    struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
-    FuseExport *exp = fuse_req_userdata(req);
 
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
     allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
@@ -371,7 +742,7 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
         allocated_blocks = DIV_ROUND_UP(allocated_blocks, 512);
     }
 
-    statbuf = (struct stat) {
+    *statbuf = (struct stat) {
         .st_ino     = inode,
         .st_mode    = exp->st_mode,
         .st_nlink   = 1,
@@ -385,6 +756,29 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
         .st_ctime   = now,
     };
 
+    return 0;
+}
+
+/**
+ * Let clients get file attributes (i.e., stat() the file).
+ */
+static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
+                         struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
+    struct stat statbuf;
+    int ret;
+
+    queue_ctx = fuse_enter_export_ctx(exp);
+    ret = fuse_do_getattr(exp, inode, &statbuf);
+    fuse_leave_export_ctx(queue_ctx);
+
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
@@ -444,6 +838,7 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
                          int to_set, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
     int supported_attrs;
     int ret;
 
@@ -485,7 +880,9 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
             return;
         }
 
+        queue_ctx = fuse_enter_export_ctx(exp);
         ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        fuse_leave_export_ctx(queue_ctx);
         if (ret < 0) {
             fuse_reply_err(req, -ret);
             return;
@@ -524,8 +921,9 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
                       size_t size, off_t offset, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
     int64_t length;
-    void *buf;
+    void *buf = NULL;
     int ret;
 
     /* Limited by max_read, should not happen */
@@ -534,14 +932,16 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         return;
     }
 
+    queue_ctx = fuse_enter_export_ctx(exp);
+
     /**
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        ret = length;
+        goto out;
     }
 
     if (offset + size > length) {
@@ -550,11 +950,14 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
-        fuse_reply_err(req, ENOMEM);
-        return;
+        ret = -ENOMEM;
+        goto out;
     }
 
     ret = blk_pread(exp->common.blk, offset, size, buf, 0);
+
+out:
+    fuse_leave_export_ctx(queue_ctx);
     if (ret >= 0) {
         fuse_reply_buf(req, buf, size);
     } else {
@@ -571,6 +974,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
                        size_t size, off_t offset, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
     int64_t length;
     int ret;
 
@@ -585,22 +989,23 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
         return;
     }
 
+    queue_ctx = fuse_enter_export_ctx(exp);
+
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        ret = length;
+        goto out;
     }
 
     if (offset + size > length) {
         if (exp->growable) {
             ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                goto out;
             }
         } else {
             size = length - offset;
@@ -608,6 +1013,9 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
     }
 
     ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
+
+out:
+    fuse_leave_export_ctx(queue_ctx);
     if (ret >= 0) {
         fuse_reply_write(req, size);
     } else {
@@ -615,26 +1023,15 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
     }
 }
 
-/**
- * Let clients perform various fallocate() operations.
- */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static int fuse_do_fallocate(FuseExport *exp, int mode, off_t offset,
+                             off_t length)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
     int ret;
 
-    if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
-    }
-
     blk_len = blk_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        return blk_len;
     }
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
@@ -646,16 +1043,14 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            return -EOPNOTSUPP;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
             ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
@@ -665,8 +1060,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     else if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            return -EINVAL;
         }
 
         do {
@@ -685,8 +1079,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
             ret = fuse_do_truncate(exp, offset + length, false,
                                    PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
@@ -704,6 +1097,29 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         ret = -EOPNOTSUPP;
     }
 
+    return ret;
+}
+
+/**
+ * Let clients perform various fallocate() operations.
+ */
+static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
+                           off_t offset, off_t length,
+                           struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
+    int ret;
+
+    if (!exp->writable) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    queue_ctx = fuse_enter_export_ctx(exp);
+    ret = fuse_do_fallocate(exp, mode, offset, length);
+    fuse_leave_export_ctx(queue_ctx);
+
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
 
@@ -714,9 +1130,13 @@ static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
                        struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
     int ret;
 
+    queue_ctx = fuse_enter_export_ctx(exp);
     ret = blk_flush(exp->common.blk);
+    fuse_leave_export_ctx(queue_ctx);
+
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
 
@@ -732,27 +1152,19 @@ static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
 
 #ifdef CONFIG_FUSE_LSEEK
 /**
- * Let clients inquire allocation status.
+ * Find the next hole or data starting from *@offset and store its offset
+ * there.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static int fuse_do_lseek(FuseExport *exp, off_t *offset, int whence)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-
-    if (whence != SEEK_HOLE && whence != SEEK_DATA) {
-        fuse_reply_err(req, EINVAL);
-        return;
-    }
-
     while (true) {
         int64_t pnum;
         int ret;
 
         ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+                                      *offset, INT64_MAX, &pnum, NULL, NULL);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
 
         if (!pnum && (ret & BDRV_BLOCK_EOF)) {
@@ -769,37 +1181,57 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
 
             blk_len = blk_getlength(exp->common.blk);
             if (blk_len < 0) {
-                fuse_reply_err(req, -blk_len);
-                return;
+                return blk_len;
             }
 
-            if (offset > blk_len || whence == SEEK_DATA) {
-                fuse_reply_err(req, ENXIO);
-            } else {
-                fuse_reply_lseek(req, offset);
+            if (*offset > blk_len || whence == SEEK_DATA) {
+                return -ENXIO;
             }
-            return;
+            return 0;
         }
 
         if (ret & BDRV_BLOCK_DATA) {
             if (whence == SEEK_DATA) {
-                fuse_reply_lseek(req, offset);
-                return;
+                return 0;
             }
         } else {
             if (whence == SEEK_HOLE) {
-                fuse_reply_lseek(req, offset);
-                return;
+                return 0;
             }
         }
 
         /* Safety check against infinite loops */
         if (!pnum) {
-            fuse_reply_err(req, ENXIO);
-            return;
+            return -ENXIO;
         }
 
-        offset += pnum;
+        *offset += pnum;
+    }
+}
+
+/**
+ * Let clients inquire allocation status.
+ */
+static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
+                       int whence, struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    AioContext *queue_ctx;
+    int ret;
+
+    if (whence != SEEK_HOLE && whence != SEEK_DATA) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    queue_ctx = fuse_enter_export_ctx(exp);
+    ret = fuse_do_lseek(exp, &offset, whence);
+    fuse_leave_export_ctx(queue_ctx);
+
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_lseek(req, offset);
     }
 }
 #endif
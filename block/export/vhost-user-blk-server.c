@@ -17,6 +17,8 @@
 #include "vhost-user-blk-server.h"
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 #include "virtio-blk-handler.h"
 
@@ -37,14 +39,21 @@ typedef struct {
     VirtioBlkHandler handler;
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
+
+    /* IOThreads the virtqueues are spread over, if any */
+    IOThread **queue_iothreads;
+    unsigned int num_queue_iothreads;
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
 {
     VuDev *vu_dev = &req->server->vu_dev;
+    int qidx = req->vq - vu_dev->vq;
 
+    vhost_user_server_queue_lock(req->server, qidx);
     vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
     vu_queue_notify(vu_dev, req->vq);
+    vhost_user_server_queue_unlock(req->server, qidx);
 
     free(req);
 }
@@ -61,10 +70,27 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
     struct iovec *out_iov = elem->out_sg;
     unsigned in_num = elem->in_num;
     unsigned out_num = elem->out_num;
+    AioContext *queue_ctx = qemu_get_current_aio_context();
+    AioContext *blk_ctx = vexp->export.ctx;
     int in_len;
 
+    /*
+     * The block layer is only used from the node's AioContext, so a queue
+     * running in its own IOThread submits the I/O there and comes back to
+     * complete the request.  All queues funnel through that one thread,
+     * which therefore bounds the request rate of the export; until the
+     * block layer can be used from several AioContexts at once, only the
+     * virtqueue work scales with queue-iothreads.
+     */
+    if (queue_ctx != blk_ctx) {
+        aio_co_reschedule_self(blk_ctx);
+    }
     in_len = virtio_blk_process_req(handler, in_iov, out_iov,
                                     in_num, out_num);
+    if (queue_ctx != blk_ctx) {
+        aio_co_reschedule_self(queue_ctx);
+    }
+
     if (in_len < 0) {
         free(req);
         vhost_user_server_unref(server);
@@ -126,6 +152,7 @@ static uint64_t vu_blk_get_features(VuDev *dev)
                1ull << VIRTIO_F_VERSION_1 |
                1ull << VIRTIO_RING_F_INDIRECT_DESC |
                1ull << VIRTIO_RING_F_EVENT_IDX |
+               1ull << VIRTIO_F_RING_PACKED |
                1ull << VHOST_USER_F_PROTOCOL_FEATURES;
 
     if (!vexp->handler.writable) {
@@ -220,6 +247,73 @@ static void blk_aio_detach(void *opaque)
     vexp->export.ctx = NULL;
 }
 
+/*
+ * Kicks of queues in their own IOThreads are not stopped by draining the
+ * node's AioContext, so pause them explicitly.
+ */
+static void vu_blk_drained_begin(void *opaque)
+{
+    VuBlkExport *vexp = opaque;
+
+    vhost_user_server_pause_queues(&vexp->vu_server);
+}
+
+static void vu_blk_drained_end(void *opaque)
+{
+    VuBlkExport *vexp = opaque;
+
+    vhost_user_server_resume_queues(&vexp->vu_server);
+}
+
+/* Requests still on their way to or back from the node's AioContext */
+static bool vu_blk_drained_poll(void *opaque)
+{
+    VuBlkExport *vexp = opaque;
+
+    return qatomic_read(&vexp->vu_server.refcount) > 0;
+}
+
+static const BlockDevOps vu_blk_dev_ops = {
+    .drained_begin = vu_blk_drained_begin,
+    .drained_end   = vu_blk_drained_end,
+    .drained_poll  = vu_blk_drained_poll,
+};
+
+static void vu_blk_free_queue_iothreads(VuBlkExport *vexp)
+{
+    unsigned int i;
+
+    for (i = 0; i < vexp->num_queue_iothreads; i++) {
+        object_unref(OBJECT(vexp->queue_iothreads[i]));
+    }
+    g_free(vexp->queue_iothreads);
+    vexp->queue_iothreads = NULL;
+    vexp->num_queue_iothreads = 0;
+}
+
+static int vu_blk_get_queue_iothreads(VuBlkExport *vexp, strList *ids,
+                                      Error **errp)
+{
+    strList *id;
+
+    for (id = ids; id; id = id->next) {
+        IOThread *iothread = iothread_by_id(id->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", id->value);
+            vu_blk_free_queue_iothreads(vexp);
+            return -EINVAL;
+        }
+
+        vexp->queue_iothreads = g_renew(IOThread *, vexp->queue_iothreads,
+                                        vexp->num_queue_iothreads + 1);
+        vexp->queue_iothreads[vexp->num_queue_iothreads++] = iothread;
+        object_ref(OBJECT(iothread));
+    }
+
+    return 0;
+}
+
 static void
 vu_blk_initialize_config(BlockDriverState *bs,
                          struct virtio_blk_config *config,
@@ -281,6 +375,16 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         error_setg(errp, "num-queues must be greater than 0");
         return -EINVAL;
     }
+    if (vu_opts->has_queue_iothreads) {
+        if (!vu_opts->queue_iothreads) {
+            error_setg(errp, "queue-iothreads must not be empty");
+            return -EINVAL;
+        }
+        if (vu_blk_get_queue_iothreads(vexp, vu_opts->queue_iothreads,
+                                       errp) < 0) {
+            return -EINVAL;
+        }
+    }
     vexp->handler.blk = exp->blk;
     vexp->handler.serial = g_strdup("vhost_user_blk");
     vexp->handler.logical_block_size = logical_block_size;
@@ -297,9 +401,29 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
         g_free(vexp->handler.serial);
+        vu_blk_free_queue_iothreads(vexp);
         return -EADDRNOTAVAIL;
     }
 
+    if (vexp->num_queue_iothreads) {
+        g_autofree AioContext **ctxs =
+            g_new(AioContext *, vexp->num_queue_iothreads);
+        unsigned int i;
+
+        for (i = 0; i < vexp->num_queue_iothreads; i++) {
+            ctxs[i] = iothread_get_aio_context(vexp->queue_iothreads[i]);
+        }
+        vhost_user_server_set_queue_contexts(&vexp->vu_server, ctxs,
+                                             vexp->num_queue_iothreads);
+        /*
+         * A request that already moved to the node's AioContext must be
+         * able to complete in a drained section, vu_blk_drained_poll()
+         * waits for it.
+         */
+        blk_set_disable_request_queuing(exp->blk, true);
+        blk_set_dev_ops(exp->blk, &vu_blk_dev_ops, vexp);
+    }
+
     return 0;
 }
 
@@ -309,7 +433,11 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    if (vexp->num_queue_iothreads) {
+        blk_set_dev_ops(exp->blk, NULL, NULL);
+    }
     g_free(vexp->handler.serial);
+    vu_blk_free_queue_iothreads(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
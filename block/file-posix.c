@@ -211,6 +211,9 @@ typedef struct RawPosixAIOData {
             int aio_fd2;
             off_t aio_offset2;
         } copy_range;
+        struct {
+            int pipe_fd;
+        } splice;
         struct {
             PreallocMode prealloc;
             Error **errp;
@@ -1826,6 +1829,44 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#ifdef CONFIG_SPLICE
+static int handle_aiocb_splice_read(void *opaque)
+{
+    static const uint8_t zeroes[4096];
+    RawPosixAIOData *aiocb = opaque;
+    uint64_t bytes = aiocb->aio_nbytes;
+    loff_t off = aiocb->aio_offset;
+    ssize_t ret;
+
+    while (bytes) {
+        ret = splice(aiocb->aio_fildes, &off, aiocb->splice.pipe_fd, NULL,
+                     bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        trace_file_splice_read(aiocb->bs, aiocb->aio_fildes, off,
+                               aiocb->splice.pipe_fd, bytes, ret);
+        if (ret == 0) {
+            /* Beyond the end of the file, which reads as zeroes */
+            ret = write(aiocb->splice.pipe_fd, zeroes,
+                        MIN(bytes, sizeof(zeroes)));
+            if (ret > 0) {
+                off += ret;
+            }
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && bytes < aiocb->aio_nbytes) {
+                /* The pipe is full */
+                break;
+            }
+            return errno == EINVAL ? -ENOTSUP : -errno;
+        }
+        bytes -= ret;
+    }
+    return aiocb->aio_nbytes - bytes;
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -3294,6 +3335,33 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+#ifdef CONFIG_SPLICE
+static int coroutine_fn raw_co_splice_read(BlockDriverState *bs,
+                                           int64_t offset, int64_t bytes,
+                                           int pipe_fd)
+{
+    RawPosixAIOData acb;
+    BDRVRawState *s = bs->opaque;
+
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SPLICE_READ,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .splice         = {
+            .pipe_fd        = pipe_fd,
+        },
+    };
+
+    return raw_thread_pool_submit(bs, handle_aiocb_splice_read, &acb);
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3320,6 +3388,9 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SPLICE
+    .bdrv_co_splice_read    = raw_co_splice_read,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
@@ -3692,6 +3763,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SPLICE
+    .bdrv_co_splice_read    = raw_co_splice_read,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
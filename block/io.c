@@ -41,6 +41,46 @@
 /* Maximum bounce buffer for copy-on-read and write zeroes, in bytes */
 #define MAX_BOUNCE_BUFFER (32768 << BDRV_SECTOR_BITS)
 
+int coroutine_fn bdrv_co_splice_read(BdrvChild *child, int64_t offset,
+                                     int64_t bytes, int pipe_fd)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+    IO_CODE();
+
+    trace_bdrv_co_splice_read(bs, offset, bytes, pipe_fd);
+
+    if (!bs || !bdrv_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret) {
+        return ret;
+    }
+
+    /*
+     * Copy-on-read would have to write what is read, and O_DIRECT files
+     * only take aligned requests
+     */
+    if (!bs->drv->bdrv_co_splice_read || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read) ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_splice_read(bs, offset, bytes, pipe_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int64_t bytes, BdrvRequestFlags flags);
@@ -733,6 +773,68 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/*
+ * End of the range that @req is indexed with in bs->tracked_request_tree.
+ * Empty requests still take one byte: they can overlap others, see
+ * tracked_request_overlaps().
+ */
+static int64_t tracked_request_tree_key_end(BdrvTrackedRequest *req)
+{
+    return req->overlap_offset + MAX(req->overlap_bytes, 1);
+}
+
+static BdrvTrackedRequest *tracked_request_tree_entry(TreapNode *node)
+{
+    return treap_entry(node, BdrvTrackedRequest, tree_node);
+}
+
+static void tracked_request_tree_update(TreapNode *node)
+{
+    BdrvTrackedRequest *req = tracked_request_tree_entry(node);
+
+    req->tree_end = tracked_request_tree_key_end(req);
+    if (node->left) {
+        req->tree_end = MAX(req->tree_end,
+                            tracked_request_tree_entry(node->left)->tree_end);
+    }
+    if (node->right) {
+        req->tree_end = MAX(req->tree_end,
+                            tracked_request_tree_entry(node->right)->tree_end);
+    }
+}
+
+/* Order by overlap_offset; the address makes keys unique */
+static bool tracked_request_before(const TreapNode *a, const TreapNode *b)
+{
+    BdrvTrackedRequest *req_a = container_of(a, BdrvTrackedRequest, tree_node);
+    BdrvTrackedRequest *req_b = container_of(b, BdrvTrackedRequest, tree_node);
+
+    if (req_a->overlap_offset != req_b->overlap_offset) {
+        return req_a->overlap_offset < req_b->overlap_offset;
+    }
+    return (uintptr_t)req_a < (uintptr_t)req_b;
+}
+
+const TreapOps bdrv_tracked_request_tree_ops = {
+    .before = tracked_request_before,
+    .update = tracked_request_tree_update,
+};
+
+/* Called with req->bs->reqs_lock held */
+static void tracked_request_tree_insert(BdrvTrackedRequest *req)
+{
+    treap_insert(&req->bs->tracked_request_tree, &req->tree_node);
+}
+
+/*
+ * Called with req->bs->reqs_lock held, and before changing the overlap
+ * range of @req.
+ */
+static void tracked_request_tree_remove(BdrvTrackedRequest *req)
+{
+    treap_remove(&req->bs->tracked_request_tree, &req->tree_node);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -746,6 +848,7 @@ static void coroutine_fn tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    tracked_request_tree_remove(req);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
@@ -776,6 +879,7 @@ static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_tree_insert(req);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
@@ -795,38 +899,63 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
-/* Called with self->bs->reqs_lock held */
-static coroutine_fn BdrvTrackedRequest *
-bdrv_find_conflicting_request(BdrvTrackedRequest *self)
+/*
+ * Look for a request that @self must wait for among the requests in
+ * @t that may overlap [@self->overlap_offset, @end).  Only subtrees
+ * that reach into the range are visited.
+ */
+static BdrvTrackedRequest *
+bdrv_find_conflicting_request_in(TreapNode *node, BdrvTrackedRequest *self,
+                                 int64_t end)
 {
+    BdrvTrackedRequest *t = tracked_request_tree_entry(node);
     BdrvTrackedRequest *req;
 
-    QLIST_FOREACH(req, &self->bs->tracked_requests, list) {
-        if (req == self || (!req->serialising && !self->serialising)) {
-            continue;
-        }
-        if (tracked_request_overlaps(req, self->overlap_offset,
-                                     self->overlap_bytes))
-        {
-            /*
-             * Hitting this means there was a reentrant request, for
-             * example, a block driver issuing nested requests.  This must
-             * never happen since it means deadlock.
-             */
-            assert(qemu_coroutine_self() != req->co);
+    if (!t || t->tree_end <= self->overlap_offset) {
+        return NULL;
+    }
 
-            /*
-             * If the request is already (indirectly) waiting for us, or
-             * will wait for us as soon as it wakes up, then just go on
-             * (instead of producing a deadlock in the former case).
-             */
-            if (!req->waiting_for) {
-                return req;
-            }
+    req = bdrv_find_conflicting_request_in(node->left, self, end);
+    if (req) {
+        return req;
+    }
+
+    /* Neither @t nor its right subtree start before @end */
+    if (t->overlap_offset >= end) {
+        return NULL;
+    }
+
+    if (t != self && (t->serialising || self->serialising) &&
+        tracked_request_overlaps(t, self->overlap_offset,
+                                 self->overlap_bytes))
+    {
+        /*
+         * Hitting this means there was a reentrant request, for
+         * example, a block driver issuing nested requests.  This must
+         * never happen since it means deadlock.
+         */
+        assert(qemu_coroutine_self() != t->co);
+
+        /*
+         * If the request is already (indirectly) waiting for us, or
+         * will wait for us as soon as it wakes up, then just go on
+         * (instead of producing a deadlock in the former case).
+         */
+        if (!t->waiting_for) {
+            return t;
         }
     }
 
-    return NULL;
+    return bdrv_find_conflicting_request_in(node->right, self, end);
+}
+
+/* Called with self->bs->reqs_lock held */
+static coroutine_fn BdrvTrackedRequest *
+bdrv_find_conflicting_request(BdrvTrackedRequest *self)
+{
+    return bdrv_find_conflicting_request_in(
+        self->bs->tracked_request_tree.root, self,
+        tracked_request_tree_key_end(self));
 }
 
 /* Called with self->bs->reqs_lock held */
@@ -857,8 +986,10 @@ static void tracked_request_set_serialising(BdrvTrackedRequest *req,
         req->serialising = true;
     }
 
+    tracked_request_tree_remove(req);
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    tracked_request_tree_insert(req);
 }
 
 /**
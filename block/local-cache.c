@@ -0,0 +1,1332 @@
+/*
+ * Persistent local cache block driver
+ *
+ * The driver caches extents of its remote child in a local cache node, so
+ * that reads of hot data are served locally.  The cache node holds a
+ * header, a persistent map of the cached extents and the extent data
+ * itself, so the cache survives restarts.
+ *
+ * In writethrough mode, writes go to the remote node and update cached
+ * extents.  The cache is only trusted after a clean shutdown: if the
+ * header still says the cache is in use when it is opened, all extents
+ * are dropped.
+ *
+ * In writeback mode, writes to cached extents only go to the cache.  The
+ * map entry of an extent is persisted as dirty before its data is first
+ * written, and dirty extents are written back to the remote node when
+ * they are evicted or the node is closed.  Map entries are only ever
+ * persisted after the data they describe has been flushed, and a slot is
+ * only reused once its old entry is invalid on disk, so the map stays
+ * consistent across crashes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "migration/blocker.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define LOCAL_CACHE_MAGIC 0x4843434c554d4551ULL /* "QEMULCCH" on disk */
+#define LOCAL_CACHE_VERSION 1
+
+#define LOCAL_CACHE_HEADER_SIZE 4096
+#define LOCAL_CACHE_MAP_BLOCK 4096
+
+#define LOCAL_CACHE_MAX_EXTENT_SIZE (64 * MiB)
+
+/* Number of extents evicted at once when the cache is full */
+#define LOCAL_CACHE_EVICT_BATCH 16
+
+/* Header flags */
+#define LOCAL_CACHE_F_IN_USE     (1 << 0)
+#define LOCAL_CACHE_F_WRITEBACK  (1 << 1)
+
+/* Map entry flags */
+#define LOCAL_CACHE_E_VALID      (1 << 0)
+#define LOCAL_CACHE_E_DIRTY      (1 << 1)
+
+/* All fields are little endian */
+typedef struct QEMU_PACKED LocalCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t extent_size;
+    uint64_t nb_slots;
+    uint64_t map_offset;
+    uint64_t data_offset;
+    uint64_t remote_length;
+} LocalCacheHeader;
+
+typedef struct QEMU_PACKED LocalCacheMapEntry {
+    /* Offset of the extent in the remote node */
+    uint64_t offset;
+    uint32_t flags;
+    uint32_t reserved;
+} LocalCacheMapEntry;
+
+#define LOCAL_CACHE_ENTRIES_PER_BLOCK \
+    (LOCAL_CACHE_MAP_BLOCK / sizeof(LocalCacheMapEntry))
+
+typedef struct LocalCacheExtent {
+    int64_t offset;
+    uint32_t slot;
+
+    /* The slot holds the data of the extent */
+    bool valid;
+    bool dirty;
+    /* Removed from the cache, freed once the last reference is gone */
+    bool stale;
+    unsigned refs;
+
+    /* Held for writing while the extent is filled or modified */
+    CoRwlock lock;
+    QTAILQ_ENTRY(LocalCacheExtent) lru;
+} LocalCacheExtent;
+
+typedef struct BDRVLocalCacheState {
+    BdrvChild *cache;
+    bool writeback;
+
+    int64_t extent_size;
+    uint32_t nb_slots;
+    int64_t map_offset;
+    int64_t data_offset;
+    int64_t remote_length;
+
+    /* In-memory copy of the map in its on-disk format */
+    LocalCacheMapEntry *map;
+    size_t map_size;
+    /* Map blocks that differ from the cache node */
+    unsigned long *map_dirty;
+    CoMutex map_lock;
+
+    /* Cached extents by remote offset, least recently used first */
+    GHashTable *extents;
+    QTAILQ_HEAD(, LocalCacheExtent) lru;
+
+    /* Slots that can be filled */
+    uint32_t *free_slots;
+    uint32_t nb_free;
+    /* Freed slots whose map entry may still be valid on disk */
+    GArray *pending_slots;
+
+    uint64_t nb_dirty;
+    Error *migration_blocker;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t filled_bytes;
+    uint64_t evictions;
+    uint64_t written_back_bytes;
+} BDRVLocalCacheState;
+
+#define LOCAL_CACHE_OPT_MODE "mode"
+#define LOCAL_CACHE_OPT_EXTENT_SIZE "extent-size"
+static QemuOptsList runtime_opts = {
+    .name = "local-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = LOCAL_CACHE_OPT_MODE,
+            .type = QEMU_OPT_STRING,
+            .help = "cache mode (writethrough, writeback), "
+                "default writethrough",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_EXTENT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cached extents, default 1M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int64_t local_cache_slot_offset(BDRVLocalCacheState *s, uint32_t slot)
+{
+    return s->data_offset + slot * s->extent_size;
+}
+
+static int64_t local_cache_extent_bytes(BDRVLocalCacheState *s,
+                                        LocalCacheExtent *e)
+{
+    return MIN(s->extent_size, s->remote_length - e->offset);
+}
+
+static void local_cache_set_entry(BDRVLocalCacheState *s, uint32_t slot,
+                                  int64_t offset, uint32_t flags)
+{
+    s->map[slot] = (LocalCacheMapEntry) {
+        .offset = cpu_to_le64(offset),
+        .flags = cpu_to_le32(flags),
+    };
+    set_bit(slot / LOCAL_CACHE_ENTRIES_PER_BLOCK, s->map_dirty);
+}
+
+static void local_cache_extent_unref(BDRVLocalCacheState *s,
+                                     LocalCacheExtent *e)
+{
+    assert(e->refs > 0);
+    if (--e->refs == 0 && e->stale) {
+        g_free(e);
+    }
+}
+
+/*
+ * Remove @e from the cache.  Its slot is only reused once the invalid map
+ * entry has been persisted, see local_cache_co_persist_map().
+ */
+static void local_cache_extent_drop(BDRVLocalCacheState *s,
+                                    LocalCacheExtent *e)
+{
+    assert(e->valid && !e->stale && !e->dirty);
+
+    local_cache_set_entry(s, e->slot, 0, 0);
+    g_array_append_val(s->pending_slots, e->slot);
+
+    g_hash_table_remove(s->extents, &e->offset);
+    QTAILQ_REMOVE(&s->lru, e, lru);
+    e->stale = true;
+    e->refs++;
+    local_cache_extent_unref(s, e);
+}
+
+/*
+ * Write the modified map blocks to the cache node.  The data they describe
+ * is flushed before, and the map itself after, so that the on-disk map
+ * never points at data that has not reached the disk.
+ *
+ * The blocks are copied before the first flush: an entry set while that
+ * flush is in flight may describe data it does not cover, so it is left
+ * for the next update.
+ */
+static int coroutine_fn local_cache_co_persist_map(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint8_t *buf = NULL;
+    long *blocks = NULL;
+    guint nb_pending;
+    long nb_blocks = DIV_ROUND_UP(s->map_size, LOCAL_CACHE_MAP_BLOCK);
+    long i, n = 0, nb_copied;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->map_lock);
+
+    nb_pending = s->pending_slots->len;
+
+    nb_copied = bitmap_count_one(s->map_dirty, nb_blocks);
+    if (nb_copied) {
+        buf = qemu_try_blockalign(s->cache->bs,
+                                  nb_copied * LOCAL_CACHE_MAP_BLOCK);
+        if (!buf) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        blocks = g_new(long, nb_copied);
+        for (i = find_first_bit(s->map_dirty, nb_blocks); i < nb_blocks;
+             i = find_next_bit(s->map_dirty, nb_blocks, i + 1)) {
+            clear_bit(i, s->map_dirty);
+            memcpy(buf + n * LOCAL_CACHE_MAP_BLOCK,
+                   (uint8_t *)s->map + i * LOCAL_CACHE_MAP_BLOCK,
+                   LOCAL_CACHE_MAP_BLOCK);
+            blocks[n++] = i;
+        }
+    }
+
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (n = 0; n < nb_copied; n++) {
+        ret = bdrv_co_pwrite(s->cache,
+                             s->map_offset + blocks[n] * LOCAL_CACHE_MAP_BLOCK,
+                             LOCAL_CACHE_MAP_BLOCK,
+                             buf + n * LOCAL_CACHE_MAP_BLOCK, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* The slots freed before the map was copied can be reused now */
+    for (i = 0; i < nb_pending; i++) {
+        s->free_slots[s->nb_free++] = g_array_index(s->pending_slots,
+                                                    uint32_t, i);
+    }
+    g_array_remove_range(s->pending_slots, 0, nb_pending);
+
+out:
+    if (ret < 0) {
+        /* Nothing is known to be on disk, write all copied blocks again */
+        for (n = 0; blocks && n < nb_copied; n++) {
+            set_bit(blocks[n], s->map_dirty);
+        }
+    }
+    g_free(blocks);
+    qemu_vfree(buf);
+    qemu_co_mutex_unlock(&s->map_lock);
+    return ret;
+}
+
+/* Write a dirty extent back to the remote node, @e must be write locked */
+static int coroutine_fn local_cache_co_writeback(BlockDriverState *bs,
+                                                 LocalCacheExtent *e)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t bytes = local_cache_extent_bytes(s, e);
+    uint8_t *buf;
+    int ret;
+
+    assert(e->dirty);
+
+    buf = qemu_try_blockalign(bs->file->bs, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(s->cache, local_cache_slot_offset(s, e->slot), bytes,
+                        buf, 0);
+    if (ret >= 0) {
+        ret = bdrv_co_pwrite(bs->file, e->offset, bytes, buf, 0);
+    }
+    if (ret >= 0) {
+        /* The map entry must not become clean before the data is safe */
+        ret = bdrv_co_flush(bs->file->bs);
+    }
+    qemu_vfree(buf);
+    trace_local_cache_writeback(bs, e->offset, bytes, ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    e->dirty = false;
+    s->nb_dirty--;
+    s->written_back_bytes += bytes;
+    local_cache_set_entry(s, e->slot, e->offset, LOCAL_CACHE_E_VALID);
+
+    return 0;
+}
+
+/*
+ * Evict up to LOCAL_CACHE_EVICT_BATCH of the least recently used idle
+ * extents, writing them back if needed.  Their slots become free with the
+ * next map update, which is shared by the whole batch.
+ */
+static int coroutine_fn local_cache_co_evict(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheExtent *victims[LOCAL_CACHE_EVICT_BATCH];
+    LocalCacheExtent *e;
+    int i, n = 0;
+    int ret = 0;
+
+    QTAILQ_FOREACH(e, &s->lru, lru) {
+        if (!e->refs) {
+            e->refs++;
+            victims[n++] = e;
+            if (n == LOCAL_CACHE_EVICT_BATCH) {
+                break;
+            }
+        }
+    }
+    if (!n) {
+        return -ENOSPC;
+    }
+
+    for (i = 0; i < n; i++) {
+        e = victims[i];
+        qemu_co_rwlock_wrlock(&e->lock);
+        if (!e->stale && ret >= 0) {
+            if (e->dirty) {
+                ret = local_cache_co_writeback(bs, e);
+            }
+            if (ret >= 0) {
+                trace_local_cache_evict(bs, e->offset, e->slot);
+                local_cache_extent_drop(s, e);
+                s->evictions++;
+            }
+        }
+        qemu_co_rwlock_unlock(&e->lock);
+        local_cache_extent_unref(s, e);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_get_slot(BlockDriverState *bs,
+                                                uint32_t *slot)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    while (!s->nb_free) {
+        if (s->pending_slots->len) {
+            ret = local_cache_co_persist_map(bs);
+        } else {
+            ret = local_cache_co_evict(bs);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    *slot = s->free_slots[--s->nb_free];
+    return 0;
+}
+
+/*
+ * Add the extent at @offset to the cache, write locked and holding a
+ * reference.  The caller fills it.
+ */
+static LocalCacheExtent * coroutine_fn
+local_cache_extent_new(BDRVLocalCacheState *s, int64_t offset)
+{
+    LocalCacheExtent *e = g_new0(LocalCacheExtent, 1);
+
+    e->offset = offset;
+    e->refs = 1;
+    qemu_co_rwlock_init(&e->lock);
+    /* Nobody else can hold the lock of a new extent, this doesn't yield */
+    qemu_co_rwlock_wrlock(&e->lock);
+
+    g_hash_table_insert(s->extents, &e->offset, e);
+    QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+
+    return e;
+}
+
+/*
+ * Read the extent @e from the remote node into @buf and store it in a free
+ * slot.  If it cannot be stored, @e is dropped, but @buf still holds its
+ * data unless an error is returned.
+ */
+static int coroutine_fn local_cache_co_fill(BlockDriverState *bs,
+                                            LocalCacheExtent *e, uint8_t *buf)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t bytes = local_cache_extent_bytes(s, e);
+    uint32_t slot;
+    int ret;
+
+    ret = bdrv_co_pread(bs->file, e->offset, bytes, buf, 0);
+    if (ret >= 0) {
+        ret = local_cache_co_get_slot(bs, &slot);
+        if (ret >= 0) {
+            ret = bdrv_co_pwrite(s->cache, local_cache_slot_offset(s, slot),
+                                 bytes, buf, 0);
+            trace_local_cache_fill(bs, e->offset, bytes, slot, ret);
+            if (ret < 0) {
+                /* The slot never became valid, it can be reused right away */
+                s->free_slots[s->nb_free++] = slot;
+            }
+        }
+        if (ret >= 0) {
+            e->slot = slot;
+            e->valid = true;
+            s->filled_bytes += bytes;
+            local_cache_set_entry(s, slot, e->offset, LOCAL_CACHE_E_VALID);
+            return 0;
+        }
+        /* The data was read, it just can't be cached */
+        ret = 0;
+    }
+
+    g_hash_table_remove(s->extents, &e->offset);
+    QTAILQ_REMOVE(&s->lru, e, lru);
+    e->stale = true;
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_preadv_part(BlockDriverState *bs,
+                                                   int64_t offset,
+                                                   int64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    if (flags) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    while (bytes) {
+        int64_t start = QEMU_ALIGN_DOWN(offset, s->extent_size);
+        int64_t n = MIN(bytes, start + s->extent_size - offset);
+        LocalCacheExtent *e = g_hash_table_lookup(s->extents, &start);
+
+        if (e) {
+            bool dirty;
+
+            e->refs++;
+            qemu_co_rwlock_rdlock(&e->lock);
+            if (e->stale) {
+                /* Evicted or failed to fill while we waited, try again */
+                qemu_co_rwlock_unlock(&e->lock);
+                local_cache_extent_unref(s, e);
+                continue;
+            }
+            ret = bdrv_co_preadv_part(s->cache,
+                                      local_cache_slot_offset(s, e->slot) +
+                                      offset - start, n, qiov, qiov_offset, 0);
+            dirty = e->dirty;
+            QTAILQ_REMOVE(&s->lru, e, lru);
+            QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+            qemu_co_rwlock_unlock(&e->lock);
+            local_cache_extent_unref(s, e);
+
+            if (ret >= 0) {
+                s->hits++;
+            } else if (!dirty) {
+                /* The remote node still has the data */
+                ret = bdrv_co_preadv_part(bs->file, offset, n, qiov,
+                                          qiov_offset, 0);
+            }
+        } else {
+            s->misses++;
+            if (!buf) {
+                buf = qemu_try_blockalign(bs->file->bs, s->extent_size);
+                if (!buf) {
+                    return -ENOMEM;
+                }
+            }
+
+            e = local_cache_extent_new(s, start);
+            ret = local_cache_co_fill(bs, e, buf);
+            qemu_co_rwlock_unlock(&e->lock);
+            local_cache_extent_unref(s, e);
+
+            if (ret >= 0) {
+                qemu_iovec_from_buf(qiov, qiov_offset, buf + offset - start,
+                                    n);
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/* Mark @e dirty, persisting its map entry before its data changes */
+static int coroutine_fn local_cache_co_make_dirty(BlockDriverState *bs,
+                                                  LocalCacheExtent *e)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    if (e->dirty) {
+        return 0;
+    }
+
+    local_cache_set_entry(s, e->slot, e->offset,
+                          LOCAL_CACHE_E_VALID | LOCAL_CACHE_E_DIRTY);
+    ret = local_cache_co_persist_map(bs);
+    if (ret < 0) {
+        local_cache_set_entry(s, e->slot, e->offset, LOCAL_CACHE_E_VALID);
+        return ret;
+    }
+
+    e->dirty = true;
+    s->nb_dirty++;
+    return 0;
+}
+
+static int coroutine_fn local_cache_co_pwritev_part(BlockDriverState *bs,
+                                                    int64_t offset,
+                                                    int64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret = 0;
+
+    while (bytes) {
+        int64_t start = QEMU_ALIGN_DOWN(offset, s->extent_size);
+        int64_t n = MIN(bytes, start + s->extent_size - offset);
+        LocalCacheExtent *e = g_hash_table_lookup(s->extents, &start);
+        bool written = false;
+
+        if (!e) {
+            /* Uncached extents are written around the cache */
+            ret = bdrv_co_pwritev_part(bs->file, offset, n, qiov, qiov_offset,
+                                       flags);
+            if (ret < 0) {
+                break;
+            }
+            written = true;
+
+            /*
+             * The extent may have been filled with the old data while the
+             * write was in flight, it is updated below.
+             */
+            e = g_hash_table_lookup(s->extents, &start);
+            if (!e) {
+                goto next;
+            }
+        }
+
+        e->refs++;
+        qemu_co_rwlock_wrlock(&e->lock);
+        if (e->stale) {
+            qemu_co_rwlock_unlock(&e->lock);
+            local_cache_extent_unref(s, e);
+            if (!written) {
+                continue;
+            }
+            goto next;
+        }
+
+        if (!written && s->writeback) {
+            ret = local_cache_co_make_dirty(bs, e);
+        } else if (!written) {
+            ret = bdrv_co_pwritev_part(bs->file, offset, n, qiov, qiov_offset,
+                                       flags);
+        }
+        if (ret >= 0) {
+            ret = bdrv_co_pwritev_part(s->cache,
+                                       local_cache_slot_offset(s, e->slot) +
+                                       offset - start, n, qiov, qiov_offset,
+                                       e->dirty ? flags & BDRV_REQ_FUA : 0);
+            if (ret < 0 && !e->dirty) {
+                /* The remote node has the data, forget the extent */
+                local_cache_extent_drop(s, e);
+                ret = 0;
+            }
+        }
+        qemu_co_rwlock_unlock(&e->lock);
+        local_cache_extent_unref(s, e);
+        if (ret < 0) {
+            break;
+        }
+
+next:
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Drop the cached extents overlapping [@offset, @offset + @bytes), writing
+ * dirty ones back first.
+ */
+static int coroutine_fn local_cache_co_invalidate(BlockDriverState *bs,
+                                                  int64_t offset,
+                                                  int64_t bytes)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->extent_size);
+    int64_t end = offset + bytes;
+    LocalCacheExtent *e;
+    int ret = 0;
+
+    for (; start < end && ret >= 0; start += s->extent_size) {
+        e = g_hash_table_lookup(s->extents, &start);
+        if (!e) {
+            continue;
+        }
+
+        e->refs++;
+        qemu_co_rwlock_wrlock(&e->lock);
+        if (!e->stale) {
+            if (e->dirty) {
+                ret = local_cache_co_writeback(bs, e);
+            }
+            if (ret >= 0) {
+                local_cache_extent_drop(s, e);
+            }
+        }
+        qemu_co_rwlock_unlock(&e->lock);
+        local_cache_extent_unref(s, e);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                     int64_t offset,
+                                                     int64_t bytes,
+                                                     BdrvRequestFlags flags)
+{
+    int ret = local_cache_co_invalidate(bs, offset, bytes);
+
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    if (ret < 0) {
+        return ret;
+    }
+    /* Drop extents that were filled while the request was in flight */
+    return local_cache_co_invalidate(bs, offset, bytes);
+}
+
+static int coroutine_fn local_cache_co_pdiscard(BlockDriverState *bs,
+                                                int64_t offset, int64_t bytes)
+{
+    int ret = local_cache_co_invalidate(bs, offset, bytes);
+
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    return local_cache_co_invalidate(bs, offset, bytes);
+}
+
+static int coroutine_fn local_cache_co_writeback_all(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    g_autoptr(GPtrArray) dirty = g_ptr_array_new();
+    LocalCacheExtent *e;
+    guint i;
+    int ret = 0;
+
+    /* The LRU list changes while we yield, take references first */
+    QTAILQ_FOREACH(e, &s->lru, lru) {
+        if (e->dirty) {
+            e->refs++;
+            g_ptr_array_add(dirty, e);
+        }
+    }
+
+    for (i = 0; i < dirty->len; i++) {
+        e = g_ptr_array_index(dirty, i);
+        if (ret >= 0) {
+            qemu_co_rwlock_wrlock(&e->lock);
+            if (!e->stale && e->dirty) {
+                ret = local_cache_co_writeback(bs, e);
+            }
+            qemu_co_rwlock_unlock(&e->lock);
+        }
+        local_cache_extent_unref(s, e);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_flush(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    if (s->writeback) {
+        /* Writeback data only needs to be safe in the cache */
+        ret = local_cache_co_persist_map(bs);
+    } else {
+        /* Left over from a previous writeback user */
+        ret = local_cache_co_writeback_all(bs);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int coroutine_fn local_cache_co_truncate(BlockDriverState *bs,
+                                                int64_t offset, bool exact,
+                                                PreallocMode prealloc,
+                                                BdrvRequestFlags flags,
+                                                Error **errp)
+{
+    error_setg(errp, "Cannot resize a node with a local cache");
+    return -ENOTSUP;
+}
+
+static int local_cache_write_header(BlockDriverState *bs, uint32_t flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header = {
+        .magic          = cpu_to_le64(LOCAL_CACHE_MAGIC),
+        .version        = cpu_to_le32(LOCAL_CACHE_VERSION),
+        .flags          = cpu_to_le32(flags),
+        .extent_size    = cpu_to_le64(s->extent_size),
+        .nb_slots       = cpu_to_le64(s->nb_slots),
+        .map_offset     = cpu_to_le64(s->map_offset),
+        .data_offset    = cpu_to_le64(s->data_offset),
+        .remote_length  = cpu_to_le64(s->remote_length),
+    };
+
+    return bdrv_pwrite_sync(s->cache, 0, sizeof(header), &header, 0);
+}
+
+/*
+ * Check that a map that does not match the current geometry can be thrown
+ * away, i.e. that it has no dirty extents.
+ */
+static int local_cache_check_old_map(BlockDriverState *bs,
+                                     LocalCacheHeader *header,
+                                     int64_t cache_length, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t nb_slots = le64_to_cpu(header->nb_slots);
+    uint64_t map_offset = le64_to_cpu(header->map_offset);
+    g_autofree LocalCacheMapEntry *map = NULL;
+    uint64_t i;
+    int ret;
+
+    if (map_offset < LOCAL_CACHE_HEADER_SIZE || map_offset > cache_length ||
+        nb_slots > (cache_length - map_offset) / sizeof(*map)) {
+        /* Not a map we could have written, nothing to preserve */
+        return 0;
+    }
+
+    map = g_try_new(LocalCacheMapEntry, nb_slots);
+    if (nb_slots && !map) {
+        error_setg(errp, "Could not allocate the old cache map");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, map_offset, nb_slots * sizeof(*map), map, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the old cache map");
+        return ret;
+    }
+
+    for (i = 0; i < nb_slots; i++) {
+        if (le32_to_cpu(map[i].flags) & LOCAL_CACHE_E_DIRTY) {
+            error_setg(errp, "The cache holds dirty data, but was created "
+                       "with a different extent size or cache size");
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Load the map from the cache node and build the extent list.  Clean
+ * extents are dropped if they may be stale.
+ */
+static int local_cache_load_map(BlockDriverState *bs, bool drop_clean,
+                                Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint32_t slot;
+    int ret;
+
+    ret = bdrv_pread(s->cache, s->map_offset, s->map_size, s->map, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache map");
+        return ret;
+    }
+
+    for (slot = s->nb_slots; slot-- > 0;) {
+        LocalCacheMapEntry *entry = &s->map[slot];
+        uint32_t flags = le32_to_cpu(entry->flags);
+        int64_t offset = le64_to_cpu(entry->offset);
+        LocalCacheExtent *e;
+
+        if (!(flags & LOCAL_CACHE_E_VALID)) {
+            s->free_slots[s->nb_free++] = slot;
+            continue;
+        }
+
+        if (drop_clean && !(flags & LOCAL_CACHE_E_DIRTY)) {
+            local_cache_set_entry(s, slot, 0, 0);
+            s->free_slots[s->nb_free++] = slot;
+            continue;
+        }
+
+        if (!QEMU_IS_ALIGNED(offset, s->extent_size) || offset < 0 ||
+            offset >= s->remote_length ||
+            g_hash_table_contains(s->extents, &offset)) {
+            error_setg(errp, "The cache map is corrupt (slot %" PRIu32 ")",
+                       slot);
+            return -EINVAL;
+        }
+
+        e = g_new0(LocalCacheExtent, 1);
+        e->offset = offset;
+        e->slot = slot;
+        e->valid = true;
+        e->dirty = flags & LOCAL_CACHE_E_DIRTY;
+        qemu_co_rwlock_init(&e->lock);
+        g_hash_table_insert(s->extents, &e->offset, e);
+        QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+        s->nb_dirty += e->dirty;
+    }
+
+    return 0;
+}
+
+static int local_cache_open_cache(BlockDriverState *bs, int flags,
+                                  Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header;
+    int64_t cache_length;
+    uint64_t nb_slots;
+    bool reuse = false;
+    bool drop_clean = false;
+    int ret;
+
+    cache_length = bdrv_getlength(s->cache->bs);
+    if (cache_length < 0) {
+        error_setg_errno(errp, -cache_length, "Could not get cache size");
+        return cache_length;
+    }
+
+    /* Header, map and data; each map entry comes with one extent */
+    s->map_offset = LOCAL_CACHE_HEADER_SIZE;
+    nb_slots = MAX(cache_length - s->map_offset, 0) /
+               (s->extent_size + sizeof(LocalCacheMapEntry));
+    nb_slots = MIN(nb_slots, UINT32_MAX - 1);
+    for (;; nb_slots--) {
+        s->map_size = ROUND_UP(nb_slots * sizeof(LocalCacheMapEntry),
+                               LOCAL_CACHE_MAP_BLOCK);
+        s->data_offset = s->map_offset + s->map_size;
+        if (!nb_slots ||
+            s->data_offset + nb_slots * s->extent_size <= cache_length) {
+            break;
+        }
+    }
+    if (!nb_slots) {
+        error_setg(errp, "The cache node is too small for a single extent");
+        return -EINVAL;
+    }
+    s->nb_slots = nb_slots;
+
+    s->map = qemu_try_blockalign0(s->cache->bs, s->map_size);
+    s->map_dirty = bitmap_new(s->map_size / LOCAL_CACHE_MAP_BLOCK);
+    s->free_slots = g_try_new(uint32_t, s->nb_slots);
+    if (!s->map || !s->free_slots) {
+        error_setg(errp, "Could not allocate the cache map");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+
+    if (le64_to_cpu(header.magic) == LOCAL_CACHE_MAGIC) {
+        uint32_t header_flags = le32_to_cpu(header.flags);
+
+        if (le32_to_cpu(header.version) != LOCAL_CACHE_VERSION) {
+            error_setg(errp, "Unsupported cache version %" PRIu32,
+                       le32_to_cpu(header.version));
+            return -ENOTSUP;
+        }
+
+        reuse = le64_to_cpu(header.extent_size) == s->extent_size &&
+                le64_to_cpu(header.nb_slots) == s->nb_slots &&
+                le64_to_cpu(header.map_offset) == s->map_offset &&
+                le64_to_cpu(header.data_offset) == s->data_offset;
+        if (!reuse) {
+            ret = local_cache_check_old_map(bs, &header, cache_length, errp);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        /*
+         * Writethrough users may have left stale clean extents behind
+         * when they crashed, writeback users keep all extents consistent.
+         */
+        if ((header_flags & LOCAL_CACHE_F_IN_USE) &&
+            !(header_flags & LOCAL_CACHE_F_WRITEBACK)) {
+            drop_clean = true;
+        }
+        if (le64_to_cpu(header.remote_length) != s->remote_length) {
+            drop_clean = true;
+        }
+    }
+
+    if (reuse) {
+        ret = local_cache_load_map(bs, drop_clean, errp);
+        if (ret < 0) {
+            return ret;
+        }
+        if (s->nb_dirty &&
+            le64_to_cpu(header.remote_length) != s->remote_length) {
+            error_setg(errp, "The cache holds dirty data, but the size of "
+                       "the remote node changed");
+            return -EINVAL;
+        }
+    } else {
+        uint32_t slot;
+
+        for (slot = s->nb_slots; slot-- > 0;) {
+            s->free_slots[s->nb_free++] = slot;
+        }
+        bitmap_set(s->map_dirty, 0, s->map_size / LOCAL_CACHE_MAP_BLOCK);
+    }
+
+    if (s->nb_dirty && !(flags & BDRV_O_RDWR)) {
+        error_setg(errp, "The cache holds dirty data, the node must be "
+                   "opened read-write to write it back");
+        return -EINVAL;
+    }
+
+    /*
+     * Mark the cache in use before it can diverge from the map on disk.
+     * A new or trimmed map is written before the header that makes it
+     * valid.
+     */
+    if (!bitmap_empty(s->map_dirty, s->map_size / LOCAL_CACHE_MAP_BLOCK)) {
+        ret = bdrv_pwrite_sync(s->cache, s->map_offset, s->map_size, s->map,
+                               0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the cache map");
+            return ret;
+        }
+        bitmap_zero(s->map_dirty, s->map_size / LOCAL_CACHE_MAP_BLOCK);
+    }
+    ret = local_cache_write_header(bs, LOCAL_CACHE_F_IN_USE |
+                                   (s->writeback ? LOCAL_CACHE_F_WRITEBACK :
+                                    0));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+
+    return 0;
+}
+
+static void local_cache_free(BDRVLocalCacheState *s)
+{
+    LocalCacheExtent *e, *next;
+
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        QTAILQ_REMOVE(&s->lru, e, lru);
+        g_free(e);
+    }
+    g_hash_table_destroy(s->extents);
+    g_array_free(s->pending_slots, true);
+    g_free(s->free_slots);
+    g_free(s->map_dirty);
+    qemu_vfree(s->map);
+}
+
+static int local_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *mode;
+    uint32_t align;
+    int ret;
+
+    if (flags & BDRV_O_INACTIVE) {
+        error_setg(errp, "The local-cache driver does not support incoming "
+                   "migration");
+        return -ENOTSUP;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    mode = qemu_opt_get(opts, LOCAL_CACHE_OPT_MODE);
+    ret = qapi_enum_parse(&LocalCacheMode_lookup, mode,
+                          LOCAL_CACHE_MODE_WRITETHROUGH, errp);
+    s->writeback = ret == LOCAL_CACHE_MODE_WRITEBACK;
+    s->extent_size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_EXTENT_SIZE,
+                                       1 * MiB);
+    qemu_opts_del(opts);
+    if (ret < 0) {
+        return -EINVAL;
+    }
+
+    /*
+     * This is not a filter: dirty extents and, after a crash, extents left
+     * over from a writeback user are newer in the cache than in the remote
+     * node, so the remote node must not be accessed behind our back.
+     */
+    bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                    BDRV_CHILD_DATA | BDRV_CHILD_PRIMARY, false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    /*
+     * The cache is written even if the remote node is read-only, which is
+     * the common case of a golden image.
+     */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                              "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_METADATA, false,
+                               errp);
+    if (!s->cache) {
+        return -EINVAL;
+    }
+
+    align = MAX(bs->file->bs->bl.request_alignment,
+                s->cache->bs->bl.request_alignment);
+    if (!is_power_of_2(s->extent_size) || s->extent_size < align ||
+        s->extent_size > LOCAL_CACHE_MAX_EXTENT_SIZE) {
+        error_setg(errp, "extent-size must be a power of two between %"
+                   PRIu32 " and 64M", align);
+        return -EINVAL;
+    }
+
+    s->remote_length = bdrv_getlength(bs->file->bs);
+    if (s->remote_length < 0) {
+        error_setg_errno(errp, -s->remote_length,
+                         "Could not get the size of the remote node");
+        return s->remote_length;
+    }
+
+    s->extents = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    s->pending_slots = g_array_new(false, false, sizeof(uint32_t));
+    qemu_co_mutex_init(&s->map_lock);
+
+    ret = local_cache_open_cache(bs, flags, errp);
+    if (ret < 0) {
+        local_cache_free(s);
+        return ret;
+    }
+
+    /* The cache is local to this host */
+    error_setg(&s->migration_blocker,
+               "The local-cache driver used by node '%s' does not support "
+               "live migration", bdrv_get_device_or_node_name(bs));
+    ret = migrate_add_blocker(s->migration_blocker, errp);
+    if (ret < 0) {
+        error_free(s->migration_blocker);
+        local_cache_free(s);
+        return ret;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+typedef struct LocalCacheCloseCo {
+    BlockDriverState *bs;
+    int ret;
+} LocalCacheCloseCo;
+
+static void coroutine_fn local_cache_co_close_entry(void *opaque)
+{
+    LocalCacheCloseCo *c = opaque;
+    BlockDriverState *bs = c->bs;
+    int ret;
+
+    /* Leave the remote node consistent on its own */
+    ret = local_cache_co_writeback_all(bs);
+    if (ret < 0) {
+        error_report("local-cache: Failed to write back dirty extents: %s",
+                     strerror(-ret));
+    }
+
+    ret = local_cache_co_persist_map(bs);
+    if (ret < 0) {
+        error_report("local-cache: Failed to write the cache map: %s",
+                     strerror(-ret));
+    }
+
+    c->ret = ret;
+    aio_wait_kick();
+}
+
+static void local_cache_close(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheCloseCo c = {
+        .bs = bs,
+        .ret = -EINPROGRESS,
+    };
+    uint32_t flags = 0;
+    int ret;
+
+    bdrv_coroutine_enter(bs, qemu_coroutine_create(local_cache_co_close_entry,
+                                                   &c));
+    BDRV_POLL_WHILE(bs, c.ret == -EINPROGRESS);
+
+    /* A cache that could not be made consistent stays marked in use */
+    if (c.ret < 0 || s->nb_dirty) {
+        flags = LOCAL_CACHE_F_IN_USE |
+                (s->writeback ? LOCAL_CACHE_F_WRITEBACK : 0);
+    }
+    ret = local_cache_write_header(bs, flags);
+    if (ret < 0) {
+        error_report("local-cache: Failed to write the cache header: %s",
+                     strerror(-ret));
+    }
+
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    local_cache_free(s);
+}
+
+static void local_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                   BdrvChildRole role,
+                                   BlockReopenQueue *reopen_queue,
+                                   uint64_t perm, uint64_t shared,
+                                   uint64_t *nperm, uint64_t *nshared)
+{
+    if (role & BDRV_CHILD_METADATA) {
+        /* The cache node belongs to us alone */
+        *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE;
+        *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+        return;
+    }
+
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* The remote node is never resized through us */
+    *nperm &= ~BLK_PERM_RESIZE;
+    /* Writes that bypass this node would leave stale data in the cache */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+/*
+ * Return the start of the first dirty extent that overlaps [@offset, @end),
+ * or @end if there is none.
+ */
+static int64_t local_cache_next_dirty(BDRVLocalCacheState *s, int64_t offset,
+                                      int64_t end)
+{
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->extent_size);
+    int64_t next = end;
+    LocalCacheExtent *e;
+
+    if (!s->nb_dirty) {
+        return end;
+    }
+
+    if ((end - start) / s->extent_size > g_hash_table_size(s->extents)) {
+        QTAILQ_FOREACH(e, &s->lru, lru) {
+            if (e->dirty && e->offset + s->extent_size > offset &&
+                e->offset < next) {
+                next = MAX(e->offset, offset);
+            }
+        }
+        return next;
+    }
+
+    for (; start < end; start += s->extent_size) {
+        e = g_hash_table_lookup(s->extents, &start);
+        if (e && e->dirty) {
+            return MAX(start, offset);
+        }
+    }
+    return end;
+}
+
+static int coroutine_fn local_cache_co_block_status(BlockDriverState *bs,
+                                                    bool want_zero,
+                                                    int64_t offset,
+                                                    int64_t bytes,
+                                                    int64_t *pnum,
+                                                    int64_t *map,
+                                                    BlockDriverState **file)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->extent_size);
+    int64_t next = local_cache_next_dirty(s, offset, offset + bytes);
+    LocalCacheExtent *e;
+
+    if (next > offset) {
+        /* The remote node is up to date */
+        *pnum = next - offset;
+        *map = offset;
+        *file = bs->file->bs;
+        return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+    }
+
+    /* Only the cache node has the current data, whatever the remote holds */
+    e = g_hash_table_lookup(s->extents, &start);
+    *pnum = MIN(bytes, start + s->extent_size - offset);
+    *map = local_cache_slot_offset(s, e->slot) + offset - start;
+    *file = s->cache->bs;
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static int64_t local_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static BlockStatsSpecific *local_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVLocalCacheState *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_LOCAL_CACHE;
+    stats->u.local_cache = (BlockStatsSpecificLocalCache) {
+        .hits = s->hits,
+        .misses = s->misses,
+        .filled_bytes = s->filled_bytes,
+        .evictions = s->evictions,
+        .cached_extents = g_hash_table_size(s->extents),
+        .dirty_extents = s->nb_dirty,
+        .written_back_bytes = s->written_back_bytes,
+    };
+
+    return stats;
+}
+
+static BlockDriver bdrv_local_cache = {
+    .format_name                        = "local-cache",
+    .instance_size                      = sizeof(BDRVLocalCacheState),
+
+    .bdrv_open                          = local_cache_open,
+    .bdrv_close                         = local_cache_close,
+    .bdrv_child_perm                    = local_cache_child_perm,
+
+    .bdrv_getlength                     = local_cache_getlength,
+
+    .bdrv_co_preadv_part                = local_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = local_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = local_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = local_cache_co_pdiscard,
+    .bdrv_co_flush                      = local_cache_co_flush,
+    .bdrv_co_truncate                   = local_cache_co_truncate,
+    .bdrv_co_block_status               = local_cache_co_block_status,
+
+    .bdrv_get_specific_stats            = local_cache_get_specific_stats,
+};
+
+static void bdrv_local_cache_init(void)
+{
+    bdrv_register(&bdrv_local_cache);
+}
+
+block_init(bdrv_local_cache_init);
@@ -456,3 +456,38 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+/*
+ * Look up the table at @offset without taking a reference and without
+ * yielding.  Returns NULL if the table is not cached.
+ *
+ * The returned table may only be used until the caller yields.  Until
+ * then it cannot change: the cache is only used from the node's
+ * AioContext, and qcow2_cache_do_get() clears the offset of an entry
+ * before it yields to fill the entry with another table.
+ */
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i, lookup_index;
+
+    if (offset == 0 || !QEMU_IS_ALIGNED(offset, c->table_size)) {
+        return NULL;
+    }
+
+    i = lookup_index = (offset / c->table_size * 4) % c->size;
+    do {
+        Qcow2CachedTable *t = &c->entries[i];
+        if (t->offset == offset) {
+            /* Keep tables that are only used by lookups from being evicted */
+            if (t->ref == 0) {
+                t->lru_counter = ++c->lru_counter;
+            }
+            return qcow2_cache_get_table_addr(c, i);
+        }
+        if (++i == c->size) {
+            i = 0;
+        }
+    } while (i != lookup_index);
+
+    return NULL;
+}
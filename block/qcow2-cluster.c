@@ -742,6 +742,97 @@ fail:
     return ret;
 }
 
+/*
+ * get_host_offset_lockless
+ *
+ * Fast path of qcow2_get_host_offset() for reads of allocated data.  It is
+ * called without s->lock and never yields, so readers do not queue up
+ * behind a coroutine that holds the lock across metadata I/O.
+ *
+ * The mapping is only resolved if the L2 slice is already cached and
+ * @offset points to a QCOW2_SUBCLUSTER_NORMAL subcluster.  A slice that
+ * is being read into the L2 cache is not found, and as this function does
+ * not yield, no other coroutine changes the slice while it is used.
+ *
+ * On success, *bytes and *host_offset are updated as in
+ * qcow2_get_host_offset() and the subcluster type is implicitly
+ * QCOW2_SUBCLUSTER_NORMAL.  Returns -EAGAIN (leaving all outputs untouched)
+ * if the caller has to fall back to qcow2_get_host_offset() under s->lock.
+ */
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int l2_index, sc_index, offset_in_cluster;
+    uint64_t l1_index, l2_offset, *l2_slice, l2_entry, l2_bitmap;
+    uint64_t host_cluster_offset, bytes_available, bytes_needed, nb_clusters;
+    int start_of_slice;
+    int sc;
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    bytes_needed = (uint64_t) *bytes + offset_in_cluster;
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
+    bytes_needed = MIN(bytes_needed, bytes_available);
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return -EAGAIN;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return -EAGAIN;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    l2_slice = qcow2_cache_lookup(s->l2_table_cache,
+                                  l2_offset + start_of_slice);
+    if (!l2_slice) {
+        return -EAGAIN;
+    }
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+
+    if (qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index) !=
+        QCOW2_SUBCLUSTER_NORMAL)
+    {
+        return -EAGAIN;
+    }
+
+    /* Corruption is reported by qcow2_get_host_offset() on the slow path */
+    host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+    if (offset_into_cluster(s, host_cluster_offset)) {
+        return -EAGAIN;
+    }
+    if (has_data_file(bs) &&
+        host_cluster_offset + offset_in_cluster != offset) {
+        return -EAGAIN;
+    }
+
+    nb_clusters = size_to_clusters(s, bytes_needed);
+    assert(nb_clusters <= INT_MAX);
+
+    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                      l2_slice, &l2_index);
+    if (sc <= 0) {
+        return -EAGAIN;
+    }
+
+    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+    bytes_available = MIN(bytes_available, bytes_needed);
+    assert(bytes_available - offset_in_cluster <= UINT_MAX);
+
+    *bytes = bytes_available - offset_in_cluster;
+    *host_offset = host_cluster_offset + offset_in_cluster;
+    return 0;
+}
+
 /*
  * get_cluster_table
  *
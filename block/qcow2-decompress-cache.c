@@ -0,0 +1,302 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * Compressed clusters are never rewritten in place: a guest write always
+ * allocates a new cluster, so the decompressed data for a given host offset
+ * stays valid until the host cluster holding it is freed.  Entries are keyed
+ * by the host offset of the compressed data and dropped by
+ * qcow2_decompress_cache_invalidate() when a refcount drops to zero.
+ *
+ * All accesses happen in the AioContext of the qcow2 node, so no locking is
+ * needed.  Concurrent misses on the same cluster wait for the request that
+ * is already decompressing it instead of doing the work twice.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qcow2.h"
+#include "trace.h"
+
+struct Qcow2DecompressCache {
+    GHashTable *entries;
+    QTAILQ_HEAD(, Qcow2DecompressedCluster) lru;
+    int cluster_size;
+
+    /* Includes invalidated entries that are still referenced */
+    int nb_entries;
+    int max_entries;
+
+    /* Incremented by every invalidation */
+    uint64_t generation;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+Qcow2DecompressCache *qcow2_decompress_cache_create(int cluster_size,
+                                                    uint64_t size)
+{
+    Qcow2DecompressCache *c = g_new0(Qcow2DecompressCache, 1);
+
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&c->lru);
+    c->cluster_size = cluster_size;
+    c->max_entries = MIN(size / cluster_size, INT_MAX);
+
+    return c;
+}
+
+static void qcow2_decompress_cache_free_entry(Qcow2DecompressCache *c,
+                                              Qcow2DecompressedCluster *entry)
+{
+    assert(entry->refs == 0);
+    c->nb_entries--;
+    g_free(entry->data);
+    g_free(entry);
+}
+
+/* Make @entry invisible to new lookups, freeing it if nobody uses it */
+static void qcow2_decompress_cache_drop(Qcow2DecompressCache *c,
+                                        Qcow2DecompressedCluster *entry)
+{
+    assert(!entry->stale);
+    g_hash_table_remove(c->entries, &entry->coffset);
+    QTAILQ_REMOVE(&c->lru, entry, next);
+    entry->stale = true;
+
+    if (entry->refs == 0) {
+        qcow2_decompress_cache_free_entry(c, entry);
+    }
+}
+
+/* Evict the least recently used unreferenced entry, if there is one */
+static bool qcow2_decompress_cache_evict(Qcow2DecompressCache *c)
+{
+    Qcow2DecompressedCluster *entry;
+
+    QTAILQ_FOREACH(entry, &c->lru, next) {
+        if (entry->refs == 0) {
+            trace_qcow2_decompress_cache_evict(c, entry->coffset);
+            qcow2_decompress_cache_drop(c, entry);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Allocate an entry for @coffset and add it to the cache, evicting another
+ * one if necessary.  Returns NULL if there is no room.
+ */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_new_entry(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int csize)
+{
+    Qcow2DecompressedCluster *entry;
+
+    if (c->nb_entries >= c->max_entries && !qcow2_decompress_cache_evict(c)) {
+        return NULL;
+    }
+
+    entry = g_new0(Qcow2DecompressedCluster, 1);
+    entry->data = g_try_malloc(c->cluster_size);
+    if (!entry->data) {
+        g_free(entry);
+        return NULL;
+    }
+
+    entry->coffset = coffset;
+    entry->csize = csize;
+    qemu_co_queue_init(&entry->waiters);
+
+    g_hash_table_insert(c->entries, &entry->coffset, entry);
+    QTAILQ_INSERT_TAIL(&c->lru, entry, next);
+    c->nb_entries++;
+
+    return entry;
+}
+
+void qcow2_decompress_cache_set_size(Qcow2DecompressCache *c, uint64_t size)
+{
+    c->max_entries = MIN(size / c->cluster_size, INT_MAX);
+
+    while (c->nb_entries > c->max_entries &&
+           qcow2_decompress_cache_evict(c)) {
+        /* keep going */
+    }
+}
+
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c)
+{
+    Qcow2DecompressedCluster *entry, *next_entry;
+
+    if (!c) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(entry, &c->lru, next, next_entry) {
+        qcow2_decompress_cache_drop(c, entry);
+    }
+    assert(c->nb_entries == 0);
+
+    g_hash_table_destroy(c->entries);
+    g_free(c);
+}
+
+/*
+ * Look up the decompressed data of the compressed cluster stored at
+ * @coffset.
+ *
+ * On a hit, *@hit is set to true and a referenced entry with valid data is
+ * returned; release it with qcow2_decompress_cache_put().
+ *
+ * On a miss, a new entry is returned that the caller must fill by
+ * decompressing the cluster into entry->data and then pass to
+ * qcow2_decompress_cache_complete().  Other requests for the same cluster
+ * wait until that happens.  NULL is returned if the cache is disabled or all
+ * entries are in use; the caller then decompresses into its own buffer.
+ */
+Qcow2DecompressedCluster *coroutine_fn
+qcow2_decompress_cache_get(Qcow2DecompressCache *c, uint64_t coffset,
+                           int csize, bool *hit)
+{
+    Qcow2DecompressedCluster *entry;
+
+    *hit = false;
+
+    while ((entry = g_hash_table_lookup(c->entries, &coffset))) {
+        entry->refs++;
+        if (entry->ret == -EINPROGRESS) {
+            qemu_co_queue_wait(&entry->waiters, NULL);
+        }
+
+        if (entry->ret == 0 && !entry->stale) {
+            QTAILQ_REMOVE(&c->lru, entry, next);
+            QTAILQ_INSERT_TAIL(&c->lru, entry, next);
+            c->hits++;
+            *hit = true;
+            return entry;
+        }
+
+        /* Filling it failed or it was invalidated in the meantime */
+        qcow2_decompress_cache_put(c, entry);
+    }
+
+    c->misses++;
+
+    entry = qcow2_decompress_cache_new_entry(c, coffset, csize);
+    if (entry) {
+        entry->ret = -EINPROGRESS;
+        entry->refs = 1;
+    }
+
+    return entry;
+}
+
+void qcow2_decompress_cache_put(Qcow2DecompressCache *c,
+                                Qcow2DecompressedCluster *entry)
+{
+    assert(entry->refs > 0);
+
+    if (--entry->refs == 0 && entry->stale) {
+        qcow2_decompress_cache_free_entry(c, entry);
+    }
+}
+
+/*
+ * Finish filling an entry returned by a miss in qcow2_decompress_cache_get()
+ * and release the reference to it.  @ret is the result of decompressing the
+ * cluster; on failure the entry is dropped again.
+ */
+void qcow2_decompress_cache_complete(Qcow2DecompressCache *c,
+                                     Qcow2DecompressedCluster *entry, int ret)
+{
+    assert(entry->ret == -EINPROGRESS);
+
+    entry->ret = ret;
+    if (ret < 0 && !entry->stale) {
+        qcow2_decompress_cache_drop(c, entry);
+    }
+    qemu_co_queue_restart_all(&entry->waiters);
+
+    qcow2_decompress_cache_put(c, entry);
+}
+
+/*
+ * Returns whether @coffset is cached or being filled, so that a batched read
+ * does not decompress it again.
+ */
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset)
+{
+    return g_hash_table_contains(c->entries, &coffset);
+}
+
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c)
+{
+    return c->generation;
+}
+
+/*
+ * Add a cluster that was decompressed without going through
+ * qcow2_decompress_cache_get(), such as part of a batched read; this counts
+ * as a miss.  @generation is the value of
+ * qcow2_decompress_cache_generation() from before the compressed data was
+ * read: if anything was invalidated since then, the data may be outdated and
+ * is not added.  Nothing is added either if the cluster is already present
+ * or the cache is full of referenced entries.
+ */
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c,
+                                   uint64_t generation, uint64_t coffset,
+                                   int csize, const void *data)
+{
+    Qcow2DecompressedCluster *entry;
+
+    c->misses++;
+
+    if (generation != c->generation ||
+        qcow2_decompress_cache_contains(c, coffset))
+    {
+        return;
+    }
+
+    entry = qcow2_decompress_cache_new_entry(c, coffset, csize);
+    if (entry) {
+        memcpy(entry->data, data, c->cluster_size);
+    }
+}
+
+/*
+ * Drop all entries whose compressed data overlaps the host range
+ * [@offset, @offset + @bytes), which is about to be reused.
+ */
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    Qcow2DecompressedCluster *entry, *next_entry;
+
+    if (!c) {
+        return;
+    }
+
+    c->generation++;
+
+    QTAILQ_FOREACH_SAFE(entry, &c->lru, next, next_entry) {
+        if (entry->coffset < offset + bytes &&
+            offset < entry->coffset + entry->csize)
+        {
+            trace_qcow2_decompress_cache_invalidate(c, entry->coffset);
+            qcow2_decompress_cache_drop(c, entry);
+        }
+    }
+}
+
+void qcow2_decompress_cache_get_stats(Qcow2DecompressCache *c,
+                                      uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
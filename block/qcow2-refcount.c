@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
@@ -902,6 +903,9 @@ static int update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            qcow2_decompress_cache_invalidate(s->decompress_cache,
+                                              cluster_offset, s->cluster_size);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1652,8 +1656,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller has read from @l2_offset
+ * into @l2_table. While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1661,24 +1665,15 @@ fail:
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
+                              uint64_t *l2_table,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1849,11 +1844,513 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+/* Number of L2 tables that check_refcounts_l1() keeps reading ahead */
+#define CHECK_L2_READ_AHEAD 16
+
+/*
+ * Read of an L2 table by check_refcounts_l1(), running in its own
+ * coroutine so that the following tables are read while the current
+ * one is checked.
+ */
+typedef struct CheckL2Read {
+    BlockDriverState *bs;
+    int l1_index;
+    uint64_t l2_offset;
+    uint64_t *l2_table;
+    int ret;
+    bool done;
+    /* An earlier table with the same offset was repaired in the meantime */
+    bool stale;
+    Coroutine *waiter;
+} CheckL2Read;
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    CheckL2Read *r = opaque;
+    BDRVQcow2State *s = r->bs->opaque;
+
+    r->ret = bdrv_co_pread(r->bs->file, r->l2_offset,
+                           s->l2_size * l2_entry_size(s), r->l2_table, 0);
+    r->done = true;
+    if (r->waiter) {
+        aio_co_wake(r->waiter);
+    }
+}
+
+static void check_l2_read_start(CheckL2Read *r, BlockDriverState *bs,
+                                int l1_index, uint64_t l2_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!r->l2_table) {
+        r->l2_table = g_malloc(s->l2_size * l2_entry_size(s));
+    }
+    r->bs = bs;
+    r->l1_index = l1_index;
+    r->l2_offset = l2_offset;
+    r->ret = 0;
+    r->done = false;
+    r->stale = false;
+    qemu_coroutine_enter(qemu_coroutine_create(check_l2_read_entry, r));
+}
+
+static void coroutine_fn check_l2_read_wait(CheckL2Read *r)
+{
+    while (!r->done) {
+        r->waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        r->waiter = NULL;
+    }
+}
+
+/* Number of threads, and of refcount shards, of the parallel L2 scan */
+#define CHECK_L2_SCAN_THREADS QCOW2_MAX_THREADS
+
+/* Result of the parallel scan for one L1 entry */
+typedef struct CheckL2ScanResult {
+    /* The references of the L2 table were counted in a shard */
+    bool counted;
+    uint64_t allocated_clusters;
+    uint64_t compressed_clusters;
+    uint64_t fragmented_clusters;
+} CheckL2ScanResult;
+
+typedef struct CheckL2Scan {
+    BlockDriverState *bs;
+    /* The active L1 table first, then those of the snapshots */
+    uint64_t **l1_tables;
+    int *l1_sizes;
+    int nb_l1_tables;
+    int next_table;
+    int next_index;
+    int64_t file_len;
+
+    /*
+     * Per-thread counts of references to each cluster, for all L1 tables.
+     * A thread takes a free shard for each table it scans.
+     */
+    uint16_t *shards[CHECK_L2_SCAN_THREADS];
+    bool shard_busy[CHECK_L2_SCAN_THREADS];
+    int64_t shard_size;
+    CoQueue shard_queue;
+    /* A count hit UINT16_MAX, the shards cannot be used */
+    bool saturated;
+
+    /* For each L1 table, the result for each of its entries */
+    CheckL2ScanResult **results;
+    int nb_workers;
+    Coroutine *waiter;
+} CheckL2Scan;
+
+typedef struct CheckL2ScanTask {
+    CheckL2Scan *scan;
+    const uint64_t *l2_table;
+    uint16_t *shard;
+    CheckL2ScanResult *result;
+} CheckL2ScanTask;
+
+/*
+ * Handles one entry of an L2 table for check_l2_scan_table().  Returns false
+ * if check_refcounts_l2() would report or repair the entry.  If @shard is
+ * not NULL, the clusters referenced by the entry are counted in it.
+ */
+static bool check_l2_scan_entry(CheckL2Scan *sc, const uint64_t *l2_table,
+                                int i, uint16_t *shard, CheckL2ScanResult *r,
+                                uint64_t *next_contiguous_offset)
+{
+    BlockDriverState *bs = sc->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_entry = get_l2_entry(s, l2_table, i);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+    QCow2ClusterType type = qcow2_get_cluster_type(bs, l2_entry);
+    uint64_t coffset;
+    int64_t offset, size, k;
+    int csize;
+
+    if (type != QCOW2_CLUSTER_COMPRESSED &&
+        (l2_entry & L2E_STD_RESERVED_MASK)) {
+        return false;
+    }
+
+    switch (type) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        if ((l2_entry & QCOW_OFLAG_COPIED) || has_data_file(bs) || l2_bitmap) {
+            return false;
+        }
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        offset = coffset;
+        size = csize;
+        if (shard) {
+            r->allocated_clusters++;
+            r->compressed_clusters++;
+            r->fragmented_clusters++;
+        }
+        break;
+
+    case QCOW2_CLUSTER_ZERO_ALLOC:
+    case QCOW2_CLUSTER_NORMAL:
+        offset = l2_entry & L2E_OFFSET_MASK;
+        if (((l2_bitmap >> 32) & l2_bitmap) ||
+            offset_into_cluster(s, offset)) {
+            return false;
+        }
+        if (shard) {
+            r->allocated_clusters++;
+            if (*next_contiguous_offset &&
+                offset != *next_contiguous_offset) {
+                r->fragmented_clusters++;
+            }
+            *next_contiguous_offset = offset + s->cluster_size;
+        }
+        if (has_data_file(bs)) {
+            return true;
+        }
+        size = s->cluster_size;
+        break;
+
+    case QCOW2_CLUSTER_ZERO_PLAIN:
+        return !l2_bitmap;
+
+    case QCOW2_CLUSTER_UNALLOCATED:
+        return !(l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC);
+
+    default:
+        abort();
+    }
+
+    /* See qcow2_inc_refcounts_imrt() */
+    if (offset + size - sc->file_len >= s->cluster_size) {
+        return false;
+    }
+
+    if (shard) {
+        for (k = offset >> s->cluster_bits;
+             k <= (offset + size - 1) >> s->cluster_bits; k++) {
+            if (shard[k] == UINT16_MAX) {
+                qatomic_set(&sc->saturated, true);
+            } else {
+                shard[k]++;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Counts the references of an L2 table in a refcount shard, running in a
+ * worker thread.  Tables with entries that need a message or a repair are
+ * not counted; check_refcounts_l2() checks them in L1 order instead.
+ */
+static int check_l2_scan_table(void *opaque)
+{
+    CheckL2ScanTask *t = opaque;
+    BDRVQcow2State *s = t->scan->bs->opaque;
+    uint64_t next_contiguous_offset = 0;
+    int i;
+
+    for (i = 0; i < s->l2_size; i++) {
+        if (!check_l2_scan_entry(t->scan, t->l2_table, i, NULL, NULL, NULL)) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < s->l2_size; i++) {
+        check_l2_scan_entry(t->scan, t->l2_table, i, t->shard, t->result,
+                            &next_contiguous_offset);
+    }
+    t->result->counted = true;
+    return 0;
+}
+
+static void coroutine_fn check_l2_scan_worker(void *opaque)
+{
+    CheckL2Scan *sc = opaque;
+    BlockDriverState *bs = sc->bs;
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    uint64_t *l2_table = g_malloc(l2_size_bytes);
+
+    for (;;) {
+        uint64_t l1_entry, l2_offset;
+        CheckL2ScanTask task = {
+            .scan = sc,
+            .l2_table = l2_table,
+        };
+        int j;
+
+        while (sc->next_table < sc->nb_l1_tables &&
+               sc->next_index >= sc->l1_sizes[sc->next_table]) {
+            sc->next_table++;
+            sc->next_index = 0;
+        }
+        if (sc->next_table == sc->nb_l1_tables) {
+            break;
+        }
+        l1_entry = sc->l1_tables[sc->next_table][sc->next_index];
+        task.result = &sc->results[sc->next_table][sc->next_index];
+        sc->next_index++;
+        l2_offset = l1_entry & L1E_OFFSET_MASK;
+
+        /*
+         * Unaligned tables may overlap a table that is repaired, and read
+         * errors must be reported in order, leave both to the serial check
+         */
+        if (!l1_entry || offset_into_cluster(s, l2_offset)) {
+            continue;
+        }
+        if (bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table,
+                          0) < 0) {
+            continue;
+        }
+
+        for (;;) {
+            for (j = 0; j < CHECK_L2_SCAN_THREADS; j++) {
+                if (!sc->shard_busy[j]) {
+                    break;
+                }
+            }
+            if (j < CHECK_L2_SCAN_THREADS) {
+                break;
+            }
+            qemu_co_queue_wait(&sc->shard_queue, NULL);
+        }
+
+        sc->shard_busy[j] = true;
+        task.shard = sc->shards[j];
+        thread_pool_submit_co(pool, check_l2_scan_table, &task);
+        sc->shard_busy[j] = false;
+        qemu_co_queue_next(&sc->shard_queue);
+    }
+
+    g_free(l2_table);
+    if (--sc->nb_workers == 0 && sc->waiter) {
+        aio_co_wake(sc->waiter);
+    }
+}
+
+/* Frees the result of check_l2_scan() for an image with @nb_l1_tables */
+static void check_l2_scan_free(CheckL2ScanResult **results, int nb_l1_tables)
+{
+    int t;
+
+    if (results) {
+        for (t = 0; t < nb_l1_tables; t++) {
+            g_free(results[t]);
+        }
+        g_free(results);
+    }
+}
+
+/*
+ * Reads the L1 table at @offset for check_l2_scan(), or returns NULL.
+ * Errors are left to check_refcounts_l1() to report.
+ */
+static uint64_t * coroutine_fn check_l2_scan_read_l1(BlockDriverState *bs,
+                                                     uint64_t offset,
+                                                     int l1_size)
+{
+    uint64_t *l1_table = g_try_new(uint64_t, l1_size);
+    int i;
+
+    if (!l1_table) {
+        return NULL;
+    }
+    if (bdrv_co_pread(bs->file, offset, l1_size * L1E_SIZE, l1_table,
+                      0) < 0) {
+        g_free(l1_table);
+        return NULL;
+    }
+    for (i = 0; i < l1_size; i++) {
+        be64_to_cpus(&l1_table[i]);
+    }
+    return l1_table;
+}
+
+/*
+ * Counts the references of the L2 tables of the active L1 table and of
+ * all snapshots that calculate_refcounts() checks, in worker threads, and
+ * adds them to the refcount table.  The shards are allocated and merged
+ * only once for the whole check.
+ *
+ * Sets @results to an array with, for the active L1 table and then for
+ * each snapshot, the results for its L1 entries (NULL for snapshots that
+ * are not checked), or to NULL if nothing was counted.  Tables that were
+ * not counted must be checked by check_refcounts_l2().
+ *
+ * The shards are only used if no refcount in the refcount table can
+ * overflow while the L1 tables are checked.  Then the refcount table, the
+ * counters and the messages come out exactly as if every table had been
+ * checked in L1 order.
+ *
+ * Returns 0 on success, -errno if an internal error occurred.
+ */
+static int coroutine_fn check_l2_scan(BlockDriverState *bs,
+                                      BdrvCheckResult *res,
+                                      void **refcount_table,
+                                      int64_t *refcount_table_size,
+                                      CheckL2ScanResult ***results)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int nb_l1_tables = s->nb_snapshots + 1;
+    g_autofree uint64_t **l1_tables = g_new0(uint64_t *, nb_l1_tables);
+    g_autofree int *l1_sizes = g_new0(int, nb_l1_tables);
+    CheckL2Scan sc = {
+        .bs = bs,
+        .l1_tables = l1_tables,
+        .l1_sizes = l1_sizes,
+        .nb_l1_tables = nb_l1_tables,
+    };
+    uint64_t extra = 0, refcount;
+    int64_t k, last = -1;
+    int i, j, t, ret = 0;
+
+    *results = NULL;
+
+    sc.file_len = bdrv_getlength(bs->file->bs);
+    if (sc.file_len < 0) {
+        return 0;
+    }
+
+    /* The same L1 tables as calculate_refcounts() checks */
+    for (t = 0; t < nb_l1_tables; t++) {
+        uint64_t offset;
+        int l1_size;
+
+        if (t == 0) {
+            offset = s->l1_table_offset;
+            l1_size = s->l1_size;
+        } else {
+            QCowSnapshot *sn = s->snapshots + t - 1;
+
+            if (offset_into_cluster(s, sn->l1_table_offset) ||
+                sn->l1_size > QCOW_MAX_L1_SIZE / L1E_SIZE) {
+                continue;
+            }
+            offset = sn->l1_table_offset;
+            l1_size = sn->l1_size;
+        }
+        if (!l1_size) {
+            continue;
+        }
+
+        /* A table that is checked without the scan could overflow */
+        l1_tables[t] = check_l2_scan_read_l1(bs, offset, l1_size);
+        if (!l1_tables[t]) {
+            goto out;
+        }
+        l1_sizes[t] = l1_size;
+    }
+
+    /* Each reference is less than a cluster beyond the end of the file */
+    sc.shard_size = size_to_clusters(s, sc.file_len) + 1;
+    for (j = 0; j < CHECK_L2_SCAN_THREADS; j++) {
+        sc.shards[j] = g_try_new0(uint16_t, sc.shard_size);
+        if (!sc.shards[j]) {
+            goto out;
+        }
+    }
+    sc.results = g_new0(CheckL2ScanResult *, nb_l1_tables);
+    for (t = 0; t < nb_l1_tables; t++) {
+        if (l1_tables[t]) {
+            sc.results[t] = g_new0(CheckL2ScanResult, l1_sizes[t]);
+        }
+    }
+    qemu_co_queue_init(&sc.shard_queue);
+
+    for (j = 0; j < CHECK_L2_READ_AHEAD; j++) {
+        sc.nb_workers++;
+        qemu_coroutine_enter(qemu_coroutine_create(check_l2_scan_worker, &sc));
+    }
+    while (sc.nb_workers) {
+        sc.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        sc.waiter = NULL;
+    }
+
+    if (sc.saturated) {
+        goto out;
+    }
+
+    /*
+     * The most that check_refcounts_l1() may still add to one refcount:
+     * one per L1 table, one per L2 table and one per entry of each table
+     * that was not counted
+     */
+    for (t = 0; t < nb_l1_tables; t++) {
+        if (!l1_tables[t]) {
+            continue;
+        }
+        extra++;
+        for (i = 0; i < l1_sizes[t]; i++) {
+            if (l1_tables[t][i]) {
+                extra++;
+                if (!sc.results[t][i].counted) {
+                    extra += s->l2_size;
+                }
+            }
+        }
+    }
+
+    for (k = 0; k < sc.shard_size; k++) {
+        refcount = 0;
+        for (j = 0; j < CHECK_L2_SCAN_THREADS; j++) {
+            refcount += sc.shards[j][k];
+        }
+        if (!refcount) {
+            continue;
+        }
+        if (k < *refcount_table_size) {
+            refcount += s->get_refcount(*refcount_table, k);
+        }
+        if (refcount + extra > s->refcount_max) {
+            /* Leave everything to check_refcounts_l2() */
+            goto out;
+        }
+        last = k;
+    }
+
+    if (last >= *refcount_table_size) {
+        ret = realloc_refcount_array(s, refcount_table, refcount_table_size,
+                                     last + 1);
+        if (ret < 0) {
+            res->check_errors++;
+            goto out;
+        }
+    }
+
+    for (k = 0; k <= last; k++) {
+        refcount = s->get_refcount(*refcount_table, k);
+        for (j = 0; j < CHECK_L2_SCAN_THREADS; j++) {
+            refcount += sc.shards[j][k];
+        }
+        s->set_refcount(*refcount_table, k, refcount);
+    }
+
+    *results = g_steal_pointer(&sc.results);
+
+out:
+    for (j = 0; j < CHECK_L2_SCAN_THREADS; j++) {
+        g_free(sc.shards[j]);
+    }
+    for (t = 0; t < nb_l1_tables; t++) {
+        g_free(l1_tables[t]);
+    }
+    check_l2_scan_free(sc.results, nb_l1_tables);
+    return ret;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * If @scan is not NULL, the references of the L2 tables were already
+ * counted by check_l2_scan(), and only the tables it could not count are
+ * checked.  In coroutine context, they are checked in L1 order with up to
+ * CHECK_L2_READ_AHEAD of them read ahead of the one being checked, so the
+ * results and messages are the same as with synchronous reads.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1862,13 +2359,21 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags, BdrvCheckMode fix, bool active)
+                              int flags, BdrvCheckMode fix, bool active,
+                              const CheckL2ScanResult *scan)
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
     g_autofree uint64_t *l1_table = NULL;
+    g_autofree uint64_t *l2_buf = NULL;
+    uint64_t *l2_table;
+    CheckL2Read ra[CHECK_L2_READ_AHEAD] = {};
+    bool read_ahead = qemu_in_coroutine();
+    unsigned ra_head = 0, ra_tail = 0, j;
+    int ra_next = 0;
     uint64_t l2_offset;
-    int i, ret;
+    int i, fixed, ret;
 
     if (!l1_size) {
         return 0;
@@ -1918,7 +2423,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
                                        refcount_table, refcount_table_size,
                                        l2_offset, s->cluster_size);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
 
         /* L2 tables are cluster aligned */
@@ -1928,16 +2433,82 @@ static int check_refcounts_l1(BlockDriverState *bs,
             res->corruptions++;
         }
 
+        if (scan && scan[i].counted) {
+            if (flags & CHECK_FRAG_INFO) {
+                res->bfi.allocated_clusters += scan[i].allocated_clusters;
+                res->bfi.compressed_clusters += scan[i].compressed_clusters;
+                res->bfi.fragmented_clusters += scan[i].fragmented_clusters;
+            }
+            continue;
+        }
+
+        /* Read L2 table from disk */
+        if (read_ahead) {
+            CheckL2Read *r;
+
+            for (; ra_next < l1_size &&
+                   ra_tail - ra_head < CHECK_L2_READ_AHEAD; ra_next++) {
+                if (l1_table[ra_next] && !(scan && scan[ra_next].counted)) {
+                    check_l2_read_start(&ra[ra_tail++ % CHECK_L2_READ_AHEAD],
+                                        bs, ra_next,
+                                        l1_table[ra_next] & L1E_OFFSET_MASK);
+                }
+            }
+
+            r = &ra[ra_head++ % CHECK_L2_READ_AHEAD];
+            assert(r->l1_index == i);
+            check_l2_read_wait(r);
+            if (r->stale) {
+                check_l2_read_start(r, bs, i, l2_offset);
+                check_l2_read_wait(r);
+            }
+            ret = r->ret;
+            l2_table = r->l2_table;
+        } else {
+            if (!l2_buf) {
+                l2_buf = g_malloc(l2_size_bytes);
+            }
+            ret = bdrv_pread(bs->file, l2_offset, l2_size_bytes, l2_buf, 0);
+            l2_table = l2_buf;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            goto out;
+        }
+
         /* Process and check L2 entries */
+        fixed = res->corruptions_fixed;
         ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
+                                 refcount_table_size, l2_offset, l2_table,
+                                 flags, fix, active);
         if (ret < 0) {
-            return ret;
+            goto out;
+        }
+
+        if (res->corruptions_fixed != fixed) {
+            /* Tables read ahead from the same offset are now outdated */
+            for (j = ra_head; j != ra_tail; j++) {
+                if (ra[j % CHECK_L2_READ_AHEAD].l2_offset == l2_offset) {
+                    ra[j % CHECK_L2_READ_AHEAD].stale = true;
+                }
+            }
         }
     }
 
-    return 0;
+    ret = 0;
+
+out:
+    if (read_ahead) {
+        /* Requests still in flight write into the buffers */
+        while (ra_head != ra_tail) {
+            check_l2_read_wait(&ra[ra_head++ % CHECK_L2_READ_AHEAD]);
+        }
+        for (j = 0; j < CHECK_L2_READ_AHEAD; j++) {
+            g_free(ra[j].l2_table);
+        }
+    }
+    return ret;
 }
 
 /*
@@ -2201,6 +2772,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                void **refcount_table, int64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
+    CheckL2ScanResult **scan = NULL;
+    int nb_l1_tables = s->nb_snapshots + 1;
     int64_t i;
     QCowSnapshot *sn;
     int ret;
@@ -2222,12 +2795,19 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    if (qemu_in_coroutine()) {
+        ret = check_l2_scan(bs, res, refcount_table, nb_clusters, &scan);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix, true);
+                             fix, true, scan ? scan[0] : NULL);
     if (ret < 0) {
-        return ret;
+        goto out;
     }
 
     /* snapshots */
@@ -2255,11 +2835,13 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                                  sn->l1_table_offset, sn->l1_size, 0, fix,
-                                 false);
+                                 false, scan ? scan[i + 1] : NULL);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
+    check_l2_scan_free(g_steal_pointer(&scan), nb_l1_tables);
+
     ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
                                    s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
@@ -2292,6 +2874,10 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
+
+out:
+    check_l2_scan_free(scan, nb_l1_tables);
+    return ret;
 }
 
 /*
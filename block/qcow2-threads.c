@@ -388,6 +388,21 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
     return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
+static Qcow2CompressFunc qcow2_decompress_func(BDRVQcow2State *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress;
+
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress;
+#endif
+    default:
+        abort();
+    }
+}
+
 /*
  * qcow2_co_decompress()
  *
@@ -406,25 +421,67 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size)
 {
     BDRVQcow2State *s = bs->opaque;
-    Qcow2CompressFunc fn;
 
-    switch (s->compression_type) {
-    case QCOW2_COMPRESSION_TYPE_ZLIB:
-        fn = qcow2_zlib_decompress;
-        break;
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
+                                qcow2_decompress_func(s));
+}
 
-#ifdef CONFIG_ZSTD
-    case QCOW2_COMPRESSION_TYPE_ZSTD:
-        fn = qcow2_zstd_decompress;
-        break;
-#endif
-    default:
-        abort();
+typedef struct Qcow2DecompressManyData {
+    Qcow2DecompressRequest *reqs;
+    int nb_reqs;
+    size_t dest_size;
+    int ret;
+
+    Qcow2CompressFunc func;
+} Qcow2DecompressManyData;
+
+static int qcow2_decompress_many_pool_func(void *opaque)
+{
+    Qcow2DecompressManyData *data = opaque;
+    int i;
+
+    for (i = 0; i < data->nb_reqs; i++) {
+        Qcow2DecompressRequest *req = &data->reqs[i];
+
+        if (data->func(req->dest, data->dest_size,
+                       req->src, req->src_size) < 0) {
+            data->ret = -EIO;
+            break;
+        }
     }
 
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+    return 0;
 }
 
+/*
+ * qcow2_co_decompress_many()
+ *
+ * Like qcow2_co_decompress(), but decompress several clusters in one thread
+ * pool job, so that a sequential read of compressed clusters doesn't pay for
+ * a thread pool round trip per cluster.
+ *
+ * @reqs - @nb_reqs source and destination buffers, destinations are
+ *         @dest_size bytes each
+ *
+ * Returns: 0 on success
+ *          a negative error code on failure
+ */
+int coroutine_fn
+qcow2_co_decompress_many(BlockDriverState *bs, Qcow2DecompressRequest *reqs,
+                         int nb_reqs, size_t dest_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressManyData arg = {
+        .reqs = reqs,
+        .nb_reqs = nb_reqs,
+        .dest_size = dest_size,
+        .func = qcow2_decompress_func(s),
+    };
+
+    qcow2_co_process(bs, qcow2_decompress_many_pool_func, &arg);
+
+    return arg.ret;
+}
 
 /*
  * Cryptography
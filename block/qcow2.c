@@ -81,6 +81,20 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            QEMUIOVector *qiov,
                            size_t qiov_offset);
 
+/* Consecutive compressed clusters that are read and decompressed together */
+typedef struct Qcow2CompressedBatch {
+    int nb_clusters;
+    uint64_t l2_entries[QCOW2_MAX_COMPRESSED_BATCH];
+} Qcow2CompressedBatch;
+
+static int coroutine_fn
+qcow2_co_preadv_compressed_batch(BlockDriverState *bs,
+                                 Qcow2CompressedBatch *batch,
+                                 uint64_t offset,
+                                 uint64_t bytes,
+                                 QEMUIOVector *qiov,
+                                 size_t qiov_offset);
+
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
@@ -696,6 +710,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DECOMPRESSED_CACHE_SIZE,
     NULL
 };
 
@@ -807,6 +822,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_DECOMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache of decompressed clusters",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -968,6 +988,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t decompressed_cache_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1069,6 +1090,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->decompressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_DECOMPRESSED_CACHE_SIZE,
+                          DEFAULT_DECOMPRESSED_CACHE_SIZE);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1224,6 +1249,15 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    if (s->decompress_cache) {
+        qcow2_decompress_cache_set_size(s->decompress_cache,
+                                        r->decompressed_cache_size);
+    } else {
+        s->decompress_cache =
+            qcow2_decompress_cache_create(s->cluster_size,
+                                          r->decompressed_cache_size);
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1870,6 +1904,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_decompress_cache_destroy(s->decompress_cache);
+    s->decompress_cache = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2226,6 +2262,7 @@ typedef struct Qcow2AioTask {
     QEMUIOVector *qiov;
     uint64_t qiov_offset;
     QCowL2Meta *l2meta; /* only for write */
+    Qcow2CompressedBatch *batch; /* only for batched compressed read */
 } Qcow2AioTask;
 
 static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task);
@@ -2238,7 +2275,8 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
                                        uint64_t bytes,
                                        QEMUIOVector *qiov,
                                        size_t qiov_offset,
-                                       QCowL2Meta *l2meta)
+                                       QCowL2Meta *l2meta,
+                                       Qcow2CompressedBatch *batch)
 {
     Qcow2AioTask local_task;
     Qcow2AioTask *task = pool ? g_new(Qcow2AioTask, 1) : &local_task;
@@ -2253,6 +2291,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
         .bytes = bytes,
         .qiov_offset = qiov_offset,
         .l2meta = l2meta,
+        .batch = batch,
     };
 
     trace_qcow2_add_task(qemu_coroutine_self(), bs, pool,
@@ -2316,14 +2355,90 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
 static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
 {
     Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
+    int ret;
 
     assert(!t->l2meta);
 
+    if (t->batch) {
+        ret = qcow2_co_preadv_compressed_batch(t->bs, t->batch,
+                                               t->offset, t->bytes,
+                                               t->qiov, t->qiov_offset);
+        g_free(t->batch);
+        return ret;
+    }
+
     return qcow2_co_preadv_task(t->bs, t->subcluster_type,
                                 t->host_offset, t->offset, t->bytes,
                                 t->qiov, t->qiov_offset);
 }
 
+/*
+ * A sequential read of compressed clusters whose compressed data is stored
+ * back to back in the image file can be served with one read and one thread
+ * pool job that decompresses all of them.
+ *
+ * Starting with the cluster described by @l2_entry at @offset, which the
+ * first *@cur_bytes of the request cover, collect the following clusters of
+ * the request as long as they are compressed, not cached and their
+ * compressed data follows that of the previous cluster.  *@cur_bytes is
+ * extended to cover all of them.  Returns NULL if there is nothing to batch.
+ */
+static coroutine_fn Qcow2CompressedBatch *
+qcow2_co_collect_compressed(BlockDriverState *bs, uint64_t l2_entry,
+                            int64_t offset, int64_t bytes,
+                            unsigned int *cur_bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedBatch *batch = NULL;
+    uint64_t coffset, prev_coffset, span_end;
+    int csize;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    if (*cur_bytes == bytes ||
+        qcow2_decompress_cache_contains(s->decompress_cache, coffset))
+    {
+        return NULL;
+    }
+    prev_coffset = coffset;
+    span_end = coffset + csize;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (*cur_bytes < bytes &&
+           (!batch || batch->nb_clusters < QCOW2_MAX_COMPRESSED_BATCH))
+    {
+        unsigned int next_bytes = MIN(bytes - *cur_bytes, INT_MAX);
+        QCow2SubclusterType type;
+        uint64_t next_entry;
+
+        if (qcow2_get_host_offset(bs, offset + *cur_bytes, &next_bytes,
+                                  &next_entry, &type) < 0 ||
+            type != QCOW2_SUBCLUSTER_COMPRESSED)
+        {
+            break;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, next_entry, &coffset, &csize);
+        if (coffset <= prev_coffset || coffset > span_end ||
+            qcow2_decompress_cache_contains(s->decompress_cache, coffset))
+        {
+            break;
+        }
+
+        if (!batch) {
+            batch = g_new(Qcow2CompressedBatch, 1);
+            batch->l2_entries[0] = l2_entry;
+            batch->nb_clusters = 1;
+        }
+        batch->l2_entries[batch->nb_clusters++] = next_entry;
+        prev_coffset = coffset;
+        span_end = MAX(span_end, coffset + csize);
+        *cur_bytes += next_bytes;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return batch;
+}
+
 static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                                              int64_t offset, int64_t bytes,
                                              QEMUIOVector *qiov,
@@ -2345,12 +2460,21 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        /*
+         * Allocated clusters with a cached L2 slice can be looked up without
+         * waiting for s->lock; everything else takes the slow path.
+         */
+        if (qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                           &host_offset) == 0) {
+            type = QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2360,12 +2484,19 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
         {
             qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
         } else {
+            Qcow2CompressedBatch *batch = NULL;
+
+            if (type == QCOW2_SUBCLUSTER_COMPRESSED) {
+                batch = qcow2_co_collect_compressed(bs, host_offset, offset,
+                                                    bytes, &cur_bytes);
+            }
+
             if (!aio && cur_bytes != bytes) {
                 aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
             }
             ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
                                  host_offset, offset, cur_bytes,
-                                 qiov, qiov_offset, NULL);
+                                 qiov, qiov_offset, NULL, batch);
             if (ret < 0) {
                 goto out;
             }
@@ -2660,7 +2791,7 @@ static coroutine_fn int qcow2_co_pwritev_part(
         }
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
                              host_offset, offset,
-                             cur_bytes, qiov, qiov_offset, l2meta);
+                             cur_bytes, qiov, qiov_offset, l2meta, NULL);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
         if (ret < 0) {
             goto fail_nometa;
@@ -2743,6 +2874,8 @@ static void qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_decompress_cache_destroy(s->decompress_cache);
+    s->decompress_cache = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4704,7 +4837,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+                             0, 0, offset, chunk_size, qiov, qiov_offset,
+                             NULL, NULL);
         if (ret < 0) {
             break;
         }
@@ -4737,15 +4871,27 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     uint64_t coffset;
     uint8_t *buf, *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
+    Qcow2DecompressedCluster *entry;
+    bool hit;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
+    entry = qcow2_decompress_cache_get(s->decompress_cache, coffset, csize,
+                                       &hit);
+    if (hit) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            entry->data + offset_in_cluster, bytes);
+        qcow2_decompress_cache_put(s->decompress_cache, entry);
+        return 0;
+    }
+
     buf = g_try_malloc(csize);
     if (!buf) {
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
+    out_buf = entry ? entry->data : qemu_blockalign(bs, s->cluster_size);
 
     BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
@@ -4760,6 +4906,86 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
+fail:
+    if (!entry) {
+        qemu_vfree(out_buf);
+    }
+    g_free(buf);
+out:
+    if (entry) {
+        qcow2_decompress_cache_complete(s->decompress_cache, entry, ret);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn
+qcow2_co_preadv_compressed_batch(BlockDriverState *bs,
+                                 Qcow2CompressedBatch *batch,
+                                 uint64_t offset,
+                                 uint64_t bytes,
+                                 QEMUIOVector *qiov,
+                                 size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressRequest reqs[QCOW2_MAX_COMPRESSED_BATCH];
+    uint64_t coffsets[QCOW2_MAX_COMPRESSED_BATCH];
+    int csizes[QCOW2_MAX_COMPRESSED_BATCH];
+    uint64_t span_start, span_end = 0;
+    uint64_t generation;
+    uint8_t *buf, *out_buf;
+    int i, ret;
+
+    for (i = 0; i < batch->nb_clusters; i++) {
+        qcow2_parse_compressed_l2_entry(bs, batch->l2_entries[i],
+                                        &coffsets[i], &csizes[i]);
+        span_end = MAX(span_end, coffsets[i] + csizes[i]);
+    }
+    span_start = coffsets[0];
+
+    buf = g_try_malloc(span_end - span_start);
+    out_buf = qemu_try_blockalign(bs, (size_t)batch->nb_clusters *
+                                      s->cluster_size);
+    if (!buf || !out_buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    trace_qcow2_preadv_compressed_batch(qemu_coroutine_self(), bs, offset,
+                                        batch->nb_clusters,
+                                        span_end - span_start);
+
+    generation = qcow2_decompress_cache_generation(s->decompress_cache);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, span_start, span_end - span_start, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < batch->nb_clusters; i++) {
+        reqs[i] = (Qcow2DecompressRequest) {
+            .dest = out_buf + (size_t)i * s->cluster_size,
+            .src = buf + (coffsets[i] - span_start),
+            .src_size = csizes[i],
+        };
+    }
+
+    if (qcow2_co_decompress_many(bs, reqs, batch->nb_clusters,
+                                 s->cluster_size) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        out_buf + offset_into_cluster(s, offset), bytes);
+
+    for (i = 0; i < batch->nb_clusters; i++) {
+        qcow2_decompress_cache_insert(s->decompress_cache, generation,
+                                      coffsets[i], csizes[i], reqs[i].dest);
+    }
+    s->decompress_batched_clusters += batch->nb_clusters;
+
 fail:
     qemu_vfree(out_buf);
     g_free(buf);
@@ -5233,6 +5459,20 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVQcow2State *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    qcow2_decompress_cache_get_stats(s->decompress_cache,
+                                     &stats->u.qcow2.decompressed_cache_hits,
+                                     &stats->u.qcow2.decompressed_cache_misses);
+    stats->u.qcow2.batched_clusters = s->decompress_batched_clusters;
+
+    return stats;
+}
+
 static int qcow2_has_zero_init(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -6080,6 +6320,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -126,6 +126,11 @@
 #define DEFAULT_CACHE_CLEAN_INTERVAL 0
 #endif
 
+#define DEFAULT_DECOMPRESSED_CACHE_SIZE (4 * MiB)
+
+/* Maximum number of compressed clusters decompressed in one batch */
+#define QCOW2_MAX_COMPRESSED_BATCH 16
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 #define QCOW2_OPT_DATA_FILE "data-file"
@@ -149,6 +154,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DECOMPRESSED_CACHE_SIZE "decompressed-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -229,6 +235,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -309,6 +316,23 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+typedef struct Qcow2DecompressedCluster {
+    uint64_t coffset; /* host offset of the compressed data */
+    int csize;
+    uint8_t *data; /* cluster_size bytes of decompressed data */
+    int ret; /* -EINPROGRESS while being filled */
+    int refs;
+    bool stale; /* no longer in the cache, freed when unreferenced */
+    CoQueue waiters;
+    QTAILQ_ENTRY(Qcow2DecompressedCluster) next;
+} Qcow2DecompressedCluster;
+
+typedef struct Qcow2DecompressRequest {
+    void *dest;
+    const void *src;
+    size_t src_size;
+} Qcow2DecompressRequest;
+
 typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
                                       uint64_t index);
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
@@ -408,6 +432,9 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    Qcow2DecompressCache *decompress_cache;
+    uint64_t decompress_batched_clusters;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -908,6 +935,8 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset);
 int coroutine_fn qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                                          unsigned int *bytes,
                                          uint64_t *host_offset, QCowL2Meta **m);
@@ -977,6 +1006,30 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset);
+
+/* qcow2-decompress-cache.c functions */
+Qcow2DecompressCache *qcow2_decompress_cache_create(int cluster_size,
+                                                    uint64_t size);
+void qcow2_decompress_cache_set_size(Qcow2DecompressCache *c, uint64_t size);
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c);
+Qcow2DecompressedCluster *coroutine_fn
+qcow2_decompress_cache_get(Qcow2DecompressCache *c, uint64_t coffset,
+                           int csize, bool *hit);
+void qcow2_decompress_cache_put(Qcow2DecompressCache *c,
+                                Qcow2DecompressedCluster *entry);
+void qcow2_decompress_cache_complete(Qcow2DecompressCache *c,
+                                     Qcow2DecompressedCluster *entry, int ret);
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset);
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c);
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c,
+                                   uint64_t generation, uint64_t coffset,
+                                   int csize, const void *data);
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c,
+                                       uint64_t offset, uint64_t bytes);
+void qcow2_decompress_cache_get_stats(Qcow2DecompressCache *c,
+                                      uint64_t *hits, uint64_t *misses);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -1009,6 +1062,9 @@ ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
 int coroutine_fn
+qcow2_co_decompress_many(BlockDriverState *bs, Qcow2DecompressRequest *reqs,
+                         int nb_reqs, size_t dest_size);
+int coroutine_fn
 qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
 int coroutine_fn
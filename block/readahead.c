@@ -0,0 +1,634 @@
+/*
+ * Sequential read-ahead filter block driver
+ *
+ * The driver detects sequential read streams and prefetches the aligned
+ * extents ahead of them into a bounded in-memory cache, so that small
+ * sequential reads over a high latency protocol node (nbd, curl, ssh, ...)
+ * don't each pay a full round trip.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/* Number of read streams that are tracked at the same time */
+#define READAHEAD_STREAMS 8
+
+/* Consecutive reads after which a stream is considered sequential */
+#define READAHEAD_MIN_SEQUENTIAL 2
+
+#define READAHEAD_MAX_SIZE (64 * MiB)
+
+typedef struct ReadaheadOpts {
+    int64_t readahead_size;
+    int64_t cache_size;
+} ReadaheadOpts;
+
+typedef struct ReadaheadStream {
+    /* Offset at which the next sequential read of this stream starts */
+    int64_t next;
+    unsigned sequential;
+    uint64_t last_use;
+} ReadaheadStream;
+
+typedef struct ReadaheadExtent {
+    int64_t offset;
+    int64_t bytes;
+    uint8_t *buf;
+
+    /* Result of the prefetch, valid once !in_flight */
+    int ret;
+    bool in_flight;
+    /* Dropped from the cache, freed once the last user is gone */
+    bool stale;
+    /* At least one read has been served from this extent */
+    bool used;
+    unsigned readers;
+    CoQueue waiters;
+
+    QTAILQ_ENTRY(ReadaheadExtent) lru;
+} ReadaheadExtent;
+
+typedef struct BDRVReadaheadState {
+    ReadaheadOpts opts;
+
+    ReadaheadStream streams[READAHEAD_STREAMS];
+    uint64_t stream_clock;
+
+    /* Cached and in-flight extents by offset, least recently used first */
+    GHashTable *extents;
+    QTAILQ_HEAD(, ReadaheadExtent) lru;
+    /* Extents holding a buffer, including stale ones not yet freed */
+    int64_t nb_allocated;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetched_bytes;
+    uint64_t wasted_bytes;
+} BDRVReadaheadState;
+
+#define READAHEAD_OPT_READAHEAD_SIZE "readahead-size"
+#define READAHEAD_OPT_CACHE_SIZE "cache-size"
+static QemuOptsList runtime_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READAHEAD_OPT_READAHEAD_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size and alignment of the prefetched extents, "
+                "default 1M",
+        },
+        {
+            .name = READAHEAD_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum memory used for prefetched data, default 16M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool readahead_absorb_opts(ReadaheadOpts *dest, QDict *options,
+                                  BlockDriverState *child_bs, Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->readahead_size =
+        qemu_opt_get_size(opts, READAHEAD_OPT_READAHEAD_SIZE, 1 * MiB);
+    dest->cache_size =
+        qemu_opt_get_size(opts, READAHEAD_OPT_CACHE_SIZE, 16 * MiB);
+
+    qemu_opts_del(opts);
+
+    if (!is_power_of_2(dest->readahead_size) ||
+        dest->readahead_size < child_bs->bl.request_alignment ||
+        dest->readahead_size > READAHEAD_MAX_SIZE) {
+        error_setg(errp, "readahead-size parameter of readahead filter must "
+                   "be a power of two between the underlying node request "
+                   "alignment (%" PRIu32 ") and 64M",
+                   child_bs->bl.request_alignment);
+        return false;
+    }
+
+    if (dest->cache_size < dest->readahead_size) {
+        error_setg(errp, "cache-size parameter of readahead filter must not "
+                   "be smaller than readahead-size");
+        return false;
+    }
+
+    return true;
+}
+
+static void readahead_extent_unref(BDRVReadaheadState *s, ReadaheadExtent *e)
+{
+    if (e->stale && !e->in_flight && !e->readers) {
+        qemu_vfree(e->buf);
+        g_free(e);
+        s->nb_allocated--;
+    }
+}
+
+/* Remove @e from the cache, it is freed once it is no longer in use */
+static void readahead_extent_drop(BDRVReadaheadState *s, ReadaheadExtent *e)
+{
+    assert(!e->stale);
+
+    if (!e->used && e->ret >= 0) {
+        s->wasted_bytes += e->bytes;
+    }
+
+    g_hash_table_remove(s->extents, &e->offset);
+    QTAILQ_REMOVE(&s->lru, e, lru);
+    e->stale = true;
+    readahead_extent_unref(s, e);
+}
+
+/* Drop all cached data overlapping [@offset, @offset + @bytes) */
+static void readahead_invalidate(BDRVReadaheadState *s, int64_t offset,
+                                 int64_t bytes)
+{
+    int64_t size = s->opts.readahead_size;
+    int64_t start = QEMU_ALIGN_DOWN(offset, size);
+    int64_t end = offset + bytes;
+    ReadaheadExtent *e, *next;
+
+    if ((end - start) / size < g_hash_table_size(s->extents)) {
+        for (; start < end; start += size) {
+            e = g_hash_table_lookup(s->extents, &start);
+            if (e) {
+                readahead_extent_drop(s, e);
+            }
+        }
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        if (e->offset < end && offset < e->offset + e->bytes) {
+            readahead_extent_drop(s, e);
+        }
+    }
+}
+
+static void readahead_invalidate_all(BDRVReadaheadState *s)
+{
+    ReadaheadExtent *e, *next;
+
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        readahead_extent_drop(s, e);
+    }
+}
+
+/*
+ * Account a read of [@offset, @offset + @bytes) to the stream it continues,
+ * or start a new stream replacing the least recently used one.  Returns
+ * whether the read is part of a sequential stream.
+ */
+static bool readahead_update_stream(BDRVReadaheadState *s, int64_t offset,
+                                    int64_t bytes)
+{
+    ReadaheadStream *stream = &s->streams[0];
+    int i;
+
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        if (s->streams[i].next == offset && s->streams[i].sequential) {
+            stream = &s->streams[i];
+            break;
+        }
+        if (s->streams[i].last_use < stream->last_use) {
+            stream = &s->streams[i];
+        }
+    }
+
+    if (i == READAHEAD_STREAMS) {
+        stream->sequential = 0;
+    }
+    stream->sequential++;
+    stream->next = offset + bytes;
+    stream->last_use = ++s->stream_clock;
+
+    return stream->sequential >= READAHEAD_MIN_SEQUENTIAL;
+}
+
+typedef struct ReadaheadPrefetch {
+    BlockDriverState *bs;
+    ReadaheadExtent *extent;
+} ReadaheadPrefetch;
+
+static void coroutine_fn readahead_prefetch_entry(void *opaque)
+{
+    ReadaheadPrefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadExtent *e = p->extent;
+
+    g_free(p);
+
+    e->ret = bdrv_co_pread(bs->file, e->offset, e->bytes, e->buf, 0);
+    trace_readahead_prefetch_done(bs, e->offset, e->bytes, e->ret);
+
+    e->in_flight = false;
+    qemu_co_queue_restart_all(&e->waiters);
+
+    if (e->ret < 0 && !e->stale) {
+        readahead_extent_drop(s, e);
+    } else {
+        readahead_extent_unref(s, e);
+    }
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Find room for one more extent, evicting the least recently used ones that
+ * are idle while the cache is full.
+ */
+static bool readahead_make_room(BDRVReadaheadState *s)
+{
+    ReadaheadExtent *e, *next;
+
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        if ((s->nb_allocated + 1) * s->opts.readahead_size <=
+            s->opts.cache_size) {
+            return true;
+        }
+        if (!e->in_flight && !e->readers) {
+            readahead_extent_drop(s, e);
+        }
+    }
+
+    return (s->nb_allocated + 1) * s->opts.readahead_size <=
+           s->opts.cache_size;
+}
+
+static void readahead_prefetch(BlockDriverState *bs, int64_t offset)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int64_t size = s->opts.readahead_size;
+    int64_t start = QEMU_ALIGN_DOWN(offset, size);
+    int64_t end = offset + size;
+    int64_t len = bdrv_getlength(bs->file->bs);
+
+    if (len < 0) {
+        return;
+    }
+
+    for (; start < end && start < len; start += size) {
+        ReadaheadPrefetch *p;
+        ReadaheadExtent *e;
+
+        e = g_hash_table_lookup(s->extents, &start);
+        if (e) {
+            continue;
+        }
+
+        if (!readahead_make_room(s)) {
+            return;
+        }
+
+        e = g_new0(ReadaheadExtent, 1);
+        e->offset = start;
+        e->bytes = MIN(size, len - start);
+        e->buf = qemu_try_blockalign(bs->file->bs, e->bytes);
+        if (!e->buf) {
+            g_free(e);
+            return;
+        }
+        e->in_flight = true;
+        qemu_co_queue_init(&e->waiters);
+
+        g_hash_table_insert(s->extents, &e->offset, e);
+        QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+        s->nb_allocated++;
+        s->prefetched_bytes += e->bytes;
+        trace_readahead_prefetch(bs, e->offset, e->bytes);
+
+        p = g_new(ReadaheadPrefetch, 1);
+        *p = (ReadaheadPrefetch) {
+            .bs = bs,
+            .extent = e,
+        };
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs),
+                     qemu_coroutine_create(readahead_prefetch_entry, p));
+    }
+}
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!readahead_absorb_opts(&s->opts, options, bs->file->bs, errp)) {
+        return -EINVAL;
+    }
+
+    s->extents = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+
+    readahead_invalidate_all(s);
+    assert(!s->nb_allocated);
+    g_hash_table_destroy(s->extents);
+}
+
+static int readahead_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    ReadaheadOpts *opts = g_new0(ReadaheadOpts, 1);
+
+    if (!readahead_absorb_opts(opts, reopen_state->options,
+                               reopen_state->bs->file->bs, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+static void readahead_reopen_commit(BDRVReopenState *state)
+{
+    BDRVReadaheadState *s = state->bs->opaque;
+
+    /* The extent size may change, start over with an empty cache */
+    readahead_invalidate_all(s);
+    s->opts = *(ReadaheadOpts *)state->opaque;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void readahead_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void readahead_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                 BdrvChildRole role,
+                                 BlockReopenQueue *reopen_queue,
+                                 uint64_t perm, uint64_t shared,
+                                 uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Writes that bypass this node would leave stale data in the cache */
+    *nshared &= ~BLK_PERM_WRITE;
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/*
+ * Serve [@offset, @offset + @bytes) from the cache.  Returns false if any
+ * part of it is not cached, in which case @qiov is left untouched.
+ */
+static bool coroutine_fn readahead_co_read_cached(BDRVReadaheadState *s,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset)
+{
+    int64_t size = s->opts.readahead_size;
+    int64_t start = QEMU_ALIGN_DOWN(offset, size);
+    int64_t end = offset + bytes;
+    ReadaheadExtent *extents[2];
+    int i, n = 0;
+    bool hit = true;
+
+    /* Requests are at most readahead_size long, so they span two extents */
+    for (; start < end; start += size) {
+        ReadaheadExtent *e = g_hash_table_lookup(s->extents, &start);
+
+        if (!e) {
+            hit = false;
+            break;
+        }
+        e->readers++;
+        extents[n++] = e;
+    }
+
+    for (i = 0; hit && i < n; i++) {
+        ReadaheadExtent *e = extents[i];
+
+        while (e->in_flight) {
+            qemu_co_queue_wait(&e->waiters, NULL);
+        }
+        /* Extents are short at EOF, the request may extend beyond it */
+        if (e->stale || e->ret < 0 ||
+            e->offset + e->bytes < MIN(end, e->offset + size)) {
+            hit = false;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        ReadaheadExtent *e = extents[i];
+
+        if (hit) {
+            int64_t from = MAX(offset, e->offset);
+            int64_t to = MIN(end, e->offset + e->bytes);
+
+            qemu_iovec_from_buf(qiov, qiov_offset + from - offset,
+                                e->buf + from - e->offset, to - from);
+            e->used = true;
+            QTAILQ_REMOVE(&s->lru, e, lru);
+            QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+        }
+        e->readers--;
+        readahead_extent_unref(s, e);
+    }
+
+    return hit;
+}
+
+static int coroutine_fn readahead_co_preadv_part(BlockDriverState *bs,
+                                                 int64_t offset, int64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 size_t qiov_offset,
+                                                 BdrvRequestFlags flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    if (flags || bytes > s->opts.readahead_size || !bytes) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    if (readahead_co_read_cached(s, offset, bytes, qiov, qiov_offset)) {
+        s->hits++;
+    } else {
+        s->misses++;
+        ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                  0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (readahead_update_stream(s, offset, bytes)) {
+        readahead_prefetch(bs, offset + bytes);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn readahead_co_pwritev_part(BlockDriverState *bs,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+
+    /*
+     * Invalidate only once the write is done: an extent prefetched while it
+     * was in flight may hold either the old or the new data.
+     */
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset,
+                                                   int64_t bytes,
+                                                   BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int64_t bytes)
+{
+    int ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwritev_compressed(BlockDriverState *bs,
+                                                        int64_t offset,
+                                                        int64_t bytes,
+                                                        QEMUIOVector *qiov)
+{
+    int ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov,
+                              BDRV_REQ_WRITE_COMPRESSED);
+
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_truncate(BlockDriverState *bs,
+                                              int64_t offset, bool exact,
+                                              PreallocMode prealloc,
+                                              BdrvRequestFlags flags,
+                                              Error **errp)
+{
+    int ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    readahead_invalidate_all(bs->opaque);
+    return ret;
+}
+
+static void readahead_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void readahead_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static BlockStatsSpecific *readahead_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVReadaheadState *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_READAHEAD;
+    stats->u.readahead = (BlockStatsSpecificReadahead) {
+        .hits = s->hits,
+        .misses = s->misses,
+        .prefetched_bytes = s->prefetched_bytes,
+        .wasted_bytes = s->wasted_bytes,
+    };
+
+    return stats;
+}
+
+static BlockDriver bdrv_readahead = {
+    .format_name                        = "readahead",
+    .instance_size                      = sizeof(BDRVReadaheadState),
+
+    .bdrv_open                          = readahead_open,
+    .bdrv_close                         = readahead_close,
+    .bdrv_child_perm                    = readahead_child_perm,
+
+    .bdrv_reopen_prepare                = readahead_reopen_prepare,
+    .bdrv_reopen_commit                 = readahead_reopen_commit,
+    .bdrv_reopen_abort                  = readahead_reopen_abort,
+
+    .bdrv_getlength                     = readahead_getlength,
+
+    .bdrv_co_preadv_part                = readahead_co_preadv_part,
+    .bdrv_co_pwritev_part               = readahead_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = readahead_co_pdiscard,
+    .bdrv_co_pwritev_compressed         = readahead_co_pwritev_compressed,
+    .bdrv_co_truncate                   = readahead_co_truncate,
+
+    .bdrv_eject                         = readahead_eject,
+    .bdrv_lock_medium                   = readahead_lock_medium,
+
+    .bdrv_get_specific_stats            = readahead_get_specific_stats,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
@@ -62,6 +62,14 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Taking the lock for every request does not scale when the members of a
+ * group run in many different AioContexts. So while a group is not
+ * throttling a type of request, each member accounts for a small batch of
+ * I/O in advance (a grant, see throttle_grant()) and lets its next requests
+ * through without the lock as long as the grant covers them. As soon as
+ * a timer is armed, requests go through the lock and the round robin again,
+ * and the members return what is left of their grants.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -69,18 +77,29 @@ struct ThrottleGroup {
     /* refuse individual property change if initialization is complete */
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
+    bool grants; /* x-grants, constant once initialization is complete */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
+    unsigned nb_members;
     ThrottleGroupMember *tokens[2];
+    /* any_timer_armed and grant_generation are also read without the lock */
     bool any_timer_armed[2];
+    /* Incremented when the bucket levels are reset, invalidating all grants */
+    unsigned grant_generation;
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
 
+/* How much I/O the members of a group may account for in advance, in total.
+ * Each member gets an equal share of this, at the configured rate, and its
+ * grant expires once that share would have drained from the buckets.
+ */
+#define THROTTLE_GROUP_GRANT_NS (4 * SCALE_MS)
+
 /* This is protected by the global QEMU mutex */
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -286,7 +305,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[is_write] = tgm;
-        tg->any_timer_armed[is_write] = true;
+        qatomic_set(&tg->any_timer_armed[is_write], true);
     }
 
     return must_wait;
@@ -343,12 +362,83 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[is_write], now);
-            tg->any_timer_armed[is_write] = true;
+            qatomic_set(&tg->any_timer_armed[is_write], true);
         }
         tg->tokens[is_write] = token;
     }
 }
 
+/* Give back what is left of the grant of a ThrottleGroupMember.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_return_grant(ThrottleGroupMember *tgm,
+                                        bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+
+    if (tgm->grant_generation[is_write] == tg->grant_generation) {
+        throttle_return_grant(ts, is_write, qemu_clock_get_ns(tg->clock_type),
+                              &tgm->grants[is_write]);
+    } else {
+        /* The bucket levels have been reset since this was granted */
+        tgm->grants[is_write].active = false;
+    }
+}
+
+/* Account for a batch of I/O in advance and give it to a
+ * ThrottleGroupMember, so that its next requests don't need tg->lock.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_refill_grant(ThrottleGroupMember *tgm,
+                                        bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    int64_t now = qemu_clock_get_ns(tg->clock_type);
+
+    throttle_group_return_grant(tgm, is_write);
+    throttle_grant(ts, is_write, now, THROTTLE_GROUP_GRANT_NS / tg->nb_members,
+                   &tgm->grants[is_write]);
+    tgm->grant_generation[is_write] = tg->grant_generation;
+}
+
+/* Let an I/O request through without taking tg->lock if the grant of the
+ * ThrottleGroupMember covers it. This is only done while the group is not
+ * throttling this type of request, so there is no round robin order to
+ * respect.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the request can be executed right away
+ */
+static bool coroutine_fn throttle_group_co_try_grant(ThrottleGroupMember *tgm,
+                                                     int64_t bytes,
+                                                     bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    /* pending_reqs is only modified in tgm's own AioContext */
+    if (tgm->pending_reqs[is_write] ||
+        qatomic_read(&tg->any_timer_armed[is_write]) ||
+        tgm->grant_generation[is_write] !=
+            qatomic_read(&tg->grant_generation)) {
+        return false;
+    }
+
+    return throttle_grant_consume(&tgm->grants[is_write],
+                                  qemu_clock_get_ns(tg->clock_type), bytes);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -367,8 +457,15 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    if (throttle_group_co_try_grant(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* Whatever is left of the grant is not enough for this request */
+    throttle_group_return_grant(tgm, is_write);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -391,6 +488,12 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /* If nothing is waiting, let the next requests skip the lock */
+    if (tg->grants && !tg->any_timer_armed[is_write] &&
+        !tgm->pending_reqs[is_write]) {
+        throttle_group_refill_grant(tgm, is_write);
+    }
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -475,6 +578,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    qatomic_set(&tg->grant_generation, tg->grant_generation + 1);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -509,7 +613,7 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write)
 
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
-    tg->any_timer_armed[is_write] = false;
+    qatomic_set(&tg->any_timer_armed[is_write], false);
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -558,6 +662,12 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nb_members++;
+
+    for (i = 0; i < 2; i++) {
+        tgm->grants[i].active = false;
+        tgm->grant_generation[i] = tg->grant_generation;
+    }
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -600,6 +710,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[i] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[i]));
             assert(!timer_pending(tgm->throttle_timers.timers[i]));
+            throttle_group_return_grant(tgm, i);
             if (tg->tokens[i] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -612,6 +723,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nb_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -642,7 +754,7 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
     WITH_QEMU_LOCK_GUARD(&tg->lock) {
         for (i = 0; i < 2; i++) {
             if (timer_pending(tt->timers[i])) {
-                tg->any_timer_armed[i] = false;
+                qatomic_set(&tg->any_timer_armed[i], false);
                 schedule_next_request(tgm, i);
             }
         }
@@ -758,6 +870,7 @@ static void throttle_group_obj_init(Object *obj)
         tg->clock_type = QEMU_CLOCK_VIRTUAL;
     }
     tg->is_initialized = false;
+    tg->grants = true;
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
@@ -900,6 +1013,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    qatomic_set(&tg->grant_generation, tg->grant_generation + 1);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -926,6 +1040,22 @@ static void throttle_group_get_limits(Object *obj, Visitor *v,
     visit_type_ThrottleLimits(v, name, &argp, errp);
 }
 
+static bool throttle_group_get_grants(Object *obj, Error **errp)
+{
+    return THROTTLE_GROUP(obj)->grants;
+}
+
+static void throttle_group_set_grants(Object *obj, bool value, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    if (tg->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return;
+    }
+    tg->grants = value;
+}
+
 static bool throttle_group_can_be_deleted(UserCreatable *uc)
 {
     return OBJECT(uc)->ref == 1;
@@ -955,6 +1085,12 @@ static void throttle_group_obj_class_init(ObjectClass *klass, void *class_data)
                               throttle_group_get_limits,
                               throttle_group_set_limits,
                               NULL, NULL);
+
+    /* Only for comparing the lock-free path with the lock, see
+     * tests/bench/throttle-groups-bench.c */
+    object_class_property_add_bool(klass, "x-grants",
+                                   throttle_group_get_grants,
+                                   throttle_group_set_grants);
 }
 
 static const TypeInfo throttle_group_info = {
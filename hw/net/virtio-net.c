@@ -59,6 +59,12 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/*
+ * TX packets handed to the peer at once, and completed TX buffers returned
+ * to the guest with a single used idx update
+ */
+#define VIRTIO_NET_TX_BATCH 64
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -1828,7 +1834,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
-    size_t lens[VIRTQUEUE_MAX_SIZE];
+    unsigned int lens[VIRTQUEUE_MAX_SIZE];
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
@@ -1889,7 +1895,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             err = -1;
             goto err;
         }
@@ -1927,7 +1933,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             err = size;
             goto err;
         }
@@ -1944,13 +1950,22 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    for (j = 0; j < i; j++) {
-        /* signal other side */
-        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
-        g_free(elems[j]);
+    if (q->rx_batching) {
+        /* virtio_net_receive_batch() flushes and notifies */
+        for (j = 0; j < i; j++) {
+            virtqueue_fill(q->rx_vq, elems[j], lens[j],
+                           q->rx_batch_filled + j);
+            virtqueue_element_free(q->rx_vq, elems[j]);
+        }
+        q->rx_batch_filled += i;
+        return size;
     }
 
-    virtqueue_flush(q->rx_vq, i);
+    /* signal other side */
+    virtqueue_push_batch(q->rx_vq, elems, lens, i);
+    for (j = 0; j < i; j++) {
+        virtqueue_element_free(q->rx_vq, elems[j]);
+    }
     virtio_notify(vdev, q->rx_vq);
 
     return size;
@@ -1958,7 +1973,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 err:
     for (j = 0; j < i; j++) {
         virtqueue_detach_element(q->rx_vq, elems[j], lens[j]);
-        g_free(elems[j]);
+        virtqueue_element_free(q->rx_vq, elems[j]);
     }
 
     return err;
@@ -2576,6 +2591,42 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
     }
 }
 
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int i;
+
+    /* RSC needs to see the packets one at a time */
+    if (n->rsc4_enabled || n->rsc6_enabled) {
+        return 0;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    q->rx_batching = true;
+    q->rx_batch_filled = 0;
+    for (i = 0; i < count; i++) {
+        /*
+         * Out of buffers or unable to receive, the caller delivers the rest
+         * one by one, which queues or drops them as usual.
+         */
+        if (virtio_net_receive_rcu(nc, pkts[i].iov_base, pkts[i].iov_len,
+                                   false) <= 0) {
+            break;
+        }
+    }
+    q->rx_batching = false;
+
+    if (q->rx_batch_filled) {
+        virtqueue_flush(q->rx_vq, q->rx_batch_filled);
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -2588,7 +2639,7 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2611,11 +2662,93 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+typedef struct VirtIONetTxBatch {
+    /* Packets waiting to be handed to the peer */
+    VirtQueueElement *pending[VIRTIO_NET_TX_BATCH];
+    NetPacketIOV pkts[VIRTIO_NET_TX_BATCH];
+    unsigned int num_pending;
+    /* Sent packets waiting to be returned to the guest */
+    VirtQueueElement *done[VIRTIO_NET_TX_BATCH];
+    unsigned int num_done;
+} VirtIONetTxBatch;
+
+static void virtio_net_tx_push(VirtIONetQueue *q, VirtIONetTxBatch *b)
+{
+    static const unsigned int lens[VIRTIO_NET_TX_BATCH];
+    unsigned int i;
+
+    if (!b->num_done) {
+        return;
+    }
+
+    virtqueue_push_batch(q->tx_vq, b->done, lens, b->num_done);
+    virtio_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+    for (i = 0; i < b->num_done; i++) {
+        virtqueue_element_free(q->tx_vq, b->done[i]);
+    }
+    b->num_done = 0;
+}
+
+static void virtio_net_tx_done(VirtIONetQueue *q, VirtIONetTxBatch *b,
+                               VirtQueueElement *elem)
+{
+    b->done[b->num_done++] = elem;
+    if (b->num_done == ARRAY_SIZE(b->done)) {
+        virtio_net_tx_push(q, b);
+    }
+}
+
+/*
+ * Send the pending packets.  If the peer queues one of them, it becomes
+ * the in-flight async_tx element and the ones behind it go back to the
+ * ring; returns -EBUSY in that case.
+ */
+static int virtio_net_tx_send_batch(VirtIONetQueue *q, VirtIONetTxBatch *b)
+{
+    VirtIONet *n = q->n;
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    unsigned int i, sent, num = b->num_pending;
+
+    if (!num) {
+        return 0;
+    }
+    b->num_pending = 0;
+
+    sent = qemu_sendv_packet_batch_async(qemu_get_subqueue(n->nic, queue_index),
+                                         b->pkts, num, virtio_net_tx_complete);
+    for (i = 0; i < sent; i++) {
+        virtio_net_tx_done(q, b, b->pending[i]);
+    }
+    if (sent == num) {
+        return 0;
+    }
+
+    q->async_tx.elem = b->pending[sent];
+    for (i = sent + 1; i < num; i++) {
+        virtqueue_unpop(q->tx_vq, b->pending[i], 0);
+        virtqueue_element_free(q->tx_vq, b->pending[i]);
+    }
+    return -EBUSY;
+}
+
+static void virtio_net_tx_discard_batch(VirtIONetQueue *q, VirtIONetTxBatch *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->num_pending; i++) {
+        virtqueue_detach_element(q->tx_vq, b->pending[i], 0);
+        virtqueue_element_free(q->tx_vq, b->pending[i]);
+    }
+    b->num_pending = 0;
+    virtio_net_tx_push(q, b);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtIONetTxBatch b;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -2627,6 +2760,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    b.num_pending = b.num_done = 0;
+
     for (;;) {
         ssize_t ret;
         unsigned int out_num;
@@ -2643,7 +2778,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->tx_vq, elem);
+            virtio_net_tx_discard_batch(q, &b);
             return -EINVAL;
         }
 
@@ -2652,7 +2788,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
+                virtqueue_element_free(q->tx_vq, elem);
+                virtio_net_tx_discard_batch(q, &b);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -2686,24 +2823,50 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
+        if (out_sg == elem->out_sg) {
+            /* The packet can be sent straight from the element */
+            b.pending[b.num_pending] = elem;
+            b.pkts[b.num_pending].iov = out_sg;
+            b.pkts[b.num_pending].iovcnt = out_num;
+            if (++b.num_pending == ARRAY_SIZE(b.pending) &&
+                virtio_net_tx_send_batch(q, &b) < 0) {
+                goto busy;
+            }
+            goto next;
+        }
+
+        /* Rewritten headers live on the stack, send those right away */
+        if (virtio_net_tx_send_batch(q, &b) < 0) {
+            virtqueue_unpop(q->tx_vq, elem, 0);
+            virtqueue_element_free(q->tx_vq, elem);
+            goto busy;
+        }
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
-            return -EBUSY;
+            goto busy;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_tx_done(q, &b, elem);
 
+next:
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    if (virtio_net_tx_send_batch(q, &b) < 0) {
+        goto busy;
+    }
+    virtio_net_tx_push(q, &b);
     return num_packets;
+
+busy:
+    virtio_net_tx_push(q, &b);
+    virtio_queue_set_notification(q->tx_vq, 0);
+    return -EBUSY;
 }
 
 static void virtio_net_tx_timer(void *opaque);
@@ -2879,6 +3042,11 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    virtio_queue_set_element_pool(n->vqs[index].rx_vq,
+                                  sizeof(VirtQueueElement));
+    virtio_queue_set_element_pool(n->vqs[index].tx_vq,
+                                  sizeof(VirtQueueElement));
+
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -3292,6 +3460,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -9,6 +9,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/iova-tree.h"
+#include "qemu/lockable.h"
 #include "vhost-iova-tree.h"
 
 #define iova_min_addr qemu_real_host_page_size()
@@ -26,6 +27,12 @@ struct VhostIOVATree {
     /* Last addressable iova address in the device */
     uint64_t iova_last;
 
+    /*
+     * Protects iova_taddr_map: shadow virtqueues running in an IOThread
+     * translate addresses while the memory listener updates the maps.
+     */
+    QemuMutex lock;
+
     /* IOVA address to qemu memory maps. */
     IOVATree *iova_taddr_map;
 };
@@ -43,6 +50,7 @@ VhostIOVATree *vhost_iova_tree_new(hwaddr iova_first, hwaddr iova_last)
     tree->iova_first = MAX(iova_first, iova_min_addr);
     tree->iova_last = iova_last;
 
+    qemu_mutex_init(&tree->lock);
     tree->iova_taddr_map = iova_tree_new();
     return tree;
 }
@@ -53,6 +61,7 @@ VhostIOVATree *vhost_iova_tree_new(hwaddr iova_first, hwaddr iova_last)
 void vhost_iova_tree_delete(VhostIOVATree *iova_tree)
 {
     iova_tree_destroy(iova_tree->iova_taddr_map);
+    qemu_mutex_destroy(&iova_tree->lock);
     g_free(iova_tree);
 }
 
@@ -61,13 +70,24 @@ void vhost_iova_tree_delete(VhostIOVATree *iova_tree)
  *
  * @tree: The iova tree
  * @map: The map with the memory address
+ * @result: The stored mapping, copied under the lock
  *
- * Return the stored mapping, or NULL if not found.
+ * Return true if a mapping was found.  The tree may change as soon as the
+ * lock is dropped, so the mapping is returned by value.
  */
-const DMAMap *vhost_iova_tree_find_iova(const VhostIOVATree *tree,
-                                        const DMAMap *map)
+bool vhost_iova_tree_find_iova(VhostIOVATree *tree, const DMAMap *map,
+                               DMAMap *result)
 {
-    return iova_tree_find_iova(tree->iova_taddr_map, map);
+    const DMAMap *found;
+
+    QEMU_LOCK_GUARD(&tree->lock);
+    found = iova_tree_find_iova(tree->iova_taddr_map, map);
+    if (!found) {
+        return false;
+    }
+
+    *result = *found;
+    return true;
 }
 
 /**
@@ -94,6 +114,7 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map)
     }
 
     /* Allocate a node in IOVA address */
+    QEMU_LOCK_GUARD(&tree->lock);
     return iova_tree_alloc_map(tree->iova_taddr_map, map, iova_first,
                                tree->iova_last);
 }
@@ -106,5 +127,6 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map)
  */
 void vhost_iova_tree_remove(VhostIOVATree *iova_tree, DMAMap map)
 {
+    QEMU_LOCK_GUARD(&iova_tree->lock);
     iova_tree_remove(iova_tree->iova_taddr_map, map);
 }
@@ -19,8 +19,8 @@ VhostIOVATree *vhost_iova_tree_new(uint64_t iova_first, uint64_t iova_last);
 void vhost_iova_tree_delete(VhostIOVATree *iova_tree);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(VhostIOVATree, vhost_iova_tree_delete);
 
-const DMAMap *vhost_iova_tree_find_iova(const VhostIOVATree *iova_tree,
-                                        const DMAMap *map);
+bool vhost_iova_tree_find_iova(VhostIOVATree *iova_tree, const DMAMap *map,
+                               DMAMap *result);
 int vhost_iova_tree_map_alloc(VhostIOVATree *iova_tree, DMAMap *map);
 void vhost_iova_tree_remove(VhostIOVATree *iova_tree, DMAMap map);
 
@@ -15,6 +15,8 @@
 #include "qemu/main-loop.h"
 #include "qemu/log.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
+#include "block/aio-wait.h"
 #include "linux-headers/linux/vhost.h"
 
 /**
@@ -93,26 +95,27 @@ static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
             .size = iovec[i].iov_len,
         };
         Int128 needle_last, map_last;
+        DMAMap map;
         size_t off;
 
-        const DMAMap *map = vhost_iova_tree_find_iova(svq->iova_tree, &needle);
         /*
-         * Map cannot be NULL since iova map contains all guest space and
+         * The map must exist since iova map contains all guest space and
          * qemu already has a physical address mapped
          */
-        if (unlikely(!map)) {
+        if (unlikely(!vhost_iova_tree_find_iova(svq->iova_tree, &needle,
+                                                &map))) {
             qemu_log_mask(LOG_GUEST_ERROR,
                           "Invalid address 0x%"HWADDR_PRIx" given by guest",
                           needle.translated_addr);
             return false;
         }
 
-        off = needle.translated_addr - map->translated_addr;
-        addrs[i] = map->iova + off;
+        off = needle.translated_addr - map.translated_addr;
+        addrs[i] = map.iova + off;
 
         needle_last = int128_add(int128_make64(needle.translated_addr),
                                  int128_make64(iovec[i].iov_len));
-        map_last = int128_make64(map->translated_addr + map->size);
+        map_last = int128_make64(map.translated_addr + map.size);
         if (unlikely(int128_gt(needle_last, map_last))) {
             qemu_log_mask(LOG_GUEST_ERROR,
                           "Guest buffer expands over iova range");
@@ -229,26 +232,29 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 
     if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t avail_event = *(uint16_t *)(&svq->vring.used->ring[svq->vring.num]);
-        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, svq->shadow_avail_idx - 1);
+        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx,
+                                      svq->shadow_avail_idx - svq->num_added);
     } else {
         needs_kick = !(svq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
     }
+    svq->num_added = 0;
 
     if (!needs_kick) {
         return;
     }
 
+    stat64_add(&svq->kicks, 1);
     event_notifier_set(&svq->hdev_kick);
 }
 
-/**
- * Add an element to a SVQ.
- *
- * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+/*
+ * Add an element to a SVQ without notifying the device, so a batch of
+ * buffers costs a single kick.
  */
-int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
-                  size_t out_num, const struct iovec *in_sg, size_t in_num,
-                  VirtQueueElement *elem)
+static int vhost_svq_add_nokick(VhostShadowVirtqueue *svq,
+                                const struct iovec *out_sg, size_t out_num,
+                                const struct iovec *in_sg, size_t in_num,
+                                VirtQueueElement *elem)
 {
     unsigned qemu_head;
     unsigned ndescs = in_num + out_num;
@@ -265,16 +271,34 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
 
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
+    svq->num_added++;
+    stat64_add(&svq->avail_bufs, 1);
     return 0;
 }
 
+/**
+ * Add an element to a SVQ.
+ *
+ * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+ */
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const struct iovec *in_sg, size_t in_num,
+                  VirtQueueElement *elem)
+{
+    int r = vhost_svq_add_nokick(svq, out_sg, out_num, in_sg, in_num, elem);
+
+    if (r == 0) {
+        vhost_svq_kick(svq);
+    }
+    return r;
+}
+
 /* Convenience wrapper to add a guest's element to SVQ */
 static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
                                  VirtQueueElement *elem)
 {
-    return vhost_svq_add(svq, elem->out_sg, elem->out_num, elem->in_sg,
-                         elem->in_num, elem);
+    return vhost_svq_add_nokick(svq, elem->out_sg, elem->out_num, elem->in_sg,
+                                elem->in_num, elem);
 }
 
 /**
@@ -335,12 +359,18 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                 }
 
                 /* VQ is full or broken, just return and ignore kicks */
+                if (svq->num_added) {
+                    vhost_svq_kick(svq);
+                }
                 return;
             }
             /* elem belongs to SVQ or external caller now */
             elem = NULL;
         }
 
+        if (svq->num_added) {
+            vhost_svq_kick(svq);
+        }
         virtio_queue_set_notification(svq->vq, true);
     } while (!virtio_queue_empty(svq->vq));
 }
@@ -499,7 +529,16 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
         }
 
         virtqueue_flush(vq, i);
-        event_notifier_set(&svq->svq_call);
+        if (i) {
+            stat64_add(&svq->used_bufs, i);
+            /* Respect the guest's notification suppression */
+            WITH_RCU_READ_LOCK_GUARD() {
+                if (virtio_should_notify(svq->vdev, vq)) {
+                    stat64_add(&svq->calls, 1);
+                    event_notifier_set(&svq->svq_call);
+                }
+            }
+        }
 
         if (check_for_avail_queue && svq->next_guest_avail_elem) {
             /*
@@ -606,6 +645,81 @@ size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq)
     return ROUND_UP(used_size, qemu_real_host_page_size());
 }
 
+static void vhost_svq_kick_poll_begin(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
+
+    virtio_queue_set_notification(svq->vq, false);
+}
+
+static bool vhost_svq_kick_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
+
+    /* Nothing to do until the device uses buffers if the SVQ is full */
+    return svq->vq && !svq->next_guest_avail_elem &&
+           !virtio_queue_empty(svq->vq);
+}
+
+static void vhost_svq_kick_poll_ready(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
+
+    vhost_handle_guest_kick(svq);
+}
+
+static void vhost_svq_kick_poll_end(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue, svq_kick);
+
+    /* Caller polls once more after this to catch kicks that race with us */
+    virtio_queue_set_notification(svq->vq, true);
+}
+
+static bool vhost_svq_call_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+
+    return svq->vq && vhost_svq_more_used(svq);
+}
+
+static void vhost_svq_call_poll_ready(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+
+    vhost_svq_flush(svq, true);
+}
+
+/* Start forwarding in svq->ctx, polling both rings while it is busy */
+static void vhost_svq_attach_aio_context(VhostShadowVirtqueue *svq)
+{
+    aio_context_acquire(svq->ctx);
+    aio_set_event_notifier(svq->ctx, &svq->svq_kick, false,
+                           vhost_handle_guest_kick_notifier,
+                           vhost_svq_kick_poll, vhost_svq_kick_poll_ready);
+    aio_set_event_notifier_poll(svq->ctx, &svq->svq_kick,
+                                vhost_svq_kick_poll_begin,
+                                vhost_svq_kick_poll_end);
+    aio_set_event_notifier(svq->ctx, &svq->hdev_call, false,
+                           vhost_svq_handle_call, vhost_svq_call_poll,
+                           vhost_svq_call_poll_ready);
+    aio_context_release(svq->ctx);
+}
+
+/* Runs in svq->ctx so no handler is in progress once it returns */
+static void vhost_svq_detach_aio_context_bh(void *opaque)
+{
+    VhostShadowVirtqueue *svq = opaque;
+
+    aio_set_event_notifier(svq->ctx, &svq->svq_kick, false, NULL, NULL, NULL);
+    aio_set_event_notifier(svq->ctx, &svq->hdev_call, false, NULL, NULL,
+                           NULL);
+}
+
 /**
  * Set a new file descriptor for the guest to kick the SVQ and notify for avail
  *
@@ -621,7 +735,12 @@ void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
     bool poll_start = svq_kick_fd != VHOST_FILE_UNBIND;
 
     if (poll_stop) {
-        event_notifier_set_handler(svq_kick, NULL);
+        if (svq->ctx) {
+            aio_wait_bh_oneshot(svq->ctx, vhost_svq_detach_aio_context_bh,
+                                svq);
+        } else {
+            event_notifier_set_handler(svq_kick, NULL);
+        }
     }
 
     event_notifier_init_fd(svq_kick, svq_kick_fd);
@@ -632,10 +751,51 @@ void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
      */
     if (poll_start) {
         event_notifier_set(svq_kick);
-        event_notifier_set_handler(svq_kick, vhost_handle_guest_kick_notifier);
+        if (svq->ctx) {
+            vhost_svq_attach_aio_context(svq);
+        } else {
+            event_notifier_set_handler(svq_kick,
+                                       vhost_handle_guest_kick_notifier);
+        }
     }
 }
 
+/**
+ * Run the SVQ forwarding in an AioContext other than the main loop.
+ *
+ * @svq: The svq, not started yet
+ * @ctx: The context, usually an IOThread's
+ *
+ * Both the guest kick and the device call are then handled in @ctx, with
+ * the context's adaptive polling. The SVQ must not have an avail_handler,
+ * since those expect to run under the BQL.
+ */
+void vhost_svq_set_aio_context(VhostShadowVirtqueue *svq, AioContext *ctx)
+{
+    assert(!svq->ops);
+    assert(event_notifier_get_fd(&svq->svq_kick) == VHOST_FILE_UNBIND);
+
+    event_notifier_set_handler(&svq->hdev_call, NULL);
+    svq->ctx = ctx;
+}
+
+/**
+ * Report the forwarding counters of a SVQ.
+ *
+ * @svq: The svq
+ */
+VirtVhostShadowQueueStats *vhost_svq_get_stats(VhostShadowVirtqueue *svq)
+{
+    VirtVhostShadowQueueStats *stats = g_new0(VirtVhostShadowQueueStats, 1);
+
+    stats->iothread = svq->ctx != NULL;
+    stats->avail_bufs = stat64_get(&svq->avail_bufs);
+    stats->used_bufs = stat64_get(&svq->used_bufs);
+    stats->kicks = stat64_get(&svq->kicks);
+    stats->calls = stat64_get(&svq->calls);
+    return stats;
+}
+
 /**
  * Start the shadow virtqueue operation.
  *
@@ -763,7 +923,9 @@ void vhost_svq_free(gpointer pvq)
     VhostShadowVirtqueue *vq = pvq;
     vhost_svq_stop(vq);
     event_notifier_cleanup(&vq->hdev_kick);
-    event_notifier_set_handler(&vq->hdev_call, NULL);
+    if (!vq->ctx) {
+        event_notifier_set_handler(&vq->hdev_call, NULL);
+    }
     event_notifier_cleanup(&vq->hdev_call);
     g_free(vq);
 }
@@ -11,6 +11,9 @@
 #define VHOST_SHADOW_VIRTQUEUE_H
 
 #include "qemu/event_notifier.h"
+#include "qemu/stats64.h"
+#include "block/aio.h"
+#include "qapi/qapi-types-virtio.h"
 #include "hw/virtio/virtio.h"
 #include "standard-headers/linux/vhost_types.h"
 #include "hw/virtio/vhost-iova-tree.h"
@@ -107,6 +110,18 @@ typedef struct VhostShadowVirtqueue {
 
     /* Next head to consume from the device */
     uint16_t last_used_idx;
+
+    /* Buffers made available to the device since the last kick */
+    uint16_t num_added;
+
+    /* Context running the forwarding, NULL for the main loop */
+    AioContext *ctx;
+
+    /* Forwarding counters, read by the monitor */
+    Stat64 avail_bufs;
+    Stat64 used_bufs;
+    Stat64 kicks;
+    Stat64 calls;
 } VhostShadowVirtqueue;
 
 bool vhost_svq_valid_features(uint64_t features, Error **errp);
@@ -125,6 +140,9 @@ void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
 size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq);
 size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq);
 
+void vhost_svq_set_aio_context(VhostShadowVirtqueue *svq, AioContext *ctx);
+VirtVhostShadowQueueStats *vhost_svq_get_stats(VhostShadowVirtqueue *svq);
+
 void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
                      VirtQueue *vq);
 void vhost_svq_stop(VhostShadowVirtqueue *svq);
@@ -285,7 +285,7 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
     llsize = int128_sub(llend, int128_make64(iova));
 
     if (v->shadow_vqs_enabled) {
-        const DMAMap *result;
+        DMAMap result;
         const void *vaddr = memory_region_get_ram_ptr(section->mr) +
             section->offset_within_region +
             (iova - section->offset_within_address_space);
@@ -294,13 +294,12 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
             .size = int128_get64(llsize) - 1,
         };
 
-        result = vhost_iova_tree_find_iova(v->iova_tree, &mem_region);
-        if (!result) {
+        if (!vhost_iova_tree_find_iova(v->iova_tree, &mem_region, &result)) {
             /* The memory listener map wasn't mapped */
             return;
         }
-        iova = result->iova;
-        vhost_iova_tree_remove(v->iova_tree, *result);
+        iova = result.iova;
+        vhost_iova_tree_remove(v->iova_tree, result);
     }
     vhost_vdpa_iotlb_batch_begin_once(v);
     ret = vhost_vdpa_dma_unmap(v, iova, int128_get64(llsize));
@@ -436,6 +435,9 @@ static int vhost_vdpa_init_svq(struct vhost_dev *hdev, struct vhost_vdpa *v,
             error_setg(errp, "Cannot create svq %u", n);
             return -1;
         }
+        if (v->svq_aio_context) {
+            vhost_svq_set_aio_context(svq, v->svq_aio_context);
+        }
         g_ptr_array_add(shadow_vqs, g_steal_pointer(&svq));
     }
 
@@ -889,23 +891,23 @@ static void vhost_vdpa_svq_unmap_ring(struct vhost_vdpa *v, hwaddr addr)
     const DMAMap needle = {
         .translated_addr = addr,
     };
-    const DMAMap *result = vhost_iova_tree_find_iova(v->iova_tree, &needle);
+    DMAMap result;
     hwaddr size;
     int r;
 
-    if (unlikely(!result)) {
+    if (unlikely(!vhost_iova_tree_find_iova(v->iova_tree, &needle, &result))) {
         error_report("Unable to find SVQ address to unmap");
         return;
     }
 
-    size = ROUND_UP(result->size, qemu_real_host_page_size());
-    r = vhost_vdpa_dma_unmap(v, result->iova, size);
+    size = ROUND_UP(result.size, qemu_real_host_page_size());
+    r = vhost_vdpa_dma_unmap(v, result.iova, size);
     if (unlikely(r < 0)) {
         error_report("Unable to unmap SVQ vring: %s (%d)", g_strerror(-r), -r);
         return;
     }
 
-    vhost_iova_tree_remove(v->iova_tree, *result);
+    vhost_iova_tree_remove(v->iova_tree, result);
 }
 
 static void vhost_vdpa_svq_unmap_rings(struct vhost_dev *dev,
@@ -1278,6 +1280,18 @@ static bool  vhost_vdpa_force_iommu(struct vhost_dev *dev)
     return true;
 }
 
+static VirtVhostShadowQueueStats *vhost_vdpa_get_svq_stats(
+    struct vhost_dev *dev, int idx)
+{
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (!v->shadow_vqs_enabled || idx < 0 || idx >= v->shadow_vqs->len) {
+        return NULL;
+    }
+
+    return vhost_svq_get_stats(g_ptr_array_index(v->shadow_vqs, idx));
+}
+
 const VhostOps vdpa_ops = {
         .backend_type = VHOST_BACKEND_TYPE_VDPA,
         .vhost_backend_init = vhost_vdpa_init,
@@ -1310,4 +1324,5 @@ const VhostOps vdpa_ops = {
         .vhost_get_device_id = vhost_vdpa_get_device_id,
         .vhost_vq_get_addr = vhost_vdpa_vq_get_addr,
         .vhost_force_iommu = vhost_vdpa_force_iommu,
+        .vhost_get_svq_stats = vhost_vdpa_get_svq_stats,
 };
@@ -18,6 +18,7 @@
 #include "qemu/module.h"
 #include "qemu/timer.h"
 #include "qemu/madvise.h"
+#include "block/aio-wait.h"
 #include "hw/virtio/virtio.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/qdev-properties.h"
@@ -326,30 +327,89 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
-static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+typedef struct BalloonReportRange {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t size;
+} BalloonReportRange;
+
+static gint balloon_report_range_cmp(gconstpointer a, gconstpointer b)
 {
-    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+    const BalloonReportRange *ra = a, *rb = b;
+
+    if (ra->rb != rb->rb) {
+        return (uintptr_t)ra->rb < (uintptr_t)rb->rb ? -1 : 1;
+    }
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * The guest reports free pages in page-sized or larger chunks that are often
+ * adjacent, both within one element and across elements of the same batch.
+ * Sort and merge them, so that each contiguous range is discarded with a
+ * single madvise()/fallocate().
+ */
+static void virtio_balloon_discard_ranges(GArray *ranges)
+{
+    BalloonReportRange *cur = NULL;
+    unsigned int nr_discards = 0;
+    guint i;
+
+    g_array_sort(ranges, balloon_report_range_cmp);
+
+    for (i = 0; i < ranges->len; i++) {
+        BalloonReportRange *r = &g_array_index(ranges, BalloonReportRange, i);
+
+        if (cur && cur->rb == r->rb && cur->offset + cur->size >= r->offset) {
+            cur->size = MAX(cur->size, r->offset + r->size - cur->offset);
+            continue;
+        }
+        if (cur) {
+            ram_block_discard_range(cur->rb, cur->offset, cur->size);
+            nr_discards++;
+        }
+        cur = r;
+    }
+    if (cur) {
+        ram_block_discard_range(cur->rb, cur->offset, cur->size);
+        nr_discards++;
+    }
+    trace_virtio_balloon_discard_ranges(ranges->len, nr_discards);
+}
+
+static void virtio_balloon_process_report(VirtIOBalloon *dev)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VirtQueue *vq = dev->reporting_vq;
+    g_autoptr(GPtrArray) elems = g_ptr_array_new_with_free_func(g_free);
+    g_autoptr(GArray) ranges = g_array_new(false, false,
+                                           sizeof(BalloonReportRange));
     VirtQueueElement *elem;
+    bool discard;
+    guint i;
 
-    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
-        unsigned int i;
+    /*
+     * When we discard the page it has the effect of removing the page
+     * from the hypervisor itself and causing it to be zeroed when it
+     * is returned to us. So we must not discard the page if it is
+     * accessible by another device or process, or if the guest is
+     * expecting it to retain a non-zero value.
+     */
+    discard = !virtio_balloon_inhibited() && !dev->poison_val;
 
-        /*
-         * When we discard the page it has the effect of removing the page
-         * from the hypervisor itself and causing it to be zeroed when it
-         * is returned to us. So we must not discard the page if it is
-         * accessible by another device or process, or if the guest is
-         * expecting it to retain a non-zero value.
-         */
-        if (virtio_balloon_inhibited() || dev->poison_val) {
-            goto skip_element;
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        g_ptr_array_add(elems, elem);
+        if (!discard) {
+            continue;
         }
 
         for (i = 0; i < elem->in_num; i++) {
-            void *addr = elem->in_sg[i].iov_base;
-            size_t size = elem->in_sg[i].iov_len;
-            ram_addr_t ram_offset;
-            RAMBlock *rb;
+            BalloonReportRange range = {
+                .size = elem->in_sg[i].iov_len,
+            };
 
             /*
              * There is no need to check the memory section to see if
@@ -362,8 +422,9 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
              * will return NULL after the first bounce buffer and fail
              * to map any resources.
              */
-            rb = qemu_ram_block_from_host(addr, false, &ram_offset);
-            if (!rb) {
+            range.rb = qemu_ram_block_from_host(elem->in_sg[i].iov_base,
+                                                false, &range.offset);
+            if (!range.rb) {
                 trace_virtio_balloon_bad_addr(elem->in_addr[i]);
                 continue;
             }
@@ -372,18 +433,58 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
              * For now we will simply ignore unaligned memory regions, or
              * regions that overrun the end of the RAMBlock.
              */
-            if (!QEMU_IS_ALIGNED(ram_offset | size, qemu_ram_pagesize(rb)) ||
-                (ram_offset + size) > qemu_ram_get_used_length(rb)) {
+            if (!QEMU_IS_ALIGNED(range.offset | range.size,
+                                 qemu_ram_pagesize(range.rb)) ||
+                (range.offset + range.size) >
+                qemu_ram_get_used_length(range.rb)) {
                 continue;
             }
 
-            ram_block_discard_range(rb, ram_offset, size);
+            g_array_append_val(ranges, range);
         }
+    }
 
-skip_element:
-        virtqueue_push(vq, elem, 0);
-        virtio_notify(vdev, vq);
-        g_free(elem);
+    if (!elems->len) {
+        return;
+    }
+
+    /* Discard while the elements are still mapped, then complete them. */
+    virtio_balloon_discard_ranges(ranges);
+    for (i = 0; i < elems->len; i++) {
+        virtqueue_fill(vq, g_ptr_array_index(elems, i), 0, i);
+    }
+    virtqueue_flush(vq, elems->len);
+    virtio_notify(vdev, vq);
+}
+
+static void virtio_balloon_report_bh(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+
+    qemu_mutex_lock(&dev->reporting_lock);
+    if (!dev->reporting_blocked) {
+        virtio_balloon_process_report(dev);
+    }
+    qemu_mutex_unlock(&dev->reporting_lock);
+}
+
+/* Context: BH in the iothread, see virtio_balloon_device_unrealize() */
+static void virtio_balloon_report_bh_delete(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+
+    qemu_bh_delete(dev->reporting_bh);
+    dev->reporting_bh = NULL;
+}
+
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+
+    if (dev->reporting_bh) {
+        qemu_bh_schedule(dev->reporting_bh);
+    } else {
+        virtio_balloon_process_report(dev);
     }
 }
 
@@ -917,6 +1018,11 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
         s->reporting_vq = virtio_add_queue(vdev, 32,
                                            virtio_balloon_handle_report);
+        if (s->iothread) {
+            object_ref(OBJECT(s->iothread));
+            s->reporting_bh = aio_bh_new(iothread_get_aio_context(s->iothread),
+                                         virtio_balloon_report_bh, s);
+        }
     }
 
     reset_stats(s);
@@ -933,6 +1039,23 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
         virtio_balloon_free_page_stop(s);
         precopy_remove_notifier(&s->free_page_hint_notify);
     }
+    if (s->reporting_bh) {
+        AioContext *ctx = iothread_get_aio_context(s->iothread);
+
+        /* A batch that is already scheduled must not touch the queue */
+        qemu_mutex_lock(&s->reporting_lock);
+        s->reporting_blocked = true;
+        qemu_mutex_unlock(&s->reporting_lock);
+
+        /*
+         * Delete the BH from the iothread, so that it cannot be running
+         * there anymore when the queues are freed below.
+         */
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_balloon_report_bh_delete, s);
+        aio_context_release(ctx);
+        object_unref(OBJECT(s->iothread));
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
 
@@ -995,6 +1118,24 @@ static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
             qemu_mutex_unlock(&s->free_page_lock);
         }
     }
+
+    if (s->reporting_bh) {
+        bool blocked = !vdev->vm_running ||
+                       !(status & VIRTIO_CONFIG_S_DRIVER_OK);
+
+        /*
+         * Taking the lock waits for a batch in progress, so that no element
+         * is popped or pushed once the VM is stopped or the device is reset.
+         */
+        qemu_mutex_lock(&s->reporting_lock);
+        s->reporting_blocked = blocked;
+        qemu_mutex_unlock(&s->reporting_lock);
+
+        /* Process reports the guest queued while we were blocked */
+        if (!blocked) {
+            qemu_bh_schedule(s->reporting_bh);
+        }
+    }
 }
 
 static void virtio_balloon_instance_init(Object *obj)
@@ -1003,6 +1144,8 @@ static void virtio_balloon_instance_init(Object *obj)
 
     qemu_mutex_init(&s->free_page_lock);
     qemu_cond_init(&s->free_page_cond);
+    qemu_mutex_init(&s->reporting_lock);
+    s->reporting_blocked = true;
     s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
     s->free_page_hint_notify.notify = virtio_balloon_free_page_hint_notify;
 
@@ -14,10 +14,12 @@
 #include "qemu/iov.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/units.h"
 #include "sysemu/numa.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/reset.h"
+#include "sysemu/runstate.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
@@ -444,6 +446,27 @@ static bool virtio_mem_valid_range(const VirtIOMEM *vmem, uint64_t gpa,
     return true;
 }
 
+/*
+ * Preallocation of a plug request runs in a separate thread, without the BQL,
+ * using the memory backend's "prealloc-threads" and "prealloc-context". The
+ * request element is held until the thread is done; the response is sent from
+ * a bottom half in the main loop.
+ */
+struct VirtIOMEMPlugJob {
+    VirtIOMEM *vmem;
+    VirtQueueElement *elem;
+    uint64_t gpa;
+    uint64_t size;
+
+    int fd;
+    char *area;
+    int max_threads;
+    ThreadContext *tc;
+
+    QemuThread thread;
+    Error *err;
+};
+
 static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
                                       uint64_t size, bool plug)
 {
@@ -459,51 +482,19 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
             return -EBUSY;
         }
         virtio_mem_notify_unplug(vmem, offset, size);
-    } else {
-        int ret = 0;
-
-        if (vmem->prealloc) {
-            void *area = memory_region_get_ram_ptr(vmem->memdev->mr) + offset;
-            int fd = memory_region_get_fd(vmem->memdev->mr);
-            Error *local_err = NULL;
-
-            qemu_prealloc_mem(fd, area, size, 1, NULL, &local_err);
-            if (local_err) {
-                static bool warned;
-
-                /*
-                 * Warn only once, we don't want to fill the log with these
-                 * warnings.
-                 */
-                if (!warned) {
-                    warn_report_err(local_err);
-                    warned = true;
-                } else {
-                    error_free(local_err);
-                }
-                ret = -EBUSY;
-            }
-        }
-        if (!ret) {
-            ret = virtio_mem_notify_plug(vmem, offset, size);
-        }
-
-        if (ret) {
-            /* Could be preallocation or a notifier populated memory. */
-            ram_block_discard_range(vmem->memdev->mr->ram_block, offset, size);
-            return -EBUSY;
-        }
+    } else if (virtio_mem_notify_plug(vmem, offset, size)) {
+        /* Could be preallocation or a notifier populated memory. */
+        ram_block_discard_range(vmem->memdev->mr->ram_block, offset, size);
+        return -EBUSY;
     }
     virtio_mem_set_bitmap(vmem, start_gpa, size, plug);
     return 0;
 }
 
-static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
-                                           uint16_t nb_blocks, bool plug)
+static uint16_t virtio_mem_check_state_change(const VirtIOMEM *vmem,
+                                              uint64_t gpa, uint64_t size,
+                                              bool plug)
 {
-    const uint64_t size = nb_blocks * vmem->block_size;
-    int ret;
-
     if (!virtio_mem_valid_range(vmem, gpa, size)) {
         return VIRTIO_MEM_RESP_ERROR;
     }
@@ -516,9 +507,13 @@ static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
     if (!virtio_mem_test_bitmap(vmem, gpa, size, !plug)) {
         return VIRTIO_MEM_RESP_ERROR;
     }
+    return VIRTIO_MEM_RESP_ACK;
+}
 
-    ret = virtio_mem_set_block_state(vmem, gpa, size, plug);
-    if (ret) {
+static uint16_t virtio_mem_state_change(VirtIOMEM *vmem, uint64_t gpa,
+                                        uint64_t size, bool plug)
+{
+    if (virtio_mem_set_block_state(vmem, gpa, size, plug)) {
         return VIRTIO_MEM_RESP_BUSY;
     }
     if (plug) {
@@ -530,16 +525,128 @@ static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
     return VIRTIO_MEM_RESP_ACK;
 }
 
-static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
+static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
+                                           uint16_t nb_blocks, bool plug)
+{
+    const uint64_t size = nb_blocks * vmem->block_size;
+    uint16_t type;
+
+    type = virtio_mem_check_state_change(vmem, gpa, size, plug);
+    if (type != VIRTIO_MEM_RESP_ACK) {
+        return type;
+    }
+    return virtio_mem_state_change(vmem, gpa, size, plug);
+}
+
+static void *virtio_mem_plug_job_thread(void *opaque)
+{
+    VirtIOMEMPlugJob *job = opaque;
+
+    qemu_prealloc_mem(job->fd, job->area, job->size, job->max_threads,
+                      job->tc, &job->err);
+    qemu_bh_schedule(job->vmem->plug_bh);
+    return NULL;
+}
+
+static void virtio_mem_plug_job_start(VirtIOMEM *vmem, VirtQueueElement *elem,
+                                      uint64_t gpa, uint64_t size)
+{
+    HostMemoryBackend *backend = vmem->memdev;
+    VirtIOMEMPlugJob *job = g_new0(VirtIOMEMPlugJob, 1);
+
+    job->vmem = vmem;
+    job->elem = elem;
+    job->gpa = gpa;
+    job->size = size;
+    job->fd = memory_region_get_fd(backend->mr);
+    job->area = memory_region_get_ram_ptr(backend->mr) + (gpa - vmem->addr);
+    job->max_threads = backend->prealloc_threads;
+    job->tc = backend->prealloc_context;
+    if (job->tc) {
+        object_ref(OBJECT(job->tc));
+    }
+
+    trace_virtio_mem_plug_prealloc_start(gpa, size);
+    vmem->plug_job = job;
+    qemu_thread_create(&job->thread, "virtio-mem-plug",
+                       virtio_mem_plug_job_thread, job, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Wait for the preallocation thread and complete the plug request. If
+ * @respond is false, the request is dropped (e.g., on device reset) and the
+ * preallocated memory is discarded again.
+ */
+static void virtio_mem_plug_job_finish(VirtIOMEM *vmem, bool respond)
+{
+    VirtIOMEMPlugJob *job = vmem->plug_job;
+    const uint64_t offset = job->gpa - vmem->addr;
+    RAMBlock *rb = vmem->memdev->mr->ram_block;
+    uint16_t type = VIRTIO_MEM_RESP_BUSY;
+
+    qemu_thread_join(&job->thread);
+    qemu_bh_cancel(vmem->plug_bh);
+    vmem->plug_job = NULL;
+
+    if (job->err) {
+        static bool warned;
+
+        /*
+         * Warn only once, we don't want to fill the log with these
+         * warnings.
+         */
+        if (!warned) {
+            warn_report_err(job->err);
+            warned = true;
+        } else {
+            error_free(job->err);
+        }
+    } else if (respond) {
+        type = virtio_mem_state_change(vmem, job->gpa, job->size, true);
+    }
+    if (type != VIRTIO_MEM_RESP_ACK) {
+        /*
+         * Unplugged memory must be discarded, also if migration became
+         * active while we were preallocating.
+         */
+        ram_block_discard_range(rb, offset, job->size);
+    }
+    trace_virtio_mem_plug_prealloc_done(job->gpa, job->size, type);
+
+    if (respond) {
+        virtio_mem_send_response_simple(vmem, job->elem, type);
+    }
+    if (job->tc) {
+        object_unref(OBJECT(job->tc));
+    }
+    g_free(job->elem);
+    g_free(job);
+}
+
+/* Returns true if the request completes asynchronously. */
+static bool virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
                                     struct virtio_mem_req *req)
 {
     const uint64_t gpa = le64_to_cpu(req->u.plug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
+    const uint64_t size = nb_blocks * vmem->block_size;
     uint16_t type;
 
     trace_virtio_mem_plug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
+    if (!vmem->prealloc) {
+        type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
+    } else {
+        type = virtio_mem_check_state_change(vmem, gpa, size, true);
+        if (type == VIRTIO_MEM_RESP_ACK && virtio_mem_is_busy()) {
+            type = VIRTIO_MEM_RESP_BUSY;
+        }
+        if (type == VIRTIO_MEM_RESP_ACK) {
+            virtio_mem_plug_job_start(vmem, elem, gpa, size);
+            return true;
+        }
+    }
     virtio_mem_send_response_simple(vmem, elem, type);
+    return false;
 }
 
 static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
@@ -646,6 +753,11 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
     uint16_t type;
 
     while (true) {
+        /* Requests are processed in order, wait for the pending plug. */
+        if (vmem->plug_job) {
+            return;
+        }
+
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
             return;
@@ -672,7 +784,10 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
         type = le16_to_cpu(req.type);
         switch (type) {
         case VIRTIO_MEM_REQ_PLUG:
-            virtio_mem_plug_request(vmem, elem, &req);
+            if (virtio_mem_plug_request(vmem, elem, &req)) {
+                /* The element is completed by virtio_mem_plug_bh(). */
+                continue;
+            }
             break;
         case VIRTIO_MEM_REQ_UNPLUG:
             virtio_mem_unplug_request(vmem, elem, &req);
@@ -695,6 +810,19 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+static void virtio_mem_plug_bh(void *opaque)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(opaque);
+
+    if (!vmem->plug_job) {
+        return;
+    }
+    virtio_mem_plug_job_finish(vmem, true);
+
+    /* Process requests the guest queued up in the meantime. */
+    virtio_mem_handle_request(VIRTIO_DEVICE(vmem), vmem->vq);
+}
+
 static void virtio_mem_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOMEM *vmem = VIRTIO_MEM(vdev);
@@ -736,10 +864,38 @@ static int virtio_mem_validate_features(VirtIODevice *vdev)
     return 0;
 }
 
+static void virtio_mem_reset(VirtIODevice *vdev)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+
+    /* The virtqueue is about to be reset, drop a pending plug request. */
+    if (vmem->plug_job) {
+        virtio_mem_plug_job_finish(vmem, false);
+    }
+}
+
+static void virtio_mem_vm_state_change(void *opaque, bool running,
+                                       RunState state)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(opaque);
+
+    /*
+     * Don't leave a popped element behind when the VM stops, it would not
+     * survive migration. This waits for the remaining preallocation.
+     */
+    if (!running && vmem->plug_job) {
+        virtio_mem_plug_job_finish(vmem, true);
+    }
+}
+
 static void virtio_mem_system_reset(void *opaque)
 {
     VirtIOMEM *vmem = VIRTIO_MEM(opaque);
 
+    if (vmem->plug_job) {
+        virtio_mem_plug_job_finish(vmem, false);
+    }
+
     /*
      * During usual resets, we will unplug all memory and shrink the usable
      * region size. This is, however, not possible in all scenarios. Then,
@@ -869,6 +1025,9 @@ static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
 
     virtio_init(vdev, VIRTIO_ID_MEM, sizeof(struct virtio_mem_config));
     vmem->vq = virtio_add_queue(vdev, 128, virtio_mem_handle_request);
+    vmem->plug_bh = qemu_bh_new(virtio_mem_plug_bh, vmem);
+    vmem->vmstate_change = qemu_add_vm_change_state_handler(
+                               virtio_mem_vm_state_change, vmem);
 
     host_memory_backend_set_mapped(vmem->memdev, true);
     vmstate_register_ram(vmem->memdev->mr, DEVICE(vmem));
@@ -887,6 +1046,12 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOMEM *vmem = VIRTIO_MEM(dev);
 
+    if (vmem->plug_job) {
+        virtio_mem_plug_job_finish(vmem, false);
+    }
+    qemu_del_vm_change_state_handler(vmem->vmstate_change);
+    qemu_bh_delete(vmem->plug_bh);
+
     /*
      * The unplug handler unmapped the memory region, it cannot be
      * found via an address space anymore. Unset ourselves.
@@ -1347,6 +1512,7 @@ static void virtio_mem_class_init(ObjectClass *klass, void *data)
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     vdc->realize = virtio_mem_device_realize;
     vdc->unrealize = virtio_mem_device_unrealize;
+    vdc->reset = virtio_mem_reset;
     vdc->get_config = virtio_mem_get_config;
     vdc->get_features = virtio_mem_get_features;
     vdc->validate_features = virtio_mem_validate_features;
@@ -526,6 +526,11 @@ typedef struct VRingPackedDescEvent {
     uint16_t flags;
 } VRingPackedDescEvent ;
 
+/* Number of recycled elements kept per virtqueue */
+#define VIRTQUEUE_ELEM_POOL_SIZE 64
+/* Descriptors per direction that a pooled element can describe */
+#define VIRTQUEUE_ELEM_POOL_SG   16
+
 struct VirtQueue
 {
     VRing vring;
@@ -562,6 +567,23 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Recycled elements, see virtio_queue_set_element_pool() */
+    VirtQueueElement **elem_pool;
+    unsigned int elem_pool_num;
+    size_t elem_pool_sz;
+
+    /* Interrupt coalescing, see virtio_queue_coalesce_irq() */
+    QEMUTimer *irq_timer;
+    AioContext *irq_timer_ctx;
+    unsigned int irq_pending;
+    bool irq_pending_irqfd;
+    int64_t irq_last_ns;
+    /* Moving average of the time between notifications */
+    int64_t irq_interval_ns;
+    uint64_t irq_raised;
+    uint64_t irq_coalesced;
+    uint64_t irq_timer_fired;
 };
 
 const char *virtio_device_names[] = {
@@ -1405,6 +1427,32 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/*
+ * virtqueue_push_batch:
+ * @vq: the virtqueue
+ * @elems: the completed elements
+ * @lens: bytes written to each element
+ * @count: number of elements, at most the queue size
+ *
+ * Like virtqueue_push() for each element, but the used index is updated
+ * once for the whole batch.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens[i], i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1871,29 +1919,133 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static void virtqueue_layout_element(VirtQueueElement *elem, size_t sz,
+                                     unsigned out_max, unsigned in_max,
+                                     size_t *total)
 {
-    VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
-    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
-    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t out_addr_ofs = in_addr_ofs + in_max * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_max * sizeof(elem->out_addr[0]);
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
-    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    size_t out_sg_ofs = in_sg_ofs + in_max * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_max * sizeof(elem->out_sg[0]);
 
-    assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
-    trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
-    elem->out_num = out_num;
-    elem->in_num = in_num;
+    if (total) {
+        *total = out_sg_end;
+        return;
+    }
     elem->in_addr = (void *)elem + in_addr_ofs;
     elem->out_addr = (void *)elem + out_addr_ofs;
     elem->in_sg = (void *)elem + in_sg_ofs;
     elem->out_sg = (void *)elem + out_sg_ofs;
+}
+
+static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t total;
+
+    assert(sz >= sizeof(VirtQueueElement));
+    virtqueue_layout_element(NULL, sz, out_num, in_num, &total);
+    elem = g_malloc(total);
+    trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->pooled = false;
+    virtqueue_layout_element(elem, sz, out_num, in_num, NULL);
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Pooled elements always have room for VIRTQUEUE_ELEM_POOL_SG descriptors
+ * in each direction so that any of them can be reused for the next request.
+ * Larger chains fall back to a plain allocation.
+ */
+static void *virtqueue_alloc_element_pooled(VirtQueue *vq, size_t sz,
+                                            unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t total;
+
+    if (sz != vq->elem_pool_sz ||
+        out_num > VIRTQUEUE_ELEM_POOL_SG || in_num > VIRTQUEUE_ELEM_POOL_SG) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    if (vq->elem_pool_num) {
+        elem = vq->elem_pool[--vq->elem_pool_num];
+    } else {
+        virtqueue_layout_element(NULL, sz, VIRTQUEUE_ELEM_POOL_SG,
+                                 VIRTQUEUE_ELEM_POOL_SG, &total);
+        elem = g_malloc(total);
+        trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+        virtqueue_layout_element(elem, sz, VIRTQUEUE_ELEM_POOL_SG,
+                                 VIRTQUEUE_ELEM_POOL_SG, NULL);
+        elem->pooled = true;
+    }
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    return elem;
+}
+
+static void virtqueue_drain_element_pool(VirtQueue *vq)
+{
+    while (vq->elem_pool_num) {
+        g_free(vq->elem_pool[--vq->elem_pool_num]);
+    }
+    g_free(vq->elem_pool);
+    vq->elem_pool = NULL;
+    vq->elem_pool_sz = 0;
+}
+
+/*
+ * virtio_queue_set_element_pool:
+ * @vq: the virtqueue
+ * @sz: the size passed to virtqueue_pop() for this queue
+ *
+ * Let elements of size @sz popped from @vq be recycled through
+ * virtqueue_element_free() instead of going back to the allocator for
+ * every request.  The pool is only touched from the context that processes
+ * @vq, so no locking is needed.  Must be called while no elements are in
+ * flight, typically at realize time.  Passing 0 disables the pool.
+ */
+void virtio_queue_set_element_pool(VirtQueue *vq, size_t sz)
+{
+    virtqueue_drain_element_pool(vq);
+    if (sz) {
+        assert(sz >= sizeof(VirtQueueElement));
+        vq->elem_pool = g_new(VirtQueueElement *, VIRTQUEUE_ELEM_POOL_SIZE);
+        vq->elem_pool_sz = sz;
+    }
+}
+
+/*
+ * virtqueue_element_free:
+ * @vq: the virtqueue @elem was popped from
+ * @elem: the element, or NULL
+ *
+ * Release an element returned by virtqueue_pop() or virtqueue_pop_batch().
+ * Elements are still plain g_malloc() allocations, so callers that do not
+ * know the originating queue may keep using g_free().
+ */
+void virtqueue_element_free(VirtQueue *vq, void *elem)
+{
+    VirtQueueElement *e = elem;
+
+    if (e && e->pooled && vq->elem_pool &&
+        vq->elem_pool_num < VIRTQUEUE_ELEM_POOL_SIZE) {
+        vq->elem_pool[vq->elem_pool_num++] = e;
+        return;
+    }
+    g_free(elem);
+}
+
+/*
+ * Pop the element at last_avail_idx.  Called within rcu_read_lock(), after
+ * the caller has checked that the ring is not empty; the caller also
+ * publishes the new avail event.
+ */
+static void *virtqueue_split_pop_rcu(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     VRingMemoryRegionCaches *caches;
@@ -1908,14 +2060,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1930,10 +2074,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
     caches = vring_get_region_caches(vq);
@@ -2005,7 +2145,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element_pooled(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -2030,6 +2170,49 @@ err_undo_map:
     goto done;
 }
 
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    uint16_t old_avail_idx = vq->last_avail_idx;
+    unsigned int n = 0;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return 0;
+    }
+    if (max > 1 &&
+        (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx) < max) {
+        vring_avail_idx(vq);
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    /* Only consume what the avail index read above covers */
+    max = MIN(max, (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx));
+    while (n < max) {
+        elems[n] = virtqueue_split_pop_rcu(vq, sz);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    if (vq->last_avail_idx != old_avail_idx &&
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return n;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem = NULL;
+
+    virtqueue_split_pop_batch(vq, sz, &elem, 1);
+    return elem;
+}
+
 static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
@@ -2131,7 +2314,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element_pooled(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -2178,6 +2361,39 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/*
+ * virtqueue_pop_batch:
+ * @vq: the virtqueue
+ * @sz: size of each element, as for virtqueue_pop()
+ * @elems: array receiving the popped elements
+ * @max: number of entries in @elems
+ *
+ * Pop up to @max elements.  For split rings the avail index is read, the
+ * read barrier issued and the avail event published once per batch rather
+ * than once per element.
+ *
+ * Returns the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        while (n < max && (elems[n] = virtqueue_packed_pop(vq, sz))) {
+            n++;
+        }
+    } else {
+        n = virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+    trace_virtqueue_pop_batch(vq, n, max);
+    return n;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -2464,6 +2680,24 @@ static enum virtio_device_endian virtio_current_cpu_endian(void)
     }
 }
 
+static void virtio_queue_reset_irq_coalesce(VirtQueue *vq)
+{
+    if (vq->irq_timer) {
+        timer_del(vq->irq_timer);
+    }
+    vq->irq_pending = 0;
+    vq->irq_pending_irqfd = false;
+    vq->irq_last_ns = 0;
+    vq->irq_interval_ns = 0;
+}
+
+static void virtio_queue_free_irq_coalesce(VirtQueue *vq)
+{
+    g_clear_pointer(&vq->irq_timer, timer_free);
+    vq->irq_timer_ctx = NULL;
+    virtio_queue_reset_irq_coalesce(vq);
+}
+
 static void __virtio_queue_reset(VirtIODevice *vdev, uint32_t i)
 {
     vdev->vq[i].vring.desc = 0;
@@ -2481,6 +2715,7 @@ static void __virtio_queue_reset(VirtIODevice *vdev, uint32_t i)
     vdev->vq[i].notification = true;
     vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
     vdev->vq[i].inuse = 0;
+    virtio_queue_reset_irq_coalesce(&vdev->vq[i]);
     virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
 }
 
@@ -2924,6 +3159,8 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    virtqueue_drain_element_pool(vq);
+    virtio_queue_free_irq_coalesce(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -3016,7 +3253,7 @@ static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
         return virtio_packed_should_notify(vdev, vq);
@@ -3025,16 +3262,8 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
-void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_irqfd(VirtQueue *vq)
 {
-    WITH_RCU_READ_LOCK_GUARD() {
-        if (!virtio_should_notify(vdev, vq)) {
-            return;
-        }
-    }
-
-    trace_virtio_notify_irqfd(vdev, vq);
-
     /*
      * virtio spec 1.0 says ISR bit 0 should be ignored with MSI, but
      * windows drivers included in virtio-win 1.8.0 (circa 2015) are
@@ -3060,14 +3289,140 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool virtio_irq_coalesce_enabled(VirtIODevice *vdev)
+{
+    return vdev->irq_coalesce_max_delay_us &&
+           vdev->irq_coalesce_max_completions > 1;
+}
+
+/*
+ * Send any interrupt held back by coalescing now.  Called before the
+ * queue moves to another context and when the VM stops, so that no
+ * completion is left unsignalled across migration.
+ */
+static void virtio_queue_flush_irq(VirtQueue *vq)
+{
+    bool irqfd = vq->irq_pending_irqfd;
+
+    if (vq->irq_pending) {
+        timer_del(vq->irq_timer);
+        vq->irq_pending = 0;
+        vq->irq_pending_irqfd = false;
+        vq->irq_raised++;
+        if (irqfd) {
+            virtio_irqfd(vq);
+        } else {
+            virtio_irq(vq);
+        }
+    }
+}
+
+static void virtio_queue_irq_timer_cb(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    if (vq->irq_pending) {
+        trace_virtio_queue_irq_coalesce_timer(vq->vdev, vq, vq->irq_pending);
+        vq->irq_timer_fired++;
+        virtio_queue_flush_irq(vq);
+    }
+}
+
+/*
+ * Decide whether the interrupt for a flush the driver wants to hear about
+ * can be held back, so that several completions share it.
+ *
+ * An interrupt is held back for at most irq_coalesce_max_delay_us, and
+ * is sent as soon as irq_coalesce_max_completions flushes are waiting
+ * for it.  In adaptive mode the count is further limited to what is
+ * expected to arrive within the delay at the current completion rate,
+ * so a queue that completes requests slowly is not delayed at all.
+ *
+ * The timer runs in the AioContext of the caller, which must be the one
+ * processing the queue.
+ *
+ * Returns true if the interrupt was deferred.
+ */
+static bool virtio_queue_coalesce_irq(VirtIODevice *vdev, VirtQueue *vq,
+                                      bool irqfd)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t max_delay_ns = (int64_t)vdev->irq_coalesce_max_delay_us * SCALE_US;
+    unsigned int limit = vdev->irq_coalesce_max_completions;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    if (vq->irq_last_ns) {
+        vq->irq_interval_ns += (now - vq->irq_last_ns -
+                                vq->irq_interval_ns) / 8;
+    }
+    vq->irq_last_ns = now;
+
+    if (vdev->irq_coalesce_adaptive) {
+        limit = MIN(limit, max_delay_ns / MAX(vq->irq_interval_ns, 1));
+    }
+
+    /* Nowhere to run the timer from, don't hold the interrupt */
+    if (++vq->irq_pending >= limit || !ctx) {
+        if (vq->irq_timer) {
+            timer_del(vq->irq_timer);
+        }
+        vq->irq_pending = 0;
+        vq->irq_pending_irqfd = false;
+        return false;
+    }
+
+    vq->irq_coalesced++;
+    vq->irq_pending_irqfd |= irqfd;
+    if (vq->irq_pending > 1) {
+        return true;
+    }
+
+    if (vq->irq_timer_ctx != ctx) {
+        g_clear_pointer(&vq->irq_timer, timer_free);
+        vq->irq_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      virtio_queue_irq_timer_cb, vq);
+        vq->irq_timer_ctx = ctx;
+    }
+    timer_mod(vq->irq_timer, now + max_delay_ns);
+    return true;
+}
+
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    WITH_RCU_READ_LOCK_GUARD() {
+        /* Flushes done while an interrupt is held back count against it */
+        if (!virtio_should_notify(vdev, vq) && !vq->irq_pending) {
+            return;
+        }
+    }
+
+    if (virtio_irq_coalesce_enabled(vdev)) {
+        if (virtio_queue_coalesce_irq(vdev, vq, true)) {
+            return;
+        }
+        vq->irq_raised++;
+    }
+
+    trace_virtio_notify_irqfd(vdev, vq);
+    virtio_irqfd(vq);
+}
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
-        if (!virtio_should_notify(vdev, vq)) {
+        /* Flushes done while an interrupt is held back count against it */
+        if (!virtio_should_notify(vdev, vq) && !vq->irq_pending) {
             return;
         }
     }
 
+    if (virtio_irq_coalesce_enabled(vdev)) {
+        if (virtio_queue_coalesce_irq(vdev, vq, false)) {
+            return;
+        }
+        vq->irq_raised++;
+    }
+
     trace_virtio_notify(vdev, vq);
     virtio_irq(vq);
 }
@@ -3732,6 +4087,14 @@ static void virtio_vmstate_change(void *opaque, bool running, RunState state)
         k->vmstate_change(qbus->parent, backend_run);
     }
 
+    if (!running) {
+        int i;
+
+        for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+            virtio_queue_flush_irq(&vdev->vq[i]);
+        }
+    }
+
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
@@ -4094,6 +4457,8 @@ void virtio_queue_aio_detach_host_notifier(VirtQueue *vq, AioContext *ctx)
     /* Test and clear notifier before after disabling event,
      * in case poll callback didn't have time to run. */
     virtio_queue_host_notifier_read(&vq->host_notifier);
+    /* The coalescing timer lives in ctx, which stops handling this queue */
+    virtio_queue_flush_irq(vq);
 }
 
 void virtio_queue_host_notifier_read(EventNotifier *n)
@@ -4220,6 +4585,8 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtqueue_drain_element_pool(&vdev->vq[i]);
+        virtio_queue_free_irq_coalesce(&vdev->vq[i]);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
@@ -4241,6 +4608,12 @@ static Property virtio_properties[] = {
     DEFINE_PROP_BOOL("use-disabled-flag", VirtIODevice, use_disabled_flag, true),
     DEFINE_PROP_BOOL("x-disable-legacy-check", VirtIODevice,
                      disable_legacy_check, false),
+    DEFINE_PROP_UINT32("x-irq-coalesce-max-completions", VirtIODevice,
+                       irq_coalesce_max_completions, 32),
+    DEFINE_PROP_UINT32("x-irq-coalesce-max-delay-us", VirtIODevice,
+                       irq_coalesce_max_delay_us, 0),
+    DEFINE_PROP_BOOL("x-irq-coalesce-adaptive", VirtIODevice,
+                     irq_coalesce_adaptive, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -4769,6 +5142,11 @@ VirtVhostQueueStatus *qmp_x_query_virtio_vhost_queue_status(const char *path,
     status->avail_size = hdev->vqs[queue].avail_size;
     status->used_phys = hdev->vqs[queue].used_phys;
     status->used_size = hdev->vqs[queue].used_size;
+    if (hdev->vhost_ops->vhost_get_svq_stats) {
+        status->svq = hdev->vhost_ops->vhost_get_svq_stats(hdev,
+                                                    queue - hdev->vq_index);
+        status->has_svq = status->svq != NULL;
+    }
 
     return status;
 }
@@ -4829,6 +5207,21 @@ VirtQueueStatus *qmp_x_query_virtio_queue_status(const char *path,
         status->shadow_avail_idx = vdev->vq[queue].shadow_avail_idx;
     }
 
+    if (virtio_irq_coalesce_enabled(vdev)) {
+        VirtQueue *vq = &vdev->vq[queue];
+
+        status->irq_coalesce = g_new0(VirtQueueIrqCoalesceStatus, 1);
+        status->has_irq_coalesce = true;
+        status->irq_coalesce->max_completions =
+            vdev->irq_coalesce_max_completions;
+        status->irq_coalesce->max_delay_us = vdev->irq_coalesce_max_delay_us;
+        status->irq_coalesce->adaptive = vdev->irq_coalesce_adaptive;
+        status->irq_coalesce->interval_ns = vq->irq_interval_ns;
+        status->irq_coalesce->raised = vq->irq_raised;
+        status->irq_coalesce->coalesced = vq->irq_coalesced;
+        status->irq_coalesce->timer_fired = vq->irq_timer_fired;
+    }
+
     return status;
 }
 
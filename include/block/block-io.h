@@ -237,6 +237,26 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                     int64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
 
+/**
+ * bdrv_co_splice_read:
+ *
+ * Move data from @child into a pipe without copying it into a buffer, so
+ * that the caller can splice it on to a socket.  Only protocol drivers
+ * that read from a file descriptor implement this; like
+ * bdrv_co_copy_range, there is no fallback, and the caller should read
+ * the data as usual after an error.
+ *
+ * @child: Child to read from
+ * @offset: offset in @child to read data
+ * @bytes: maximum number of bytes to move
+ * @pipe_fd: write end of a non-blocking pipe
+ *
+ * Returns: the number of bytes moved, which is less than @bytes if the
+ * pipe filled up; negative error code if failed.
+ **/
+int coroutine_fn bdrv_co_splice_read(BdrvChild *child, int64_t offset,
+                                     int64_t bytes, int pipe_fd);
+
 /**
  * bdrv_drained_end_no_poll:
  *
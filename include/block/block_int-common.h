@@ -35,6 +35,7 @@
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
 #include "qemu/rcu.h"
+#include "qemu/treap.h"
 
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
 
@@ -88,6 +89,10 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    /* Node of bs->tracked_request_tree, keyed by overlap_offset */
+    TreapNode tree_node;
+    int64_t tree_end; /* Highest overlap end in this subtree */
+
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
@@ -585,6 +590,18 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Move up to @bytes of data starting at @offset into the pipe @pipe_fd,
+     * as splice(2) does, without copying it into a buffer.  The pipe is
+     * non-blocking, so less may be moved when it is full.
+     *
+     * See the comment of bdrv_co_splice_read for the return value
+     * semantics.
+     */
+    int coroutine_fn (*bdrv_co_splice_read)(BlockDriverState *bs,
+                                            int64_t offset, int64_t bytes,
+                                            int pipe_fd);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -1193,6 +1210,12 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    /*
+     * The same requests in a treap that also tracks the highest overlap
+     * end of every subtree, so that conflicts can be looked up without
+     * walking all of them.
+     */
+    Treap tracked_request_tree;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -1239,6 +1262,7 @@ extern BlockDriver bdrv_raw;
 extern BlockDriver bdrv_qcow2;
 
 extern unsigned int bdrv_drain_all_count;
+extern const TreapOps bdrv_tracked_request_tree_ops;
 extern QemuOptsList bdrv_create_opts_simple;
 
 /*
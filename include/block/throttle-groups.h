@@ -49,6 +49,13 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* I/O accounted for in the group in advance, see throttle_grant().
+     * Only used in aio_context, and filled or returned with the
+     * ThrottleGroup lock held.
+     */
+    ThrottleGrant  grants[2];
+    unsigned       grant_generation[2];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -81,6 +81,15 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * With mapped-ram, bitmap of the pages present in the migration file
+     * (source side only), and the file offsets of the bitmap and of the
+     * page region of this block.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
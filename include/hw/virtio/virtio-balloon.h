@@ -64,6 +64,15 @@ struct VirtIOBalloon {
      * stopped.
      */
     bool block_iothread;
+    /* Processes free page reports in the iothread, if one is set */
+    QEMUBH *reporting_bh;
+    /*
+     * Held by the iothread while it processes a batch of free page reports;
+     * reporting_blocked is set while the VM is stopped or the driver is not
+     * ready.
+     */
+    QemuMutex reporting_lock;
+    bool reporting_blocked;
     NotifierWithReturn free_page_hint_notify;
     int64_t stats_last_update;
     int64_t stats_poll_interval;
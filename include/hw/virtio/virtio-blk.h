@@ -46,6 +46,8 @@ struct VirtIOBlkConf
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
     bool x_enable_wce_if_config_wce;
+    uint16_t x_pop_batch;
+    bool x_pop_stats;
 };
 
 struct VirtIOBlockDataPlane;
@@ -66,6 +68,9 @@ struct VirtIOBlock {
     uint64_t host_features;
     size_t config_size;
     BlockRAMRegistrar blk_ram_registrar;
+    /* Host ticks spent popping requests, and their number (x-pop-stats) */
+    uint64_t pop_ticks;
+    uint64_t pop_requests;
 };
 
 typedef struct VirtIOBlockReq {
@@ -24,6 +24,8 @@
 OBJECT_DECLARE_TYPE(VirtIOMEM, VirtIOMEMClass,
                     VIRTIO_MEM)
 
+typedef struct VirtIOMEMPlugJob VirtIOMEMPlugJob;
+
 #define VIRTIO_MEM_MEMDEV_PROP "memdev"
 #define VIRTIO_MEM_NODE_PROP "node"
 #define VIRTIO_MEM_SIZE_PROP "size"
@@ -74,6 +76,14 @@ struct VirtIOMEM {
     /* whether to prealloc memory when plugging new blocks */
     bool prealloc;
 
+    /*
+     * Plug request that is preallocating memory outside the BQL, if any.
+     * Further requests are only processed once it completed.
+     */
+    VirtIOMEMPlugJob *plug_job;
+    QEMUBH *plug_bh;
+    VMChangeStateEntry *vmstate_change;
+
     /* notifiers to notify when "size" changes */
     NotifierList size_change_notifiers;
 
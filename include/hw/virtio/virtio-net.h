@@ -154,6 +154,9 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Used ring entries filled but not flushed by virtio_net_receive_batch */
+    bool rx_batching;
+    unsigned int rx_batch_filled;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
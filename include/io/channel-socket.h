@@ -49,6 +49,14 @@ struct QIOChannelSocket {
     socklen_t remoteAddrLen;
     ssize_t zero_copy_queued;
     ssize_t zero_copy_sent;
+    /*
+     * Completions reaped since the last qio_channel_flush(), which may be
+     * reaped without it by qio_channel_socket_zero_copy_reap() or readv
+     * and writev: zero_copy_sent at the last flush, and whether any of
+     * the writes completed since then really avoided a copy.
+     */
+    ssize_t zero_copy_flushed;
+    bool zero_copy_used;
 
     struct UnixSocketAddress sendtoDgramAddr;
     struct UnixSocketAddress recvfromDgramAddr;
@@ -266,6 +274,35 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Try to enable zero copy writes on a connected socket, such as
+ * one returned by qio_channel_socket_accept(). On success the
+ * channel gains QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.
+ *
+ * Returns: true if zero copy writes are available, false otherwise
+ */
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+
+/**
+ * qio_channel_socket_zero_copy_reap:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Collect the completion notifications of zero copy writes
+ * that are already available, without waiting for the others
+ * like qio_channel_flush() does. Afterwards the buffers of the
+ * first @ioc->zero_copy_sent zero copy writes may be reused.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                      Error **errp);
+
+
 void qio_channel_socket_set_dgram_send_address(QIOChannelSocket *ioc,
                                                  const struct UnixSocketAddress *un_addr);
 
@@ -33,6 +33,11 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 #define QIO_CHANNEL_ERR_BLOCK -2
 
 #define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+/*
+ * With QIO_CHANNEL_WRITE_FLAG_ZERO_COPY: copy the data as usual instead
+ * of failing when the pages cannot be pinned
+ */
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK 0x2
 
 typedef enum QIOChannelFeature QIOChannelFeature;
 
@@ -49,6 +49,9 @@ typedef int (NetLoad)(NetClientState *);
 typedef void (NetStop)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const struct iovec *, int);
+typedef struct NetPacketIOV NetPacketIOV;
+typedef int (NetReceiveIOVBatch)(NetClientState *, const NetPacketIOV *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -67,12 +70,25 @@ typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
 typedef bool (NetCheckPeerType)(NetClientState *, ObjectClass *, Error **);
 
+struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
+};
+
 typedef struct NetClientInfo {
     NetClientDriver type;
     size_t size;
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /*
+     * Optional: receive up to @count single-buffer packets at once and
+     * return how many were consumed.  The remaining ones are delivered
+     * one by one through the regular path.
+     */
+    NetReceiveBatch *receive_batch;
+    /* Same for packets made of several buffers, see NetPacketIOV */
+    NetReceiveIOVBatch *receive_iov_batch;
     NetCanReceive *can_receive;
     NetStart *start;
     NetLoad *load;
@@ -174,6 +190,11 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc,
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_send_packet_batch_async(NetClientState *nc, const struct iovec *pkts,
+                                 int count, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch_async(NetClientState *nc,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
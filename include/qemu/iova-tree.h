@@ -145,6 +145,8 @@ void iova_tree_foreach(IOVATree *tree, iova_tree_iterator iterator);
  * @iova_end: the maximum addressable direction of the allocation
  *
  * Allocates a new region of a given size, between iova_min and iova_max.
+ * The lowest free range that fits is used, and it is found in
+ * O(log n) on the number of mappings.
  *
  * Return: Same as iova_tree_insert, but cannot overlap and can return error if
  * iova tree is out of free contiguous range. The caller gets the assigned iova
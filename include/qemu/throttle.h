@@ -99,6 +99,22 @@ typedef struct ThrottleState {
     int64_t previous_leak;    /* timestamp of the last leak done */
 } ThrottleState;
 
+/* I/O that has been accounted in a ThrottleState in advance, so that it can
+ * be handed out to requests without accessing the ThrottleState.
+ */
+typedef struct ThrottleGrant {
+    bool active;
+    bool limit_units;         /* whether units is a limit */
+    bool limit_size;          /* whether size is a limit */
+    double units;             /* operations left */
+    double size;              /* bytes left */
+    double granted_units;     /* operations accounted by throttle_grant() */
+    double granted_size;      /* bytes accounted by throttle_grant() */
+    uint64_t op_size;         /* size of an operation in bytes */
+    int64_t start;            /* timestamp of the throttle_grant() call */
+    int64_t period_ns;        /* time after which the grant has expired */
+} ThrottleGrant;
+
 typedef struct ThrottleTimers {
     QEMUTimer *timers[2];     /* timers used to do the throttling */
     QEMUClockType clock_type; /* the clock used */
@@ -152,6 +168,12 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              bool is_write);
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+bool throttle_grant(ThrottleState *ts, bool is_write, int64_t now,
+                    int64_t period_ns, ThrottleGrant *grant);
+bool throttle_grant_consume(ThrottleGrant *grant, int64_t now, uint64_t size);
+void throttle_return_grant(ThrottleState *ts, bool is_write, int64_t now,
+                           ThrottleGrant *grant);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
@@ -0,0 +1,59 @@
+/*
+ * Augmented treap
+ *
+ * An intrusive binary search tree that is kept balanced by giving every
+ * node a random priority.  Users embed a TreapNode in their own struct
+ * and can keep data about whole subtrees in it (for example the largest
+ * value of a field), which the treap recomputes with an update callback
+ * whenever the children of a node change.  Lookups walk the nodes
+ * directly, so that they can use that data to skip subtrees.
+ *
+ * Keys must be unique: the order must never consider two different
+ * nodes equal.
+ *
+ * The treap does not provide any thread protection.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_TREAP_H
+#define QEMU_TREAP_H
+
+typedef struct TreapNode {
+    struct TreapNode *left;
+    struct TreapNode *right;
+    uint32_t prio;
+} TreapNode;
+
+typedef struct TreapOps {
+    /* Whether @a sorts before @b */
+    bool (*before)(const TreapNode *a, const TreapNode *b);
+    /* Recompute the data of @node from @node itself and its children */
+    void (*update)(TreapNode *node);
+} TreapOps;
+
+typedef struct Treap {
+    TreapNode *root;
+    const TreapOps *ops;
+    uint32_t seed;
+} Treap;
+
+/* The struct of type @type that embeds @node as @field, NULL for NULL */
+#define treap_entry(node, type, field) \
+    ((node) ? container_of(node, type, field) : NULL)
+
+void treap_init(Treap *treap, const TreapOps *ops);
+
+/* Add @node, which must not be in the treap already */
+void treap_insert(Treap *treap, TreapNode *node);
+
+/*
+ * Take @node out of the treap.  Its key must not have changed since it
+ * was inserted.
+ */
+void treap_remove(Treap *treap, TreapNode *node);
+
+/* Call @func for every node, children first, e.g. to free them */
+void treap_foreach_post_order(Treap *treap, void (*func)(TreapNode *node));
+
+#endif
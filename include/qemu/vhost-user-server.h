@@ -25,6 +25,10 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    /* Queue context and lock, NULL if handled in VuServer->ctx */
+    AioContext *ctx;
+    QemuRecMutex *lock;
+    bool removed; /* protected by lock */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -32,7 +36,8 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, unless
+ * vhost_user_server_set_queue_contexts() moves the kicks to other ones.
  */
 typedef struct {
     QIONetListener *listener;
@@ -41,13 +46,27 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
-    /* Protected by ctx lock */
+    /*
+     * Queue contexts, see vhost_user_server_set_queue_contexts().  Each
+     * has a lock, held while one of its queues is processed and by the
+     * vhost-user message handling, which must not race with them.
+     */
+    AioContext **queue_ctx;
+    QemuRecMutex *queue_lock;
+    unsigned int num_queue_ctx;
+    bool queues_locked;
+    bool queues_paused; /* protected by all queue locks */
+
+    /* Accessed atomically, queue contexts take references too */
     unsigned int refcount;
     bool wait_idle;
+
+    /* Protected by ctx lock */
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
     QIOChannelSocket *sioc; /* The underlying data channel with the client */
-    QTAILQ_HEAD(, VuFdWatch) vu_fd_watches;
+    QemuMutex watches_lock;
+    QTAILQ_HEAD(, VuFdWatch) vu_fd_watches; /* protected by watches_lock */
 
     Coroutine *co_trip; /* coroutine for processing VhostUserMsg */
 } VuServer;
@@ -67,4 +86,13 @@ void vhost_user_server_unref(VuServer *server);
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
+void vhost_user_server_set_queue_contexts(VuServer *server,
+                                          AioContext **ctxs,
+                                          unsigned int num_ctxs);
+AioContext *vhost_user_server_queue_context(VuServer *server, int qidx);
+void vhost_user_server_queue_lock(VuServer *server, int qidx);
+void vhost_user_server_queue_unlock(VuServer *server, int qidx);
+void vhost_user_server_pause_queues(VuServer *server);
+void vhost_user_server_resume_queues(VuServer *server);
+
 #endif /* VHOST_USER_SERVER_H */
@@ -64,6 +64,8 @@ qio_channel_socket_new(void)
     sioc->fd = -1;
     sioc->zero_copy_queued = 0;
     sioc->zero_copy_sent = 0;
+    sioc->zero_copy_flushed = 0;
+    sioc->zero_copy_used = false;
 
     ioc = QIO_CHANNEL(sioc);
     qio_channel_set_feature(ioc, QIO_CHANNEL_FEATURE_SHUTDOWN);
@@ -163,17 +165,26 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
+    qio_channel_socket_enable_zero_copy(ioc);
+
+    return 0;
+}
+
+
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
 #ifdef QEMU_MSG_ZEROCOPY
     int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
+    ret = setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
     if (ret == 0) {
         /* Zero copy available on host */
         qio_channel_set_feature(QIO_CHANNEL(ioc),
                                 QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        return true;
     }
 #endif
 
-    return 0;
+    return false;
 }
 
 
@@ -568,6 +579,14 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     ret = recvmsg(sioc->fd, &msg, sflags);
     if (ret < 0) {
         if (errno == EAGAIN) {
+            /*
+             * Pending zero copy notifications make the socket poll
+             * as G_IO_ERR, which wakes up readers too; drain them so
+             * that the caller does not spin.
+             */
+            if (sioc->zero_copy_queued != sioc->zero_copy_sent) {
+                qio_channel_socket_zero_copy_reap(sioc, NULL);
+            }
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
@@ -612,6 +631,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     size_t fdsize = sizeof(int) * nfds;
     struct cmsghdr *cmsg;
     int sflags = 0;
+    bool zero_copy = false;
     struct sockaddr_un addr;
     size_t addr_len;
 
@@ -641,6 +661,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
 #ifdef QEMU_MSG_ZEROCOPY
         sflags = MSG_ZEROCOPY;
+        zero_copy = true;
 #else
         /*
          * We expect QIOChannel class entry point to have
@@ -665,10 +686,21 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     if (ret <= 0) {
         switch (errno) {
         case EAGAIN:
+            /* See qio_channel_socket_readv() */
+            if (sioc->zero_copy_queued != sioc->zero_copy_sent) {
+                qio_channel_socket_zero_copy_reap(sioc, NULL);
+            }
             return QIO_CHANNEL_ERR_BLOCK;
         case EINTR:
             goto retry;
         case ENOBUFS:
+            if (zero_copy &&
+                flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK) {
+                /* MSG_ZEROCOPY is the only flag we pass */
+                sflags = 0;
+                zero_copy = false;
+                goto retry;
+            }
             if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
                 error_setg_errno(errp, errno,
                                  "Process can't lock enough memory for using MSG_ZEROCOPY");
@@ -687,7 +719,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         return -1;
     }
 
-    if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+    if (zero_copy) {
         sioc->zero_copy_queued++;
     }
 
@@ -782,16 +814,22 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+/*
+ * Count the zero copy writes whose completion has been reported on the
+ * socket's error queue.  If @block is false, stop as soon as the error
+ * queue is empty instead of waiting for all queued writes.  Whether the
+ * writes were copied is recorded for qio_channel_socket_flush().
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int qio_channel_socket_reap(QIOChannelSocket *sioc, bool block,
+                                   Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
     char control[CMSG_SPACE(sizeof(*serr))];
     int received;
-    int ret;
 
     if (sioc->zero_copy_queued == sioc->zero_copy_sent) {
         return 0;
@@ -801,15 +839,16 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     msg.msg_controllen = sizeof(control);
     memset(control, 0, sizeof(control));
 
-    ret = 1;
-
     while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
         received = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
         if (received < 0) {
             switch (errno) {
             case EAGAIN:
+                if (!block) {
+                    return 0;
+                }
                 /* Nothing on errqueue, wait until something is available */
-                qio_channel_wait(ioc, G_IO_ERR);
+                qio_channel_wait(QIO_CHANNEL(sioc), G_IO_ERR);
                 continue;
             case EINTR:
                 continue;
@@ -843,15 +882,47 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
         /* No errors, count successfully finished sendmsg()*/
         sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
 
-        /* If any sendmsg() succeeded using zero copy, return 0 at the end */
+        /* If any sendmsg() succeeded using zero copy, flush returns 0 */
         if (serr->ee_code != SO_EE_CODE_ZEROCOPY_COPIED) {
-            ret = 0;
+            sioc->zero_copy_used = true;
         }
     }
 
+    return 0;
+}
+
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    int ret;
+
+    if (qio_channel_socket_reap(sioc, true, errp) < 0) {
+        return -1;
+    }
+
+    /* Also covers the completions reaped since the last flush */
+    ret = sioc->zero_copy_sent != sioc->zero_copy_flushed &&
+          !sioc->zero_copy_used;
+    sioc->zero_copy_flushed = sioc->zero_copy_sent;
+    sioc->zero_copy_used = false;
     return ret;
 }
 
+int qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                      Error **errp)
+{
+    return qio_channel_socket_reap(ioc, false, errp);
+}
+
+#else /* QEMU_MSG_ZEROCOPY */
+
+int qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                      Error **errp)
+{
+    return 0;
+}
+
 #endif /* QEMU_MSG_ZEROCOPY */
 
 static int
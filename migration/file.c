@@ -0,0 +1,126 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * The migration stream is written to, or read from, a regular file.
+ * With mapped-ram, RAM pages are accessed at fixed offsets of the file
+ * through a separate descriptor, that may be opened with O_DIRECT.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+#define FILE_RAM_CHANNEL "ram-channel"
+
+/*
+ * Open the descriptor used for RAM pages, and keep it as a child of
+ * the stream channel so that both share the same lifetime.
+ */
+static int file_open_ram_channel(QIOChannelFile *fioc, const char *filename,
+                                 int flags, Error **errp)
+{
+    QIOChannelFile *ram_ioc;
+
+    if (!migrate_mapped_ram() || !migrate_direct_io()) {
+        return 0;
+    }
+
+#ifdef O_DIRECT
+    ram_ioc = qio_channel_file_new_path(filename, flags | O_DIRECT, 0, errp);
+    if (!ram_ioc) {
+        return -1;
+    }
+    object_property_add_child(OBJECT(fioc), FILE_RAM_CHANNEL,
+                              OBJECT(ram_ioc));
+    object_unref(OBJECT(ram_ioc));
+    return 0;
+#else
+    error_setg(errp, "direct-io is not supported on this host");
+    return -1;
+#endif
+}
+
+/**
+ * file_ram_fd: get the descriptor for RAM page I/O
+ *
+ * Returns the O_DIRECT descriptor if direct-io was requested, the one
+ * of @ioc otherwise, or -1 if @ioc is not a file channel.
+ *
+ * @ioc: the channel of the migration stream
+ * @errp: pointer to an error
+ */
+int file_ram_fd(QIOChannel *ioc, Error **errp)
+{
+    Object *ram_ioc;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "mapped-ram requires a file migration channel");
+        return -1;
+    }
+
+    ram_ioc = object_resolve_path_component(OBJECT(ioc), FILE_RAM_CHANNEL);
+    if (ram_ioc) {
+        return QIO_CHANNEL_FILE(ram_ioc)->fd;
+    }
+    return QIO_CHANNEL_FILE(ioc)->fd;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+    int flags = O_CREAT | O_TRUNC | O_WRONLY;
+
+    trace_migration_file_outgoing(filename);
+
+    fioc = qio_channel_file_new_path(filename, flags, 0600, errp);
+    if (!fioc) {
+        return;
+    }
+    if (file_open_ram_channel(fioc, filename, O_WRONLY, errp)) {
+        object_unref(OBJECT(fioc));
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+    if (file_open_ram_channel(fioc, filename, O_RDONLY, errp)) {
+        object_unref(OBJECT(fioc));
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
@@ -0,0 +1,532 @@
+/*
+ * Multifd XBZRLE compression implementation
+ *
+ * Each send channel delta-encodes its pages against a page cache that
+ * is sharded by page index, so that channels only contend when they
+ * happen to touch the same shard.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "cgs.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Every page of the payload is preceded by a big endian 32-bit header.
+ * The header is either one of the flags below, or the length of the
+ * XBZRLE encoded data that follows it.  A length of 0 means that the
+ * page did not change since it was last sent.
+ */
+#define XBZRLE_PAGE_RAW  (1U << 31)
+#define XBZRLE_PAGE_ZERO (1U << 30)
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} XBZRLEShard;
+
+static struct {
+    XBZRLEShard *shards;
+    unsigned int nshards;
+    /* size of the cache of every shard, in pages */
+    uint64_t shard_pages;
+    /* number of send channels using the shards */
+    unsigned int users;
+    /* serializes updates of xbzrle_counters */
+    QemuMutex stats_lock;
+} xbzrle_shared;
+
+struct xbzrle_data {
+    /* payload buffer, headers and page data */
+    uint8_t *buf;
+    /* size of payload buffer */
+    uint32_t buf_len;
+    /* snapshot of the page being encoded */
+    uint8_t *page;
+};
+
+static XBZRLEShard *xbzrle_shard(ram_addr_t addr, uint64_t *key)
+{
+    uint64_t page = addr >> qemu_target_page_bits();
+    unsigned int n = xbzrle_shared.nshards;
+
+    /* key is unique within its shard, and consecutive for the cache hash */
+    *key = (page / n) << qemu_target_page_bits();
+    return &xbzrle_shared.shards[page % n];
+}
+
+static void xbzrle_shards_free(void)
+{
+    for (unsigned int i = 0; i < xbzrle_shared.nshards; i++) {
+        XBZRLEShard *shard = &xbzrle_shared.shards[i];
+
+        if (shard->cache) {
+            cache_fini(shard->cache);
+        }
+        qemu_mutex_destroy(&shard->lock);
+    }
+    g_free(xbzrle_shared.shards);
+    xbzrle_shared.shards = NULL;
+    xbzrle_shared.nshards = 0;
+    xbzrle_shared.shard_pages = 0;
+    qemu_mutex_destroy(&xbzrle_shared.stats_lock);
+}
+
+/*
+ * The shards split @cache_size between them, one shard per channel.
+ * Each shard is rounded down to a power of two number of pages, as
+ * required by the page cache.
+ *
+ * Returns the number of pages of every shard, or 0 for error
+ */
+static uint64_t xbzrle_shard_pages(uint64_t cache_size, unsigned int n,
+                                   Error **errp)
+{
+    uint64_t shard_pages = cache_size / qemu_target_page_size() / n;
+
+    if (!shard_pages) {
+        error_setg(errp, "xbzrle cache size is smaller than one page "
+                   "per multifd channel");
+        return 0;
+    }
+    return pow2floor(shard_pages);
+}
+
+static int xbzrle_shards_init(Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    unsigned int n = migrate_multifd_channels();
+    uint64_t shard_pages = xbzrle_shard_pages(migrate_xbzrle_cache_size(),
+                                              n, errp);
+
+    if (!shard_pages) {
+        return -1;
+    }
+
+    qemu_mutex_init(&xbzrle_shared.stats_lock);
+    xbzrle_shared.shards = g_new0(XBZRLEShard, n);
+    xbzrle_shared.nshards = n;
+    xbzrle_shared.shard_pages = shard_pages;
+    for (unsigned int i = 0; i < n; i++) {
+        XBZRLEShard *shard = &xbzrle_shared.shards[i];
+
+        qemu_mutex_init(&shard->lock);
+        shard->cache = cache_init(shard_pages * page_size, page_size, errp);
+        if (!shard->cache) {
+            xbzrle_shards_free();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * multifd_xbzrle_cache_resize: resize the page cache shards
+ *
+ * Called from the main thread, like the setup and cleanup of the send
+ * channels, when xbzrle-cache-size changes.  The shards of a running
+ * migration are replaced by empty ones of the new size, so the pages
+ * that they held are sent raw the next time.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @new_size: new size of the whole cache
+ * @errp: pointer to an error
+ */
+int multifd_xbzrle_cache_resize(uint64_t new_size, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t shard_pages;
+
+    if (!xbzrle_shared.users) {
+        /* the next migration sizes the shards from the parameter */
+        return 0;
+    }
+
+    shard_pages = xbzrle_shard_pages(new_size, xbzrle_shared.nshards, errp);
+    if (!shard_pages) {
+        return -1;
+    }
+    if (shard_pages == xbzrle_shared.shard_pages) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < xbzrle_shared.nshards; i++) {
+        XBZRLEShard *shard = &xbzrle_shared.shards[i];
+        PageCache *new_cache, *old_cache;
+
+        new_cache = cache_init(shard_pages * page_size, page_size, errp);
+        if (!new_cache) {
+            return -1;
+        }
+
+        qemu_mutex_lock(&shard->lock);
+        old_cache = shard->cache;
+        shard->cache = new_cache;
+        qemu_mutex_unlock(&shard->lock);
+        cache_fini(old_cache);
+    }
+    xbzrle_shared.shard_pages = shard_pages;
+    return 0;
+}
+
+/* Multifd xbzrle compression */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Allocate the payload buffer of the channel.  The first channel also
+ * creates the shared page cache shards.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *z;
+
+    if (!xbzrle_shared.users && xbzrle_shards_init(errp)) {
+        return -1;
+    }
+    xbzrle_shared.users++;
+
+    z = g_new0(struct xbzrle_data, 1);
+    /* worst case every page is sent raw */
+    z->buf_len = (MULTIFD_PACKET_SIZE / page_size) * (page_size + 4);
+    z->buf = g_try_malloc(z->buf_len);
+    z->page = g_try_malloc(page_size);
+    p->data = z;
+    if (!z->buf || !z->page) {
+        error_setg(errp, "multifd %u: out of memory for xbzrle buffers",
+                   p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Return the memory of the channel.  The last channel also frees the
+ * page cache shards.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+
+    if (z) {
+        g_free(z->buf);
+        g_free(z->page);
+        g_free(z);
+        p->data = NULL;
+    }
+    if (xbzrle_shared.users && !--xbzrle_shared.users) {
+        xbzrle_shards_free();
+    }
+}
+
+/*
+ * Encode one page at @out, which has room for a header and a full page.
+ * Called with the shard lock held.
+ *
+ * Returns the number of bytes written to @out.
+ */
+static uint32_t xbzrle_encode_page(PageCache *cache, uint64_t key,
+                                   const uint8_t *page, uint8_t *out,
+                                   uint64_t age, XBZRLECacheStats *stats)
+{
+    size_t page_size = qemu_target_page_size();
+    uint8_t *prev;
+    int len;
+
+    if (buffer_is_zero(page, page_size)) {
+        /* keep the cache in sync with the zeroed page on the destination */
+        if (cache_is_cached(cache, key, age)) {
+            memset(get_cached_data(cache, key), 0, page_size);
+        }
+        stl_be_p(out, XBZRLE_PAGE_ZERO);
+        return 4;
+    }
+
+    if (!cache_is_cached(cache, key, age)) {
+        stats->cache_miss++;
+        /* a failed insert only means that the page stays uncached */
+        cache_insert(cache, key, page, age);
+        goto raw;
+    }
+
+    stats->pages++;
+    prev = get_cached_data(cache, key);
+    len = xbzrle_encode_buffer(prev, page, page_size, out + 4, page_size);
+    if (len == -1) {
+        stats->overflow++;
+        memcpy(prev, page, page_size);
+        goto raw;
+    }
+    if (len) {
+        memcpy(prev, page, page_size);
+    }
+    stats->bytes += len + 4;
+    stl_be_p(out, len);
+    return len + 4;
+
+raw:
+    stl_be_p(out, XBZRLE_PAGE_RAW);
+    memcpy(out + 4, page, page_size);
+    return page_size + 4;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Delta encode every normal page against the cached copy of its last
+ * sent contents.  Pages that were not cached are inserted in the cache
+ * and sent raw.  Zero pages detected by the multifd core only need the
+ * cache to be updated, as they carry no payload.
+ *
+ * Without multifd-zero-page, the core does not look for zero pages and
+ * passes all of them as normal pages; they are only found here, so the
+ * pages are accounted here instead of by the core.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    RAMBlock *block = p->pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = ram_counters.dirty_sync_count;
+    XBZRLECacheStats stats = {};
+    uint32_t out_size = 0;
+    uint32_t zero_num = 0;
+    uint64_t key;
+    uint32_t i;
+    int ret;
+
+    if (multifd_pages_is_private(p->pages)) {
+        ret = cgs_mig_multifd_send_prepare(p, errp);
+        if (ret) {
+            return ret;
+        }
+        p->flags |= MULTIFD_FLAG_PRIVATE;
+        return 0;
+    }
+
+    for (i = 0; i < p->zero_num; i++) {
+        XBZRLEShard *shard = xbzrle_shard(block->offset + p->zero[i], &key);
+
+        qemu_mutex_lock(&shard->lock);
+        if (cache_is_cached(shard->cache, key, age)) {
+            memset(get_cached_data(shard->cache, key), 0, page_size);
+        }
+        qemu_mutex_unlock(&shard->lock);
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        XBZRLEShard *shard = xbzrle_shard(block->offset + p->normal[i], &key);
+        uint32_t len;
+
+        /*
+         * The guest may be writing to the page, so encode and cache the
+         * same snapshot of it.
+         */
+        memcpy(z->page, block->host + p->normal[i], page_size);
+
+        qemu_mutex_lock(&shard->lock);
+        len = xbzrle_encode_page(shard->cache, key, z->page,
+                                 z->buf + out_size, age, &stats);
+        qemu_mutex_unlock(&shard->lock);
+
+        if (ldl_be_p(z->buf + out_size) == XBZRLE_PAGE_ZERO) {
+            zero_num++;
+        }
+        out_size += len;
+    }
+
+    if (!migrate_multifd_zero_page()) {
+        p->acct_normal_pages += p->normal_num - zero_num;
+        p->acct_zero_pages += zero_num;
+    }
+
+    if (stats.pages || stats.cache_miss) {
+        qemu_mutex_lock(&xbzrle_shared.stats_lock);
+        xbzrle_counters.pages += stats.pages;
+        xbzrle_counters.cache_miss += stats.cache_miss;
+        xbzrle_counters.overflow += stats.overflow;
+        xbzrle_counters.bytes += stats.bytes;
+        qemu_mutex_unlock(&xbzrle_shared.stats_lock);
+    }
+
+    p->iov[p->iovs_num].iov_base = z->buf;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the payload buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *z = g_new0(struct xbzrle_data, 1);
+
+    p->data = z;
+    z->buf_len = (MULTIFD_PACKET_SIZE / page_size) * (page_size + 4);
+    z->buf = g_try_malloc(z->buf_len);
+    if (!z->buf) {
+        error_setg(errp, "multifd %u: out of memory for xbzrle buffer", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Return the memory of the channel.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *z = p->data;
+
+    g_free(z->buf);
+    g_free(z);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the payload, and copy or delta-decode every page in place.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (p->flags & MULTIFD_FLAG_PRIVATE) {
+        return cgs_mig_multifd_recv_pages(p, errp);
+    }
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > z->buf_len) {
+        error_setg(errp, "multifd %u: packet size %u larger than buffer %u",
+                   p->id, in_size, z->buf_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *host = p->host + p->normal[i];
+        uint32_t hdr;
+
+        if (in_size - pos < 4) {
+            goto truncated;
+        }
+        hdr = ldl_be_p(z->buf + pos);
+        pos += 4;
+
+        if (hdr == XBZRLE_PAGE_ZERO) {
+            if (!buffer_is_zero(host, page_size)) {
+                memset(host, 0, page_size);
+            }
+        } else if (hdr == XBZRLE_PAGE_RAW) {
+            if (in_size - pos < page_size) {
+                goto truncated;
+            }
+            memcpy(host, z->buf + pos, page_size);
+            pos += page_size;
+        } else {
+            if (hdr > page_size || in_size - pos < hdr) {
+                goto truncated;
+            }
+            if (hdr &&
+                xbzrle_decode_buffer(z->buf + pos, hdr, host, page_size) < 0) {
+                error_setg(errp, "multifd %u: failed to decode xbzrle page "
+                           "at offset " RAM_ADDR_FMT, p->id, p->normal[i]);
+                return -1;
+            }
+            pos += hdr;
+        }
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %u: truncated xbzrle packet", p->id);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -11,6 +11,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -34,6 +35,8 @@
 
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
+/* Packets that may describe zero pages, see MultiFDPacket_t.zero_pages */
+#define MULTIFD_VERSION_ZERO_PAGE 2
 
 typedef struct {
     uint32_t magic;
@@ -79,13 +82,13 @@ static int nocomp_send_prepare_shared(MultiFDSendParams *p, Error **errp)
     MultiFDPages_t *pages = p->pages;
     size_t page_size = qemu_target_page_size();
 
-    for (int i = 0; i < pages->num; i++) {
-        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
+    for (int i = 0; i < p->normal_num; i++) {
+        p->iov[p->iovs_num].iov_base = pages->block->host + p->normal[i];
         p->iov[p->iovs_num].iov_len = page_size;
         p->iovs_num++;
     }
 
-    p->next_packet_size = pages->num * page_size;
+    p->next_packet_size = p->normal_num * page_size;
     p->flags |= MULTIFD_FLAG_NOCOMP;
     return 0;
 }
@@ -103,11 +106,45 @@ static int nocomp_send_prepare_private(MultiFDSendParams *p, Error **errp)
     return 0;
 }
 
-static inline bool multifd_pages_is_private(MultiFDPages_t *pages)
+bool multifd_pages_is_private(MultiFDPages_t *pages)
 {
     return pages->private_gpa[0] != CGS_PRIVATE_GPA_INVALID;
 }
 
+/* Whether the channel thread checks the (non-empty) @pages for zeroes */
+static bool multifd_pages_check_zero(MultiFDPages_t *pages)
+{
+    /* Private pages are encrypted, their contents can't be checked */
+    return migrate_multifd_zero_page() && !multifd_pages_is_private(pages);
+}
+
+/*
+ * Whether the channel threads account the shared pages that they send:
+ * either the core looks for zero pages, or the xbzrle method finds them
+ * while encoding.
+ */
+bool multifd_send_accounts_pages(void)
+{
+    return migrate_multifd_zero_page() ||
+           migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE;
+}
+
+/*
+ * Add the pages that the channel thread of @p checked for zeroes to the
+ * migration statistics.  Called with p->mutex held.
+ */
+static void multifd_send_account_pages(MultiFDSendParams *p)
+{
+    uint64_t bytes = p->acct_normal_pages * qemu_target_page_size();
+
+    ram_counters.normal += p->acct_normal_pages;
+    ram_counters.duplicate += p->acct_zero_pages;
+    ram_counters.multifd_bytes += bytes;
+    ram_counters.transferred += bytes;
+    p->acct_normal_pages = 0;
+    p->acct_zero_pages = 0;
+}
+
 /**
  * nocomp_send_prepare: prepare date to be able to send
  *
@@ -307,6 +344,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(pages->allocated);
     packet->normal_pages = cpu_to_be32(p->normal_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
 
@@ -314,8 +352,11 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
         strncpy(packet->ramblock, pages->block->idstr, 256);
     }
 
-    for (i = 0; i < pages->num; i++) {
-        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+    for (i = 0; i < p->normal_num; i++) {
+        packet->offset[i] = cpu_to_be64(p->normal[i]);
+    }
+    for (i = 0; i < p->zero_num; i++) {
+        packet->offset[p->normal_num + i] = cpu_to_be64(p->zero[i]);
     }
 }
 
@@ -336,10 +377,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (packet->version != MULTIFD_VERSION &&
+        (packet->version != MULTIFD_VERSION_ZERO_PAGE ||
+         !migrate_multifd_zero_page())) {
         error_setg(errp, "multifd: received packet "
                    "version %u and expected version %u",
-                   packet->version, MULTIFD_VERSION);
+                   packet->version, migrate_multifd_zero_page() ?
+                   MULTIFD_VERSION_ZERO_PAGE : MULTIFD_VERSION);
         return -1;
     }
 
@@ -365,10 +409,22 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if (packet->version == MULTIFD_VERSION_ZERO_PAGE) {
+        p->zero_num = be32_to_cpu(packet->zero_pages);
+    } else {
+        p->zero_num = 0;
+    }
+    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+        error_setg(errp, "multifd: received packet "
+                   "with %u zero pages and expected maximum pages are %u",
+                   p->zero_num, packet->pages_alloc - p->normal_num);
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->normal_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -395,11 +451,48 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
 	ram_load_update_cgs_bmap(block, offset,
                                  p->flags & MULTIFD_FLAG_PRIVATE);
+        ramblock_recv_bitmap_set(block, offset);
+    }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
+
+        if (offset > (block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+
+        p->zero[i] = offset;
+        ram_load_update_cgs_bmap(block, offset, false);
+        ramblock_recv_bitmap_set(block, offset);
     }
 
     return 0;
 }
 
+/*
+ * multifd_recv_zero_pages: clear the pages that the source reported as zero
+ *
+ * Pages that are already zero are not written to, so that untouched
+ * destination memory is not populated needlessly.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    size_t page_size = qemu_target_page_size();
+
+    for (int i = 0; i < p->zero_num; i++) {
+        void *page = p->host + p->zero[i];
+
+        if (!buffer_is_zero(page, page_size)) {
+            memset(page, 0, page_size);
+        }
+    }
+}
+
 struct {
     MultiFDSendParams *params;
     /* Array of shared pages to sent */
@@ -492,6 +585,11 @@ static int multifd_send_pages(QEMUFile *f, MultiFDPages_t *pages)
     transferred = ((uint64_t) pages->num) * qemu_target_page_size()
                 + p->packet_len;
     qemu_file_acct_rate_limit(f, transferred);
+    if (!multifd_pages_is_private(pages) && multifd_send_accounts_pages()) {
+        /* Accounted once the channel thread found the zero pages */
+        transferred = p->packet_len;
+    }
+    multifd_send_account_pages(p);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;
     qemu_mutex_unlock(&p->mutex);
@@ -615,6 +713,8 @@ void multifd_save_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -719,6 +819,10 @@ int multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_pages(p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->shared_packet_num);
 
@@ -731,6 +835,7 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_zero_copy_send = migrate_use_zero_copy_send();
+    size_t page_size = qemu_target_page_size();
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
@@ -753,8 +858,12 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
-            p->normal_num = 0;
 	    MultiFDPages_t *pages = p->pages;
+            bool detect_zero = pages->num && multifd_pages_check_zero(pages);
+
+            p->normal_num = 0;
+            p->zero_num = 0;
+            p->next_packet_size = 0;
 
             if (use_zero_copy_send) {
                 p->iovs_num = 0;
@@ -763,11 +872,23 @@ static void *multifd_send_thread(void *opaque)
             }
 
             for (int i = 0; i < pages->num; i++) {
-                p->normal[p->normal_num] = pages->offset[i];
-                p->normal_num++;
+                ram_addr_t offset = pages->offset[i];
+
+                if (detect_zero &&
+                    buffer_is_zero(pages->block->host + offset, page_size)) {
+                    p->zero[p->zero_num] = offset;
+                    p->zero_num++;
+                } else {
+                    p->normal[p->normal_num] = offset;
+                    p->normal_num++;
+                }
             }
 
-            if (p->normal_num) {
+            /*
+             * Zero pages are passed to send_prepare too, so that methods
+             * keeping state about page contents (xbzrle) can update it.
+             */
+            if (p->normal_num || p->zero_num) {
                 ret = multifd_send_state->ops->send_prepare(p, &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
@@ -778,12 +899,17 @@ static void *multifd_send_thread(void *opaque)
             p->flags = 0;
             p->num_packets++;
             p->total_normal_pages += p->normal_num;
+            p->total_zero_pages += p->zero_num;
+            if (detect_zero) {
+                p->acct_normal_pages += p->normal_num;
+                p->acct_zero_pages += p->zero_num;
+            }
             pages->num = 0;
             pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, p->normal_num, flags,
-                               p->next_packet_size);
+            trace_multifd_send(p->id, packet_num, p->normal_num, p->zero_num,
+                               flags, p->next_packet_size);
 
             if (use_zero_copy_send) {
                 /* Send header first, without zerocopy */
@@ -842,7 +968,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1026,11 +1153,16 @@ int multifd_save_setup(Error **errp)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        if (migrate_multifd_zero_page()) {
+            p->packet->version = cpu_to_be32(MULTIFD_VERSION_ZERO_PAGE);
+        } else {
+            p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        }
         p->name = g_strdup_printf("multifdsend_%d", i);
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, iov_count + 1);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
 
         if (migrate_use_zero_copy_send()) {
             p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
@@ -1139,6 +1271,8 @@ int multifd_load_cleanup(Error **errp)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1227,10 +1361,11 @@ static void *multifd_recv_thread(void *opaque)
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, p->normal_num, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
+                           flags, p->next_packet_size);
         p->num_packets++;
         p->total_normal_pages += p->normal_num;
+        p->total_zero_pages += p->zero_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (p->normal_num) {
@@ -1240,6 +1375,10 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (p->zero_num) {
+            multifd_recv_zero_pages(p);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1255,7 +1394,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1298,6 +1438,7 @@ int multifd_load_setup(Error **errp)
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, iov_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
     }
 
     for (i = 0; i < thread_count; i++) {
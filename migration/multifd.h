@@ -35,6 +35,7 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block,
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
 /* Private pages */
 #define MULTIFD_FLAG_PRIVATE (4 << 1)
 
@@ -52,8 +53,15 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* zero pages, only valid with MULTIFD_VERSION_ZERO_PAGE packets */
+    uint32_t zero_pages;
+    uint32_t unused32[1];  /* Reserved for future use */
+    uint64_t unused64[3];  /* Reserved for future use */
     char ramblock[256];
+    /*
+     * normal_pages offsets, followed by zero_pages offsets.  Zero pages
+     * carry no payload.
+     */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
@@ -70,6 +78,10 @@ typedef struct {
     RAMBlock *block;
 } MultiFDPages_t;
 
+bool multifd_pages_is_private(MultiFDPages_t *pages);
+bool multifd_send_accounts_pages(void);
+int multifd_xbzrle_cache_resize(uint64_t new_size, Error **errp);
+
 typedef struct {
     /* Fields are only written at creating/deletion time */
     /* No lock required for them, they are read only */
@@ -104,6 +116,13 @@ typedef struct {
     uint32_t flags;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /*
+     * Pages of packets checked for zero pages that are not in ram_counters
+     * yet; only the channel thread knows how many of them are zero.  The
+     * xbzrle method adds its pages itself when the core did not check.
+     */
+    uint64_t acct_normal_pages;
+    uint64_t acct_zero_pages;
     /* thread has work to do */
     int pending_job;
     /* array of pages to sent.
@@ -123,6 +142,8 @@ typedef struct {
     uint64_t num_packets;
     /* non zero pages sent through this channel */
     uint64_t total_normal_pages;
+    /* zero pages sent through this channel */
+    uint64_t total_zero_pages;
     /* buffers to send */
     struct iovec *iov;
     /* number of iovs used */
@@ -131,6 +152,10 @@ typedef struct {
     ram_addr_t *normal;
     /* num of non zero pages */
     uint32_t normal_num;
+    /* Pages that are zero */
+    ram_addr_t *zero;
+    /* num of zero pages */
+    uint32_t zero_num;
     /* used for compression methods */
     void *data;
 }  MultiFDSendParams;
@@ -176,12 +201,18 @@ typedef struct {
     uint8_t *host;
     /* non zero pages recv through this channel */
     uint64_t total_normal_pages;
+    /* zero pages recv through this channel */
+    uint64_t total_zero_pages;
     /* buffers to recv */
     struct iovec *iov;
     /* Pages that are not zero */
     ram_addr_t *normal;
     /* num of non zero pages */
     uint32_t normal_num;
+    /* Pages that are zero */
+    ram_addr_t *zero;
+    /* num of zero pages */
+    uint32_t zero_num;
     /* used for de-compression methods */
     void *data;
 } MultiFDRecvParams;
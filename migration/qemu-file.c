@@ -951,3 +951,44 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
 {
     return file->ioc;
 }
+
+/*
+ * Get the position of the stream in the underlying channel, which must
+ * be seekable.  Returns -1 and sets an error on the file on failure.
+ */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    Error *local_err = NULL;
+    off_t off;
+
+    qemu_fflush(f);
+    off = qio_channel_io_seek(f->ioc, 0, SEEK_CUR, &local_err);
+    if (off < 0) {
+        qemu_file_set_error_obj(f, -EINVAL, local_err);
+        return -1;
+    }
+    if (!qemu_file_is_writable(f)) {
+        /* account for data that was read ahead */
+        off -= f->buf_size - f->buf_index;
+    }
+    return off;
+}
+
+/*
+ * Move the stream to offset @off of the underlying channel, which must
+ * be seekable.  Pending writes are flushed and read-ahead data is
+ * dropped.
+ */
+void qemu_set_offset(QEMUFile *f, off_t off)
+{
+    Error *local_err = NULL;
+
+    qemu_fflush(f);
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (qio_channel_io_seek(f->ioc, off, SEEK_SET, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EINVAL, local_err);
+    }
+}
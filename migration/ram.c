@@ -57,6 +57,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "file.h"
 #include "sysemu/runstate.h"
 #include "sysemu/kvm.h"
 
@@ -145,6 +146,11 @@ int xbzrle_cache_resize(uint64_t new_size, Error **errp)
         return -1;
     }
 
+    /* The multifd channels keep their own shards of the cache */
+    if (multifd_xbzrle_cache_resize(new_size, errp)) {
+        return -1;
+    }
+
     if (new_size == migrate_xbzrle_cache_size()) {
         /* nothing to do */
         return 0;
@@ -167,6 +173,18 @@ out:
     return ret;
 }
 
+/*
+ * With the xbzrle multifd compression method the channels encode pages
+ * against their own page cache shards, and the migration thread never
+ * uses XBZRLE.cache.
+ */
+static bool xbzrle_on_main_stream(void)
+{
+    return migrate_use_xbzrle() &&
+           !(migrate_use_multifd() &&
+             migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE);
+}
+
 bool ramblock_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
@@ -323,6 +341,8 @@ struct RAMState {
     QEMUFile *f;
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
+    /* File descriptor for RAM pages, used in 'mapped-ram' migration */
+    int mapped_ram_fd;
     /* Last block that we have visited searching for dirty pages */
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
@@ -1301,6 +1321,185 @@ static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return -1;
 }
 
+/*
+ * Mapped-ram file layout: the stream carries, for each RAMBlock, a
+ * header with the file offsets of a bitmap of the pages present in the
+ * file and of the page region.  Page N of the block is stored at
+ * pages_offset + N * TARGET_PAGE_SIZE, and the stream resumes after the
+ * page region.  The bitmap is written when RAM migration completes.
+ */
+#define MAPPED_RAM_HDR_MAGIC    0x4d52414d /* "MRAM" */
+#define MAPPED_RAM_HDR_VERSION  1
+/* Keep the page regions aligned for O_DIRECT */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+
+static size_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    return BITS_TO_LONGS(length >> TARGET_PAGE_BITS) * sizeof(unsigned long);
+}
+
+static int mapped_ram_pwrite(int fd, const uint8_t *buf, size_t len,
+                             off_t off)
+{
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, off);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int mapped_ram_pread(int fd, uint8_t *buf, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, off);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Write the header of @block to the stream, and reserve space in the
+ * file for its bitmap and pages.
+ */
+static int mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size = mapped_ram_bitmap_size(block->used_length);
+    off_t header_end = qemu_get_offset(f);
+
+    if (header_end < 0) {
+        return -EINVAL;
+    }
+    header_end += 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    block->bitmap_offset = header_end;
+    block->pages_offset = ROUND_UP(header_end + bitmap_size,
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_MAGIC);
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+    return qemu_file_get_error(f);
+}
+
+/* Write the bitmaps of all RAMBlocks in place, then resume the stream */
+static int mapped_ram_write_bitmaps(QEMUFile *f)
+{
+    off_t end = qemu_get_offset(f);
+    RAMBlock *block;
+
+    if (end < 0) {
+        return -EINVAL;
+    }
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        g_autofree unsigned long *le_bmap = bitmap_new(pages);
+
+        bitmap_to_le(le_bmap, block->file_bmap, pages);
+        qemu_set_offset(f, block->bitmap_offset);
+        qemu_put_buffer(f, (uint8_t *)le_bmap,
+                        mapped_ram_bitmap_size(block->used_length));
+    }
+
+    qemu_set_offset(f, end);
+    return qemu_file_get_error(f);
+}
+
+/**
+ * ram_save_mapped_ram_bitmaps: write the mapped-ram file bitmaps
+ *
+ * Used by background snapshot, which never runs ram_save_complete().
+ * Does nothing unless the mapped-ram capability is enabled.
+ *
+ * Returns zero on success, negative on error.
+ *
+ * @f: QEMUFile the RAM has been saved to
+ */
+int ram_save_mapped_ram_bitmaps(QEMUFile *f)
+{
+    if (!migrate_mapped_ram()) {
+        return 0;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    return mapped_ram_write_bitmaps(f);
+}
+
+/**
+ * ram_save_mapped_page: write a page at its offset of the migration file
+ *
+ * Zero pages are not written, their bit in the file bitmap is cleared
+ * instead as the destination starts from zeroed memory.
+ *
+ * The page is written synchronously by the migration thread, one pwrite()
+ * per page; unlike loading, saving does not use the multifd channels yet.
+ * Handing pages to them must keep background snapshots consistent: a page
+ * has to be in the file before ram_save_release_protection() lets the
+ * guest write to it again, and all of them before the bitmaps are written.
+ *
+ * Returns the number of pages written, or negative on error.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int ram_save_mapped_page(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    uint8_t *p = block->host + offset;
+    int ret;
+
+    if (pss->cgs_private_gpa != CGS_PRIVATE_GPA_INVALID) {
+        error_report("mapped-ram does not support private guest memory");
+        return -EINVAL;
+    }
+
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        clear_bit(pss->page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    ret = mapped_ram_pwrite(rs->mapped_ram_fd, p, TARGET_PAGE_SIZE,
+                            block->pages_offset + offset);
+    if (ret < 0) {
+        error_report("Failed to write page " RAM_ADDR_FMT " of %s to the "
+                     "migration file: %s", offset, block->idstr,
+                     strerror(-ret));
+        return ret;
+    }
+    set_bit(pss->page, block->file_bmap);
+    ram_counters.normal++;
+    ram_transferred_add(TARGET_PAGE_SIZE);
+    return 1;
+}
+
 /*
  * @pages: the number of pages written by the control path,
  *        < 0 - error
@@ -1422,7 +1621,8 @@ static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
 
     if (private_gpa != CGS_PRIVATE_GPA_INVALID) {
         ram_counters.cgs_private_pages++;
-    } else {
+    } else if (!multifd_send_accounts_pages()) {
+        /* Otherwise the channel thread tells normal and zero pages apart */
         ram_counters.normal++;
     }
 
@@ -1631,7 +1831,7 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
             pss->complete_round = true;
             rs->cgs_start_epoch = true;
             /* After the first round, enable XBZRLE. */
-            if (migrate_use_xbzrle()) {
+            if (xbzrle_on_main_stream()) {
                 rs->xbzrle_enabled = true;
             }
         }
@@ -2369,6 +2569,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
     int res;
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, pss);
+    }
+
     if (pss->cgs_private_gpa != CGS_PRIVATE_GPA_INVALID) {
         if (migrate_use_multifd() && !migration_in_postcopy())
             return ram_save_multifd_page(rs, block, offset,
@@ -2384,6 +2588,20 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    /*
+     * With multifd-zero-page the multifd send threads check for zero
+     * pages, so keep buffer_is_zero() off the migration thread.  The
+     * xbzrle method does the same, as it must keep its page cache in
+     * sync with zeroed pages.
+     */
+    if (migrate_use_multifd() &&
+        (migrate_multifd_zero_page() ||
+         migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE) &&
+        !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset,
+                                     CGS_PRIVATE_GPA_INVALID);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2852,6 +3070,11 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
     }
 
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+
     xbzrle_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
@@ -3106,7 +3329,7 @@ static int xbzrle_init(void)
 {
     Error *local_err = NULL;
 
-    if (!migrate_use_xbzrle()) {
+    if (!xbzrle_on_main_stream()) {
         return 0;
     }
 
@@ -3386,6 +3609,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        (*rsp)->mapped_ram_fd = file_ram_fd(qemu_file_get_ioc(f), &local_err);
+        if ((*rsp)->mapped_ram_fd < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -3400,6 +3633,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                ret = mapped_ram_setup_ramblock(f, block);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
         }
     }
 
@@ -3583,6 +3822,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (!ret && migrate_mapped_ram()) {
+            ret = mapped_ram_write_bitmaps(f);
+        }
     }
 
     if (ret < 0) {
@@ -4474,6 +4717,154 @@ int ram_load_update_cgs_bmap(RAMBlock *block, ram_addr_t offset,
     return ret;
 }
 
+typedef struct {
+    QemuThread thread;
+    int fd;
+    RAMBlock *block;
+    const unsigned long *bmap;
+    /* range of pages loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    off_t pages_offset;
+    int ret;
+} MappedRamLoadJob;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoadJob *job = opaque;
+    unsigned long set, clear;
+
+    set = find_next_bit(job->bmap, job->end, job->start);
+    while (set < job->end) {
+        ram_addr_t offset = (ram_addr_t)set << TARGET_PAGE_BITS;
+        size_t len;
+
+        clear = find_next_zero_bit(job->bmap, job->end, set);
+        len = (clear - set) << TARGET_PAGE_BITS;
+
+        job->ret = mapped_ram_pread(job->fd, job->block->host + offset, len,
+                                    job->pages_offset + offset);
+        if (job->ret < 0) {
+            break;
+        }
+        set = find_next_bit(job->bmap, job->end, clear);
+    }
+    return NULL;
+}
+
+/*
+ * Read the pages of @block that are present in the migration file.
+ * The block is split in one range per thread, and each thread reads
+ * runs of contiguous pages with a single call.
+ */
+static int mapped_ram_load_pages(int fd, RAMBlock *block,
+                                 const unsigned long *bmap,
+                                 unsigned long pages, off_t pages_offset)
+{
+    unsigned long nthreads = MIN(MAX(migrate_multifd_channels(), 1), pages);
+    unsigned long chunk;
+    g_autofree MappedRamLoadJob *jobs = NULL;
+    unsigned long i;
+    int ret = 0;
+
+    if (!pages) {
+        return 0;
+    }
+
+    chunk = DIV_ROUND_UP(pages, nthreads);
+    jobs = g_new0(MappedRamLoadJob, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        MappedRamLoadJob *job = &jobs[i];
+
+        job->fd = fd;
+        job->block = block;
+        job->bmap = bmap;
+        job->start = i * chunk;
+        job->end = MIN(job->start + chunk, pages);
+        job->pages_offset = pages_offset;
+        qemu_thread_create(&job->thread, "mapped-ram-load",
+                           mapped_ram_load_thread, job,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&jobs[i].thread);
+        if (jobs[i].ret < 0 && !ret) {
+            ret = jobs[i].ret;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Parse the mapped-ram header of @block, load its pages from the file,
+ * then resume reading the stream after its page region.
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = mapped_ram_bitmap_size(length);
+    g_autofree unsigned long *le_bmap = NULL;
+    g_autofree unsigned long *bmap = NULL;
+    uint32_t magic, version;
+    uint64_t page_size, bitmap_offset, pages_offset;
+    Error *local_err = NULL;
+    int fd, ret;
+
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (magic != MAPPED_RAM_HDR_MAGIC || version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Invalid mapped-ram header for block %s (magic 0x%x, "
+                     "version %u)", block->idstr, magic, version);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size for block %s "
+                     "(local) %d != %" PRIu64, block->idstr,
+                     TARGET_PAGE_SIZE, page_size);
+        return -EINVAL;
+    }
+    if (pages_offset % MAPPED_RAM_FILE_OFFSET_ALIGNMENT ||
+        bitmap_offset + bitmap_size > pages_offset) {
+        error_report("Invalid mapped-ram offsets for block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    fd = file_ram_fd(qemu_file_get_ioc(f), &local_err);
+    if (fd < 0) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    le_bmap = bitmap_new(pages);
+    qemu_set_offset(f, bitmap_offset);
+    qemu_get_buffer(f, (uint8_t *)le_bmap, bitmap_size);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    bmap = bitmap_new(pages);
+    bitmap_from_le(bmap, le_bmap, pages);
+
+    trace_ram_load_mapped_ramblock(block->idstr, length,
+                                   bitmap_count_one(bmap, pages));
+    ret = mapped_ram_load_pages(fd, block, bmap, pages, pages_offset);
+    if (ret < 0) {
+        error_report("Failed to read pages of %s from the migration file: %s",
+                     block->idstr, strerror(-ret));
+        return ret;
+    }
+
+    qemu_set_offset(f, pages_offset + length);
+    return qemu_file_get_error(f);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -4631,6 +5022,9 @@ static int ram_load_precopy(QEMUFile *f)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -95,6 +95,7 @@ bool ram_write_tracking_compatible(void);
 void ram_write_tracking_prepare(void);
 int ram_write_tracking_start(void);
 void ram_write_tracking_stop(void);
+int ram_save_mapped_ram_bitmaps(QEMUFile *f);
 
 void dirty_sync_missed_zero_copy(void);
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -23,9 +24,12 @@
   nzrun = length byte...
 
   length = uleb128 encoded integer
+
+  All encoders emit maximal zruns and nzruns, so they produce identical
+  output for the same input, including where they report an overflow.
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +130,222 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+/*
+ * Vector encoders compare 64 bytes at a time into a bit mask of equal
+ * bytes (bit n set if old_buf[start + n] == new_buf[start + n]); run
+ * boundaries are then found with bit scans on the cached mask, so that
+ * short runs do not reload the same data.  Bits past the end of the
+ * buffer must be clear.
+ */
+typedef uint64_t XBZRLEEqMaskFunc(uint8_t *old_buf, uint8_t *new_buf,
+                                  int start, int slen);
+
+typedef struct XBZRLEEqMask {
+    int start;
+    uint64_t eq;
+} XBZRLEEqMask;
+
+/* Return the end of the run of equal (@eq) or differing (!@eq) bytes at @i */
+static inline __attribute__((always_inline))
+int xbzrle_run_end(uint8_t *old_buf, uint8_t *new_buf, int i, int slen,
+                   bool eq, XBZRLEEqMask *m, XBZRLEEqMaskFunc *eq_mask)
+{
+    while (i < slen) {
+        uint64_t bits;
+        int avail;
+
+        if (i >= m->start + 64) {
+            m->start = i;
+            m->eq = eq_mask(old_buf, new_buf, i, slen);
+        }
+
+        avail = m->start + 64 - i;
+        bits = m->eq >> (i - m->start);
+        if (eq) {
+            bits = ~bits;
+        }
+        if (avail < 64) {
+            bits &= (1ULL << avail) - 1;
+        }
+        if (bits) {
+            return MIN(i + ctz64(bits), slen);
+        }
+        i = m->start + 64;
+    }
+    return slen;
+}
+
+static inline __attribute__((always_inline))
+int xbzrle_encode_buffer_vec(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen,
+                             XBZRLEEqMaskFunc *eq_mask)
+{
+    XBZRLEEqMask m = { .start = -64 };
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = xbzrle_run_end(old_buf, new_buf, i, slen, true, &m, eq_mask);
+        zrun_len = end - i;
+        i = end;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = xbzrle_run_end(old_buf, new_buf, i, slen, false, &m, eq_mask);
+        nzrun_len = end - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = end;
+    }
+
+    return d;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint64_t xbzrle_eq_mask_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                           int start, int slen)
+{
+    uint64_t eq = 0;
+    int i;
+
+    if (start + 64 <= slen) {
+        __m256i a0 = _mm256_loadu_si256((__m256i *)(old_buf + start));
+        __m256i b0 = _mm256_loadu_si256((__m256i *)(new_buf + start));
+        __m256i a1 = _mm256_loadu_si256((__m256i *)(old_buf + start + 32));
+        __m256i b1 = _mm256_loadu_si256((__m256i *)(new_buf + start + 32));
+        uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, b0));
+        uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, b1));
+
+        return ((uint64_t)hi << 32) | lo;
+    }
+
+    /* Tail of the buffer */
+    for (i = start; i < slen; i++) {
+        eq |= (uint64_t)(old_buf[i] == new_buf[i]) << (i - start);
+    }
+    return eq;
+}
+
+int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_eq_mask_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline uint64_t xbzrle_eq_mask_avx512(uint8_t *old_buf,
+                                             uint8_t *new_buf,
+                                             int start, int slen)
+{
+    __mmask64 valid = -1;
+    __m512i a, b;
+
+    if (start + 64 > slen) {
+        valid = (1ULL << (slen - start)) - 1;
+    }
+    a = _mm512_maskz_loadu_epi8(valid, old_buf + start);
+    b = _mm512_maskz_loadu_epi8(valid, new_buf + start);
+    return _mm512_mask_cmpeq_epi8_mask(valid, a, b);
+}
+
+int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_eq_mask_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+static XBZRLEEncoder xbzrle_encoder_type = XBZRLE_ENCODER_SCALAR;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = xbzrle_encode_buffer_int;
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_xbzrle_encoder(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max < 7) {
+        return;
+    }
+
+    __cpuid(1, a, b, c, d);
+    /* We must check that AVX is not just available, but usable.  */
+    if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+        int bv;
+        __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+#ifdef CONFIG_AVX2_OPT
+        if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+            xbzrle_encoder_type = XBZRLE_ENCODER_AVX2;
+            xbzrle_encode_accel = xbzrle_encode_buffer_avx2;
+        }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+        /* OPMASK, ZMM and YMM state must be enabled, see bufferiszero.c */
+        if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+            xbzrle_encoder_type = XBZRLE_ENCODER_AVX512;
+            xbzrle_encode_accel = xbzrle_encode_buffer_avx512;
+        }
+#endif
+    }
+}
+#endif
+
+XBZRLEEncoder xbzrle_encoder(void)
+{
+    return xbzrle_encoder_type;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
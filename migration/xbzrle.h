@@ -14,8 +14,25 @@
 #ifndef QEMU_MIGRATION_XBZRLE_H
 #define QEMU_MIGRATION_XBZRLE_H
 
+#include "qapi/qapi-types-migration.h"
+
+/* Encode with the fastest implementation supported by the host CPU */
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
+/* The implementation used by xbzrle_encode_buffer() */
+XBZRLEEncoder xbzrle_encoder(void);
+
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+#ifdef CONFIG_AVX2_OPT
+int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen);
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
+#endif
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 #endif
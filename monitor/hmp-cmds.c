@@ -327,6 +327,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->encoding_rate);
         monitor_printf(mon, "xbzrle overflow: %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle encoder: %s\n",
+                       XBZRLEEncoder_str(info->xbzrle_cache->encoder));
     }
 
     if (info->has_compression) {
@@ -495,6 +497,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        assert(params->has_direct_io);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRECT_IO),
+            params->direct_io ? "on" : "off");
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -1340,6 +1346,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
         break;
+    case MIGRATION_PARAMETER_DIRECT_IO:
+        p->has_direct_io = true;
+        visit_type_bool(v, param, &p->direct_io, &err);
+        break;
     default:
         assert(0);
     }
@@ -2699,6 +2709,21 @@ void hmp_virtio_queue_status(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  shadow_avail_idx:     %d\n",
                        s->shadow_avail_idx);
     }
+    if (s->has_irq_coalesce) {
+        VirtQueueIrqCoalesceStatus *c = s->irq_coalesce;
+
+        monitor_printf(mon, "  irq_coalesce:         %u completions, %u us%s\n",
+                       c->max_completions, c->max_delay_us,
+                       c->adaptive ? ", adaptive" : "");
+        monitor_printf(mon, "    interval_ns:        %" PRId64 "\n",
+                       c->interval_ns);
+        monitor_printf(mon, "    raised:             %" PRIu64 "\n",
+                       c->raised);
+        monitor_printf(mon, "    coalesced:          %" PRIu64 "\n",
+                       c->coalesced);
+        monitor_printf(mon, "    timer_fired:        %" PRIu64 "\n",
+                       c->timer_fired);
+    }
     monitor_printf(mon, "  VRing:\n");
     monitor_printf(mon, "    num:          %"PRId32"\n", s->vring_num);
     monitor_printf(mon, "    num_default:  %"PRId32"\n",
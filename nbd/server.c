@@ -81,8 +81,29 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+    size_t zero_copy_bytes; /* bytes of @data sent with zero copy */
 };
 
+/*
+ * Read buffers that were sent with zero copy and must not be freed
+ * before the kernel reports completion of the write that queued them.
+ */
+typedef struct NBDZeroCopyBuffer {
+    uint8_t *data;
+    size_t bytes;
+    ssize_t seq; /* sioc->zero_copy_queued after the last write */
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
+/* Smaller payloads are cheaper to copy than to pin and reap */
+#define NBD_ZERO_COPY_MIN_SIZE (64 * KiB)
+/* Limit on zero copy data in flight for a single client */
+#define NBD_ZERO_COPY_MAX_PENDING (64 * MiB)
+/* How often the buffers of a client that is gone are checked */
+#define NBD_ZERO_COPY_REAP_INTERVAL_MS 100
+/* Size asked for the pipes that spliced read payloads go through */
+#define NBD_SPLICE_PIPE_SIZE (1 * MiB)
+
 struct NBDExport {
     BlockExport common;
 
@@ -97,6 +118,7 @@ struct NBDExport {
     Notifier eject_notifier;
 
     bool allocation_depth;
+    bool zero_copy;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
 };
@@ -144,6 +166,11 @@ struct NBDClient {
     bool structured_reply;
     NBDExportMetaContexts export_meta;
 
+    bool zero_copy; /* send large read payloads with MSG_ZEROCOPY */
+    bool splice; /* splice large read payloads from the file to the socket */
+    size_t zero_copy_pending;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) zero_copy_buffers;
+
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
@@ -1455,6 +1482,82 @@ void nbd_client_get(NBDClient *client)
     client->refcount++;
 }
 
+/* Free the zero copy buffers whose writes the kernel has completed */
+static void nbd_client_zero_copy_release(NBDClient *client)
+{
+    NBDZeroCopyBuffer *buf;
+
+    /* A broken socket is noticed by the next read or write */
+    qio_channel_socket_zero_copy_reap(client->sioc, NULL);
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_buffers))) {
+        if (buf->seq > client->sioc->zero_copy_sent) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_buffers, next);
+        client->zero_copy_pending -= buf->bytes;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
+/*
+ * The zero copy buffers of a client that is gone, kept together with its
+ * socket until the kernel reports that it is done with them.
+ */
+typedef struct NBDZeroCopyReaper {
+    QIOChannelSocket *sioc;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) buffers;
+} NBDZeroCopyReaper;
+
+static gboolean nbd_zero_copy_reaper_timer(gpointer opaque)
+{
+    NBDZeroCopyReaper *reaper = opaque;
+    NBDZeroCopyBuffer *buf;
+    /* If the error queue can't be read, nothing will ever be reported */
+    bool failed = qio_channel_socket_zero_copy_reap(reaper->sioc, NULL) < 0;
+
+    while ((buf = QSIMPLEQ_FIRST(&reaper->buffers))) {
+        if (!failed && buf->seq > reaper->sioc->zero_copy_sent) {
+            return G_SOURCE_CONTINUE;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&reaper->buffers, next);
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+
+    object_unref(OBJECT(reaper->sioc));
+    g_free(reaper);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Hand the zero copy buffers that are still in flight over to the main
+ * loop, which frees them as the error queue reports their completion.
+ * Flushing here instead could block for as long as TCP retransmits to a
+ * peer that went away.  The error queue is polled on a timer because a
+ * pending socket error would keep a G_IO_ERR watch firing.
+ */
+static void nbd_client_zero_copy_orphan(NBDClient *client)
+{
+    NBDZeroCopyReaper *reaper;
+
+    nbd_client_zero_copy_release(client);
+    if (QSIMPLEQ_EMPTY(&client->zero_copy_buffers)) {
+        return;
+    }
+
+    reaper = g_new(NBDZeroCopyReaper, 1);
+    reaper->sioc = client->sioc;
+    object_ref(OBJECT(reaper->sioc));
+    QSIMPLEQ_INIT(&reaper->buffers);
+    QSIMPLEQ_CONCAT(&reaper->buffers, &client->zero_copy_buffers);
+    client->zero_copy_pending = 0;
+
+    g_timeout_add(NBD_ZERO_COPY_REAP_INTERVAL_MS, nbd_zero_copy_reaper_timer,
+                  reaper);
+}
+
 void nbd_client_put(NBDClient *client)
 {
     if (--client->refcount == 0) {
@@ -1464,6 +1567,7 @@ void nbd_client_put(NBDClient *client)
         assert(client->closing);
 
         qio_channel_detach_aio_context(client->ioc);
+        nbd_client_zero_copy_orphan(client);
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
         if (client->tlscreds) {
@@ -1516,7 +1620,15 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->zero_copy_bytes) {
+        NBDZeroCopyBuffer *buf = g_new(NBDZeroCopyBuffer, 1);
+
+        buf->data = req->data;
+        buf->bytes = req->zero_copy_bytes;
+        buf->seq = client->sioc->zero_copy_queued;
+        QSIMPLEQ_INSERT_TAIL(&client->zero_copy_buffers, buf, next);
+        nbd_client_zero_copy_release(client);
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1772,6 +1884,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1871,16 +1984,60 @@ const BlockExportDriver blk_exp_nbd = {
     .request_shutdown   = nbd_export_request_shutdown,
 };
 
-static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
-                                        unsigned niov, Error **errp)
+/*
+ * Can @bytes more of read payload be sent with zero copy?  Called with
+ * send_lock held.
+ */
+static bool nbd_client_can_zero_copy(NBDClient *client, size_t bytes)
+{
+    if (!client->zero_copy || bytes < NBD_ZERO_COPY_MIN_SIZE) {
+        return false;
+    }
+    if (client->zero_copy_pending + bytes > NBD_ZERO_COPY_MAX_PENDING) {
+        nbd_client_zero_copy_release(client);
+    }
+    return client->zero_copy_pending + bytes <= NBD_ZERO_COPY_MAX_PENDING;
+}
+
+/*
+ * Send @iov to the client.  If @req is not NULL, the last element of
+ * @iov is a read payload taken from @req->data, which may be sent with
+ * zero copy; nbd_request_put() then keeps the buffer alive until the
+ * kernel is done with it.
+ */
+static int coroutine_fn nbd_co_send_iov_full(NBDClient *client,
+                                             struct iovec *iov,
+                                             unsigned niov,
+                                             NBDRequestData *req,
+                                             Error **errp)
 {
+    size_t payload = req ? iov[niov - 1].iov_len : 0;
     int ret;
 
     g_assert(qemu_in_coroutine());
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
-    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (!nbd_client_can_zero_copy(client, payload)) {
+        ret = qio_channel_writev_all(client->ioc, iov, niov, errp);
+    } else {
+        /*
+         * The reply header lives on the stack and must be copied; cork
+         * the socket so that it still shares segments with the payload.
+         */
+        trace_nbd_co_send_zero_copy(payload);
+        qio_channel_set_cork(client->ioc, true);
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+        if (ret == 0) {
+            ret = qio_channel_writev_full_all(client->ioc, &iov[niov - 1], 1,
+                NULL, 0, QIO_CHANNEL_WRITE_FLAG_ZERO_COPY |
+                QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK, errp);
+        }
+        qio_channel_set_cork(client->ioc, false);
+        req->zero_copy_bytes += payload;
+        client->zero_copy_pending += payload;
+    }
+    ret = ret < 0 ? -EIO : 0;
 
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
@@ -1888,6 +2045,12 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    return nbd_co_send_iov_full(client, iov, niov, NULL, errp);
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1901,6 +2064,7 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                     uint32_t error,
                                     void *data,
                                     size_t len,
+                                    NBDRequestData *req,
                                     Error **errp)
 {
     NBDSimpleReply reply;
@@ -1914,7 +2078,8 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    return nbd_co_send_iov_full(client, iov, len ? 2 : 1, len ? req : NULL,
+                                errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1948,6 +2113,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                                                     void *data,
                                                     size_t size,
                                                     bool final,
+                                                    NBDRequestData *req,
                                                     Error **errp)
 {
     NBDStructuredReadData chunk;
@@ -1963,8 +2129,130 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_full(client, iov, 2, req, errp);
+}
+
+#ifdef CONFIG_SPLICE
+/*
+ * Send a read reply for [@offset, @offset + @size) of the export, moving
+ * the payload from the file into the socket through a pipe instead of
+ * reading it into a buffer.  @final is as for nbd_co_send_structured_read().
+ *
+ * The first part of the payload is put in the pipe before the reply header
+ * is sent, so that a failure there can still be reported to the client:
+ * -ENOTSUP is returned and the caller should read the data as usual.  Any
+ * other error happens in the middle of a reply and leaves the connection
+ * unusable.
+ */
+static int coroutine_fn nbd_co_send_spliced_read(NBDClient *client,
+                                                 uint64_t handle,
+                                                 uint64_t offset,
+                                                 size_t size,
+                                                 bool final,
+                                                 Error **errp)
+{
+    BlockBackend *blk = client->exp->common.blk;
+    NBDSimpleReply simple;
+    NBDStructuredReadData chunk;
+    struct iovec iov;
+    size_t pipe_size, filled, sent = 0;
+    int pipefd[2];
+    ssize_t ret;
+
+    if (!client->splice || size < NBD_ZERO_COPY_MIN_SIZE) {
+        return -ENOTSUP;
+    }
+
+    if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        return -ENOTSUP;
+    }
+    /* Best effort; the default size only means more round trips */
+    fcntl(pipefd[1], F_SETPIPE_SZ, NBD_SPLICE_PIPE_SIZE);
+    ret = fcntl(pipefd[1], F_GETPIPE_SZ);
+    pipe_size = ret > 0 ? ret : 64 * KiB;
+
+    ret = blk_co_splice_read(blk, offset, MIN(size, pipe_size), pipefd[1]);
+    if (ret <= 0) {
+        if (ret == -ENOTSUP) {
+            /* Not a plain file, don't try again */
+            client->splice = false;
+        }
+        ret = -ENOTSUP;
+        goto out;
+    }
+    filled = ret;
+
+    trace_nbd_co_send_spliced_read(handle, offset, size);
+    if (client->structured_reply) {
+        set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                     sizeof(chunk) - sizeof(chunk.h) + size);
+        stq_be_p(&chunk.offset, offset);
+        iov = (struct iovec) { .iov_base = &chunk, .iov_len = sizeof(chunk) };
+    } else {
+        set_be_simple_reply(&simple, 0, handle);
+        iov = (struct iovec) { .iov_base = &simple, .iov_len = sizeof(simple) };
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    /* Keep the header in the same segment as the start of the payload */
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, &iov, 1, errp) < 0 ? -EIO : 0;
+
+    while (ret == 0 && sent < size) {
+        if (sent == filled) {
+            ret = blk_co_splice_read(blk, offset + filled,
+                                     MIN(size - filled, pipe_size), pipefd[1]);
+            if (ret <= 0) {
+                error_setg_errno(errp, ret ? -ret : EIO,
+                                 "reading from file failed");
+                ret = -EIO;
+                break;
+            }
+            filled += ret;
+        }
+
+        ret = splice(pipefd[0], NULL, client->sioc->fd, NULL, filled - sent,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                     (filled < size ? SPLICE_F_MORE : 0));
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                /* The socket is full */
+                qio_channel_yield(client->ioc, G_IO_OUT);
+            } else if (errno != EINTR) {
+                error_setg_errno(errp, errno, "splice to client failed");
+                ret = -EIO;
+                break;
+            }
+            ret = 0;
+            continue;
+        }
+        sent += ret;
+        ret = 0;
+    }
+
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+out:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret < 0 ? ret : 0;
+}
+#else
+static int coroutine_fn nbd_co_send_spliced_read(NBDClient *client,
+                                                 uint64_t handle,
+                                                 uint64_t offset,
+                                                 size_t size,
+                                                 bool final,
+                                                 Error **errp)
+{
+    return -ENOTSUP;
 }
+#endif
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
@@ -1997,10 +2285,11 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                                 uint64_t handle,
                                                 uint64_t offset,
-                                                uint8_t *data,
+                                                NBDRequestData *req,
                                                 size_t size,
                                                 Error **errp)
 {
+    uint8_t *data = req->data;
     int ret = 0;
     NBDExport *exp = client->exp;
     size_t progress = 0;
@@ -2039,15 +2328,20 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->common.blk, offset + progress, pnum,
-                            data + progress, 0);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_spliced_read(client, handle, offset + progress,
+                                           pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->common.blk, offset + progress, pnum,
+                                data + progress, 0);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum,
+                                                  final, req, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2413,7 +2707,7 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
                                             errp);
     } else {
         return nbd_co_send_simple_reply(client, handle, ret < 0 ? -ret : 0,
-                                        NULL, 0, errp);
+                                        NULL, 0, NULL, errp);
     }
 }
 
@@ -2421,8 +2715,9 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
 static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
-                                        uint8_t *data, Error **errp)
+                                        NBDRequestData *req, Error **errp)
 {
+    uint8_t *data = req->data;
     int ret;
     NBDExport *exp = client->exp;
 
@@ -2441,7 +2736,15 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         request->len)
     {
         return nbd_co_send_sparse_read(client, request->handle, request->from,
-                                       data, request->len, errp);
+                                       req, request->len, errp);
+    }
+
+    if (request->len) {
+        ret = nbd_co_send_spliced_read(client, request->handle, request->from,
+                                       request->len, true, errp);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
     }
 
     ret = blk_pread(exp->common.blk, request->from, request->len, data, 0);
@@ -2454,13 +2757,13 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         if (request->len) {
             return nbd_co_send_structured_read(client, request->handle,
                                                request->from, data,
-                                               request->len, true, errp);
+                                               request->len, true, req, errp);
         } else {
             return nbd_co_send_structured_done(client, request->handle, errp);
         }
     } else {
         return nbd_co_send_simple_reply(client, request->handle, 0,
-                                        data, request->len, errp);
+                                        data, request->len, req, errp);
     }
 }
 
@@ -2491,8 +2794,9 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
  * client as an error reply. */
 static coroutine_fn int nbd_handle_request(NBDClient *client,
                                            NBDRequest *request,
-                                           uint8_t *data, Error **errp)
+                                           NBDRequestData *req, Error **errp)
 {
+    uint8_t *data = req->data;
     int ret;
     int flags;
     NBDExport *exp = client->exp;
@@ -2504,7 +2808,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         return nbd_do_cmd_cache(client, request, errp);
 
     case NBD_CMD_READ:
-        return nbd_do_cmd_read(client, request, data, errp);
+        return nbd_do_cmd_read(client, request, req, errp);
 
     case NBD_CMD_WRITE:
         flags = 0;
@@ -2675,7 +2979,7 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
-        ret = nbd_handle_request(client, &request, req->data, &local_err);
+        ret = nbd_handle_request(client, &request, req, &local_err);
     }
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
@@ -2729,6 +3033,17 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    /* TLS encrypts into its own buffers, so only plain sockets qualify */
+    if (client->exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy = qio_channel_socket_enable_zero_copy(client->sioc);
+    }
+#ifdef CONFIG_SPLICE
+    client->splice = client->exp->zero_copy &&
+                     client->ioc == QIO_CHANNEL(client->sioc);
+#endif
+    trace_nbd_co_client_start_zero_copy(client->exp->name, client->zero_copy,
+                                        client->splice);
+
     nbd_client_receive_next_request(client);
 }
 
@@ -2757,6 +3072,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
     client->ioc = QIO_CHANNEL(sioc);
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
+    QSIMPLEQ_INIT(&client->zero_copy_buffers);
 
     co = qemu_coroutine_create(nbd_co_client_start, client);
     qemu_coroutine_enter(co);
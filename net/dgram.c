@@ -100,6 +100,45 @@ static ssize_t net_dgram_receive(NetClientState *nc,
     return ret;
 }
 
+#ifdef CONFIG_LINUX
+/* Maximum number of datagrams passed to one sendmmsg() call */
+#define NET_DGRAM_SEND_BATCH 64
+
+static int net_dgram_receive_iov_batch(NetClientState *nc,
+                                       const NetPacketIOV *pkts, int count)
+{
+    NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
+    struct mmsghdr msgs[NET_DGRAM_SEND_BATCH];
+    int i, ret;
+
+    count = MIN(count, NET_DGRAM_SEND_BATCH);
+    for (i = 0; i < count; i++) {
+        msgs[i] = (struct mmsghdr) {
+            .msg_hdr = {
+                .msg_name = s->dest_addr,
+                .msg_namelen = s->dest_addr ? s->dest_len : 0,
+                .msg_iov = (struct iovec *)pkts[i].iov,
+                .msg_iovlen = pkts[i].iovcnt,
+            },
+        };
+    }
+
+    do {
+        ret = sendmmsg(s->fd, msgs, count, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            net_dgram_write_poll(s, true);
+            return 0;
+        }
+        /* Drop the first packet like net_dgram_receive() would */
+        return 1;
+    }
+    return ret;
+}
+#endif
+
 static void net_dgram_send_completed(NetClientState *nc, ssize_t len)
 {
     NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
@@ -253,6 +292,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_DGRAM,
     .size = sizeof(NetDgramState),
     .receive = net_dgram_receive,
+#ifdef CONFIG_LINUX
+    .receive_iov_batch = net_dgram_receive_iov_batch,
+#endif
     .cleanup = net_dgram_cleanup,
 };
 
@@ -719,6 +719,86 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/*
+ * Whether @sender can hand a batch of packets to its peer directly.
+ * Filters must see each packet, and packets already queued for the peer
+ * must be delivered first.
+ */
+static bool qemu_can_send_packet_batch(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    return !sender->link_down && !peer->link_down &&
+           QTAILQ_EMPTY(&sender->filters) && QTAILQ_EMPTY(&peer->filters) &&
+           qemu_net_queue_empty(peer->incoming_queue) &&
+           qemu_can_send_packet(sender);
+}
+
+/*
+ * Send @count packets, each described by a single iovec.  When the peer
+ * implements receive_batch and nothing (filters, queued packets, a
+ * stopped VM) needs to look at the packets individually, they are handed
+ * over in one call.  Otherwise they are passed to qemu_send_packet_async()
+ * one by one.
+ *
+ * Returns the number of packets sent.  If that is less than @count, the
+ * packet at that index was queued and @sent_cb will be invoked for it;
+ * the packets after it were not sent and remain owned by the caller,
+ * which must not send more packets until @sent_cb has been invoked.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i = 0;
+
+    if (peer && peer->info->receive_batch &&
+        qemu_can_send_packet_batch(sender)) {
+        i = peer->info->receive_batch(peer, pkts, count);
+    }
+
+    for (; i < count; i++) {
+        if (qemu_send_packet_async(sender, pkts[i].iov_base, pkts[i].iov_len,
+                                   sent_cb) == 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Send @count packets made of several buffers each.  As with
+ * qemu_send_packet_batch_async() the peer's receive_iov_batch hook gets
+ * the whole batch when possible.
+ *
+ * Returns the number of packets sent.  If that is less than @count, the
+ * packet at that index was queued and @sent_cb will be invoked for it;
+ * the packets after it were not sent and remain owned by the caller.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i = 0;
+
+    if (peer && peer->info->receive_iov_batch &&
+        qemu_can_send_packet_batch(sender)) {
+        i = peer->info->receive_iov_batch(peer, pkts, count);
+    }
+
+    for (; i < count; i++) {
+        if (qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                    sent_cb) == 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async(nc, buf, size, NULL);
@@ -31,6 +31,9 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <net/if.h>
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 #include "net/eth.h"
 #include "net/net.h"
@@ -40,6 +43,7 @@
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 
@@ -47,12 +51,31 @@
 
 #include "net/vhost_net.h"
 
+/* Packets read from the tap device per batch handed to the peer */
+#define TAP_RX_BATCH 16
+/* Packets from the peer written to the tap device per io_uring_enter() */
+#define TAP_TX_BATCH 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
     uint8_t buf[NET_BUFSIZE];
+    /* TAP_RX_BATCH receive buffers, allocated when the peer can batch */
+    uint8_t *batch_buf;
+    /* Packets read into batch_buf, those from batch_next on are not sent */
+    struct iovec batch_pkts[TAP_RX_BATCH];
+    uint8_t batch_min_pkt[TAP_RX_BATCH][ETH_ZLEN];
+    int batch_next;
+    int batch_count;
+    /* Sends the rest of a batch once a queued packet was delivered */
+    QEMUBH *batch_bh;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Writes batches from the peer, set up on first use */
+    struct io_uring *tx_ring;
+    bool tx_ring_failed;
+#endif
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -133,6 +156,128 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static struct io_uring *tap_get_tx_ring(TAPState *s)
+{
+    if (!s->tx_ring && !s->tx_ring_failed) {
+        s->tx_ring = g_new0(struct io_uring, 1);
+        if (io_uring_queue_init(TAP_TX_BATCH, s->tx_ring, 0) < 0) {
+            g_free(s->tx_ring);
+            s->tx_ring = NULL;
+            s->tx_ring_failed = true;
+        }
+    }
+    return s->tx_ring;
+}
+
+/*
+ * Write up to TAP_TX_BATCH frames, all with one io_uring_enter().  The
+ * writes are linked, so the device gets them in order and the ones after
+ * a failed write are cancelled.  The fd is non-blocking, so io_uring
+ * issues them right away and fails them with -EAGAIN if the device is
+ * full, just like writev() does.
+ *
+ * Returns the number of packets consumed; @full is set if the device was
+ * full for the next one.
+ */
+static int tap_write_batch_uring(TAPState *s, struct io_uring *ring,
+                                 const NetPacketIOV *pkts, int count,
+                                 bool *full)
+{
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe;
+    int consumed = count;
+    int nr = 0;
+    int i, ret;
+
+    assert(count <= TAP_TX_BATCH);
+    *full = false;
+    for (i = 0; i < count; i++) {
+        /* Too big for the device, dropped */
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            continue;
+        }
+        sqe = io_uring_get_sqe(ring);
+        io_uring_prep_writev(sqe, s->fd, pkts[i].iov, pkts[i].iovcnt, 0);
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+        sqe->flags |= IOSQE_IO_LINK;
+        nr++;
+    }
+    if (!nr) {
+        return consumed;
+    }
+    /* The chain ends with the last write */
+    sqe->flags &= ~IOSQE_IO_LINK;
+
+    do {
+        ret = io_uring_submit_and_wait(ring, nr);
+    } while (ret == -EINTR || ret == -EAGAIN);
+    assert(ret == nr);
+
+    while (nr--) {
+        io_uring_wait_cqe(ring, &cqe);
+        i = (uintptr_t)io_uring_cqe_get_data(cqe);
+        ret = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+
+        if (ret == -EAGAIN) {
+            /* Device full, let the caller queue this one and the rest */
+            tap_write_poll(s, true);
+            *full = true;
+            consumed = MIN(consumed, i);
+        } else if (ret == -ECANCELED) {
+            /* Behind a write that failed, the caller will try it again */
+            consumed = MIN(consumed, i);
+        } else if (ret < 0) {
+            /* Dropped, like writev() errors; the rest is tried again */
+            consumed = MIN(consumed, i + 1);
+        }
+    }
+    return consumed;
+}
+#endif
+
+/*
+ * A tap device only accepts one frame per write.  With io_uring the whole
+ * batch still costs a single system call; otherwise this only saves the
+ * trip through the net queue for each packet.
+ */
+static int tap_receive_iov_batch(NetClientState *nc, const NetPacketIOV *pkts,
+                                 int count)
+{
+    int i;
+
+#ifdef CONFIG_LINUX_IO_URING
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    struct io_uring *ring = NULL;
+
+    /* The vnet header that tap_receive_iov() adds needs a copy of the iov */
+    if (!s->host_vnet_hdr_len || s->using_vnet_hdr) {
+        ring = tap_get_tx_ring(s);
+    }
+    if (ring) {
+        bool full = false;
+
+        for (i = 0; i < count && !full; ) {
+            i += tap_write_batch_uring(s, ring, &pkts[i],
+                                       MIN(count - i, TAP_TX_BATCH), &full);
+        }
+        return i;
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            continue;
+        }
+        /* Device full, let the caller queue the rest */
+        if (tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -179,6 +324,75 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
     tap_read_poll(s, true);
+
+    /* The packets read after the queued one go before any new ones */
+    if (s->batch_next < s->batch_count) {
+        qemu_bh_schedule(s->batch_bh);
+    }
+}
+
+static void tap_send_batch(TAPState *s)
+{
+    bool pad = net_peer_needs_padding(&s->nc);
+    int packets = 0;
+    int n, sent, size;
+
+    if (!s->batch_buf) {
+        s->batch_buf = g_malloc(TAP_RX_BATCH * NET_BUFSIZE);
+        s->batch_bh = qemu_bh_new(tap_send, s);
+    }
+
+    /* Same fairness limit as tap_send(), rounded up to whole batches */
+    while (packets < 50) {
+        if (s->batch_next == s->batch_count) {
+            for (n = 0; n < TAP_RX_BATCH; n++) {
+                uint8_t *buf = s->batch_buf + n * NET_BUFSIZE;
+                size_t min_pktsz = sizeof(s->batch_min_pkt[n]);
+
+                size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+                if (size <= 0) {
+                    break;
+                }
+
+                if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                    buf  += s->host_vnet_hdr_len;
+                    size -= s->host_vnet_hdr_len;
+                }
+
+                if (pad && eth_pad_short_frame(s->batch_min_pkt[n],
+                                               &min_pktsz, buf, size)) {
+                    buf = s->batch_min_pkt[n];
+                    size = min_pktsz;
+                }
+
+                s->batch_pkts[n].iov_base = buf;
+                s->batch_pkts[n].iov_len = size;
+            }
+
+            if (!n) {
+                break;
+            }
+            s->batch_next = 0;
+            s->batch_count = n;
+        }
+
+        n = s->batch_count - s->batch_next;
+        sent = qemu_send_packet_batch_async(&s->nc,
+                                            &s->batch_pkts[s->batch_next], n,
+                                            tap_send_completed);
+        if (sent < n) {
+            /* One was queued, keep the rest until tap_send_completed() */
+            s->batch_next += sent + 1;
+            tap_read_poll(s, false);
+            break;
+        }
+        s->batch_next = s->batch_count;
+
+        packets += n;
+        if (s->batch_count < TAP_RX_BATCH) {
+            break;
+        }
+    }
 }
 
 static void tap_send(void *opaque)
@@ -187,6 +401,11 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    if (s->nc.peer && s->nc.peer->info->receive_batch) {
+        tap_send_batch(s);
+        return;
+    }
+
     while (true) {
         uint8_t *buf = s->buf;
         uint8_t min_pkt[ETH_ZLEN];
@@ -337,6 +556,21 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
+    s->batch_next = s->batch_count = 0;
+    if (s->batch_bh) {
+        qemu_bh_delete(s->batch_bh);
+        s->batch_bh = NULL;
+    }
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->tx_ring) {
+        io_uring_queue_exit(s->tx_ring);
+        g_free(s->tx_ring);
+        s->tx_ring = NULL;
+    }
+#endif
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -369,6 +603,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_iov_batch = tap_receive_iov_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
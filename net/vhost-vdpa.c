@@ -27,6 +27,7 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "monitor/monitor.h"
 #include "hw/virtio/vhost.h"
+#include "sysemu/iothread.h"
 
 /* Todo:need to add the multiqueue support here */
 typedef struct VhostVDPAState {
@@ -38,6 +39,9 @@ typedef struct VhostVDPAState {
     void *cvq_cmd_out_buffer;
     virtio_net_ctrl_ack *status;
 
+    /* IOThread the data shadow virtqueues run in, if any */
+    IOThread *svq_iothread;
+
     bool started;
 } VhostVDPAState;
 
@@ -174,6 +178,10 @@ static void vhost_vdpa_cleanup(NetClientState *nc)
         qemu_close(s->vhost_vdpa.device_fd);
         s->vhost_vdpa.device_fd = -1;
     }
+    if (s->svq_iothread) {
+        object_unref(OBJECT(s->svq_iothread));
+        s->svq_iothread = NULL;
+    }
 }
 
 static bool vhost_vdpa_has_vnet_hdr(NetClientState *nc)
@@ -234,20 +242,20 @@ static void vhost_vdpa_cvq_unmap_buf(struct vhost_vdpa *v, void *addr)
          */
         .translated_addr = (hwaddr)(uintptr_t)addr,
     };
-    const DMAMap *map = vhost_iova_tree_find_iova(tree, &needle);
+    DMAMap map;
     int r;
 
-    if (unlikely(!map)) {
+    if (unlikely(!vhost_iova_tree_find_iova(tree, &needle, &map))) {
         error_report("Cannot locate expected map");
         return;
     }
 
-    r = vhost_vdpa_dma_unmap(v, map->iova, map->size + 1);
+    r = vhost_vdpa_dma_unmap(v, map.iova, map.size + 1);
     if (unlikely(r != 0)) {
         error_report("Device cannot unmap: %s(%d)", g_strerror(r), r);
     }
 
-    vhost_iova_tree_remove(tree, *map);
+    vhost_iova_tree_remove(tree, map);
 }
 
 static size_t vhost_vdpa_net_cvq_cmd_len(void)
@@ -532,6 +540,7 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
                                            int nvqs,
                                            bool is_datapath,
                                            bool svq,
+                                           IOThread *svq_iothread,
                                            VhostIOVATree *iova_tree)
 {
     NetClientState *nc = NULL;
@@ -552,6 +561,13 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
     s->vhost_vdpa.index = queue_pair_index;
     s->vhost_vdpa.shadow_vqs_enabled = svq;
     s->vhost_vdpa.iova_tree = iova_tree;
+    if (svq_iothread) {
+        /* The control virtqueue handler needs the BQL */
+        assert(is_datapath);
+        s->svq_iothread = svq_iothread;
+        object_ref(OBJECT(svq_iothread));
+        s->vhost_vdpa.svq_aio_context = iothread_get_aio_context(svq_iothread);
+    }
     if (!is_datapath) {
         s->cvq_cmd_out_buffer = qemu_memalign(qemu_real_host_page_size(),
                                             vhost_vdpa_net_cvq_cmd_page_len());
@@ -630,6 +646,7 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
     int vdpa_device_fd;
     g_autofree NetClientState **ncs = NULL;
     g_autoptr(VhostIOVATree) iova_tree = NULL;
+    IOThread *svq_iothread = NULL;
     NetClientState *nc;
     int queue_pairs, r, i = 0, has_cvq = 0;
 
@@ -647,6 +664,20 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
         return -1;
     }
 
+    if (opts->has_x_svq_iothread) {
+        if (!opts->x_svq) {
+            error_setg(errp, "vhost-vdpa: x-svq-iothread= requires x-svq=on");
+            return -1;
+        }
+
+        svq_iothread = iothread_by_id(opts->x_svq_iothread);
+        if (!svq_iothread) {
+            error_setg(errp, "vhost-vdpa: IOThread '%s' not found",
+                       opts->x_svq_iothread);
+            return -1;
+        }
+    }
+
     if (opts->has_vhostdev) {
         vdpa_device_fd = qemu_open(opts->vhostdev, O_RDWR, errp);
         if (vdpa_device_fd == -1) {
@@ -697,7 +728,7 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
     for (i = 0; i < queue_pairs; i++) {
         ncs[i] = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                      vdpa_device_fd, i, 2, true, opts->x_svq,
-                                     iova_tree);
+                                     svq_iothread, iova_tree);
         if (!ncs[i])
             goto err;
     }
@@ -705,7 +736,7 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
     if (has_cvq) {
         nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                  vdpa_device_fd, i, 1, false,
-                                 opts->x_svq, iova_tree);
+                                 opts->x_svq, NULL, iova_tree);
         if (!nc)
             goto err;
     }
@@ -1289,45 +1289,292 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 }
 
 #define IO_BUF_SIZE (2 * MiB)
+#define MAX_COROUTINES 16
+
+typedef enum ImgCompareStep {
+    COMPARE_SKIP,       /* nothing to read, the area is equal */
+    COMPARE_DATA,       /* both images have data to compare */
+    COMPARE_EMPTY1,     /* only image 1 has data, which must be zero */
+    COMPARE_EMPTY2,     /* only image 2 has data, which must be zero */
+} ImgCompareStep;
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1;
+    BlockBackend *blk2; /* NULL: only check that blk1 is empty */
+    const char *filename1;
+    const char *filename2;
+    int64_t total_size1;
+    int64_t total_size2;
+    int64_t offset;     /* start of the next area to check */
+    int64_t end;
+    int64_t progress_base;
+    bool strict;
+    bool quiet;
+    long num_coroutines;
+    int running_coroutines;
+    CoMutex lock;
+
+    /*
+     * First difference or error, in image order.  The areas are
+     * handed out in order, and no new area is started once one of them
+     * failed, so this is what checking one area at a time would find.
+     */
+    int fail_ret;
+    int64_t fail_offset;
+    char *fail_msg;
+    bool fail_is_error;
+} ImgCompareState;
+
+/*
+ * Record that the area starting at @offset differs (@ret == 1) or could
+ * not be checked (@ret > 1).  Only the failure of the first area gets
+ * reported, as an error if @is_error is true.
+ */
+static void G_GNUC_PRINTF(5, 6)
+img_compare_fail(ImgCompareState *s, int64_t offset, int ret, bool is_error,
+                 const char *fmt, ...)
+{
+    va_list ap;
+
+    if (s->fail_msg && s->fail_offset <= offset) {
+        return;
+    }
+
+    g_free(s->fail_msg);
+    va_start(ap, fmt);
+    s->fail_msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    s->fail_ret = ret;
+    s->fail_offset = offset;
+    s->fail_is_error = is_error;
+}
 
 /*
  * Check if passed sectors are empty (not allocated or contain only 0 bytes)
  *
  * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
  * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
+ * failure), and 4 on error (the exit status for read errors), after recording
+ * the message in @s.
  *
+ * @param s:  State of the comparison
  * @param blk:  BlockBackend for the image
  * @param offset: Starting offset to check
  * @param bytes: Number of bytes to check
  * @param filename: Name of disk file we are checking (logging purpose)
  * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int coroutine_fn check_empty_sectors(ImgCompareState *s,
+                                            BlockBackend *blk, int64_t offset,
+                                            int64_t bytes,
+                                            const char *filename,
+                                            uint8_t *buffer)
 {
     int ret = 0;
     int64_t idx;
 
-    ret = blk_pread(blk, offset, bytes, buffer, 0);
+    ret = blk_co_pread(blk, offset, bytes, buffer, 0);
     if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
+        img_compare_fail(s, offset, 4, true,
+                         "Error while reading offset %" PRId64 " of %s: %s",
+                         offset, filename, strerror(-ret));
         return 4;
     }
     idx = find_nonzero(buffer, bytes);
     if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
+        img_compare_fail(s, offset, 1, false,
+                         "Content mismatch at offset %" PRId64 "!\n",
+                         offset + idx);
         return 1;
     }
 
     return 0;
 }
 
+/*
+ * Find out how to check the area at s->offset, from the block status of
+ * the images.  Returns the size of the area, or 0 after recording a
+ * failure.  Called with s->lock held.
+ */
+static int64_t coroutine_fn img_compare_next(ImgCompareState *s,
+                                             ImgCompareStep *step)
+{
+    int64_t offset = s->offset;
+    int64_t pnum1, pnum2, chunk;
+    int status1, status2;
+    int allocated1, allocated2;
+
+    if (!s->blk2) {
+        status1 = bdrv_block_status_above(blk_bs(s->blk1), NULL, offset,
+                                          s->end - offset, &chunk, NULL,
+                                          NULL);
+        if (status1 < 0) {
+            img_compare_fail(s, offset, 3, true,
+                             "Sector allocation test failed for %s",
+                             s->filename1);
+            return 0;
+        }
+        if (status1 & BDRV_BLOCK_ALLOCATED && !(status1 & BDRV_BLOCK_ZERO)) {
+            *step = COMPARE_EMPTY1;
+            return MIN(chunk, IO_BUF_SIZE);
+        }
+        *step = COMPARE_SKIP;
+        return chunk;
+    }
+
+    status1 = bdrv_block_status_above(blk_bs(s->blk1), NULL, offset,
+                                      s->total_size1 - offset, &pnum1, NULL,
+                                      NULL);
+    if (status1 < 0) {
+        img_compare_fail(s, offset, 3, true,
+                         "Sector allocation test failed for %s",
+                         s->filename1);
+        return 0;
+    }
+    allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+
+    status2 = bdrv_block_status_above(blk_bs(s->blk2), NULL, offset,
+                                      s->total_size2 - offset, &pnum2, NULL,
+                                      NULL);
+    if (status2 < 0) {
+        img_compare_fail(s, offset, 3, true,
+                         "Sector allocation test failed for %s",
+                         s->filename2);
+        return 0;
+    }
+    allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+    assert(pnum1 && pnum2);
+    chunk = MIN(pnum1, pnum2);
+
+    if (s->strict) {
+        if (status1 != status2) {
+            img_compare_fail(s, offset, 1, false, "Strict mode: Offset %" PRId64
+                             " block status mismatch!\n", offset);
+            return 0;
+        }
+    }
+    if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+        *step = COMPARE_SKIP;
+    } else if (allocated1 == allocated2) {
+        if (allocated1) {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+            *step = COMPARE_DATA;
+        } else {
+            *step = COMPARE_SKIP;
+        }
+    } else {
+        chunk = MIN(chunk, IO_BUF_SIZE);
+        *step = allocated1 ? COMPARE_EMPTY1 : COMPARE_EMPTY2;
+    }
+    return chunk;
+}
+
+static void coroutine_fn img_compare_co(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2 = NULL;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    if (s->blk2) {
+        buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+    }
+
+    while (1) {
+        ImgCompareStep step;
+        int64_t offset, chunk, pnum;
+        int ret = 0;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->fail_msg || s->offset >= s->end) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+        chunk = img_compare_next(s, &step);
+        /* Other coroutines can go on with the next area while we read */
+        s->offset += chunk;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (!chunk) {
+            break;
+        }
+
+        switch (step) {
+        case COMPARE_SKIP:
+            break;
+        case COMPARE_DATA:
+            ret = blk_co_pread(s->blk1, offset, chunk, buf1, 0);
+            if (ret < 0) {
+                img_compare_fail(s, offset, 4, true, "Error while reading "
+                                 "offset %" PRId64 " of %s: %s",
+                                 offset, s->filename1, strerror(-ret));
+                break;
+            }
+            ret = blk_co_pread(s->blk2, offset, chunk, buf2, 0);
+            if (ret < 0) {
+                img_compare_fail(s, offset, 4, true, "Error while reading "
+                                 "offset %" PRId64 " of %s: %s",
+                                 offset, s->filename2, strerror(-ret));
+                break;
+            }
+            ret = compare_buffers(buf1, buf2, chunk, &pnum);
+            if (ret || pnum != chunk) {
+                img_compare_fail(s, offset, 1, false,
+                                 "Content mismatch at offset %" PRId64 "!\n",
+                                 offset + (ret ? 0 : pnum));
+                ret = 1;
+            }
+            break;
+        case COMPARE_EMPTY1:
+            ret = check_empty_sectors(s, s->blk1, offset, chunk,
+                                      s->filename1, buf1);
+            break;
+        case COMPARE_EMPTY2:
+            ret = check_empty_sectors(s, s->blk2, offset, chunk,
+                                      s->filename2, buf1);
+            break;
+        }
+        if (ret) {
+            break;
+        }
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
+/*
+ * Check [s->offset, s->end) with s->num_coroutines coroutines and report
+ * the first difference or error.  Returns the exit code of compare.
+ */
+static int img_compare_run(ImgCompareState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(img_compare_co, s));
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+
+    if (s->fail_msg) {
+        if (s->fail_is_error) {
+            error_report("%s", s->fail_msg);
+        } else {
+            qprintf(s->quiet, "%s", s->fail_msg);
+        }
+        return s->fail_ret;
+    }
+    return 0;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1339,22 +1586,18 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
     int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
     int c;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    ImgCompareState s = {};
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1365,7 +1608,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsUm:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1401,6 +1644,14 @@ static int img_compare(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 2;
+            }
+            break;
         case OPTION_OBJECT:
             {
                 Error *local_err = NULL;
@@ -1458,11 +1709,6 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1488,122 +1734,39 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
-
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, chunk, buf1, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, chunk, buf2, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
-        }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+    s = (ImgCompareState) {
+        .blk1           = blk1,
+        .blk2           = blk2,
+        .filename1      = filename1,
+        .filename2      = filename2,
+        .total_size1    = total_size1,
+        .total_size2    = total_size2,
+        .offset         = 0,
+        .end            = total_size,
+        .progress_base  = progress_base,
+        .strict         = strict,
+        .quiet          = quiet,
+        .num_coroutines = num_coroutines,
+    };
+    ret = img_compare_run(&s);
+    if (ret) {
+        goto out;
     }
 
     if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
-
         qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
-        } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
-
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
 
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        /* Only the larger image is left, its remainder must be empty */
+        if (total_size1 < total_size2) {
+            s.blk1 = blk2;
+            s.filename1 = filename2;
+        }
+        s.blk2 = NULL;
+        s.offset = total_size;
+        s.end = progress_base;
+        ret = img_compare_run(&s);
+        if (ret) {
+            goto out;
         }
     }
 
@@ -1611,8 +1774,7 @@ static int img_compare(int argc, char **argv)
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
+    g_free(s.fail_msg);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1644,7 +1806,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -3156,6 +3317,56 @@ static inline bool entry_mergeable(const MapEntry *curr, const MapEntry *next)
     return true;
 }
 
+/* img_map() queries the block status of areas of this size in parallel */
+#define MAP_AREA_SIZE (256 * MiB)
+
+typedef struct ImgMapArea {
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t end;
+    GArray *entries;    /* MapEntry, split at the end of the area */
+    int ret;
+    bool done;
+} ImgMapArea;
+
+static void coroutine_fn img_map_area_co(void *opaque)
+{
+    ImgMapArea *area = opaque;
+    int64_t offset = area->offset;
+
+    while (offset < area->end) {
+        MapEntry e;
+
+        area->ret = get_block_status(area->bs, offset, area->end - offset, &e);
+        if (area->ret < 0) {
+            break;
+        }
+        g_array_append_val(area->entries, e);
+        offset += e.length;
+    }
+    area->done = true;
+}
+
+static void img_map_area_start(ImgMapArea *area, BlockDriverState *bs,
+                               int64_t offset, int64_t end)
+{
+    *area = (ImgMapArea) {
+        .bs      = bs,
+        .offset  = offset,
+        .end     = end,
+        .entries = g_array_new(false, false, sizeof(MapEntry)),
+    };
+    qemu_coroutine_enter(qemu_coroutine_create(img_map_area_co, area));
+}
+
+static void img_map_area_finish(ImgMapArea *area)
+{
+    while (!area->done) {
+        main_loop_wait(false);
+    }
+    g_array_free(area->entries, true);
+}
+
 static int img_map(int argc, char **argv)
 {
     int c;
@@ -3170,6 +3381,9 @@ static int img_map(int argc, char **argv)
     bool force_share = false;
     int64_t start_offset = 0;
     int64_t max_length = -1;
+    long num_coroutines = 8;
+    ImgMapArea areas[MAX_COROUTINES];
+    int64_t nb_areas = 0, started = 0, done = 0;
 
     fmt = NULL;
     output = NULL;
@@ -3186,7 +3400,7 @@ static int img_map(int argc, char **argv)
             {"max-length", required_argument, 0, 'l'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":f:s:l:hU",
+        c = getopt_long(argc, argv, ":f:s:l:hUm:",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -3222,6 +3436,14 @@ static int img_map(int argc, char **argv)
                 return 1;
             }
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
+            }
+            break;
         case OPTION_OBJECT:
             user_creatable_process_cmdline(optarg);
             break;
@@ -3265,29 +3487,58 @@ static int img_map(int argc, char **argv)
         length = MIN(start_offset + max_length, length);
     }
 
+    /*
+     * The areas are queried num_coroutines at a time, but their entries
+     * are merged and printed in order.  Entries cut at the end of an area
+     * merge again with the start of the next one, so the output does not
+     * depend on MAP_AREA_SIZE.
+     */
+    if (length > start_offset) {
+        nb_areas = DIV_ROUND_UP(length - start_offset, MAP_AREA_SIZE);
+    }
+
     curr.start = start_offset;
-    while (curr.start + curr.length < length) {
-        int64_t offset = curr.start + curr.length;
-        int64_t n = length - offset;
+    while (done < nb_areas) {
+        ImgMapArea *area;
+        guint i;
 
-        ret = get_block_status(bs, offset, n, &next);
-        if (ret < 0) {
-            error_report("Could not read file metadata: %s", strerror(-ret));
-            goto out;
+        while (started < nb_areas && started - done < num_coroutines) {
+            int64_t offset = start_offset + started * MAP_AREA_SIZE;
+
+            img_map_area_start(&areas[started % num_coroutines], bs, offset,
+                               MIN(offset + MAP_AREA_SIZE, length));
+            started++;
         }
 
-        if (entry_mergeable(&curr, &next)) {
-            curr.length += next.length;
-            continue;
+        area = &areas[done % num_coroutines];
+        while (!area->done) {
+            main_loop_wait(false);
         }
 
-        if (curr.length > 0) {
-            ret = dump_map_entry(output_format, &curr, &next);
-            if (ret < 0) {
-                goto out;
+        for (i = 0; i < area->entries->len; i++) {
+            next = g_array_index(area->entries, MapEntry, i);
+
+            if (entry_mergeable(&curr, &next)) {
+                curr.length += next.length;
+                continue;
             }
+
+            if (curr.length > 0) {
+                ret = dump_map_entry(output_format, &curr, &next);
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            curr = next;
+        }
+
+        if (area->ret < 0) {
+            ret = area->ret;
+            error_report("Could not read file metadata: %s", strerror(-ret));
+            goto out;
         }
-        curr = next;
+        img_map_area_finish(area);
+        done++;
     }
 
     ret = dump_map_entry(output_format, &curr, NULL);
@@ -3296,6 +3547,10 @@ static int img_map(int argc, char **argv)
     }
 
 out:
+    /* Wait for the areas still being queried */
+    for (; done < started; done++) {
+        img_map_area_finish(&areas[done % num_coroutines]);
+    }
     blk_unref(blk);
     return ret < 0;
 }
@@ -483,6 +483,33 @@ vu_log_write(VuDev *dev, uint64_t address, uint64_t length)
     vu_log_kick(dev);
 }
 
+/*
+ * Log a write to our mapping of guest memory.  Only used for areas whose
+ * guest physical address isn't at hand, so translate lazily.
+ */
+static void
+vu_log_write_va(VuDev *dev, const void *va, uint64_t length)
+{
+    uint64_t addr = (uintptr_t)va;
+    int i;
+
+    if (!(dev->features & (1ULL << VHOST_F_LOG_ALL)) ||
+        !dev->log_table || !length) {
+        return;
+    }
+
+    for (i = 0; i < dev->nregions; i++) {
+        VuDevRegion *r = &dev->regions[i];
+        uint64_t start = r->mmap_addr + r->mmap_offset;
+
+        if (addr >= start && addr < start + r->size) {
+            vu_log_write(dev, addr - start + r->gpa,
+                         MIN(length, start + r->size - addr));
+            return;
+        }
+    }
+}
+
 static void
 vu_kick_cb(VuDev *dev, int condition, void *data)
 {
@@ -1100,6 +1127,19 @@ vu_set_vring_num_exec(VuDev *dev, VhostUserMsg *vmsg)
     DPRINT("State.num:   %u\n", num);
     dev->vq[index].vring.num = num;
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        VuVirtqUsedElem *used_elems;
+
+        used_elems = realloc(dev->vq[index].used_elems,
+                             num * sizeof(used_elems[0]));
+        if (num && !used_elems) {
+            vu_panic(dev, "Failed to allocate used elements for vq: %u",
+                     index);
+            return false;
+        }
+        dev->vq[index].used_elems = used_elems;
+    }
+
     return false;
 }
 
@@ -1128,6 +1168,11 @@ vu_set_vring_addr_exec(VuDev *dev, VhostUserMsg *vmsg)
         return false;
     }
 
+    /* The packed layout has no used index, SET_VRING_BASE provides it */
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return false;
+    }
+
     vq->used_idx = le16toh(vq->vring.used->idx);
 
     if (vq->last_avail_idx != vq->used_idx) {
@@ -1154,6 +1199,22 @@ vu_set_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
 
     DPRINT("State.index: %u\n", index);
     DPRINT("State.num:   %u\n", num);
+
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        VuVirtq *vq = &dev->vq[index];
+
+        /*
+         * Bits 0-14 are last_avail_idx, bit 15 its wrap counter; bits 16-30
+         * are used_idx and bit 31 its wrap counter.
+         */
+        vq->shadow_avail_idx = vq->last_avail_idx = num & 0x7fff;
+        vq->last_avail_wrap_counter = !!(num & 0x8000);
+        vq->used_idx = (num >> 16) & 0x7fff;
+        vq->used_wrap_counter = !!(num & 0x80000000);
+        vq->signalled_used_valid = false;
+        return false;
+    }
+
     dev->vq[index].shadow_avail_idx = dev->vq[index].last_avail_idx = num;
 
     return false;
@@ -1165,7 +1226,17 @@ vu_get_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
     unsigned int index = vmsg->payload.state.index;
 
     DPRINT("State.index: %u\n", index);
-    vmsg->payload.state.num = dev->vq[index].last_avail_idx;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        VuVirtq *vq = &dev->vq[index];
+
+        /* Same encoding as in vu_set_vring_base_exec() */
+        vmsg->payload.state.num = vq->last_avail_idx |
+                                  vq->last_avail_wrap_counter << 15 |
+                                  (uint32_t)vq->used_idx << 16 |
+                                  (uint32_t)vq->used_wrap_counter << 31;
+    } else {
+        vmsg->payload.state.num = dev->vq[index].last_avail_idx;
+    }
     vmsg->size = sizeof(vmsg->payload.state);
 
     dev->vq[index].started = false;
@@ -1231,7 +1302,8 @@ vu_check_queue_inflights(VuDev *dev, VuVirtq *vq)
 {
     int i = 0;
 
-    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) ||
+        vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
         return 0;
     }
 
@@ -2011,6 +2083,9 @@ vu_deinit(VuDev *dev)
             vq->resubmit_list = NULL;
         }
 
+        free(vq->used_elems);
+        vq->used_elems = NULL;
+
         vq->inflight = NULL;
     }
 
@@ -2081,6 +2156,8 @@ vu_init(VuDev *dev,
         dev->vq[i] = (VuVirtq) {
             .call_fd = -1, .kick_fd = -1, .err_fd = -1,
             .notification = true,
+            .last_avail_wrap_counter = true,
+            .used_wrap_counter = true,
         };
     }
 
@@ -2228,10 +2305,10 @@ virtqueue_read_next_desc(VuDev *dev, struct vring_desc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
-void
-vu_queue_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
-                         unsigned int *out_bytes,
-                         unsigned max_in_bytes, unsigned max_out_bytes)
+static void
+vu_queue_split_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
 {
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
@@ -2339,6 +2416,196 @@ err:
     goto done;
 }
 
+static inline bool
+vring_packed_desc_is_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Read descriptor @i of @table into @desc, converting to host endianness */
+static void
+vring_packed_desc_read(struct vring_packed_desc *desc,
+                       struct vring_packed_desc *table,
+                       unsigned int i, bool strict_order)
+{
+    desc->flags = le16toh(table[i].flags);
+
+    if (strict_order) {
+        /* Make sure flags is read before the rest fields. */
+        smp_rmb();
+    }
+
+    desc->addr = le64toh(table[i].addr);
+    desc->len = le32toh(table[i].len);
+    desc->id = le16toh(table[i].id);
+}
+
+/* Map the indirect table described by @desc, copying it if it's fragmented */
+static struct vring_packed_desc *
+vring_packed_indirect_table(VuDev *dev, const struct vring_packed_desc *desc,
+                            struct vring_packed_desc *desc_buf,
+                            unsigned int *max)
+{
+    struct vring_packed_desc *table;
+    uint64_t read_len = desc->len;
+
+    if (!desc->len || desc->len % sizeof(struct vring_packed_desc)) {
+        vu_panic(dev, "Invalid size for indirect buffer table");
+        return NULL;
+    }
+
+    table = vu_gpa_to_va(dev, &read_len, desc->addr);
+    if (unlikely(table && read_len != desc->len)) {
+        /* Failed to use zero copy */
+        table = NULL;
+        if (!virtqueue_read_indirect_desc(dev, (struct vring_desc *)desc_buf,
+                                          desc->addr, desc->len)) {
+            table = desc_buf;
+        }
+    }
+    if (!table) {
+        vu_panic(dev, "Invalid indirect buffer table");
+        return NULL;
+    }
+
+    *max = desc->len / sizeof(struct vring_packed_desc);
+    return table;
+}
+
+static int
+virtqueue_packed_read_next_desc(VuVirtq *vq, struct vring_packed_desc *desc,
+                                struct vring_packed_desc *table,
+                                unsigned int max, unsigned int *next,
+                                bool indirect)
+{
+    /* If this descriptor says it doesn't chain, we're done. */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return VIRTQUEUE_READ_DESC_DONE;
+    }
+
+    ++*next;
+    if (*next == max) {
+        if (indirect) {
+            return VIRTQUEUE_READ_DESC_DONE;
+        }
+        *next -= vq->vring.num;
+    }
+
+    vring_packed_desc_read(desc, table, *next, false);
+    return VIRTQUEUE_READ_DESC_MORE;
+}
+
+static void
+vu_queue_packed_get_avail_bytes(VuDev *dev, VuVirtq *vq,
+                                unsigned int *in_bytes,
+                                unsigned int *out_bytes,
+                                unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int total_bufs, in_total, out_total;
+    struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+
+    total_bufs = in_total = out_total = 0;
+    if (unlikely(dev->broken) ||
+        unlikely(!vq->vring.avail)) {
+        goto done;
+    }
+
+    for (;;) {
+        struct vring_packed_desc *table = vq->vring.packed_desc;
+        struct vring_packed_desc desc;
+        unsigned int max = vq->vring.num;
+        unsigned int num_bufs = total_bufs;
+        unsigned int i = idx;
+        bool indirect = false;
+        int rc;
+
+        vring_packed_desc_read(&desc, table, idx, true);
+        if (!vring_packed_desc_is_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                vu_panic(dev, "Looped descriptor");
+                goto err;
+            }
+
+            table = vring_packed_indirect_table(dev, &desc, desc_buf, &max);
+            if (!table) {
+                goto err;
+            }
+            indirect = true;
+            num_bufs = i = 0;
+            vring_packed_desc_read(&desc, table, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                vu_panic(dev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+            rc = virtqueue_packed_read_next_desc(vq, &desc, table, max, &i,
+                                                 indirect);
+        } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+        if (indirect) {
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+void
+vu_queue_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
+                         unsigned int *out_bytes,
+                         unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_get_avail_bytes(dev, vq, in_bytes, out_bytes,
+                                        max_in_bytes, max_out_bytes);
+    } else {
+        vu_queue_split_get_avail_bytes(dev, vq, in_bytes, out_bytes,
+                                       max_in_bytes, max_out_bytes);
+    }
+}
+
 bool
 vu_queue_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int in_bytes,
                      unsigned int out_bytes)
@@ -2361,6 +2628,13 @@ vu_queue_empty(VuDev *dev, VuVirtq *vq)
         return true;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        uint16_t flags;
+
+        flags = le16toh(vq->vring.packed_desc[vq->last_avail_idx].flags);
+        return !vring_packed_desc_is_avail(flags, vq->last_avail_wrap_counter);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return false;
     }
@@ -2368,6 +2642,46 @@ vu_queue_empty(VuDev *dev, VuVirtq *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+static bool
+vring_packed_need_event(VuVirtq *vq, bool wrap, uint16_t off_wrap,
+                        uint16_t new, uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+static bool
+vring_packed_notify(VuDev *dev, VuVirtq *vq)
+{
+    struct vring_packed_desc_event *e = vq->vring.driver_event;
+    uint16_t flags, off_wrap, old, new;
+    bool v;
+
+    flags = le16toh(e->flags);
+    /* Make sure flags is seen before off_wrap */
+    smp_rmb();
+    off_wrap = le16toh(e->off_wrap);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         off_wrap, new, old);
+}
+
 static bool
 vring_notify(VuDev *dev, VuVirtq *vq)
 {
@@ -2383,6 +2697,10 @@ vring_notify(VuDev *dev, VuVirtq *vq)
         return true;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vring_packed_notify(dev, vq);
+    }
+
     if (!vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -2481,11 +2799,54 @@ vring_set_avail_event(VuVirtq *vq, uint16_t val)
     *avail = htole16(val);
 }
 
+/* Ask for a kick once the driver makes the next descriptor available */
+static inline void
+vring_packed_set_avail_event(VuDev *dev, VuVirtq *vq)
+{
+    struct vring_packed_desc_event *e = vq->vring.device_event;
+
+    if (!vq->notification) {
+        return;
+    }
+
+    e->off_wrap = htole16(vq->last_avail_idx |
+                          vq->last_avail_wrap_counter <<
+                          VRING_PACKED_EVENT_F_WRAP_CTR);
+    vu_log_write(dev, vq->vring.log_guest_addr +
+                 offsetof(struct vring_packed_desc_event, off_wrap),
+                 sizeof(e->off_wrap));
+}
+
+static void
+vring_packed_set_notification(VuDev *dev, VuVirtq *vq, int enable)
+{
+    struct vring_packed_desc_event *e = vq->vring.device_event;
+    uint16_t flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(dev, vq);
+        /* Make sure off_wrap is written before flags */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+
+    e->flags = htole16(flags);
+    vu_log_write(dev, vq->vring.log_guest_addr +
+                 offsetof(struct vring_packed_desc_event, flags),
+                 sizeof(e->flags));
+}
+
 void
 vu_queue_set_notification(VuDev *dev, VuVirtq *vq, int enable)
 {
     vq->notification = enable;
-    if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vring_packed_set_notification(dev, vq, enable);
+    } else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -2634,6 +2995,7 @@ vu_queue_map_desc(VuDev *dev, VuVirtq *vq, unsigned int idx, size_t sz)
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = idx;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_sg[i] = iov[i];
     }
@@ -2647,7 +3009,8 @@ vu_queue_map_desc(VuDev *dev, VuVirtq *vq, unsigned int idx, size_t sz)
 static int
 vu_queue_inflight_get(VuDev *dev, VuVirtq *vq, int desc_idx)
 {
-    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) ||
+        vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
         return 0;
     }
 
@@ -2664,7 +3027,8 @@ vu_queue_inflight_get(VuDev *dev, VuVirtq *vq, int desc_idx)
 static int
 vu_queue_inflight_pre_put(VuDev *dev, VuVirtq *vq, int desc_idx)
 {
-    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) ||
+        vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
         return 0;
     }
 
@@ -2680,7 +3044,8 @@ vu_queue_inflight_pre_put(VuDev *dev, VuVirtq *vq, int desc_idx)
 static int
 vu_queue_inflight_post_put(VuDev *dev, VuVirtq *vq, int desc_idx)
 {
-    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+    if (!vu_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) ||
+        vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
         return 0;
     }
 
@@ -2699,6 +3064,99 @@ vu_queue_inflight_post_put(VuDev *dev, VuVirtq *vq, int desc_idx)
     return 0;
 }
 
+static void *
+vu_queue_packed_pop(VuDev *dev, VuVirtq *vq, size_t sz)
+{
+    struct vring_packed_desc *table = vq->vring.packed_desc;
+    struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+    struct vring_packed_desc desc;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int out_num = 0, in_num = 0;
+    unsigned int max = vq->vring.num;
+    unsigned int i = vq->last_avail_idx;
+    unsigned int ndescs = 0;
+    bool indirect = false;
+    VuVirtqElement *elem;
+    uint16_t id;
+    int rc;
+
+    if (vu_queue_empty(dev, vq)) {
+        return NULL;
+    }
+
+    if (vq->inuse >= vq->vring.num) {
+        vu_panic(dev, "Virtqueue size exceeded");
+        return NULL;
+    }
+
+    /* vu_queue_empty() checked the flags, read the rest after them. */
+    vring_packed_desc_read(&desc, table, i, true);
+    id = desc.id;
+
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        table = vring_packed_indirect_table(dev, &desc, desc_buf, &max);
+        if (!table) {
+            return NULL;
+        }
+        indirect = true;
+        i = 0;
+        vring_packed_desc_read(&desc, table, i, false);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            if (!virtqueue_map_desc(dev, &in_num, iov + out_num,
+                                    VIRTQUEUE_MAX_SIZE - out_num, true,
+                                    desc.addr, desc.len)) {
+                return NULL;
+            }
+        } else {
+            if (in_num) {
+                vu_panic(dev, "Incorrect order for descriptors");
+                return NULL;
+            }
+            if (!virtqueue_map_desc(dev, &out_num, iov,
+                                    VIRTQUEUE_MAX_SIZE, false,
+                                    desc.addr, desc.len)) {
+                return NULL;
+            }
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++ndescs > max) {
+            vu_panic(dev, "Looped descriptor");
+            return NULL;
+        }
+        rc = virtqueue_packed_read_next_desc(vq, &desc, table, max, &i,
+                                             indirect);
+    } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = indirect ? 1 : ndescs;
+    for (i = 0; i < out_num; i++) {
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse += elem->ndescs;
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+
+    if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(dev, vq);
+    }
+
+    return elem;
+}
+
 void *
 vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
 {
@@ -2711,6 +3169,10 @@ vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
         return NULL;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vu_queue_packed_pop(dev, vq, sz);
+    }
+
     if (unlikely(vq->resubmit_list && vq->resubmit_num > 0)) {
         i = (--vq->resubmit_num);
         elem = vu_queue_map_desc(dev, vq, vq->resubmit_list[i].index, sz);
@@ -2762,15 +3224,30 @@ static void
 vu_queue_detach_element(VuDev *dev, VuVirtq *vq, VuVirtqElement *elem,
                         size_t len)
 {
-    vq->inuse--;
+    vq->inuse -= elem->ndescs;
     /* unmap, when DMA support is added */
 }
 
+static void
+vu_queue_packed_rewind(VuVirtq *vq, unsigned int num)
+{
+    if (vq->last_avail_idx < num) {
+        vq->last_avail_idx = vq->vring.num + vq->last_avail_idx - num;
+        vq->last_avail_wrap_counter ^= 1;
+    } else {
+        vq->last_avail_idx -= num;
+    }
+}
+
 void
 vu_queue_unpop(VuDev *dev, VuVirtq *vq, VuVirtqElement *elem,
                size_t len)
 {
-    vq->last_avail_idx--;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_rewind(vq, elem->ndescs);
+    } else {
+        vq->last_avail_idx--;
+    }
     vu_queue_detach_element(dev, vq, elem, len);
 }
 
@@ -2780,7 +3257,11 @@ vu_queue_rewind(VuDev *dev, VuVirtq *vq, unsigned int num)
     if (num > vq->inuse) {
         return false;
     }
-    vq->last_avail_idx -= num;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_rewind(vq, num);
+    } else {
+        vq->last_avail_idx -= num;
+    }
     vq->inuse -= num;
     return true;
 }
@@ -2857,6 +3338,32 @@ vu_log_queue_fill(VuDev *dev, VuVirtq *vq,
               == VIRTQUEUE_READ_DESC_MORE));
 }
 
+/*
+ * The descriptors may already have been overwritten by earlier used
+ * entries, so log the written part of the buffer from the mapped iovecs.
+ */
+static void
+vu_queue_packed_fill(VuDev *dev, VuVirtq *vq,
+                     const VuVirtqElement *elem,
+                     unsigned int len, unsigned int idx)
+{
+    size_t written = len;
+    unsigned int i;
+
+    for (i = 0; i < elem->in_num && written; i++) {
+        size_t min = MIN(elem->in_sg[i].iov_len, written);
+
+        vu_log_write_va(dev, elem->in_sg[i].iov_base, min);
+        written -= min;
+    }
+
+    vq->used_elems[idx] = (VuVirtqUsedElem) {
+        .id = elem->index,
+        .ndescs = elem->ndescs,
+        .len = len,
+    };
+}
+
 void
 vu_queue_fill(VuDev *dev, VuVirtq *vq,
               const VuVirtqElement *elem,
@@ -2869,6 +3376,11 @@ vu_queue_fill(VuDev *dev, VuVirtq *vq,
         return;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_fill(dev, vq, elem, len, idx);
+        return;
+    }
+
     vu_log_queue_fill(dev, vq, elem, len);
 
     idx = (idx + vq->used_idx) % vq->vring.num;
@@ -2889,6 +3401,79 @@ void vring_used_idx_set(VuDev *dev, VuVirtq *vq, uint16_t val)
     vq->used_idx = val;
 }
 
+static void
+vring_packed_desc_write(VuDev *dev, VuVirtq *vq, const VuVirtqUsedElem *uelem,
+                        unsigned int i, bool wrap, bool write_flags)
+{
+    struct vring_packed_desc *desc = &vq->vring.packed_desc[i];
+    uint16_t flags = 0;
+
+    if (wrap) {
+        flags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+                (1 << VRING_PACKED_DESC_F_USED);
+    }
+
+    if (!write_flags) {
+        desc->id = htole16(uelem->id);
+        desc->len = htole32(uelem->len);
+        vu_log_write_va(dev, &desc->len,
+                        sizeof(desc->len) + sizeof(desc->id));
+        return;
+    }
+
+    desc->flags = htole16(flags);
+    vu_log_write_va(dev, &desc->flags, sizeof(desc->flags));
+}
+
+static void
+vu_queue_packed_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
+{
+    unsigned int i, ndescs = 0;
+    uint16_t head = vq->used_idx;
+    bool head_wrap = vq->used_wrap_counter;
+
+    if (!count) {
+        return;
+    }
+
+    /*
+     * Used descriptors are laid out back to back, each element taking as
+     * many slots as it had descriptors.  Write the head's flags last so
+     * the driver sees the whole batch at once.
+     */
+    for (i = 0; i < count; i++) {
+        const VuVirtqUsedElem *uelem = &vq->used_elems[i];
+        unsigned int pos = head + ndescs;
+        bool wrap = head_wrap;
+
+        if (pos >= vq->vring.num) {
+            pos -= vq->vring.num;
+            wrap ^= 1;
+        }
+
+        vring_packed_desc_write(dev, vq, uelem, pos, wrap, false);
+        if (i) {
+            /* Make sure id and len are written before flags. */
+            smp_wmb();
+            vring_packed_desc_write(dev, vq, uelem, pos, wrap, true);
+        }
+        ndescs += uelem->ndescs;
+    }
+
+    /* Make sure the rest of the batch is visible before the head. */
+    smp_wmb();
+    vring_packed_desc_write(dev, vq, &vq->used_elems[0], head, head_wrap,
+                            true);
+
+    vq->inuse -= ndescs;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+        vq->signalled_used_valid = false;
+    }
+}
+
 void
 vu_queue_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
 {
@@ -2899,6 +3484,11 @@ vu_queue_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
         return;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_flush(dev, vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
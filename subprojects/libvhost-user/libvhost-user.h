@@ -234,7 +234,11 @@ typedef int (*vu_set_config_cb) (VuDev *dev, const uint8_t *data,
                                  uint32_t flags);
 
 typedef struct VuDevIface {
-    /* called by VHOST_USER_GET_FEATURES to get the features bitmask */
+    /*
+     * called by VHOST_USER_GET_FEATURES to get the features bitmask.
+     * Devices may offer VIRTIO_F_RING_PACKED, but inflight tracking
+     * (VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) only covers split rings.
+     */
     vu_get_features_cb get_features;
     /* enable vhost implementation features */
     vu_set_features_cb set_features;
@@ -264,9 +268,23 @@ typedef void (*vu_queue_handler_cb) (VuDev *dev, int qidx);
 
 typedef struct VuRing {
     unsigned int num;
-    struct vring_desc *desc;
-    struct vring_avail *avail;
-    struct vring_used *used;
+    /*
+     * With VIRTIO_F_RING_PACKED the ring consists of the descriptor ring,
+     * the driver event suppression area (at the "avail" address) and the
+     * device event suppression area (at the "used" address).
+     */
+    union {
+        struct vring_desc *desc;
+        struct vring_packed_desc *packed_desc;
+    };
+    union {
+        struct vring_avail *avail;
+        struct vring_packed_desc_event *driver_event;
+    };
+    union {
+        struct vring_used *used;
+        struct vring_packed_desc_event *device_event;
+    };
     uint64_t log_guest_addr;
     uint32_t flags;
 } VuRing;
@@ -315,6 +333,13 @@ typedef struct VuVirtqInflightDesc {
     uint64_t counter;
 } VuVirtqInflightDesc;
 
+/* A buffer completed with vu_queue_fill(), for packed virtqueues */
+typedef struct VuVirtqUsedElem {
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+} VuVirtqUsedElem;
+
 typedef struct VuVirtq {
     VuRing vring;
 
@@ -343,6 +368,15 @@ typedef struct VuVirtq {
     /* Notification enabled? */
     bool notification;
 
+    /*
+     * Packed virtqueues only: ring wrap counters for last_avail_idx and
+     * used_idx, and the buffers filled since the last vu_queue_flush().
+     */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+    VuVirtqUsedElem *used_elems;
+
+    /* In use elements (split) or descriptors (packed) */
     int inuse;
 
     vu_queue_handler_cb handler;
@@ -434,11 +468,17 @@ struct VuDev {
 };
 
 typedef struct VuVirtqElement {
+    /* Head descriptor index (split) or buffer id (packed) */
     unsigned int index;
     unsigned int out_num;
     unsigned int in_num;
     struct iovec *in_sg;
     struct iovec *out_sg;
+    /*
+     * Descriptor ring entries used by the element, 1 for split rings.
+     * Last, so that the offsets of the other fields stay unchanged.
+     */
+    unsigned int ndescs;
 } VuVirtqElement;
 
 /**
@@ -627,7 +667,8 @@ void vu_queue_unpop(VuDev *dev, VuVirtq *vq, VuVirtqElement *elem,
  * @num: number of elements to push back
  *
  * Pretend that elements weren't popped from the virtqueue.  The next
- * virtqueue_pop() will refetch the oldest element.
+ * virtqueue_pop() will refetch the oldest element.  For packed virtqueues
+ * @num counts descriptor ring entries rather than elements.
  *
  * Returns: true on success, false if @num is greater than the number of in use
  * elements.
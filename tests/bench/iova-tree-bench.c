@@ -0,0 +1,81 @@
+/*
+ * IOVA tree allocation benchmark
+ *
+ * Models the shadow virtqueue usage of the tree: fill the IOVA space with
+ * many small mappings, then keep unmapping a random one and allocating a
+ * new one, so every allocation has to look for a hole.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/iova-tree.h"
+
+#define IOVA_BENCH_CHURN (1 << 18)
+#define IOVA_BENCH_IOVA_LAST ((1ULL << 48) - 1)
+
+static void test_alloc_churn(const void *opaque)
+{
+    size_t nr_maps = GPOINTER_TO_SIZE(opaque);
+    g_autofree hwaddr *iovas = g_new(hwaddr, nr_maps);
+    IOVATree *tree = iova_tree_new();
+    GRand *rand = g_rand_new_with_seed(nr_maps);
+    size_t i;
+
+    for (i = 0; i < nr_maps; i++) {
+        DMAMap map = {
+            .translated_addr = i * qemu_real_host_page_size(),
+            .size = g_rand_int_range(rand, 1, 4) *
+                    qemu_real_host_page_size() - 1,
+            .perm = IOMMU_RW,
+        };
+
+        g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0,
+                                            IOVA_BENCH_IOVA_LAST), ==,
+                        IOVA_OK);
+        iovas[i] = map.iova;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < IOVA_BENCH_CHURN; i++) {
+        size_t victim = g_rand_int_range(rand, 0, nr_maps);
+        const DMAMap *old = iova_tree_find_address(tree, iovas[victim]);
+        DMAMap map = {
+            .translated_addr = old->translated_addr,
+            .size = g_rand_int_range(rand, 1, 4) *
+                    qemu_real_host_page_size() - 1,
+            .perm = IOMMU_RW,
+        };
+
+        iova_tree_remove(tree, *old);
+        g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0,
+                                            IOVA_BENCH_IOVA_LAST), ==,
+                        IOVA_OK);
+        iovas[victim] = map.iova;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("%zu mappings: %.0f ns per unmap + map", nr_maps,
+                   g_test_timer_last() * 1e9 / IOVA_BENCH_CHURN);
+
+    g_rand_free(rand);
+    iova_tree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t nr_maps[] = { 1024, 16384, 65536 };
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(nr_maps); i++) {
+        g_autofree char *name =
+            g_strdup_printf("/iova-tree/benchmark/alloc/maps-%zu", nr_maps[i]);
+
+        g_test_add_data_func(name, GSIZE_TO_POINTER(nr_maps[i]),
+                             test_alloc_churn);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,275 @@
+/*
+ * virtio-net transmit packet rate through the net backends
+ *
+ * Boots QEMU under qtest with a virtio-net-pci device whose peer is a
+ * "socket" netdev, which sends each packet with its own sendto(), or a
+ * "dgram" netdev, which gets whole batches through its receive_iov_batch
+ * hook and sends them with sendmmsg().  Both sit on one end of a
+ * datagram socketpair.  The bench makes batches of packets available on
+ * the transmit virtqueue, kicks once per batch and counts the packets
+ * that come out of the other end of the socketpair.
+ *
+ * The "tap" netdev also gets whole batches, and writes them with one
+ * io_uring_enter() if QEMU was built with io_uring.  It needs a tap
+ * device, which the bench creates and brings up itself, so those cases
+ * are skipped without CAP_NET_ADMIN.  Packets written to the tap device
+ * are counted in its rx_packets statistic.
+ *
+ * Every batch also costs a few qtest round trips, so the rates are lower
+ * than with a real guest driver; compare backends and batch sizes with
+ * each other rather than with other numbers.
+ *
+ * Needs QTEST_QEMU_BINARY to point to qemu-system-x86_64 or
+ * qemu-system-i386.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "tests/qtest/libqos/libqos-pc.h"
+#include "tests/qtest/libqos/virtio.h"
+#include "tests/qtest/libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_net.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#define NET_TX_BENCH_PACKETS (1 << 18)
+#define NET_TX_BENCH_DEVFN QPCI_DEVFN(4, 0)
+#define NET_TX_BENCH_TXQ 1
+
+typedef struct NetTxBenchOpts {
+    const char *backend;
+    size_t frame_len;
+    int batch;
+} NetTxBenchOpts;
+
+typedef struct NetTxBenchSink {
+    int fd;
+    uint64_t packets;
+    QemuThread thread;
+} NetTxBenchSink;
+
+static void *sink_thread(void *opaque)
+{
+    NetTxBenchSink *sink = opaque;
+    char buf[2048];
+
+    /* An empty datagram from the bench stops the sink */
+    while (recv(sink->fd, buf, sizeof(buf), 0) > 0) {
+        qatomic_inc(&sink->packets);
+    }
+    return NULL;
+}
+
+/* Create a tap device and bring it up, or return -1 */
+static int tap_open(char ifname[IFNAMSIZ])
+{
+    struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
+    int fd, sock;
+
+    /* QEMU inherits it */
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(sock, >=, 0);
+    g_assert_cmpint(ioctl(sock, SIOCGIFFLAGS, &ifr), ==, 0);
+    ifr.ifr_flags |= IFF_UP;
+    g_assert_cmpint(ioctl(sock, SIOCSIFFLAGS, &ifr), ==, 0);
+    close(sock);
+
+    memcpy(ifname, ifr.ifr_name, IFNAMSIZ);
+    return fd;
+}
+
+static uint64_t tap_rx_packets(const char *ifname)
+{
+    g_autofree char *path = g_strdup_printf("/sys/class/net/%s/statistics/"
+                                            "rx_packets", ifname);
+    g_autofree char *contents = NULL;
+
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    return g_ascii_strtoull(contents, NULL, 10);
+}
+
+static QOSState *bench_boot(const NetTxBenchOpts *opts, int fd)
+{
+    if (!strcmp(opts->backend, "tap")) {
+        return qtest_pc_boot("-netdev tap,id=n0,fd=%d "
+                             "-device virtio-net-pci,netdev=n0,addr=04.0",
+                             fd);
+    }
+    if (!strcmp(opts->backend, "dgram")) {
+        return qtest_pc_boot("-netdev dgram,id=n0,local.type=fd,local.str=%d "
+                             "-device virtio-net-pci,netdev=n0,addr=04.0",
+                             fd);
+    }
+    return qtest_pc_boot("-netdev socket,id=n0,fd=%d "
+                         "-device virtio-net-pci,netdev=n0,addr=04.0", fd);
+}
+
+static void test_tx_rate(const void *opaque)
+{
+    const NetTxBenchOpts *opts = opaque;
+    QPCIAddress addr = { .devfn = NET_TX_BENCH_DEVFN };
+    NetTxBenchSink sink = {};
+    g_autofree uint16_t *ring = g_new(uint16_t, opts->batch);
+    QVirtioPCIDevice *dev;
+    QVirtioDevice *vdev;
+    QVirtQueue *rxq, *txq;
+    QOSState *qs;
+    uint64_t features, bufs, queued = 0;
+    size_t pkt_len;
+    uint16_t avail_idx = 0;
+    uint64_t tap_rx = 0;
+    char ifname[IFNAMSIZ];
+    bool tap = !strcmp(opts->backend, "tap");
+    int sv[2];
+    int i;
+
+    if (tap) {
+        sv[0] = -1;
+        sv[1] = tap_open(ifname);
+        if (sv[1] < 0) {
+            g_test_skip("cannot create a tap device");
+            return;
+        }
+        tap_rx = tap_rx_packets(ifname);
+    } else {
+        g_assert_cmpint(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv), ==, 0);
+    }
+    qs = bench_boot(opts, sv[1]);
+
+    dev = virtio_pci_new(qs->pcibus, &addr);
+    g_assert(dev);
+    vdev = &dev->vdev;
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(vdev);
+    features = qvirtio_get_features(vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_NET_F_CTRL_VQ) |
+                  (1ull << VIRTIO_NET_F_MQ));
+    qvirtio_set_features(vdev, features);
+    rxq = qvirtqueue_setup(vdev, &qs->alloc, 0);
+    txq = qvirtqueue_setup(vdev, &qs->alloc, NET_TX_BENCH_TXQ);
+    qvirtio_set_driver_ok(vdev);
+    g_assert_cmpint(txq->size % opts->batch, ==, 0);
+
+    /*
+     * One descriptor per packet, holding the virtio-net header and a zero
+     * frame; every batch reuses descriptors 0 to batch - 1.
+     */
+    pkt_len = sizeof(struct virtio_net_hdr_mrg_rxbuf) + opts->frame_len;
+    bufs = guest_alloc(&qs->alloc, pkt_len * opts->batch);
+    qtest_memset(qs->qts, bufs, 0, pkt_len * opts->batch);
+    for (i = 0; i < opts->batch; i++) {
+        qvirtqueue_add(qs->qts, txq, bufs + i * pkt_len, pkt_len, false,
+                       false);
+        ring[i] = cpu_to_le16(i);
+    }
+
+    if (!tap) {
+        sink.fd = sv[0];
+        qemu_thread_create(&sink.thread, "sink", sink_thread, &sink,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    g_test_timer_start();
+    while (queued < NET_TX_BENCH_PACKETS) {
+        uint16_t used_idx = avail_idx;
+
+        /* x86 guests are little endian, like modern virtio rings */
+        qtest_memwrite(qs->qts,
+                       txq->avail + 4 + 2 * (avail_idx % txq->size),
+                       ring, opts->batch * sizeof(ring[0]));
+        avail_idx += opts->batch;
+        qtest_writew(qs->qts, txq->avail + 2, avail_idx);
+        vdev->bus->virtqueue_kick(vdev, txq);
+        queued += opts->batch;
+
+        /* The descriptors can only be reused once they are all used */
+        while (used_idx != avail_idx) {
+            used_idx = qtest_readw(qs->qts, txq->used + 2);
+        }
+    }
+    /* A tap device has taken every packet by the time it is used */
+    while (!tap && qatomic_read(&sink.packets) < NET_TX_BENCH_PACKETS) {
+        g_usleep(10);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("%s frame %zu batch %d: %.3f Mpps", opts->backend,
+                   opts->frame_len, opts->batch,
+                   NET_TX_BENCH_PACKETS / g_test_timer_last() / 1e6);
+
+    if (tap) {
+        g_assert_cmpint(tap_rx_packets(ifname) - tap_rx, >=,
+                        NET_TX_BENCH_PACKETS);
+    } else {
+        g_assert_cmpint(send(sv[1], ring, 0, 0), ==, 0);
+        qemu_thread_join(&sink.thread);
+    }
+
+    guest_free(&qs->alloc, bufs);
+    qvirtqueue_cleanup(vdev->bus, txq, &qs->alloc);
+    qvirtqueue_cleanup(vdev->bus, rxq, &qs->alloc);
+    qvirtio_pci_destructor(&dev->obj);
+    g_free(dev);
+    qtest_shutdown(qs);
+    if (!tap) {
+        close(sv[0]);
+    }
+    close(sv[1]);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *backends[] = { "socket", "dgram", "tap" };
+    static const size_t frame_lens[] = { 60, 1514 };
+    static const int batches[] = { 1, 16, 64 };
+    const char *arch;
+    int i, j, k;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!getenv("QTEST_QEMU_BINARY")) {
+        g_printerr("QTEST_QEMU_BINARY must point to a system emulator\n");
+        return 1;
+    }
+    arch = qtest_get_arch();
+    if (strcmp(arch, "x86_64") && strcmp(arch, "i386")) {
+        g_printerr("net-tx-bench needs an x86 emulator, not %s\n", arch);
+        return 1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(backends); i++) {
+        for (j = 0; j < ARRAY_SIZE(frame_lens); j++) {
+            for (k = 0; k < ARRAY_SIZE(batches); k++) {
+                NetTxBenchOpts *opts = g_new(NetTxBenchOpts, 1);
+                g_autofree char *name = NULL;
+
+                opts->backend = backends[i];
+                opts->frame_len = frame_lens[j];
+                opts->batch = batches[k];
+                name = g_strdup_printf("/net/benchmark/tx/%s/frame-%zu/"
+                                       "batch-%d", opts->backend,
+                                       opts->frame_len, opts->batch);
+                g_test_add_data_func_full(name, opts, test_tx_rate, g_free);
+            }
+        }
+    }
+
+    return g_test_run();
+}
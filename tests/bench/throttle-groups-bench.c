@@ -0,0 +1,179 @@
+/*
+ * Throttle group scalability benchmark
+ *
+ * Runs one ThrottleGroupMember per thread, each in its own AioContext,
+ * all in the same group, and has every member issue requests through
+ * throttle_group_co_io_limits_intercept() back to back.  Reports the
+ * request rate the group achieves and the latency of the intercept, both
+ * with a limit of 1M IOPS and with a limit that is never reached, which
+ * shows the cost of the throttling itself.
+ *
+ * Every case runs once with grants and once with x-grants=off, where each
+ * request takes the group lock as it did before grants existed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qom/object.h"
+#include "block/aio.h"
+#include "block/throttle-groups.h"
+
+#define BENCH_REQS_TOTAL (1 << 21)
+#define BENCH_REQ_SIZE 4096
+
+typedef struct BenchOpts {
+    int nb_threads;
+    uint64_t iops;
+    bool grants;
+} BenchOpts;
+
+typedef struct BenchWorker {
+    ThrottleGroupMember tgm;
+    AioContext *ctx;
+    QemuThread thread;
+    int nb_reqs;
+    int64_t *lat;
+    bool done;
+} BenchWorker;
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchWorker *w = opaque;
+    int i;
+
+    for (i = 0; i < w->nb_reqs; i++) {
+        int64_t start = get_clock();
+
+        throttle_group_co_io_limits_intercept(&w->tgm, BENCH_REQ_SIZE, false);
+        w->lat[i] = get_clock() - start;
+    }
+
+    qatomic_set(&w->done, true);
+}
+
+static void *bench_thread(void *opaque)
+{
+    BenchWorker *w = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(w->ctx);
+
+    qemu_coroutine_enter(qemu_coroutine_create(bench_co, w));
+
+    /* Keep serving timers and restarts until the group lets go of us */
+    while (!qatomic_read(&w->done) ||
+           qatomic_read(&w->tgm.restart_pending)) {
+        aio_poll(w->ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void test_throttle_groups(const void *opaque)
+{
+    const BenchOpts *opts = opaque;
+    int nb_reqs = BENCH_REQS_TOTAL / opts->nb_threads;
+    g_autofree BenchWorker *workers = g_new0(BenchWorker, opts->nb_threads);
+    g_autofree int64_t *lat = g_new(int64_t, BENCH_REQS_TOTAL);
+    ThrottleConfig cfg;
+    Object *group;
+    int i;
+
+    group = object_new_with_props("throttle-group", object_get_objects_root(),
+                                  "bench", &error_abort,
+                                  "x-grants", opts->grants ? "on" : "off",
+                                  NULL);
+
+    for (i = 0; i < opts->nb_threads; i++) {
+        BenchWorker *w = &workers[i];
+
+        w->ctx = aio_context_new(&error_abort);
+        w->nb_reqs = nb_reqs;
+        w->lat = &lat[i * nb_reqs];
+        throttle_group_register_tgm(&w->tgm, "bench", w->ctx);
+    }
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = opts->iops;
+    throttle_group_config(&workers[0].tgm, &cfg);
+
+    g_test_timer_start();
+    for (i = 0; i < opts->nb_threads; i++) {
+        qemu_thread_create(&workers[i].thread, "bench", bench_thread,
+                           &workers[i], QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < opts->nb_threads; i++) {
+        qemu_thread_join(&workers[i].thread);
+    }
+    g_test_timer_elapsed();
+
+    qsort(lat, nb_reqs * opts->nb_threads, sizeof(lat[0]), cmp_int64);
+    g_test_message("%s, threads %d limit %" PRIu64 " iops: %.2f Miops, "
+                   "latency p50 %" PRId64 " ns p99 %" PRId64
+                   " ns p99.9 %" PRId64 " ns",
+                   opts->grants ? "grants" : "lock",
+                   opts->nb_threads, opts->iops,
+                   nb_reqs * opts->nb_threads / g_test_timer_last() / 1e6,
+                   lat[nb_reqs * opts->nb_threads / 2],
+                   lat[nb_reqs * opts->nb_threads / 100 * 99],
+                   lat[nb_reqs * opts->nb_threads / 1000 * 999]);
+
+    for (i = 0; i < opts->nb_threads; i++) {
+        BenchWorker *w = &workers[i];
+
+        aio_context_acquire(w->ctx);
+        throttle_group_unregister_tgm(&w->tgm);
+        aio_context_release(w->ctx);
+        aio_context_unref(w->ctx);
+    }
+    object_unparent(group);
+}
+
+int main(int argc, char **argv)
+{
+    static const uint64_t iops[] = { 1000000, 100000000 };
+    static const int nb_threads[] = { 1, 4, 16 };
+    int i, j, k;
+
+    qemu_init_main_loop(&error_abort);
+    module_call_init(MODULE_INIT_QOM);
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(iops); i++) {
+        for (j = 0; j < ARRAY_SIZE(nb_threads); j++) {
+            for (k = 0; k < 2; k++) {
+                BenchOpts *opts = g_new(BenchOpts, 1);
+                g_autofree char *name = NULL;
+
+                opts->iops = iops[i];
+                opts->nb_threads = nb_threads[j];
+                opts->grants = !k;
+                name = g_strdup_printf("/throttle/benchmark/iops-%" PRIu64
+                                       "/threads-%d/%s",
+                                       opts->iops, opts->nb_threads,
+                                       opts->grants ? "grants" : "lock");
+                g_test_add_data_func_full(name, opts, test_throttle_groups,
+                                          g_free);
+            }
+        }
+    }
+
+    return g_test_run();
+}
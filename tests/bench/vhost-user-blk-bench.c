@@ -0,0 +1,640 @@
+/*
+ * vhost-user-blk request rate benchmark
+ *
+ * Connects to a vhost-user-blk export (e.g. qemu-storage-daemon with
+ * --export type=vhost-user-blk,...) as a minimal vhost-user front-end
+ * and drives one virtqueue per thread with random reads (or writes).
+ * Running it against exports with and without queue-iothreads shows how
+ * request processing scales with the number of queues; running it with
+ * and without -P compares split and packed virtqueues, e.g.
+ *
+ *   qemu-storage-daemon --blockdev null-co,node-name=null0,size=1G \
+ *       --export vhost-user-blk,id=exp0,node-name=null0,num-queues=1,\
+ *                addr.type=unix,addr.path=/tmp/vub.sock
+ *   vhost-user-blk-bench -S /tmp/vub.sock -q 256
+ *   vhost-user-blk-bench -S /tmp/vub.sock -q 256 -P
+ *
+ * No reference results have been recorded for the packed layout yet.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/memfd.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "subprojects/libvhost-user/libvhost-user.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define QUEUE_SIZE 1024
+#define SECTOR_SIZE 512
+
+/* One in-flight request: out header, data buffer and status byte */
+typedef struct BenchReq {
+    struct virtio_blk_outhdr hdr;
+    uint8_t status;
+} BenchReq;
+
+typedef struct BenchQueue {
+    unsigned int index;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    struct vring_packed_desc *packed_desc;
+    BenchReq *reqs;
+    uint8_t *bufs;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    /* First packed descriptor made available since the last kick */
+    uint16_t batch_head;
+    uint16_t batch_head_flags;
+    bool batch_pending;
+    int kick_fd;
+    int call_fd;
+    uint64_t seed;
+    uint64_t completed;
+    uint64_t errors;
+    QemuThread thread;
+} QEMU_ALIGNED(64) BenchQueue;
+
+static const char *socket_path;
+static unsigned int n_queues = 1;
+static unsigned int depth = 32;
+static unsigned int block_size = 4096;
+static uint64_t disk_size = 64 * MiB;
+static unsigned int duration = 5;
+static bool do_write;
+static bool packed;
+
+static int sock;
+static uint8_t *mem;
+static size_t mem_size;
+static int mem_fd;
+static BenchQueue *queues;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -S = path of the vhost-user-blk export socket (required)\n"
+    " -n = number of virtqueues, one thread each\n"
+    " -q = requests in flight per virtqueue (max 341)\n"
+    " -b = request size in bytes\n"
+    " -s = size of the region accessed, in MiB\n"
+    " -d = duration in seconds\n"
+    " -w = issue writes instead of reads\n"
+    " -P = use packed virtqueues";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s -S <socket> [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void vu_send(VhostUserRequest request, const void *payload,
+                    uint32_t size, int fd)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = 0x1,
+        .size = size,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &msg, .iov_len = VHOST_USER_HDR_SIZE },
+        { .iov_base = (void *)payload, .iov_len = size },
+    };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr mh = {
+        .msg_iov = iov,
+        .msg_iovlen = size ? 2 : 1,
+    };
+    ssize_t ret;
+
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        ret = sendmsg(sock, &mh, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != VHOST_USER_HDR_SIZE + size) {
+        fprintf(stderr, "vhost-user request %d failed: %s\n", request,
+                strerror(errno));
+        exit(1);
+    }
+}
+
+static bool vu_recv(void *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = recv(sock, buf, len, 0);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf = (uint8_t *)buf + ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static uint64_t vu_get_u64(VhostUserRequest request)
+{
+    VhostUserMsg msg;
+
+    vu_send(request, NULL, 0, -1);
+    if (!vu_recv(&msg, VHOST_USER_HDR_SIZE) ||
+        msg.request != request || msg.size != sizeof(msg.payload.u64) ||
+        !vu_recv(&msg.payload.u64, msg.size)) {
+        fprintf(stderr, "bad reply to vhost-user request %d\n", request);
+        exit(1);
+    }
+    return msg.payload.u64;
+}
+
+static void vu_connect(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "cannot connect to %s: %s\n", socket_path,
+                strerror(errno));
+        exit(1);
+    }
+}
+
+static size_t queue_mem_size(void)
+{
+    size_t rings = ROUND_UP(vring_size(QUEUE_SIZE, 4096), 4096);
+
+    return rings + ROUND_UP(depth * sizeof(BenchReq), 4096) +
+           (size_t)depth * block_size;
+}
+
+/*
+ * Guest physical addresses are offsets into the memfd; the front-end's
+ * own mapping is passed as the "QEMU virtual address" that vring
+ * addresses are expressed in.
+ */
+static uint64_t gpa(const void *p)
+{
+    return (const uint8_t *)p - mem;
+}
+
+static void setup_memory(void)
+{
+    VhostUserMemory memory = {
+        .nregions = 1,
+    };
+    Error *local_err = NULL;
+
+    mem_size = ROUND_UP(queue_mem_size() * n_queues, 2 * MiB);
+    mem = qemu_memfd_alloc("vhost-user-blk-bench", mem_size, 0, &mem_fd,
+                           &local_err);
+    if (!mem) {
+        error_report_err(local_err);
+        exit(1);
+    }
+
+    memory.regions[0] = (VhostUserMemoryRegion) {
+        .guest_phys_addr = 0,
+        .memory_size = mem_size,
+        .userspace_addr = (uintptr_t)mem,
+        .mmap_offset = 0,
+    };
+    vu_send(VHOST_USER_SET_MEM_TABLE, &memory,
+            offsetof(VhostUserMemory, regions) +
+            sizeof(VhostUserMemoryRegion), mem_fd);
+}
+
+static void setup_queue(BenchQueue *q)
+{
+    uint8_t *base = mem + queue_mem_size() * q->index;
+    size_t rings = ROUND_UP(vring_size(QUEUE_SIZE, 4096), 4096);
+    struct vhost_vring_state state = { .index = q->index };
+    struct vhost_vring_addr addr = { .index = q->index };
+    struct vring vr;
+    uint64_t u64;
+
+    vring_init(&vr, QUEUE_SIZE, base, 4096);
+    q->desc = vr.desc;
+    q->avail = vr.avail;
+    q->used = vr.used;
+    /*
+     * A packed ring is the descriptor array followed by the driver and
+     * device event suppression structures, which fits in the same space.
+     */
+    q->packed_desc = (struct vring_packed_desc *)base;
+    q->avail_wrap_counter = true;
+    q->used_wrap_counter = true;
+    q->reqs = (BenchReq *)(base + rings);
+    q->bufs = base + rings + ROUND_UP(depth * sizeof(BenchReq), 4096);
+    q->seed = q->index + 1;
+
+    q->kick_fd = eventfd(0, EFD_CLOEXEC);
+    q->call_fd = eventfd(0, EFD_CLOEXEC);
+    if (q->kick_fd < 0 || q->call_fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    state.num = QUEUE_SIZE;
+    vu_send(VHOST_USER_SET_VRING_NUM, &state, sizeof(state), -1);
+
+    if (packed) {
+        addr.desc_user_addr = (uintptr_t)q->packed_desc;
+        addr.avail_user_addr = (uintptr_t)(q->packed_desc + QUEUE_SIZE);
+        addr.used_user_addr = addr.avail_user_addr +
+                              sizeof(struct vring_packed_desc_event);
+    } else {
+        addr.desc_user_addr = (uintptr_t)q->desc;
+        addr.avail_user_addr = (uintptr_t)q->avail;
+        addr.used_user_addr = (uintptr_t)q->used;
+    }
+    vu_send(VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr), -1);
+
+    /* For packed rings this also carries both wrap counters, initially 1 */
+    state.num = packed ? (1U << 15) | (1U << 31) : 0;
+    vu_send(VHOST_USER_SET_VRING_BASE, &state, sizeof(state), -1);
+
+    u64 = q->index;
+    vu_send(VHOST_USER_SET_VRING_CALL, &u64, sizeof(u64), q->call_fd);
+    /* The back-end starts processing the queue once it has a kick fd */
+    vu_send(VHOST_USER_SET_VRING_KICK, &u64, sizeof(u64), q->kick_fd);
+}
+
+static void vu_setup(void)
+{
+    uint64_t features;
+    unsigned int i;
+
+    vu_connect();
+    vu_send(VHOST_USER_SET_OWNER, NULL, 0, -1);
+
+    features = vu_get_u64(VHOST_USER_GET_FEATURES);
+    if (!(features & (1ULL << VIRTIO_F_VERSION_1))) {
+        fprintf(stderr, "back-end does not offer VIRTIO_F_VERSION_1\n");
+        exit(1);
+    }
+    /*
+     * Without VHOST_USER_F_PROTOCOL_FEATURES the back-end enables all
+     * rings as soon as they are started, so no SET_VRING_ENABLE needed.
+     */
+    if (packed && !(features & (1ULL << VIRTIO_F_RING_PACKED))) {
+        fprintf(stderr, "back-end does not offer VIRTIO_F_RING_PACKED\n");
+        exit(1);
+    }
+    features = 1ULL << VIRTIO_F_VERSION_1;
+    if (packed) {
+        features |= 1ULL << VIRTIO_F_RING_PACKED;
+    }
+    vu_send(VHOST_USER_SET_FEATURES, &features, sizeof(features), -1);
+
+    setup_memory();
+
+    queues = g_new0(BenchQueue, n_queues);
+    for (i = 0; i < n_queues; i++) {
+        queues[i].index = i;
+        setup_queue(&queues[i]);
+    }
+}
+
+static uint64_t xorshift64star(uint64_t *x)
+{
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 2685821657736338717ULL;
+}
+
+static void queue_submit_split(BenchQueue *q, unsigned int i)
+{
+    BenchReq *req = &q->reqs[i];
+    struct vring_desc *d = &q->desc[i * 3];
+    uint16_t head = i * 3;
+
+    d[0].addr = cpu_to_le64(gpa(&req->hdr));
+    d[0].len = cpu_to_le32(sizeof(req->hdr));
+    d[0].flags = cpu_to_le16(VRING_DESC_F_NEXT);
+    d[0].next = cpu_to_le16(head + 1);
+
+    d[1].addr = cpu_to_le64(gpa(q->bufs + (size_t)i * block_size));
+    d[1].len = cpu_to_le32(block_size);
+    d[1].flags = cpu_to_le16(VRING_DESC_F_NEXT |
+                             (do_write ? 0 : VRING_DESC_F_WRITE));
+    d[1].next = cpu_to_le16(head + 2);
+
+    d[2].addr = cpu_to_le64(gpa(&req->status));
+    d[2].len = cpu_to_le32(1);
+    d[2].flags = cpu_to_le16(VRING_DESC_F_WRITE);
+    d[2].next = 0;
+
+    q->avail->ring[q->avail_idx % QUEUE_SIZE] = cpu_to_le16(head);
+    q->avail_idx++;
+}
+
+/*
+ * Requests take three consecutive ring entries with the request slot as
+ * buffer id.  The head's flags are written by queue_kick().
+ */
+static void queue_submit_packed(BenchQueue *q, unsigned int i)
+{
+    BenchReq *req = &q->reqs[i];
+    struct {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+    } chain[3] = {
+        { gpa(&req->hdr), sizeof(req->hdr), VRING_DESC_F_NEXT },
+        { gpa(q->bufs + (size_t)i * block_size), block_size,
+          VRING_DESC_F_NEXT | (do_write ? 0 : VRING_DESC_F_WRITE) },
+        { gpa(&req->status), 1, VRING_DESC_F_WRITE },
+    };
+    unsigned int j;
+
+    for (j = 0; j < ARRAY_SIZE(chain); j++) {
+        struct vring_packed_desc *d = &q->packed_desc[q->avail_idx];
+        uint16_t flags = chain[j].flags;
+
+        if (q->avail_wrap_counter) {
+            flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+        } else {
+            flags |= 1 << VRING_PACKED_DESC_F_USED;
+        }
+
+        d->addr = cpu_to_le64(chain[j].addr);
+        d->len = cpu_to_le32(chain[j].len);
+        d->id = cpu_to_le16(i);
+        if (!q->batch_pending) {
+            q->batch_head = q->avail_idx;
+            q->batch_head_flags = cpu_to_le16(flags);
+            q->batch_pending = true;
+        } else {
+            d->flags = cpu_to_le16(flags);
+        }
+
+        if (++q->avail_idx == QUEUE_SIZE) {
+            q->avail_idx = 0;
+            q->avail_wrap_counter = !q->avail_wrap_counter;
+        }
+    }
+}
+
+/* Fill the descriptor chain for slot @i and make it available */
+static void queue_submit(BenchQueue *q, unsigned int i)
+{
+    uint64_t blocks = disk_size / block_size;
+    BenchReq *req = &q->reqs[i];
+
+    req->hdr.type = cpu_to_le32(do_write ? VIRTIO_BLK_T_OUT
+                                         : VIRTIO_BLK_T_IN);
+    req->hdr.ioprio = 0;
+    req->hdr.sector = cpu_to_le64(xorshift64star(&q->seed) % blocks *
+                                  (block_size / SECTOR_SIZE));
+    req->status = 0xff;
+
+    if (packed) {
+        queue_submit_packed(q, i);
+    } else {
+        queue_submit_split(q, i);
+    }
+}
+
+static void queue_kick(BenchQueue *q)
+{
+    /* Publish descriptors and ring entries before the index or head */
+    smp_wmb();
+    if (packed) {
+        qatomic_set(&q->packed_desc[q->batch_head].flags,
+                    q->batch_head_flags);
+        q->batch_pending = false;
+    } else {
+        qatomic_set(&q->avail->idx, cpu_to_le16(q->avail_idx));
+    }
+    /* Order the index store before the back-end reads it on kick */
+    smp_mb();
+    if (eventfd_write(q->kick_fd, 1) < 0) {
+        perror("eventfd_write");
+        exit(1);
+    }
+}
+
+/* Return the slot of the next completed request, or -1 if there is none */
+static int queue_next_used(BenchQueue *q)
+{
+    if (packed) {
+        struct vring_packed_desc *d = &q->packed_desc[q->last_used_idx];
+        uint16_t flags = le16_to_cpu(qatomic_read(&d->flags));
+        bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+        int slot;
+
+        if (avail != used || used != q->used_wrap_counter) {
+            return -1;
+        }
+        /* Read the buffer id only after the flags */
+        smp_rmb();
+        slot = le16_to_cpu(d->id);
+
+        q->last_used_idx += 3;
+        if (q->last_used_idx >= QUEUE_SIZE) {
+            q->last_used_idx -= QUEUE_SIZE;
+            q->used_wrap_counter = !q->used_wrap_counter;
+        }
+        return slot;
+    }
+
+    if (q->last_used_idx == le16_to_cpu(qatomic_read(&q->used->idx))) {
+        return -1;
+    }
+    /* Read used ring entries only after the index */
+    smp_rmb();
+    return le32_to_cpu(q->used->ring[q->last_used_idx++ % QUEUE_SIZE].id) / 3;
+}
+
+static void *queue_thread(void *opaque)
+{
+    BenchQueue *q = opaque;
+    unsigned int inflight = depth;
+    unsigned int i;
+
+    for (i = 0; i < depth; i++) {
+        queue_submit(q, i);
+    }
+    queue_kick(q);
+
+    while (inflight) {
+        bool resubmitted = false;
+        eventfd_t cnt;
+        int slot;
+
+        if (eventfd_read(q->call_fd, &cnt) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("eventfd_read");
+            exit(1);
+        }
+
+        while ((slot = queue_next_used(q)) >= 0) {
+            if (q->reqs[slot].status == VIRTIO_BLK_S_OK) {
+                q->completed++;
+            } else {
+                q->errors++;
+            }
+
+            if (qatomic_read(&test_stop)) {
+                inflight--;
+            } else {
+                queue_submit(q, slot);
+                resubmitted = true;
+            }
+        }
+        if (resubmitted) {
+            queue_kick(q);
+        }
+    }
+    return NULL;
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" socket:            %s\n", socket_path);
+    printf(" # of queues:       %u\n", n_queues);
+    printf(" queue depth:       %u\n", depth);
+    printf(" request size:      %u\n", block_size);
+    printf(" region size:       %" PRIu64 " MiB\n", disk_size / MiB);
+    printf(" operation:         %s\n", do_write ? "write" : "read");
+    printf(" virtqueue layout:  %s\n", packed ? "packed" : "split");
+    printf(" duration:          %u\n", duration);
+}
+
+static void pr_stats(void)
+{
+    uint64_t completed = 0, errors = 0;
+    unsigned int i;
+    double iops;
+
+    for (i = 0; i < n_queues; i++) {
+        completed += queues[i].completed;
+        errors += queues[i].errors;
+    }
+    iops = (double)completed / duration;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Requests:           %" PRIu64 " (%" PRIu64 " failed)\n",
+           completed, errors);
+    printf(" Throughput:         %.2f kIOPS\n", iops / 1e3);
+    printf(" Throughput/queue:   %.2f kIOPS/queue\n", iops / 1e3 / n_queues);
+    printf(" Bandwidth:          %.2f MiB/s\n", iops * block_size / MiB);
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_queues; i++) {
+        qemu_thread_create(&queues[i].thread, "vu-blk-bench", queue_thread,
+                           &queues[i], QEMU_THREAD_JOINABLE);
+    }
+
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_queues; i++) {
+        qemu_thread_join(&queues[i].thread);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hS:n:q:b:s:d:wP");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'n':
+            n_queues = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'b':
+            block_size = atoi(optarg);
+            break;
+        case 's':
+            disk_size = (uint64_t)atoi(optarg) * MiB;
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'w':
+            do_write = true;
+            break;
+        case 'P':
+            packed = true;
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+
+    if (!socket_path || !n_queues || !depth || depth > QUEUE_SIZE / 3 ||
+        !block_size || block_size % SECTOR_SIZE ||
+        disk_size < block_size || !duration) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pr_params();
+    vu_setup();
+    run_test();
+    pr_stats();
+
+    close(sock);
+    qemu_memfd_free(mem, mem_size, mem_fd);
+    return 0;
+}
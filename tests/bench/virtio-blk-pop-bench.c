@@ -0,0 +1,187 @@
+/*
+ * virtio-blk request rate with and without batched virtqueue pops
+ *
+ * Boots QEMU under qtest with a virtio-blk-pci device on a null-co node
+ * and makes batches of 512 byte reads available on its virtqueue,
+ * kicking once per batch.  The device pops up to x-pop-batch requests
+ * with one virtqueue_pop_batch() call; x-pop-batch=1 pops them one at a
+ * time, as virtqueue_pop() did.
+ *
+ * Every batch also costs a few qtest round trips, which dominate the
+ * request rate.  The device therefore also runs with x-pop-stats=on and
+ * counts the host ticks (TSC cycles on x86) spent in virtqueue_pop() or
+ * virtqueue_pop_batch() alone; the ticks per request it reports compare
+ * the two without the cost of the qtest protocol.
+ *
+ * Needs QTEST_QEMU_BINARY to point to qemu-system-x86_64 or
+ * qemu-system-i386.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qapi/qmp/qdict.h"
+#include "tests/qtest/libqos/libqos-pc.h"
+#include "tests/qtest/libqos/virtio.h"
+#include "tests/qtest/libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_blk.h"
+
+#define POP_BENCH_REQUESTS (1 << 18)
+#define POP_BENCH_DEVFN QPCI_DEVFN(4, 0)
+#define POP_BENCH_SECTOR_SIZE 512
+/* Header, data and status descriptor */
+#define POP_BENCH_DESCS_PER_REQ 3
+
+#define POP_BENCH_BACKEND "/machine/peripheral/blk0/virtio-backend"
+
+typedef struct PopBenchOpts {
+    int pop_batch;
+    int batch;
+} PopBenchOpts;
+
+static uint64_t pop_bench_get_stat(QTestState *qts, const char *property)
+{
+    QDict *rsp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': "
+                           "{ 'path': %s, 'property': %s } }",
+                           POP_BENCH_BACKEND, property);
+    uint64_t value;
+
+    g_assert(qdict_haskey(rsp, "return"));
+    value = qdict_get_int(rsp, "return");
+    qobject_unref(rsp);
+    return value;
+}
+
+static void test_pop_rate(const void *opaque)
+{
+    const PopBenchOpts *opts = opaque;
+    QPCIAddress addr = { .devfn = POP_BENCH_DEVFN };
+    g_autofree uint16_t *ring = g_new(uint16_t, opts->batch);
+    struct virtio_blk_outhdr hdr = {
+        .type = cpu_to_le32(VIRTIO_BLK_T_IN),
+    };
+    QVirtioPCIDevice *dev;
+    QVirtioDevice *vdev;
+    QVirtQueue *vq;
+    QOSState *qs;
+    uint64_t hdrs, data, status, queued = 0, ticks, popped;
+    uint16_t avail_idx = 0;
+    int i;
+
+    qs = qtest_pc_boot("-blockdev null-co,node-name=null0,size=%d "
+                       "-device virtio-blk-pci,id=blk0,drive=null0,"
+                       "addr=04.0,num-queues=1,x-pop-batch=%d,"
+                       "x-pop-stats=on",
+                       POP_BENCH_SECTOR_SIZE * opts->batch, opts->pop_batch);
+
+    dev = virtio_pci_new(qs->pcibus, &addr);
+    g_assert(dev);
+    vdev = &dev->vdev;
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(vdev);
+    qvirtio_set_features(vdev, qvirtio_get_features(vdev) &
+                               ~(QVIRTIO_F_BAD_FEATURE |
+                                 (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                                 (1ull << VIRTIO_RING_F_EVENT_IDX)));
+    vq = qvirtqueue_setup(vdev, &qs->alloc, 0);
+    qvirtio_set_driver_ok(vdev);
+    g_assert_cmpint(vq->size, >=, POP_BENCH_DESCS_PER_REQ * opts->batch);
+
+    /*
+     * Request i reads sector i into its own buffer; every batch reuses
+     * the same descriptor chains.
+     */
+    hdrs = guest_alloc(&qs->alloc, sizeof(hdr) * opts->batch);
+    data = guest_alloc(&qs->alloc, POP_BENCH_SECTOR_SIZE * opts->batch);
+    status = guest_alloc(&qs->alloc, opts->batch);
+    for (i = 0; i < opts->batch; i++) {
+        hdr.sector = cpu_to_le64(i);
+        qtest_memwrite(qs->qts, hdrs + i * sizeof(hdr), &hdr, sizeof(hdr));
+        ring[i] = cpu_to_le16(qvirtqueue_add(qs->qts, vq,
+                                             hdrs + i * sizeof(hdr),
+                                             sizeof(hdr), false, true));
+        qvirtqueue_add(qs->qts, vq, data + i * POP_BENCH_SECTOR_SIZE,
+                       POP_BENCH_SECTOR_SIZE, true, true);
+        qvirtqueue_add(qs->qts, vq, status + i, 1, true, false);
+    }
+
+    g_test_timer_start();
+    while (queued < POP_BENCH_REQUESTS) {
+        uint16_t used_idx = avail_idx;
+
+        /* x86 guests are little endian, like modern virtio rings */
+        qtest_memwrite(qs->qts,
+                       vq->avail + 4 + 2 * (avail_idx % vq->size),
+                       ring, opts->batch * sizeof(ring[0]));
+        avail_idx += opts->batch;
+        qtest_writew(qs->qts, vq->avail + 2, avail_idx);
+        vdev->bus->virtqueue_kick(vdev, vq);
+        queued += opts->batch;
+
+        /* The descriptors can only be reused once they are all used */
+        while (used_idx != avail_idx) {
+            used_idx = qtest_readw(qs->qts, vq->used + 2);
+        }
+    }
+    g_test_timer_elapsed();
+
+    /* All requests were used, so the queue is idle */
+    ticks = pop_bench_get_stat(qs->qts, "x-pop-ticks");
+    popped = pop_bench_get_stat(qs->qts, "x-pop-requests");
+    g_assert_cmpint(popped, ==, POP_BENCH_REQUESTS);
+
+    g_test_message("x-pop-batch %d, %d requests per kick: %.3f Mreq/s, "
+                   "%.1f ns/req, %.1f ticks/req popping", opts->pop_batch,
+                   opts->batch,
+                   POP_BENCH_REQUESTS / g_test_timer_last() / 1e6,
+                   g_test_timer_last() * 1e9 / POP_BENCH_REQUESTS,
+                   (double)ticks / popped);
+
+    g_assert_cmpint(qtest_readb(qs->qts, status), ==, VIRTIO_BLK_S_OK);
+
+    guest_free(&qs->alloc, hdrs);
+    guest_free(&qs->alloc, data);
+    guest_free(&qs->alloc, status);
+    qvirtqueue_cleanup(vdev->bus, vq, &qs->alloc);
+    qvirtio_pci_destructor(&dev->obj);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
+
+int main(int argc, char **argv)
+{
+    static const int pop_batches[] = { 1, 32 };
+    static const int batches[] = { 1, 8, 32, 64 };
+    const char *arch;
+    int i, j;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!getenv("QTEST_QEMU_BINARY")) {
+        g_printerr("QTEST_QEMU_BINARY must point to a system emulator\n");
+        return 1;
+    }
+    arch = qtest_get_arch();
+    if (strcmp(arch, "x86_64") && strcmp(arch, "i386")) {
+        g_printerr("virtio-blk-pop-bench needs an x86 emulator, not %s\n",
+                   arch);
+        return 1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        for (j = 0; j < ARRAY_SIZE(pop_batches); j++) {
+            PopBenchOpts *opts = g_new(PopBenchOpts, 1);
+            g_autofree char *name = NULL;
+
+            opts->pop_batch = pop_batches[j];
+            opts->batch = batches[i];
+            name = g_strdup_printf("/virtio/blk/benchmark/pop/batch-%d/"
+                                   "x-pop-batch-%d", opts->batch,
+                                   opts->pop_batch);
+            g_test_add_data_func_full(name, opts, test_pop_rate, g_free);
+        }
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,100 @@
+/*
+ * Xor Based Zero Run Length Encoding encoder benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+
+typedef int (*XBZRLEEncodeFunc)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
+
+typedef struct XBZRLEBenchOpts {
+    XBZRLEEncoder encoder;
+    XBZRLEEncodeFunc encode;
+    /* number of modified runs per page, and their length */
+    int runs;
+    int run_len;
+} XBZRLEBenchOpts;
+
+static void test_encode_speed(const void *opaque)
+{
+    const XBZRLEBenchOpts *opts = opaque;
+    const size_t total = 4 * GiB;
+    uint8_t *old_buf = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *dst = g_malloc(XBZRLE_PAGE_SIZE);
+    size_t remain;
+    int i, j;
+
+    for (i = 0; i < opts->runs; i++) {
+        int start = i * (XBZRLE_PAGE_SIZE / opts->runs);
+
+        for (j = 0; j < opts->run_len; j++) {
+            new_buf[start + j] = 1 + (j & 0x7f);
+        }
+    }
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= XBZRLE_PAGE_SIZE) {
+        opts->encode(old_buf, new_buf, XBZRLE_PAGE_SIZE, dst,
+                     XBZRLE_PAGE_SIZE);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("xbzrle(%s): %d runs of %d bytes %.2f MB/sec",
+                   XBZRLEEncoder_str(opts->encoder), opts->runs,
+                   opts->run_len, total / MiB / g_test_timer_last());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(dst);
+}
+
+static void add_encoder(XBZRLEEncoder encoder, XBZRLEEncodeFunc encode)
+{
+    static const int shapes[][2] = {
+        { 0, 0 }, { 1, 8 }, { 16, 8 }, { 64, 16 }, { 256, 1 }, { 8, 256 },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(shapes); i++) {
+        XBZRLEBenchOpts *opts = g_new(XBZRLEBenchOpts, 1);
+        g_autofree char *name = NULL;
+
+        opts->encoder = encoder;
+        opts->encode = encode;
+        opts->runs = shapes[i][0];
+        opts->run_len = shapes[i][1];
+        name = g_strdup_printf("/xbzrle/benchmark/encode/%s/runs-%d-len-%d",
+                               XBZRLEEncoder_str(encoder), opts->runs,
+                               opts->run_len);
+        g_test_add_data_func_full(name, opts, test_encode_speed, g_free);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    XBZRLEEncoder best;
+
+    g_test_init(&argc, &argv, NULL);
+
+    best = xbzrle_encoder();
+    add_encoder(XBZRLE_ENCODER_SCALAR, xbzrle_encode_buffer_int);
+#ifdef CONFIG_AVX2_OPT
+    if (best >= XBZRLE_ENCODER_AVX2) {
+        add_encoder(XBZRLE_ENCODER_AVX2, xbzrle_encode_buffer_avx2);
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (best >= XBZRLE_ENCODER_AVX512) {
+        add_encoder(XBZRLE_ENCODER_AVX512, xbzrle_encode_buffer_avx512);
+    }
+#endif
+
+    return g_test_run();
+}
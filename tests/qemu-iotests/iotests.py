@@ -1219,6 +1219,20 @@ def check_equal_or_none(a, b):
         self.fail("Cannot find %s %s in result:\n%s" %
                   (node_name, file_name, result))
 
+    def assert_read_pattern(self, node_name, offset, length, pattern):
+        """Read from a node with qemu-io over HMP and check the data"""
+        result = self.vm.hmp_qemu_io(node_name,
+                                     f'read -P {pattern} {offset} {length}')
+        self.assertNotIn('Pattern verification failed', result['return'])
+
+    def node_driver_stats(self, node_name):
+        """Return the driver-specific part of the node's blockstats"""
+        result = self.vm.qmp('query-blockstats', query_nodes=True)
+        for node in result['return']:
+            if node.get('node-name') == node_name:
+                return node['driver-specific']
+        self.fail(f'Cannot find {node_name} in query-blockstats')
+
     def assert_json_filename_equal(self, json_filename, reference):
         '''Asserts that the given filename is a json: filename and that its
            content is equal to the given reference object'''
@@ -1524,6 +1524,101 @@ static void test_precopy_unix_xbzrle(void)
     test_precopy_common(&args);
 }
 
+static void test_precopy_file_mapped_ram(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    /* Load RAM from the file with several threads */
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+    migrate_ensure_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    /* The file is complete, load it on the destination */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
+/*
+ * Asynchronous snapshot to a file: the source keeps running while its
+ * write-protected RAM is written out, and the file must still hold the
+ * memory of the moment the snapshot started.
+ */
+static void test_precopy_file_mapped_ram_background(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    /* Needs userfaultfd write protection from the host kernel */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                          "  'arguments': { 'capabilities': ["
+                          "    { 'capability': 'background-snapshot',"
+                          "      'state': true } ] } }");
+    if (!qdict_haskey(rsp, "return")) {
+        qobject_unref(rsp);
+        g_test_skip("background-snapshot is not supported");
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    /* The source only stopped to save the device state */
+    rsp = wait_command(from, "{ 'execute': 'query-status' }");
+    g_assert(qdict_get_bool(rsp, "running"));
+    qobject_unref(rsp);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    /* Checks that the loaded RAM is consistent */
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
 static void test_precopy_tcp_plain(void)
 {
     MigrateCommon args = {
@@ -1902,6 +1997,26 @@ test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "xbzrle");
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_zero_page_start(QTestState *from,
+                                                 QTestState *to)
+{
+    /* multifd-zero-page can only be enabled together with multifd */
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    migrate_set_capability(from, "multifd-zero-page", true);
+    migrate_set_capability(to, "multifd-zero-page", true);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
@@ -1920,6 +2035,15 @@ static void test_multifd_tcp_none(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_zero_page(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zero_page_start,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zlib(void)
 {
     MigrateCommon args = {
@@ -1929,6 +2053,16 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        .iterations = 2,
+    };
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
@@ -2508,6 +2642,10 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix/plain", test_precopy_unix_plain);
     qtest_add_func("/migration/precopy/unix/xbzrle", test_precopy_unix_xbzrle);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+    qtest_add_func("/migration/precopy/file/mapped-ram/background-snapshot",
+                   test_precopy_file_mapped_ram_background);
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/precopy/unix/tls/psk",
                    test_precopy_unix_tls_psk);
@@ -2574,8 +2712,12 @@ int main(int argc, char **argv)
                    test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/plain/cancel",
                    test_multifd_tcp_cancel);
+    qtest_add_func("/migration/multifd/tcp/plain/zero-page",
+                   test_multifd_tcp_zero_page);
     qtest_add_func("/migration/multifd/tcp/plain/zlib",
                    test_multifd_tcp_zlib);
+    qtest_add_func("/migration/multifd/tcp/plain/xbzrle",
+                   test_multifd_tcp_xbzrle);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/plain/zstd",
                    test_multifd_tcp_zstd);
@@ -0,0 +1,221 @@
+/*
+ * QTest testcase for virtio-balloon free page reporting in an iothread
+ *
+ * Guest RAM is backed by a shared file, so that the test can check that
+ * reported pages are discarded from it.  Reports that arrive as several
+ * elements of adjacent chunks are merged into one discard by the device;
+ * all of them must be discarded and completed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/cutils.h"
+#include "qemu/units.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_balloon.h"
+
+#define RAM_SIZE        (128 * MiB)
+#define PAGE_SIZE       (4 * KiB)
+/* Elements per report, descriptors per element, pages per descriptor */
+#define NB_ELEMS        4
+#define NB_DESCS        4
+#define DESC_PAGES      4
+#define REPORT_SIZE     (NB_ELEMS * NB_DESCS * DESC_PAGES * PAGE_SIZE)
+#define BALLOON_SLOT    4
+#define TIMEOUT_US      (30 * 1000 * 1000)
+
+typedef struct BalloonTest {
+    QOSState *qs;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    char *mem_path;
+    uint64_t alloc;
+    uint64_t report;
+} BalloonTest;
+
+static void balloon_test_init(BalloonTest *t)
+{
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(BALLOON_SLOT, 0) };
+    QVirtioDevice *vdev;
+    int fd;
+
+    t->mem_path = g_strdup_printf("%s/qtest-%d-virtio-balloon.XXXXXX",
+                                  g_get_tmp_dir(), getpid());
+    fd = g_mkstemp(t->mem_path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    t->qs = qtest_pc_boot("-m %" PRIu64 "M "
+                          "-object memory-backend-file,id=ram0,mem-path=%s,"
+                          "share=on,size=%" PRIu64 " "
+                          "-machine memory-backend=ram0 "
+                          "-object iothread,id=io0 "
+                          "-device virtio-balloon-pci,id=balloon0,"
+                          "addr=%02x.0,disable-legacy=on,iothread=io0,"
+                          "free-page-reporting=on",
+                          (uint64_t)(RAM_SIZE / MiB), t->mem_path,
+                          (uint64_t)RAM_SIZE,
+                          BALLOON_SLOT);
+
+    t->dev = virtio_pci_new(t->qs->pcibus, &addr);
+    g_assert(t->dev);
+    vdev = &t->dev->vdev;
+    qvirtio_pci_device_enable(t->dev);
+    qvirtio_start_device(vdev);
+    qvirtio_set_features(vdev, (qvirtio_get_features(vdev) &
+                                ~(QVIRTIO_F_BAD_FEATURE |
+                                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                                  (1ull << VIRTIO_RING_F_EVENT_IDX))) |
+                               (1ull << VIRTIO_BALLOON_F_REPORTING));
+
+    /* Inflate, deflate and stats come first, then reporting */
+    t->vq = qvirtqueue_setup(vdev, &t->qs->alloc, 3);
+    qvirtio_set_driver_ok(vdev);
+
+    /* Page aligned memory to report */
+    t->alloc = guest_alloc(&t->qs->alloc, REPORT_SIZE + PAGE_SIZE);
+    t->report = QEMU_ALIGN_UP(t->alloc, PAGE_SIZE);
+}
+
+static void balloon_test_cleanup(BalloonTest *t, bool unplugged)
+{
+    /* An unplugged device cannot be reset or have its queues freed */
+    if (!unplugged) {
+        guest_free(&t->qs->alloc, t->alloc);
+        qvirtqueue_cleanup(t->dev->vdev.bus, t->vq, &t->qs->alloc);
+        qvirtio_pci_destructor(&t->dev->obj);
+    }
+    g_free(t->dev);
+    qtest_shutdown(t->qs);
+    unlink(t->mem_path);
+    g_free(t->mem_path);
+}
+
+/* Bytes of guest RAM that are populated */
+static uint64_t populated_size(BalloonTest *t)
+{
+    struct stat st;
+
+    g_assert_cmpint(stat(t->mem_path, &st), ==, 0);
+    return (uint64_t)st.st_blocks * 512;
+}
+
+/*
+ * Report the whole area as NB_ELEMS elements of NB_DESCS adjacent chunks
+ * each, and kick once
+ */
+static void send_report(BalloonTest *t)
+{
+    QTestState *qts = t->qs->qts;
+    uint64_t chunk = DESC_PAGES * PAGE_SIZE;
+    uint64_t addr = t->report;
+    int i, j;
+
+    for (i = 0; i < NB_ELEMS; i++) {
+        for (j = 0; j < NB_DESCS; j++) {
+            uint32_t desc = qvirtqueue_add(qts, t->vq, addr, chunk, true,
+                                           j < NB_DESCS - 1);
+            if (j == 0) {
+                /* x86 guests are little endian, like modern virtio rings */
+                qtest_writew(qts, t->vq->avail + 4 + 2 * i, desc);
+            }
+            addr += chunk;
+        }
+    }
+    qtest_writew(qts, t->vq->avail + 2, NB_ELEMS);
+    t->dev->vdev.bus->virtqueue_kick(&t->dev->vdev, t->vq);
+}
+
+static void wait_report(BalloonTest *t)
+{
+    gint64 start = g_get_monotonic_time();
+
+    while (qtest_readw(t->qs->qts, t->vq->used + 2) != NB_ELEMS) {
+        g_assert(g_get_monotonic_time() - start <= TIMEOUT_US);
+        g_usleep(1000);
+    }
+}
+
+static void test_report(void)
+{
+    g_autofree uint8_t *buf = g_malloc(REPORT_SIZE);
+    uint64_t populated;
+    BalloonTest t;
+
+    balloon_test_init(&t);
+
+    qtest_memset(t.qs->qts, t.report, 0x5a, REPORT_SIZE);
+    populated = populated_size(&t);
+
+    send_report(&t);
+    wait_report(&t);
+
+    /* All chunks of all elements were discarded */
+    g_assert_cmpint(populated - populated_size(&t), >=, REPORT_SIZE);
+    qtest_memread(t.qs->qts, t.report, buf, REPORT_SIZE);
+    g_assert(buffer_is_zero(buf, REPORT_SIZE));
+
+    balloon_test_cleanup(&t, false);
+}
+
+/* Reports are processed again once the VM is running */
+static void test_report_stopped(void)
+{
+    uint64_t populated;
+    BalloonTest t;
+
+    balloon_test_init(&t);
+
+    qtest_memset(t.qs->qts, t.report, 0x5a, REPORT_SIZE);
+    populated = populated_size(&t);
+
+    qtest_qmp_assert_success(t.qs->qts, "{ 'execute': 'stop' }");
+    send_report(&t);
+    g_usleep(100 * 1000);
+    g_assert_cmpint(qtest_readw(t.qs->qts, t.vq->used + 2), ==, 0);
+    g_assert_cmpint(populated_size(&t), ==, populated);
+
+    qtest_qmp_assert_success(t.qs->qts, "{ 'execute': 'cont' }");
+    wait_report(&t);
+    g_assert_cmpint(populated - populated_size(&t), >=, REPORT_SIZE);
+
+    balloon_test_cleanup(&t, false);
+}
+
+/* Hot-unplug the device while the iothread may be processing a report */
+static void test_report_unplug(void)
+{
+    BalloonTest t;
+
+    balloon_test_init(&t);
+
+    qtest_memset(t.qs->qts, t.report, 0x5a, REPORT_SIZE);
+    send_report(&t);
+    qpci_unplug_acpi_device_test(t.qs->qts, "balloon0", BALLOON_SLOT);
+
+    /* The iothread is still there, and QEMU still responds */
+    qtest_qmp_assert_success(t.qs->qts,
+                             "{ 'execute': 'qom-get', 'arguments': "
+                             "{ 'path': '/objects/io0', "
+                             "'property': 'poll-max-ns' } }");
+
+    balloon_test_cleanup(&t, true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio/balloon/pci/reporting/iothread", test_report);
+    qtest_add_func("/virtio/balloon/pci/reporting/stopped",
+                   test_report_stopped);
+    qtest_add_func("/virtio/balloon/pci/reporting/unplug",
+                   test_report_unplug);
+
+    return g_test_run();
+}
@@ -0,0 +1,440 @@
+/*
+ * QTest testcase for batched virtqueue processing
+ *
+ * virtio-blk pops up to 32 requests per virtqueue_pop_batch() call.  This
+ * test makes rounds of 1 to 42 requests available at once on a queue of
+ * 128 descriptors, so that batches are sometimes full and sometimes
+ * partial, and descriptor chains and batches wrap around the end of the
+ * ring.  It runs with split and packed virtqueues and checks that every
+ * request completes exactly once.
+ *
+ * The same requests also go to a vhost-user-blk export of
+ * qemu-storage-daemon, which covers the virtqueue code of libvhost-user.
+ *
+ * Finally, the completions of single requests check that interrupt
+ * coalescing holds back and later sends the interrupts they need.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+
+#define QUEUE_SIZE      128
+/* Each request is a chain of header, data and status descriptors */
+#define REQ_DESCS       3
+#define NUM_SLOTS       (QUEUE_SIZE / REQ_DESCS)
+#define SECTOR_SIZE     512
+#define TIMEOUT_US      (30 * 1000 * 1000)
+
+#define COALESCE_COMPLETIONS    3
+#define COALESCE_DELAY_US       1000000
+
+typedef struct BatchTestArgs {
+    bool packed;
+    bool vhost_user;
+    /* Extra virtio-blk-pci properties */
+    const char *device_opts;
+    /* Interrupt suppression without VIRTIO_RING_F_EVENT_IDX is simpler */
+    bool no_event_idx;
+} BatchTestArgs;
+
+typedef struct BatchQueue {
+    QOSState *qs;
+    pid_t qsd_pid;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    bool packed;
+    /* Header, data and status of each request slot */
+    uint64_t reqs;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+} BatchQueue;
+
+static uint64_t slot_hdr(BatchQueue *q, unsigned int slot)
+{
+    return q->reqs + slot * (16 + SECTOR_SIZE + 1);
+}
+
+static void desc_write(BatchQueue *q, unsigned int idx, uint64_t addr,
+                       uint32_t len, uint16_t id_or_next, uint16_t flags)
+{
+    uint64_t desc = q->vq->desc + idx * 16;
+
+    /* Modern devices use little endian rings, as do x86 guests */
+    qtest_writeq(q->qs->qts, desc, addr);
+    qtest_writel(q->qs->qts, desc + 8, len);
+    qtest_writew(q->qs->qts, desc + 12, id_or_next);
+    qtest_writew(q->qs->qts, desc + 14, flags);
+}
+
+static void slot_prepare(BatchQueue *q, unsigned int slot)
+{
+    struct virtio_blk_outhdr hdr = {
+        .type = cpu_to_le32(VIRTIO_BLK_T_IN),
+        .sector = cpu_to_le64(slot),
+    };
+    uint8_t status = 0xff;
+
+    qtest_memwrite(q->qs->qts, slot_hdr(q, slot), &hdr, sizeof(hdr));
+    qtest_memwrite(q->qs->qts, slot_hdr(q, slot) + 16 + SECTOR_SIZE,
+                   &status, 1);
+}
+
+static void split_add(BatchQueue *q, unsigned int slot)
+{
+    uint64_t avail = q->vq->avail;
+
+    /* Slot n always uses descriptors 3n to 3n + 2, see batch_queue_init */
+    qtest_writew(q->qs->qts, avail + 4 + 2 * (q->avail_idx % QUEUE_SIZE),
+                 slot * REQ_DESCS);
+    q->avail_idx++;
+}
+
+static uint16_t packed_flags(bool wrap_counter)
+{
+    return wrap_counter ? 1 << VRING_PACKED_DESC_F_AVAIL :
+                          1 << VRING_PACKED_DESC_F_USED;
+}
+
+static void packed_add(BatchQueue *q, unsigned int slot)
+{
+    uint64_t hdr = slot_hdr(q, slot);
+    uint16_t head = q->avail_idx;
+    uint16_t head_flags = VRING_DESC_F_NEXT |
+                          packed_flags(q->avail_wrap_counter);
+    int i;
+
+    for (i = 0; i < REQ_DESCS; i++) {
+        uint64_t addr = hdr + (i == 0 ? 0 : i == 1 ? 16 : 16 + SECTOR_SIZE);
+        uint32_t len = i == 0 ? 16 : i == 1 ? SECTOR_SIZE : 1;
+        uint16_t flags = VRING_DESC_F_WRITE |
+                         (i < REQ_DESCS - 1 ? VRING_DESC_F_NEXT : 0) |
+                         packed_flags(q->avail_wrap_counter);
+
+        /* The head is made available last, once the chain is complete */
+        desc_write(q, q->avail_idx, addr, len, slot, i == 0 ? 0 : flags);
+        if (++q->avail_idx == QUEUE_SIZE) {
+            q->avail_idx = 0;
+            q->avail_wrap_counter = !q->avail_wrap_counter;
+        }
+    }
+    qtest_writew(q->qs->qts, q->vq->desc + head * 16 + 14, head_flags);
+}
+
+/* Returns the slot of the next completed request, or -1 if there is none */
+static int get_used(BatchQueue *q)
+{
+    QTestState *qts = q->qs->qts;
+    uint32_t id;
+
+    if (q->packed) {
+        uint64_t desc = q->vq->desc + q->used_idx * 16;
+        uint16_t flags = qtest_readw(qts, desc + 14);
+        bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+        if (avail != used || used != q->used_wrap_counter) {
+            return -1;
+        }
+        id = qtest_readw(qts, desc + 12);
+        q->used_idx += REQ_DESCS;
+        if (q->used_idx >= QUEUE_SIZE) {
+            q->used_idx -= QUEUE_SIZE;
+            q->used_wrap_counter = !q->used_wrap_counter;
+        }
+    } else {
+        uint64_t used = q->vq->used;
+
+        if (qtest_readw(qts, used + 2) == q->used_idx) {
+            return -1;
+        }
+        id = qtest_readl(qts, used + 4 + 8 * (q->used_idx % QUEUE_SIZE));
+        g_assert_cmpint(id % REQ_DESCS, ==, 0);
+        id /= REQ_DESCS;
+        q->used_idx++;
+    }
+
+    g_assert_cmpint(id, <, NUM_SLOTS);
+    return id;
+}
+
+/* Exports a null-co node over vhost-user on @sock_path */
+static pid_t start_storage_daemon(const char *sock_path)
+{
+    const char *qsd_bin = getenv("QTEST_QEMU_STORAGE_DAEMON_BINARY");
+    g_autofree char *cmd = NULL;
+    int fd = qtest_socket_server(sock_path);
+    pid_t pid;
+
+    cmd = g_strdup_printf("exec %s "
+                          "--blockdev null-co,node-name=disk0,read-zeroes=on "
+                          "--export type=vhost-user-blk,id=exp0,node-name=disk0,"
+                          "addr.type=fd,addr.str=%d,num-queues=1",
+                          qsd_bin, fd);
+    pid = fork();
+    if (pid == 0) {
+        execlp("/bin/sh", "sh", "-c", cmd, NULL);
+        exit(1);
+    }
+    g_assert_cmpint(pid, >, 0);
+    close(fd);
+    return pid;
+}
+
+static void stop_storage_daemon(pid_t pid)
+{
+    int wstatus;
+
+    kill(pid, SIGTERM);
+    g_assert_cmpint(waitpid(pid, &wstatus, 0), ==, pid);
+    g_assert_true(WIFEXITED(wstatus));
+    g_assert_cmpint(WEXITSTATUS(wstatus), ==, 0);
+}
+
+static void batch_queue_init(BatchQueue *q, const BatchTestArgs *args)
+{
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(4, 0) };
+    const char *packed = args->packed ? "on" : "off";
+    QVirtioDevice *vdev;
+    uint64_t features;
+    int i;
+
+    *q = (BatchQueue) {
+        .packed = args->packed,
+        .avail_wrap_counter = true,
+        .used_wrap_counter = true,
+    };
+    if (args->vhost_user) {
+        g_autofree char *sock_path =
+            g_strdup_printf("%s/qtest-%d-vhost-user-blk.sock",
+                            g_get_tmp_dir(), getpid());
+
+        q->qsd_pid = start_storage_daemon(sock_path);
+        q->qs = qtest_pc_boot("-object memory-backend-memfd,id=mem,"
+                              "size=256M,share=on "
+                              "-M memory-backend=mem -m 256M "
+                              "-chardev socket,id=char0,path=%s "
+                              "-device vhost-user-blk-pci,chardev=char0,"
+                              "addr=04.0,disable-legacy=on,num-queues=1,"
+                              "queue-size=%d,packed=%s",
+                              sock_path, QUEUE_SIZE, packed);
+        unlink(sock_path);
+    } else {
+        q->qs = qtest_pc_boot("-drive if=none,id=drive0,format=raw,"
+                              "file=null-co://,file.read-zeroes=on "
+                              "-device virtio-blk-pci,id=blk0,drive=drive0,"
+                              "addr=04.0,disable-legacy=on,num-queues=1,"
+                              "queue-size=%d,packed=%s%s%s",
+                              QUEUE_SIZE, packed,
+                              args->device_opts ? "," : "",
+                              args->device_opts ?: "");
+    }
+
+    q->dev = virtio_pci_new(q->qs->pcibus, &addr);
+    g_assert(q->dev);
+    vdev = &q->dev->vdev;
+    qvirtio_pci_device_enable(q->dev);
+    qvirtio_start_device(vdev);
+
+    features = qvirtio_get_features(vdev);
+    g_assert(!q->packed || (features & (1ull << VIRTIO_F_RING_PACKED)));
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC));
+    if (args->no_event_idx) {
+        features &= ~(1ull << VIRTIO_RING_F_EVENT_IDX);
+    }
+    qvirtio_set_features(vdev, features);
+
+    q->vq = qvirtqueue_setup(vdev, &q->qs->alloc, 0);
+    g_assert_cmpint(q->vq->size, ==, QUEUE_SIZE);
+    q->reqs = guest_alloc(&q->qs->alloc, NUM_SLOTS * (16 + SECTOR_SIZE + 1));
+
+    if (q->packed) {
+        /* qvirtqueue_setup() laid out a split ring */
+        qtest_memset(q->qs->qts, q->vq->desc, 0, QUEUE_SIZE * 16);
+    } else {
+        for (i = 0; i < NUM_SLOTS; i++) {
+            uint64_t hdr = slot_hdr(q, i);
+            int desc = i * REQ_DESCS;
+
+            desc_write(q, desc, hdr, 16, desc + 1, VRING_DESC_F_NEXT);
+            desc_write(q, desc + 1, hdr + 16, SECTOR_SIZE, desc + 2,
+                       VRING_DESC_F_NEXT | VRING_DESC_F_WRITE);
+            desc_write(q, desc + 2, hdr + 16 + SECTOR_SIZE, 1, 0,
+                       VRING_DESC_F_WRITE);
+        }
+    }
+
+    qvirtio_set_driver_ok(vdev);
+}
+
+static void batch_queue_cleanup(BatchQueue *q)
+{
+    guest_free(&q->qs->alloc, q->reqs);
+    qvirtqueue_cleanup(q->dev->vdev.bus, q->vq, &q->qs->alloc);
+    qvirtio_pci_destructor(&q->dev->obj);
+    g_free(q->dev);
+    qtest_shutdown(q->qs);
+    if (q->qsd_pid) {
+        stop_storage_daemon(q->qsd_pid);
+    }
+}
+
+static void test_batches(const void *data)
+{
+    /* Full batches of 32, partial ones and both; the sum is not aligned */
+    static const int round_sizes[] = { 1, 3, 32, 33, NUM_SLOTS, 7, 5, 31 };
+    const BatchTestArgs *args = data;
+    bool packed = args->packed;
+    BatchQueue q;
+    int round;
+
+    if (args->vhost_user && !getenv("QTEST_QEMU_STORAGE_DAEMON_BINARY")) {
+        g_test_skip("QTEST_QEMU_STORAGE_DAEMON_BINARY not set");
+        return;
+    }
+
+    batch_queue_init(&q, args);
+
+    for (round = 0; round < 5 * ARRAY_SIZE(round_sizes); round++) {
+        int n = round_sizes[round % ARRAY_SIZE(round_sizes)];
+        bool done[NUM_SLOTS] = {};
+        gint64 start_time = g_get_monotonic_time();
+        int slot, completed = 0;
+
+        for (slot = 0; slot < n; slot++) {
+            slot_prepare(&q, slot);
+            if (packed) {
+                packed_add(&q, slot);
+            } else {
+                split_add(&q, slot);
+            }
+        }
+        if (!packed) {
+            qtest_writew(q.qs->qts, q.vq->avail + 2, q.avail_idx);
+        }
+        q.dev->vdev.bus->virtqueue_kick(&q.dev->vdev, q.vq);
+
+        while (completed < n) {
+            qtest_clock_step(q.qs->qts, 100);
+            while ((slot = get_used(&q)) >= 0) {
+                uint8_t status;
+
+                g_assert_cmpint(slot, <, n);
+                g_assert_false(done[slot]);
+                done[slot] = true;
+                completed++;
+
+                qtest_memread(q.qs->qts, slot_hdr(&q, slot) + 16 + SECTOR_SIZE,
+                              &status, 1);
+                g_assert_cmpint(status, ==, VIRTIO_BLK_S_OK);
+            }
+            g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+        }
+
+        /* Nothing may complete twice */
+        g_assert_cmpint(get_used(&q), ==, -1);
+    }
+
+    batch_queue_cleanup(&q);
+}
+
+/* Complete one request and return whether it raised an interrupt */
+static bool complete_one(BatchQueue *q)
+{
+    QVirtioDevice *vdev = &q->dev->vdev;
+    gint64 start_time = g_get_monotonic_time();
+    int slot;
+
+    slot_prepare(q, 0);
+    split_add(q, 0);
+    qtest_writew(q->qs->qts, q->vq->avail + 2, q->avail_idx);
+    vdev->bus->virtqueue_kick(vdev, q->vq);
+
+    /* The virtual clock stands still, so no held back interrupt is sent */
+    while ((slot = get_used(q)) < 0) {
+        g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+        g_usleep(100);
+    }
+    g_assert_cmpint(slot, ==, 0);
+
+    return vdev->bus->get_queue_isr_status(vdev, q->vq);
+}
+
+static void test_irq_coalesce(const void *data)
+{
+    BatchQueue q;
+    QDict *rsp, *status;
+
+    batch_queue_init(&q, data);
+
+    /* The third completion reaches the limit, the fourth is left waiting */
+    g_assert_false(complete_one(&q));
+    g_assert_false(complete_one(&q));
+    g_assert_true(complete_one(&q));
+    g_assert_false(complete_one(&q));
+
+    qtest_clock_step(q.qs->qts, COALESCE_DELAY_US * SCALE_US - 1);
+    g_assert_false(q.dev->vdev.bus->get_queue_isr_status(&q.dev->vdev, q.vq));
+    qtest_clock_step(q.qs->qts, 1);
+    g_assert_true(q.dev->vdev.bus->get_queue_isr_status(&q.dev->vdev, q.vq));
+
+    rsp = qtest_qmp(q.qs->qts, "{ 'execute': 'x-query-virtio-queue-status', "
+                    "'arguments': { 'path': "
+                    "'/machine/peripheral/blk0/virtio-backend', "
+                    "'queue': 0 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    status = qdict_get_qdict(qdict_get_qdict(rsp, "return"), "irq-coalesce");
+    g_assert(status);
+    g_assert_cmpint(qdict_get_int(status, "max-completions"), ==,
+                    COALESCE_COMPLETIONS);
+    g_assert_cmpint(qdict_get_int(status, "coalesced"), ==, 3);
+    g_assert_cmpint(qdict_get_int(status, "raised"), ==, 2);
+    g_assert_cmpint(qdict_get_int(status, "timer-fired"), ==, 1);
+    qobject_unref(rsp);
+
+    batch_queue_cleanup(&q);
+}
+
+int main(int argc, char **argv)
+{
+    static const BatchTestArgs split = { .packed = false };
+    static const BatchTestArgs packed = { .packed = true };
+    static const BatchTestArgs vu_split = { .vhost_user = true };
+    static const BatchTestArgs vu_packed = {
+        .packed = true,
+        .vhost_user = true,
+    };
+    static const BatchTestArgs coalesce = {
+        .device_opts = "x-irq-coalesce-max-completions="
+                       stringify(COALESCE_COMPLETIONS) ","
+                       "x-irq-coalesce-max-delay-us="
+                       stringify(COALESCE_DELAY_US),
+        .no_event_idx = true,
+    };
+
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_data_func("/virtio/blk/pci/batch/split", &split, test_batches);
+    qtest_add_data_func("/virtio/blk/pci/batch/packed", &packed,
+                        test_batches);
+    qtest_add_data_func("/vhost-user-blk/pci/batch/split", &vu_split,
+                        test_batches);
+    qtest_add_data_func("/vhost-user-blk/pci/batch/packed", &vu_packed,
+                        test_batches);
+    qtest_add_data_func("/virtio/blk/pci/irq-coalesce", &coalesce,
+                        test_irq_coalesce);
+
+    return g_test_run();
+}
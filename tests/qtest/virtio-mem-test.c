@@ -0,0 +1,249 @@
+/*
+ * QTest testcase for virtio-mem with prealloc=on
+ *
+ * Plug requests of a device with prealloc=on complete asynchronously,
+ * once a separate thread has preallocated the blocks.  The memory device
+ * is backed by a file, so that the test can check how much of it is
+ * populated: plugged blocks must be, unplugged ones must not.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_mem.h"
+
+#define BLOCK_SIZE      (2 * MiB)
+#define REGION_SIZE     (256 * MiB)
+#define TIMEOUT_US      (30 * 1000 * 1000)
+
+typedef struct MemTest {
+    QOSState *qs;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    char *mem_path;
+    uint64_t addr;
+    /* Request and response of the one request in flight */
+    uint64_t req;
+    uint64_t resp;
+    uint32_t head;
+} MemTest;
+
+static void mem_test_init(MemTest *t)
+{
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(4, 0) };
+    QVirtioDevice *vdev;
+    int fd;
+
+    t->mem_path = g_strdup_printf("%s/qtest-%d-virtio-mem.XXXXXX",
+                                  g_get_tmp_dir(), getpid());
+    fd = g_mkstemp(t->mem_path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    t->qs = qtest_pc_boot("-m 128M,maxmem=1G "
+                          "-object memory-backend-file,id=mem0,mem-path=%s,"
+                          "share=on,size=%" PRIu64 ",prealloc-threads=1 "
+                          "-device virtio-mem-pci,id=vmem0,memdev=mem0,"
+                          "addr=04.0,disable-legacy=on,prealloc=on,"
+                          "block-size=%" PRIu64 ",requested-size=%" PRIu64,
+                          t->mem_path, (uint64_t)REGION_SIZE,
+                          (uint64_t)BLOCK_SIZE, (uint64_t)REGION_SIZE);
+
+    t->dev = virtio_pci_new(t->qs->pcibus, &addr);
+    g_assert(t->dev);
+    vdev = &t->dev->vdev;
+    qvirtio_pci_device_enable(t->dev);
+    qvirtio_start_device(vdev);
+    qvirtio_set_features(vdev, qvirtio_get_features(vdev) &
+                               ~QVIRTIO_F_BAD_FEATURE);
+
+    t->vq = qvirtqueue_setup(vdev, &t->qs->alloc, 0);
+    t->req = guest_alloc(&t->qs->alloc, sizeof(struct virtio_mem_req));
+    t->resp = guest_alloc(&t->qs->alloc, sizeof(struct virtio_mem_resp));
+    qvirtio_set_driver_ok(vdev);
+
+    g_assert_cmpint(qvirtio_config_readq(vdev,
+                                         offsetof(struct virtio_mem_config,
+                                                  block_size)),
+                    ==, BLOCK_SIZE);
+    t->addr = qvirtio_config_readq(vdev, offsetof(struct virtio_mem_config,
+                                                  addr));
+}
+
+static void mem_test_cleanup(MemTest *t)
+{
+    guest_free(&t->qs->alloc, t->req);
+    guest_free(&t->qs->alloc, t->resp);
+    qvirtqueue_cleanup(t->dev->vdev.bus, t->vq, &t->qs->alloc);
+    qvirtio_pci_destructor(&t->dev->obj);
+    g_free(t->dev);
+    qtest_shutdown(t->qs);
+    unlink(t->mem_path);
+    g_free(t->mem_path);
+}
+
+static uint64_t plugged_size(MemTest *t)
+{
+    return qvirtio_config_readq(&t->dev->vdev,
+                                offsetof(struct virtio_mem_config,
+                                         plugged_size));
+}
+
+/* Bytes of the memory backend that are populated */
+static uint64_t populated_size(MemTest *t)
+{
+    struct stat st;
+
+    g_assert_cmpint(stat(t->mem_path, &st), ==, 0);
+    return (uint64_t)st.st_blocks * 512;
+}
+
+static void send_request(MemTest *t, uint16_t type, uint64_t offset,
+                         uint16_t nb_blocks)
+{
+    QTestState *qts = t->qs->qts;
+    struct virtio_mem_req req = {
+        .type = cpu_to_le16(type),
+        .u.plug.addr = cpu_to_le64(t->addr + offset),
+        .u.plug.nb_blocks = cpu_to_le16(nb_blocks),
+    };
+
+    qtest_memwrite(qts, t->req, &req, sizeof(req));
+    qtest_memset(qts, t->resp, 0xff, sizeof(struct virtio_mem_resp));
+    t->head = qvirtqueue_add(qts, t->vq, t->req, sizeof(req), false, true);
+    qvirtqueue_add(qts, t->vq, t->resp, sizeof(struct virtio_mem_resp), true,
+                   false);
+    qvirtqueue_kick(qts, &t->dev->vdev, t->vq, t->head);
+}
+
+static uint16_t wait_response(MemTest *t)
+{
+    struct virtio_mem_resp resp;
+
+    qvirtio_wait_used_elem(t->qs->qts, &t->dev->vdev, t->vq, t->head, NULL,
+                           TIMEOUT_US);
+    qtest_memread(t->qs->qts, t->resp, &resp, sizeof(resp));
+    return le16_to_cpu(resp.type);
+}
+
+static void test_plug_unplug(void)
+{
+    const uint16_t nb_blocks = 16;
+    MemTest t;
+
+    mem_test_init(&t);
+
+    send_request(&t, VIRTIO_MEM_REQ_PLUG, 0, nb_blocks);
+    g_assert_cmpint(wait_response(&t), ==, VIRTIO_MEM_RESP_ACK);
+    g_assert_cmpint(plugged_size(&t), ==, nb_blocks * BLOCK_SIZE);
+    g_assert_cmpint(populated_size(&t), >=, nb_blocks * BLOCK_SIZE);
+
+    /* Already plugged */
+    send_request(&t, VIRTIO_MEM_REQ_PLUG, 0, 1);
+    g_assert_cmpint(wait_response(&t), ==, VIRTIO_MEM_RESP_ERROR);
+
+    send_request(&t, VIRTIO_MEM_REQ_UNPLUG, 0, nb_blocks);
+    g_assert_cmpint(wait_response(&t), ==, VIRTIO_MEM_RESP_ACK);
+    g_assert_cmpint(plugged_size(&t), ==, 0);
+    g_assert_cmpint(populated_size(&t), ==, 0);
+
+    mem_test_cleanup(&t);
+}
+
+/* Stopping the VM completes a pending plug request first */
+static void test_plug_stop(void)
+{
+    const uint16_t nb_blocks = REGION_SIZE / BLOCK_SIZE;
+    uint32_t head;
+    MemTest t;
+
+    mem_test_init(&t);
+
+    send_request(&t, VIRTIO_MEM_REQ_PLUG, 0, nb_blocks);
+    qtest_qmp_assert_success(t.qs->qts, "{ 'execute': 'stop' }");
+    g_assert_true(qvirtqueue_get_buf(t.qs->qts, t.vq, &head, NULL));
+    g_assert_cmpint(head, ==, t.head);
+    g_assert_cmpint(plugged_size(&t), ==, REGION_SIZE);
+    g_assert_cmpint(populated_size(&t), >=, REGION_SIZE);
+    qtest_qmp_assert_success(t.qs->qts, "{ 'execute': 'cont' }");
+
+    mem_test_cleanup(&t);
+}
+
+/*
+ * A plug request that completes after migration started is answered
+ * with BUSY, and the blocks it preallocated are discarded again.
+ */
+static void test_plug_migration(void)
+{
+    const uint16_t nb_blocks = REGION_SIZE / BLOCK_SIZE;
+    MemTest t;
+
+    mem_test_init(&t);
+
+    qtest_qmp_assert_success(t.qs->qts,
+                             "{ 'execute': 'migrate-set-parameters',"
+                             "  'arguments': { 'max-bandwidth': 1 } }");
+    send_request(&t, VIRTIO_MEM_REQ_PLUG, 0, nb_blocks);
+    qtest_qmp_assert_success(t.qs->qts,
+                             "{ 'execute': 'migrate',"
+                             "  'arguments': {"
+                             "    'uri': 'exec:cat > /dev/null' } }");
+
+    if (wait_response(&t) == VIRTIO_MEM_RESP_BUSY) {
+        g_assert_cmpint(plugged_size(&t), ==, 0);
+        g_assert_cmpint(populated_size(&t), ==, 0);
+    } else {
+        /* Preallocation won the race against the migrate command */
+        g_test_message("plug request completed before migration started");
+        g_assert_cmpint(plugged_size(&t), ==, REGION_SIZE);
+    }
+
+    qtest_qmp_assert_success(t.qs->qts, "{ 'execute': 'migrate_cancel' }");
+    mem_test_cleanup(&t);
+}
+
+/* A plug request pending on reset is dropped and its memory discarded */
+static void test_plug_reset(void)
+{
+    const uint16_t nb_blocks = REGION_SIZE / BLOCK_SIZE;
+    QDict *rsp;
+    MemTest t;
+
+    mem_test_init(&t);
+
+    send_request(&t, VIRTIO_MEM_REQ_PLUG, 0, nb_blocks);
+    qtest_qmp_assert_success(t.qs->qts, "{ 'execute': 'system_reset' }");
+    qtest_qmp_eventwait(t.qs->qts, "RESET");
+    g_assert_cmpint(populated_size(&t), ==, 0);
+
+    /* The config space is not mapped after reset, ask QOM instead */
+    rsp = qtest_qmp(t.qs->qts, "{ 'execute': 'qom-get', 'arguments': "
+                    "{ 'path': '/machine/peripheral/vmem0', "
+                    "'property': 'size' } }");
+    g_assert_cmpint(qdict_get_int(rsp, "return"), ==, 0);
+    qobject_unref(rsp);
+
+    mem_test_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio/mem/pci/prealloc/plug-unplug", test_plug_unplug);
+    qtest_add_func("/virtio/mem/pci/prealloc/plug-stop", test_plug_stop);
+    qtest_add_func("/virtio/mem/pci/prealloc/plug-migration",
+                   test_plug_migration);
+    qtest_add_func("/virtio/mem/pci/prealloc/plug-reset", test_plug_reset);
+
+    return g_test_run();
+}
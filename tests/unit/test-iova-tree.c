@@ -0,0 +1,209 @@
+/*
+ * IOVA tree tests
+ *
+ * Runs random sequences of insertions, removals and allocations on an
+ * IOVA tree and checks every result against a brute force model that
+ * keeps the mappings in a sorted array.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iova-tree.h"
+
+/* Small enough that mappings collide and the space fills up */
+#define TEST_IOVA_SPACE 0x10000
+#define TEST_MAX_SIZE 0x800
+#define TEST_OPS 20000
+
+typedef struct TestIOVAModel {
+    /* Mappings sorted by iova */
+    GArray *maps;
+} TestIOVAModel;
+
+/* iova_tree_foreach() has no opaque pointer */
+static GArray *foreach_maps;
+
+static gboolean collect_map(DMAMap *map)
+{
+    g_array_append_val(foreach_maps, *map);
+    return false;
+}
+
+static bool model_overlaps(const DMAMap *a, const DMAMap *b)
+{
+    return a->iova <= b->iova + b->size && b->iova <= a->iova + a->size;
+}
+
+static int model_insert(TestIOVAModel *m, const DMAMap *map)
+{
+    guint i;
+
+    for (i = 0; i < m->maps->len; i++) {
+        const DMAMap *cur = &g_array_index(m->maps, DMAMap, i);
+
+        if (model_overlaps(cur, map)) {
+            return IOVA_ERR_OVERLAP;
+        }
+        if (cur->iova > map->iova) {
+            break;
+        }
+    }
+    g_array_insert_val(m->maps, i, *map);
+    return IOVA_OK;
+}
+
+static void model_remove(TestIOVAModel *m, const DMAMap *map)
+{
+    guint i = 0;
+
+    while (i < m->maps->len) {
+        if (model_overlaps(&g_array_index(m->maps, DMAMap, i), map)) {
+            g_array_remove_index(m->maps, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/* First fit: the lowest iova >= @begin where @size + 1 bytes are free */
+static int model_alloc(TestIOVAModel *m, DMAMap *map, hwaddr begin,
+                       hwaddr last)
+{
+    hwaddr iova = begin;
+    guint i;
+
+    for (i = 0; i < m->maps->len; i++) {
+        const DMAMap *cur = &g_array_index(m->maps, DMAMap, i);
+
+        if (cur->iova + cur->size < iova) {
+            continue;
+        }
+        if (cur->iova > iova + map->size) {
+            break;
+        }
+        iova = cur->iova + cur->size + 1;
+    }
+
+    if (iova + map->size > last) {
+        return IOVA_ERR_NOMEM;
+    }
+    map->iova = iova;
+    return model_insert(m, map);
+}
+
+static void check_tree(IOVATree *tree, TestIOVAModel *m)
+{
+    guint i;
+
+    foreach_maps = g_array_new(false, false, sizeof(DMAMap));
+    iova_tree_foreach(tree, collect_map);
+
+    g_assert_cmpuint(foreach_maps->len, ==, m->maps->len);
+    for (i = 0; i < m->maps->len; i++) {
+        const DMAMap *a = &g_array_index(foreach_maps, DMAMap, i);
+        const DMAMap *b = &g_array_index(m->maps, DMAMap, i);
+
+        g_assert_cmphex(a->iova, ==, b->iova);
+        g_assert_cmphex(a->size, ==, b->size);
+        g_assert_cmphex(a->translated_addr, ==, b->translated_addr);
+    }
+
+    g_array_free(foreach_maps, true);
+    foreach_maps = NULL;
+}
+
+static void random_map(DMAMap *map)
+{
+    *map = (DMAMap) {
+        .iova = g_test_rand_int_range(0, TEST_IOVA_SPACE),
+        .size = g_test_rand_int_range(0, TEST_MAX_SIZE),
+        .translated_addr = g_test_rand_int(),
+        .perm = IOMMU_RW,
+    };
+}
+
+static void test_iova_tree_random(void)
+{
+    IOVATree *tree = iova_tree_new();
+    TestIOVAModel m = {
+        .maps = g_array_new(false, false, sizeof(DMAMap)),
+    };
+    int i;
+
+    for (i = 0; i < TEST_OPS; i++) {
+        DMAMap map, expected;
+        hwaddr begin, last;
+
+        random_map(&map);
+        switch (g_test_rand_int_range(0, 4)) {
+        case 0:
+            g_assert_cmpint(iova_tree_insert(tree, &map), ==,
+                            model_insert(&m, &map));
+            break;
+        case 1:
+            /* Removes every mapping the range touches */
+            iova_tree_remove(tree, map);
+            model_remove(&m, &map);
+            break;
+        default:
+            begin = g_test_rand_int_range(0, TEST_IOVA_SPACE);
+            last = begin + g_test_rand_int_range(0, TEST_IOVA_SPACE);
+            expected = map;
+            g_assert_cmpint(iova_tree_alloc_map(tree, &map, begin, last), ==,
+                            model_alloc(&m, &expected, begin, last));
+            g_assert_cmphex(map.iova, ==, expected.iova);
+            break;
+        }
+        check_tree(tree, &m);
+    }
+
+    iova_tree_destroy(tree);
+    g_array_free(m.maps, true);
+}
+
+static void test_iova_tree_alloc_full(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap map = { .size = 0xfff, .perm = IOMMU_RW };
+    hwaddr iova;
+
+    /* Fill [0x1000, 0x4fff], then free a hole in the middle */
+    for (iova = 0x1000; iova < 0x5000; iova += 0x1000) {
+        g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0x4fff), ==,
+                        IOVA_OK);
+        g_assert_cmphex(map.iova, ==, iova);
+    }
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0x4fff), ==,
+                    IOVA_ERR_NOMEM);
+
+    map.iova = 0x2000;
+    iova_tree_remove(tree, map);
+    map.size = 0x1fff;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0x4fff), ==,
+                    IOVA_ERR_NOMEM);
+    map.size = 0xfff;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0x4fff), ==,
+                    IOVA_OK);
+    g_assert_cmphex(map.iova, ==, 0x2000);
+
+    /* Up to the end of the address space */
+    map.size = HWADDR_MAX - 0x5000;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0, HWADDR_MAX), ==,
+                    IOVA_OK);
+    g_assert_cmphex(map.iova, ==, 0x5000);
+    map.size = 0;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, HWADDR_MAX), ==,
+                    IOVA_ERR_NOMEM);
+
+    iova_tree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/iova-tree/random", test_iova_tree_random);
+    g_test_add_func("/iova-tree/alloc-full", test_iova_tree_alloc_full);
+    return g_test_run();
+}
@@ -671,6 +671,78 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_grant(void)
+{
+    ThrottleConfig cfg;
+    ThrottleGrant grant = {};
+    LeakyBucket *bkt = &ts.cfg.buckets[THROTTLE_OPS_TOTAL];
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int i;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 1000;
+
+    throttle_init(&ts);
+    throttle_timers_init(tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* 10 ms worth of operations are accounted in advance */
+    g_assert(throttle_grant(&ts, false, now, 10 * SCALE_MS, &grant));
+    g_assert(double_cmp(bkt->level, 10));
+
+    /* and handed out without touching the buckets */
+    for (i = 0; i < 4; i++) {
+        g_assert(throttle_grant_consume(&grant, now, 512));
+    }
+    g_assert(double_cmp(bkt->level, 10));
+
+    /* what was not used is given back */
+    throttle_return_grant(&ts, false, now, &grant);
+    g_assert(!grant.active);
+    g_assert(double_cmp(bkt->level, 4));
+    g_assert(!throttle_grant_consume(&grant, now, 512));
+
+    /* a grant runs out */
+    g_assert(throttle_grant(&ts, false, now, 10 * SCALE_MS, &grant));
+    for (i = 0; i < 10; i++) {
+        g_assert(throttle_grant_consume(&grant, now, 512));
+    }
+    g_assert(!throttle_grant_consume(&grant, now, 512));
+    throttle_return_grant(&ts, false, now, &grant);
+    g_assert(double_cmp(bkt->level, 14));
+
+    /* nothing is granted if that would make requests wait */
+    bkt->level = 95;
+    g_assert(!throttle_grant(&ts, false, now, 10 * SCALE_MS, &grant));
+    g_assert(!grant.active);
+    g_assert(double_cmp(bkt->level, 95));
+
+    /* only what the bucket has not drained yet is given back */
+    bkt->level = 0;
+    g_assert(throttle_grant(&ts, false, now, 10 * SCALE_MS, &grant));
+    g_assert(throttle_grant_consume(&grant, now, 512));
+    for (i = 0; i < 5; i++) {
+        throttle_account(&ts, false, 512);
+    }
+    g_assert(double_cmp(bkt->level, 15));
+    now += 5 * SCALE_MS;
+    throttle_return_grant(&ts, false, now, &grant);
+    g_assert(double_cmp(bkt->level, 5));
+
+    /* a grant expires once the bucket has drained it */
+    bkt->level = 0;
+    g_assert(throttle_grant(&ts, false, now, 10 * SCALE_MS, &grant));
+    g_assert(throttle_grant_consume(&grant, now + 10 * SCALE_MS - 1, 512));
+    now += 10 * SCALE_MS;
+    g_assert(!throttle_grant_consume(&grant, now, 512));
+    throttle_return_grant(&ts, false, now, &grant);
+    g_assert(!grant.active);
+    g_assert(double_cmp(bkt->level, 10));
+
+    throttle_timers_destroy(tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -764,6 +836,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/grant",              test_grant);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -173,6 +173,76 @@ static void test_encode_decode(void)
     }
 }
 
+static int encode_accel_page(uint8_t *old_buf, uint8_t *new_buf,
+                             uint8_t *compressed, int dlen,
+                             XBZRLEEncoder encoder)
+{
+    switch (encoder) {
+#ifdef CONFIG_AVX2_OPT
+    case XBZRLE_ENCODER_AVX2:
+        return xbzrle_encode_buffer_avx2(old_buf, new_buf, XBZRLE_PAGE_SIZE,
+                                         compressed, dlen);
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    case XBZRLE_ENCODER_AVX512:
+        return xbzrle_encode_buffer_avx512(old_buf, new_buf, XBZRLE_PAGE_SIZE,
+                                           compressed, dlen);
+#endif
+    default:
+        return xbzrle_encode_buffer_int(old_buf, new_buf, XBZRLE_PAGE_SIZE,
+                                        compressed, dlen);
+    }
+}
+
+/* All encoders supported by the host must produce the same stream */
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *expected = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    XBZRLEEncoder best = xbzrle_encoder();
+    int i, j, encoder;
+
+    if (best == XBZRLE_ENCODER_SCALAR) {
+        g_test_skip("No accelerated XBZRLE encoder on this host");
+    }
+
+    for (i = 0; i < 10000 && best != XBZRLE_ENCODER_SCALAR; i++) {
+        /* Percentage of changed bytes, from almost none to all */
+        int density = g_test_rand_int_range(0, 101);
+        int dlen = g_test_rand_int_range(1, XBZRLE_PAGE_SIZE + 1);
+        int expected_len;
+
+        for (j = 0; j < XBZRLE_PAGE_SIZE; j++) {
+            old_buf[j] = g_test_rand_int();
+            new_buf[j] = old_buf[j];
+            if (g_test_rand_int_range(0, 100) < density) {
+                new_buf[j] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+
+        expected_len = xbzrle_encode_buffer_int(old_buf, new_buf,
+                                                XBZRLE_PAGE_SIZE,
+                                                expected, dlen);
+        for (encoder = XBZRLE_ENCODER_SCALAR + 1; encoder <= best;
+             encoder++) {
+            int len = encode_accel_page(old_buf, new_buf, compressed, dlen,
+                                        encoder);
+
+            g_assert_cmpint(len, ==, expected_len);
+            if (len > 0) {
+                g_assert(memcmp(compressed, expected, len) == 0);
+            }
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +255,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
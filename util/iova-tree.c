@@ -11,48 +11,170 @@
 
 #include "qemu/osdep.h"
 #include "qemu/iova-tree.h"
+#include "qemu/treap.h"
+
+/*
+ * Unmapped range of the IOVA space, [start, last].
+ *
+ * Holes are kept in a treap ordered by start, where every node also
+ * tracks the largest hole of its subtree.  That allows to find the
+ * lowest hole that fits an allocation in O(log n) instead of walking
+ * all the mappings.
+ */
+typedef struct IOVAHole {
+    hwaddr start;
+    hwaddr last;
+    /* Largest last - start in this subtree */
+    hwaddr max_span;
+    TreapNode node;
+} IOVAHole;
 
 struct IOVATree {
     GTree *tree;
+
+    /* Holes and mappings together always cover [0, HWADDR_MAX] */
+    Treap holes;
 };
 
-/* Args to pass to iova_tree_alloc foreach function. */
-struct IOVATreeAllocArgs {
-    /* Size of the desired allocation */
-    size_t new_size;
+typedef struct IOVATreeFindIOVAArgs {
+    const DMAMap *needle;
+    const DMAMap *result;
+} IOVATreeFindIOVAArgs;
 
-    /* The minimum address allowed in the allocation */
-    hwaddr iova_begin;
+static IOVAHole *iova_hole_entry(TreapNode *node)
+{
+    return treap_entry(node, IOVAHole, node);
+}
 
-    /* Map at the left of the hole, can be NULL if "this" is first one */
-    const DMAMap *prev;
+static bool iova_hole_before(const TreapNode *a, const TreapNode *b)
+{
+    return container_of(a, IOVAHole, node)->start <
+           container_of(b, IOVAHole, node)->start;
+}
 
-    /* Map at the right of the hole, can be NULL if "prev" is the last one */
-    const DMAMap *this;
+static void iova_hole_update(TreapNode *node)
+{
+    IOVAHole *hole = iova_hole_entry(node);
 
-    /* If found, we fill in the IOVA here */
-    hwaddr iova_result;
+    hole->max_span = hole->last - hole->start;
+    if (node->left) {
+        hole->max_span = MAX(hole->max_span,
+                             iova_hole_entry(node->left)->max_span);
+    }
+    if (node->right) {
+        hole->max_span = MAX(hole->max_span,
+                             iova_hole_entry(node->right)->max_span);
+    }
+}
 
-    /* Whether have we found a valid IOVA */
-    bool iova_found;
+static const TreapOps iova_hole_ops = {
+    .before = iova_hole_before,
+    .update = iova_hole_update,
 };
 
-typedef struct IOVATreeFindIOVAArgs {
-    const DMAMap *needle;
-    const DMAMap *result;
-} IOVATreeFindIOVAArgs;
+static void iova_hole_insert(IOVATree *tree, hwaddr start, hwaddr last)
+{
+    IOVAHole *hole = g_new0(IOVAHole, 1);
 
-/**
- * Iterate args to the next hole
- *
- * @args: The alloc arguments
- * @next: The next mapping in the tree. Can be NULL to signal the last one
- */
-static void iova_tree_alloc_args_iterate(struct IOVATreeAllocArgs *args,
-                                         const DMAMap *next)
+    hole->start = start;
+    hole->last = last;
+    treap_insert(&tree->holes, &hole->node);
+}
+
+static void iova_hole_remove(IOVATree *tree, IOVAHole *hole)
+{
+    treap_remove(&tree->holes, &hole->node);
+    g_free(hole);
+}
+
+/* The hole with the highest start not above @iova, NULL if none */
+static IOVAHole *iova_hole_floor(const IOVATree *tree, hwaddr iova)
+{
+    IOVAHole *hole = iova_hole_entry(tree->holes.root), *found = NULL;
+
+    while (hole) {
+        if (hole->start <= iova) {
+            found = hole;
+            hole = iova_hole_entry(hole->node.right);
+        } else {
+            hole = iova_hole_entry(hole->node.left);
+        }
+    }
+
+    return found;
+}
+
+/* Lowest hole that starts above @iova and fits @size (inclusive) */
+static IOVAHole *iova_hole_first_fit(TreapNode *node, hwaddr iova,
+                                     hwaddr size)
+{
+    IOVAHole *t = iova_hole_entry(node), *found;
+
+    if (!t || t->max_span < size) {
+        return NULL;
+    }
+
+    if (t->start <= iova) {
+        return iova_hole_first_fit(node->right, iova, size);
+    }
+
+    found = iova_hole_first_fit(node->left, iova, size);
+    if (found) {
+        return found;
+    }
+    if (t->last - t->start >= size) {
+        return t;
+    }
+    return iova_hole_first_fit(node->right, iova, size);
+}
+
+static void iova_hole_free(TreapNode *node)
 {
-    args->prev = args->this;
-    args->this = next;
+    g_free(iova_hole_entry(node));
+}
+
+/* Carve the newly mapped [iova, iova + size] out of its hole */
+static void iova_hole_take(IOVATree *tree, hwaddr iova, hwaddr size)
+{
+    IOVAHole *hole = iova_hole_floor(tree, iova);
+    hwaddr start, last;
+
+    assert(hole && hole->last - iova >= size);
+    start = hole->start;
+    last = hole->last;
+
+    iova_hole_remove(tree, hole);
+    if (start < iova) {
+        iova_hole_insert(tree, start, iova - 1);
+    }
+    if (iova + size < last) {
+        iova_hole_insert(tree, iova + size + 1, last);
+    }
+}
+
+/* Give the unmapped [iova, iova + size] back, merging adjacent holes */
+static void iova_hole_release(IOVATree *tree, hwaddr iova, hwaddr size)
+{
+    hwaddr start = iova, last = iova + size;
+    IOVAHole *hole;
+
+    if (iova > 0) {
+        hole = iova_hole_floor(tree, iova - 1);
+        if (hole && hole->last == iova - 1) {
+            start = hole->start;
+            iova_hole_remove(tree, hole);
+        }
+    }
+
+    if (last < HWADDR_MAX) {
+        hole = iova_hole_floor(tree, last + 1);
+        if (hole && hole->start == last + 1) {
+            last = hole->last;
+            iova_hole_remove(tree, hole);
+        }
+    }
+
+    iova_hole_insert(tree, start, last);
 }
 
 static int iova_tree_compare(gconstpointer a, gconstpointer b, gpointer data)
@@ -77,6 +199,8 @@ IOVATree *iova_tree_new(void)
 
     /* We don't have values actually, no need to free */
     iova_tree->tree = g_tree_new_full(iova_tree_compare, NULL, g_free, NULL);
+    treap_init(&iova_tree->holes, &iova_hole_ops);
+    iova_hole_insert(iova_tree, 0, HWADDR_MAX);
 
     return iova_tree;
 }
@@ -144,6 +268,7 @@ int iova_tree_insert(IOVATree *tree, const DMAMap *map)
     new = g_new0(DMAMap, 1);
     memcpy(new, map, sizeof(*new));
     iova_tree_insert_internal(tree->tree, new);
+    iova_hole_take(tree, new->iova, new->size);
 
     return IOVA_OK;
 }
@@ -169,114 +294,47 @@ void iova_tree_remove(IOVATree *tree, DMAMap map)
     const DMAMap *overlap;
 
     while ((overlap = iova_tree_find(tree, &map))) {
-        g_tree_remove(tree->tree, overlap);
-    }
-}
-
-/**
- * Try to find an unallocated IOVA range between prev and this elements.
- *
- * @args: Arguments to allocation
- *
- * Cases:
- *
- * (1) !prev, !this: No entries allocated, always succeed
- *
- * (2) !prev, this: We're iterating at the 1st element.
- *
- * (3) prev, !this: We're iterating at the last element.
- *
- * (4) prev, this: this is the most common case, we'll try to find a hole
- * between "prev" and "this" mapping.
- *
- * Note that this function assumes the last valid iova is HWADDR_MAX, but it
- * searches linearly so it's easy to discard the result if it's not the case.
- */
-static void iova_tree_alloc_map_in_hole(struct IOVATreeAllocArgs *args)
-{
-    const DMAMap *prev = args->prev, *this = args->this;
-    uint64_t hole_start, hole_last;
-
-    if (this && this->iova + this->size < args->iova_begin) {
-        return;
-    }
-
-    hole_start = MAX(prev ? prev->iova + prev->size + 1 : 0, args->iova_begin);
-    hole_last = this ? this->iova : HWADDR_MAX;
+        hwaddr iova = overlap->iova, size = overlap->size;
 
-    if (hole_last - hole_start > args->new_size) {
-        args->iova_result = hole_start;
-        args->iova_found = true;
+        g_tree_remove(tree->tree, overlap);
+        iova_hole_release(tree, iova, size);
     }
 }
 
-/**
- * Foreach dma node in the tree, compare if there is a hole with its previous
- * node (or minimum iova address allowed) and the node.
- *
- * @key: Node iterating
- * @value: Node iterating
- * @pargs: Struct to communicate with the outside world
- *
- * Return: false to keep iterating, true if needs break.
- */
-static gboolean iova_tree_alloc_traverse(gpointer key, gpointer value,
-                                         gpointer pargs)
-{
-    struct IOVATreeAllocArgs *args = pargs;
-    DMAMap *node = value;
-
-    assert(key == value);
-
-    iova_tree_alloc_args_iterate(args, node);
-    iova_tree_alloc_map_in_hole(args);
-    return args->iova_found;
-}
-
 int iova_tree_alloc_map(IOVATree *tree, DMAMap *map, hwaddr iova_begin,
                         hwaddr iova_last)
 {
-    struct IOVATreeAllocArgs args = {
-        .new_size = map->size,
-        .iova_begin = iova_begin,
-    };
+    const IOVAHole *hole;
+    hwaddr iova;
 
     if (unlikely(iova_last < iova_begin)) {
         return IOVA_ERR_INVALID;
     }
 
-    /*
-     * Find a valid hole for the mapping
-     *
-     * Assuming low iova_begin, so no need to do a binary search to
-     * locate the first node.
-     *
-     * TODO: Replace all this with g_tree_node_first/next/last when available
-     * (from glib since 2.68). To do it with g_tree_foreach complicates the
-     * code a lot.
-     *
-     */
-    g_tree_foreach(tree->tree, iova_tree_alloc_traverse, &args);
-    if (!args.iova_found) {
-        /*
-         * Either tree is empty or the last hole is still not checked.
-         * g_tree_foreach does not compare (last, iova_last] range, so we check
-         * it here.
-         */
-        iova_tree_alloc_args_iterate(&args, NULL);
-        iova_tree_alloc_map_in_hole(&args);
+    /* First fit: the hole around iova_begin, or the lowest one above it */
+    hole = iova_hole_floor(tree, iova_begin);
+    if (hole && hole->last >= iova_begin &&
+        hole->last - iova_begin >= map->size) {
+        iova = iova_begin;
+    } else {
+        hole = iova_hole_first_fit(tree->holes.root, iova_begin, map->size);
+        if (!hole) {
+            return IOVA_ERR_NOMEM;
+        }
+        iova = hole->start;
     }
 
-    if (!args.iova_found || args.iova_result + map->size > iova_last) {
+    if (iova + map->size > iova_last) {
         return IOVA_ERR_NOMEM;
     }
 
-    map->iova = args.iova_result;
+    map->iova = iova;
     return iova_tree_insert(tree, map);
 }
 
 void iova_tree_destroy(IOVATree *tree)
 {
     g_tree_destroy(tree->tree);
+    treap_foreach_post_order(&tree->holes, iova_hole_free);
     g_free(tree);
 }
@@ -444,46 +444,196 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
-/* do the accounting for this operation
- *
- * @is_write: the type of operation (read/write)
- * @size:     the size of the operation
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+/* Add @units operations and @size bytes to the buckets for @is_write.
+ * Negative values take them out again, without going below zero.
  */
-void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+static void throttle_do_account(ThrottleState *ts, bool is_write,
+                                double units, double size)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
-    double units = 1.0;
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
-
     for (i = 0; i < 2; i++) {
         LeakyBucket *bkt;
 
         bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
-        bkt->level += size;
+        bkt->level = MAX(bkt->level + size, 0);
         if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+            bkt->burst_level = MAX(bkt->burst_level + size, 0);
         }
 
         bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
-        bkt->level += units;
+        bkt->level = MAX(bkt->level + units, 0);
         if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
+            bkt->burst_level = MAX(bkt->burst_level + units, 0);
         }
     }
 }
 
+/* Return the number of operations that @size bytes count as */
+static double throttle_units(uint64_t op_size, uint64_t size)
+{
+    /* if op_size is defined and smaller than size we compute unit count */
+    if (op_size && size > op_size) {
+        return (double) size / op_size;
+    }
+    return 1.0;
+}
+
+/* do the accounting for this operation
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    throttle_do_account(ts, is_write, throttle_units(ts->cfg.op_size, size),
+                        size);
+}
+
+/* Return the lowest limit of the buckets in @types, or 0 if none is set */
+static uint64_t throttle_lowest_avg(ThrottleState *ts,
+                                    const BucketType types[2])
+{
+    uint64_t avg = 0;
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        uint64_t bkt_avg = ts->cfg.buckets[types[i]].avg;
+        if (bkt_avg && (!avg || bkt_avg < avg)) {
+            avg = bkt_avg;
+        }
+    }
+
+    return avg;
+}
+
+/* Account in advance for as much I/O as the most restrictive bucket lets
+ * through in @period_ns, so that the caller can hand it out to requests
+ * with throttle_grant_consume() without touching @ts.
+ *
+ * Nothing is granted if that would make the next request wait, so a grant
+ * only ever uses capacity that is available right now.
+ *
+ * @is_write: the type of operation (read/write)
+ * @now:      the current clock timestamp
+ * @period_ns: the amount of I/O to grant, in ns at the configured rate
+ * @grant:    the grant to fill, must not be active
+ * @ret:      true if something was granted
+ */
+bool throttle_grant(ThrottleState *ts, bool is_write, int64_t now,
+                    int64_t period_ns, ThrottleGrant *grant)
+{
+    uint64_t units_avg = throttle_lowest_avg(ts, bucket_types_units[is_write]);
+    uint64_t size_avg = throttle_lowest_avg(ts, bucket_types_size[is_write]);
+    double units = (double) units_avg * period_ns / NANOSECONDS_PER_SECOND;
+    double size = (double) size_avg * period_ns / NANOSECONDS_PER_SECOND;
+
+    assert(!grant->active);
+
+    /* Not worth it if not even one operation fits */
+    if (units_avg && units < 1.0) {
+        return false;
+    }
+
+    throttle_do_leak(ts, now);
+    throttle_do_account(ts, is_write, units, size);
+    if (throttle_compute_wait_for(ts, is_write)) {
+        throttle_do_account(ts, is_write, -units, -size);
+        return false;
+    }
+
+    *grant = (ThrottleGrant) {
+        .active = true,
+        .limit_units = units_avg != 0,
+        .limit_size = size_avg != 0,
+        .units = units,
+        .size = size,
+        .granted_units = units,
+        .granted_size = size,
+        .op_size = ts->cfg.op_size,
+        .start = now,
+        .period_ns = period_ns,
+    };
+    return true;
+}
+
+/* Whether @grant was made @period_ns or more before @now.  The buckets
+ * have drained what it accounted for by then, so it must not be used.
+ */
+static bool throttle_grant_expired(ThrottleGrant *grant, int64_t now)
+{
+    return now - grant->start >= grant->period_ns;
+}
+
+/* Take an operation of @size bytes out of a grant
+ *
+ * @now:  the current clock timestamp
+ * @size: the size of the operation
+ * @ret:  false if the grant is not active, has expired or is too small
+ *        for it
+ */
+bool throttle_grant_consume(ThrottleGrant *grant, int64_t now, uint64_t size)
+{
+    double units = throttle_units(grant->op_size, size);
+
+    if (!grant->active || throttle_grant_expired(grant, now) ||
+        (grant->limit_units && grant->units < units) ||
+        (grant->limit_size && grant->size < size)) {
+        return false;
+    }
+
+    grant->units -= units;
+    grant->size -= size;
+    return true;
+}
+
+/* Give back what is left of a grant and deactivate it
+ *
+ * The buckets have been leaking at the granted rate since the grant was
+ * made, so only the part of it that they have not drained yet can still
+ * be in them.  Giving back more than that would let other requests use
+ * capacity that the buckets have already handed out once.
+ *
+ * @is_write: the type of operation the grant was made for
+ * @now:      the current clock timestamp
+ * @grant:    the grant to return
+ */
+void throttle_return_grant(ThrottleState *ts, bool is_write, int64_t now,
+                           ThrottleGrant *grant)
+{
+    double undrained;
+
+    if (!grant->active) {
+        return;
+    }
+    grant->active = false;
+
+    if (throttle_grant_expired(grant, now)) {
+        return;
+    }
+
+    /* The fraction of the grant that has not been drained yet */
+    undrained = 1.0 - (double) MAX(now - grant->start, 0) / grant->period_ns;
+
+    throttle_do_leak(ts, now);
+    throttle_do_account(ts, is_write,
+                        grant->limit_units ?
+                        -MIN(grant->units, grant->granted_units * undrained) :
+                        0,
+                        grant->limit_size ?
+                        -MIN(grant->size, grant->granted_size * undrained) :
+                        0);
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
@@ -0,0 +1,113 @@
+/*
+ * Augmented treap
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/treap.h"
+
+/* Split @t in the nodes before @key and the others */
+static void treap_split(const TreapOps *ops, TreapNode *t,
+                        const TreapNode *key, TreapNode **l, TreapNode **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+
+    if (ops->before(t, key)) {
+        treap_split(ops, t->right, key, &t->right, r);
+        *l = t;
+    } else {
+        treap_split(ops, t->left, key, l, &t->left);
+        *r = t;
+    }
+    ops->update(t);
+}
+
+/* Join two treaps, all nodes of @a being before the ones of @b */
+static TreapNode *treap_merge(const TreapOps *ops, TreapNode *a, TreapNode *b)
+{
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+
+    if (a->prio > b->prio) {
+        a->right = treap_merge(ops, a->right, b);
+        ops->update(a);
+        return a;
+    }
+
+    b->left = treap_merge(ops, a, b->left);
+    ops->update(b);
+    return b;
+}
+
+static TreapNode *treap_remove_from(const TreapOps *ops, TreapNode *t,
+                                    TreapNode *node)
+{
+    assert(t);
+
+    if (t == node) {
+        return treap_merge(ops, t->left, t->right);
+    }
+
+    if (ops->before(node, t)) {
+        t->left = treap_remove_from(ops, t->left, node);
+    } else {
+        t->right = treap_remove_from(ops, t->right, node);
+    }
+    ops->update(t);
+    return t;
+}
+
+void treap_init(Treap *treap, const TreapOps *ops)
+{
+    *treap = (Treap) {
+        .ops = ops,
+        .seed = 0x9e3779b9,
+    };
+}
+
+void treap_insert(Treap *treap, TreapNode *node)
+{
+    TreapNode *l, *r;
+
+    /* xorshift32, balance only needs the priorities to look random */
+    treap->seed ^= treap->seed << 13;
+    treap->seed ^= treap->seed >> 17;
+    treap->seed ^= treap->seed << 5;
+
+    node->left = NULL;
+    node->right = NULL;
+    node->prio = treap->seed;
+    treap->ops->update(node);
+
+    treap_split(treap->ops, treap->root, node, &l, &r);
+    treap->root = treap_merge(treap->ops, treap_merge(treap->ops, l, node), r);
+}
+
+void treap_remove(Treap *treap, TreapNode *node)
+{
+    treap->root = treap_remove_from(treap->ops, treap->root, node);
+}
+
+static void treap_foreach_post_order_from(TreapNode *t,
+                                          void (*func)(TreapNode *node))
+{
+    if (t) {
+        treap_foreach_post_order_from(t->left, func);
+        treap_foreach_post_order_from(t->right, func);
+        func(t);
+    }
+}
+
+void treap_foreach_post_order(Treap *treap, void (*func)(TreapNode *node))
+{
+    treap_foreach_post_order_from(treap->root, func);
+}
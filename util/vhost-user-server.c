@@ -8,6 +8,7 @@
  * later.  See the COPYING file in the top-level directory.
  */
 #include "qemu/osdep.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/vhost-user-server.h"
 #include "block/aio-wait.h"
@@ -51,6 +52,15 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * vhost_user_server_set_queue_contexts() spreads the kick fds over other
+ * AioContexts instead, virtqueue i being handled in context i % n. Those do
+ * not follow vhost_user_server_attach_aio_context(). Each queue context has a
+ * lock that its kick handlers hold. vu_client_trip() takes all of them once
+ * a message has been read and until it is processed, so that libvhost-user
+ * never processes a message and a virtqueue at the same time. Removed kick fd
+ * watches are freed from a BH in their context, since a kick handler may be
+ * waiting for the lock.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -76,16 +86,46 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
 
 void vhost_user_server_ref(VuServer *server)
 {
-    assert(!server->wait_idle);
-    server->refcount++;
+    assert(!qatomic_read(&server->wait_idle));
+    qatomic_inc(&server->refcount);
 }
 
 void vhost_user_server_unref(VuServer *server)
 {
-    server->refcount--;
-    if (server->wait_idle && !server->refcount) {
-        aio_co_wake(server->co_trip);
+    if (qatomic_fetch_dec(&server->refcount) == 1) {
+        /* Whoever clears wait_idle wakes up vu_client_trip() */
+        if (qatomic_xchg(&server->wait_idle, false)) {
+            aio_co_wake(server->co_trip);
+        }
+        /* Requests may complete in a queue context, not the waiter's */
+        aio_wait_kick();
+    }
+}
+
+static void vhost_user_server_lock_queues(VuServer *server)
+{
+    unsigned int i;
+
+    if (server->queues_locked) {
+        return;
+    }
+    for (i = 0; i < server->num_queue_ctx; i++) {
+        qemu_rec_mutex_lock(&server->queue_lock[i]);
+    }
+    server->queues_locked = true;
+}
+
+static void vhost_user_server_unlock_queues(VuServer *server)
+{
+    unsigned int i;
+
+    if (!server->queues_locked) {
+        return;
     }
+    for (i = 0; i < server->num_queue_ctx; i++) {
+        qemu_rec_mutex_unlock(&server->queue_lock[i]);
+    }
+    server->queues_locked = false;
 }
 
 static bool coroutine_fn
@@ -174,6 +214,8 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    /* Released by vu_client_trip() once the message is processed */
+    vhost_user_server_lock_queues(server);
     return true;
 
 fail:
@@ -186,20 +228,28 @@ static coroutine_fn void vu_client_trip(void *opaque)
 {
     VuServer *server = opaque;
     VuDev *vu_dev = &server->vu_dev;
+    bool ok;
 
-    while (!vu_dev->broken && vu_dispatch(vu_dev)) {
-        /* Keep running */
-    }
+    do {
+        ok = !vu_dev->broken && vu_dispatch(vu_dev);
+        vhost_user_server_unlock_queues(server);
+    } while (ok);
 
-    if (server->refcount) {
+    if (qatomic_read(&server->refcount)) {
         /* Wait for requests to complete before we can unmap the memory */
-        server->wait_idle = true;
-        qemu_coroutine_yield();
-        server->wait_idle = false;
+        qatomic_set(&server->wait_idle, true);
+        /* Pairs with qatomic_fetch_dec() in vhost_user_server_unref() */
+        smp_mb();
+        if (qatomic_read(&server->refcount) ||
+            !qatomic_xchg(&server->wait_idle, false)) {
+            qemu_coroutine_yield();
+        }
     }
-    assert(server->refcount == 0);
+    assert(qatomic_read(&server->refcount) == 0);
 
+    vhost_user_server_lock_queues(server);
     vu_deinit(vu_dev);
+    vhost_user_server_unlock_queues(server);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -228,17 +278,29 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+
+    if (vu_fd_watch->lock) {
+        qemu_rec_mutex_lock(vu_fd_watch->lock);
+        if (vu_fd_watch->removed || server->queues_paused) {
+            qemu_rec_mutex_unlock(vu_fd_watch->lock);
+            return;
+        }
+    }
 
     vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+
+    if (vu_fd_watch->lock) {
+        qemu_rec_mutex_unlock(vu_fd_watch->lock);
+    }
 }
 
+/* Called with watches_lock held */
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
 {
 
@@ -261,6 +323,7 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
     g_assert(fd >= 0);
     g_assert(cb);
 
+    QEMU_LOCK_GUARD(&server->watches_lock);
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
@@ -270,11 +333,24 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        qemu_socket_set_nonblock(fd);
+
+        /* libvhost-user only watches kick fds, pvt is the queue index */
+        if (server->num_queue_ctx) {
+            unsigned int i = (long)pvt % server->num_queue_ctx;
+
+            vu_fd_watch->ctx = server->queue_ctx[i];
+            vu_fd_watch->lock = &server->queue_lock[i];
+            if (server->queues_paused) {
+                /* vhost_user_server_resume_queues() will add it */
+                return;
+            }
+        }
+
+        aio_set_fd_handler(vu_fd_watch->ctx ?: server->ioc->ctx, fd, true,
+                           kick_handler, NULL, NULL, NULL, vu_fd_watch);
     }
 }
 
@@ -287,16 +363,24 @@ static void remove_watch(VuDev *vu_dev, int fd)
 
     server = container_of(vu_dev, VuServer, vu_dev);
 
+    QEMU_LOCK_GUARD(&server->watches_lock);
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ioc->ctx, fd, true,
+    aio_set_fd_handler(vu_fd_watch->ctx ?: server->ioc->ctx, fd, true,
                        NULL, NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+
+    if (vu_fd_watch->lock) {
+        /* We hold the queue lock, a kick handler may be waiting for it */
+        vu_fd_watch->removed = true;
+        aio_bh_schedule_oneshot(vu_fd_watch->ctx, g_free, vu_fd_watch);
+    } else {
+        g_free(vu_fd_watch);
+    }
 }
 
 
@@ -345,6 +429,11 @@ static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
     aio_context_release(server->ctx);
 }
 
+static void vhost_user_server_queue_ctx_sync_bh(void *opaque)
+{
+    /* Nothing to do, running at all means the handlers before us are done */
+}
+
 void vhost_user_server_stop(VuServer *server)
 {
     aio_context_acquire(server->ctx);
@@ -355,9 +444,12 @@ void vhost_user_server_stop(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+        WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+            QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+                aio_set_fd_handler(vu_fd_watch->ctx ?: server->ctx,
+                                   vu_fd_watch->fd, true,
+                                   NULL, NULL, NULL, NULL, vu_fd_watch);
+            }
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -371,6 +463,32 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    if (server->num_queue_ctx) {
+        unsigned int i;
+
+        /*
+         * The fd handlers are gone, but a kick handler may still be running
+         * in a queue context, and BHs freeing removed watches may still be
+         * pending there.  Let them finish before their locks go away.
+         */
+        for (i = 0; i < server->num_queue_ctx; i++) {
+            AioContext *ctx = server->queue_ctx[i];
+
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, vhost_user_server_queue_ctx_sync_bh,
+                                NULL);
+            aio_context_release(ctx);
+        }
+
+        for (i = 0; i < server->num_queue_ctx; i++) {
+            qemu_rec_mutex_destroy(&server->queue_lock[i]);
+        }
+        g_free(server->queue_lock);
+        g_free(server->queue_ctx);
+        server->num_queue_ctx = 0;
+    }
+    qemu_mutex_destroy(&server->watches_lock);
 }
 
 /*
@@ -398,9 +516,14 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 
     qio_channel_attach_aio_context(server->ioc, ctx);
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            if (vu_fd_watch->ctx) {
+                continue; /* stays in its queue context */
+            }
+            aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
+                               NULL, NULL, vu_fd_watch);
+        }
     }
 
     aio_co_schedule(ctx, server->co_trip);
@@ -412,9 +535,14 @@ void vhost_user_server_detach_aio_context(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+        WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+            QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+                if (vu_fd_watch->ctx) {
+                    continue;
+                }
+                aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+                                   NULL, NULL, NULL, NULL, vu_fd_watch);
+            }
         }
 
         qio_channel_detach_aio_context(server->ioc);
@@ -423,6 +551,98 @@ void vhost_user_server_detach_aio_context(VuServer *server)
     server->ctx = NULL;
 }
 
+/**
+ * vhost_user_server_set_queue_contexts:
+ * @server: the server, with no client connected yet
+ * @ctxs: the AioContexts to spread virtqueues over
+ * @num_ctxs: number of elements in @ctxs
+ *
+ * Handle the kicks of virtqueue i in @ctxs[i % @num_ctxs] rather than in
+ * the server's AioContext.  The device must then take the queue lock with
+ * vhost_user_server_queue_lock() around any other use of the virtqueue,
+ * such as completing requests.
+ */
+void vhost_user_server_set_queue_contexts(VuServer *server,
+                                          AioContext **ctxs,
+                                          unsigned int num_ctxs)
+{
+    unsigned int i;
+
+    assert(!server->sioc && !server->num_queue_ctx);
+
+    server->queue_ctx = g_memdup2(ctxs, num_ctxs * sizeof(ctxs[0]));
+    server->queue_lock = g_new(QemuRecMutex, num_ctxs);
+    for (i = 0; i < num_ctxs; i++) {
+        qemu_rec_mutex_init(&server->queue_lock[i]);
+    }
+    server->num_queue_ctx = num_ctxs;
+}
+
+/* The AioContext in which virtqueue @qidx is processed */
+AioContext *vhost_user_server_queue_context(VuServer *server, int qidx)
+{
+    if (!server->num_queue_ctx) {
+        return server->ctx;
+    }
+    return server->queue_ctx[qidx % server->num_queue_ctx];
+}
+
+void vhost_user_server_queue_lock(VuServer *server, int qidx)
+{
+    if (server->num_queue_ctx) {
+        qemu_rec_mutex_lock(&server->queue_lock[qidx % server->num_queue_ctx]);
+    }
+}
+
+void vhost_user_server_queue_unlock(VuServer *server, int qidx)
+{
+    if (server->num_queue_ctx) {
+        qemu_rec_mutex_unlock(
+            &server->queue_lock[qidx % server->num_queue_ctx]);
+    }
+}
+
+static void vhost_user_server_set_queues_paused(VuServer *server, bool paused)
+{
+    VuFdWatch *vu_fd_watch;
+    unsigned int i;
+
+    for (i = 0; i < server->num_queue_ctx; i++) {
+        qemu_rec_mutex_lock(&server->queue_lock[i]);
+    }
+
+    server->queues_paused = paused;
+    WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            if (!vu_fd_watch->ctx) {
+                continue;
+            }
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd, true,
+                               paused ? NULL : kick_handler, NULL, NULL, NULL,
+                               vu_fd_watch);
+        }
+    }
+
+    for (i = 0; i < server->num_queue_ctx; i++) {
+        qemu_rec_mutex_unlock(&server->queue_lock[i]);
+    }
+}
+
+/*
+ * Stop processing kicks in the queue contexts, which aio_disable_external()
+ * on the server's AioContext does not cover.  Requests already submitted
+ * keep a reference on the server until they complete.
+ */
+void vhost_user_server_pause_queues(VuServer *server)
+{
+    vhost_user_server_set_queues_paused(server, true);
+}
+
+void vhost_user_server_resume_queues(VuServer *server)
+{
+    vhost_user_server_set_queues_paused(server, false);
+}
+
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
@@ -464,6 +684,7 @@ bool vhost_user_server_start(VuServer *server,
                                      server,
                                      NULL);
 
+    qemu_mutex_init(&server->watches_lock);
     QTAILQ_INIT(&server->vu_fd_watches);
     return true;
 }